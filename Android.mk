@@ -4,7 +4,10 @@ include $(CLEAR_VARS)
 LOCAL_CFLAGS += -DANDROID_BUILD
 LOCAL_CFLAGS += -Wall
 
-LOCAL_SRC_FILES += host/main.c host/aes_crypto.c host/clearkey_platform.c
+LOCAL_SRC_FILES += host/main.c host/aes_crypto.c host/clearkey_platform.c \
+		   host/decrypt_pool.c host/corpus.c host/ref_aes.c \
+		   host/decrypt_file.c host/cenc_mp4.c host/ts_demux.c \
+		   host/shm_arena.c host/decrypt_ahead.c
 
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/ta/include
 
@@ -14,4 +17,16 @@ LOCAL_VENDOR_MODULE := true
 LOCAL_MODULE_TAGS := optional
 include $(BUILD_EXECUTABLE)
 
+include $(CLEAR_VARS)
+LOCAL_CFLAGS += -Wall
+
+LOCAL_SRC_FILES += host/gen_corpus.c host/corpus.c host/ref_aes.c
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/ta/include
+
+LOCAL_MODULE := gen_corpus
+LOCAL_VENDOR_MODULE := true
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
+
 include $(LOCAL_PATH)/ta/Android.mk
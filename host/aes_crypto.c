@@ -25,10 +25,14 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <time.h>
+#include <unistd.h>
 #include <aes_crypto_ta.h>
 
 #include "aes_crypto.h"
 #include "clearkey_platform.h"
+#include "decrypt_pool.h"
+#include "shm_arena.h"
 #include "logging.h"
 #include "include/uapi/linux/ion.h"
 
@@ -55,6 +59,50 @@
 static TEEC_Context ctx;
 static TEEC_Session sess;
 
+/* Worker sessions for parallel decrypt, created on first use */
+static struct decrypt_pool *g_pool;
+static bool g_pool_failed;
+static pthread_mutex_t g_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Callers holding the pool, the reaper only destroys an unused pool */
+static unsigned int g_pool_users;
+static uint64_t g_pool_last_use;
+/* Counters of the worker sessions closed since the context was opened */
+static key_usage_t g_pool_usage[TA_MAX_LOADED_KEYS + 1];
+static uint32_t g_pool_usage_num;
+/* Keys loaded with TEE_load_keys(), loaded again into new worker sessions */
+static key_entry_t g_keys[TA_MAX_LOADED_KEYS];
+static uint32_t g_num_keys;
+
+/* Set by TEE_crypto_set_sched() for the jobs of the calling thread */
+static __thread decrypt_sched_t t_sched = {
+  .priority = DECRYPT_PRIO_PLAYBACK,
+  .deadline = POOL_NO_DEADLINE,
+};
+static __thread bool t_sched_set;
+
+/* Background trimming of idle resources, see TEE_crypto_set_trim_policy() */
+#define REAPER_PERIOD_MS 1000
+static pthread_once_t g_reaper_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t g_reaper_lock = PTHREAD_MUTEX_INITIALIZER;
+static void start_reaper(void);
+static trim_policy_t g_trim_policy = {
+  .idle_ms = 5000,
+  .pressure_low = 10,
+  .pressure_high = 40,
+};
+
+/*
+ * The context is reference counted by TEE_crypto_init()/close(). While
+ * warm, TEE_crypto_prefetch() holds one more reference so that it stays
+ * open between playbacks. g_ctx_opening is set while the prefetch thread
+ * opens it.
+ */
+static pthread_mutex_t g_ctx_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_ctx_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int g_ctx_refs;
+static bool g_ctx_opening;
+static bool g_ctx_warm;
+
 static TEEC_SharedMemory g_key = {
   .size = CTR_AES_BLOCK_SIZE, /* 16byte key */
   .flags = TEEC_MEM_INPUT,
@@ -65,31 +113,286 @@ static TEEC_SharedMemory g_iv = {
   .flags = TEEC_MEM_INPUT,
 };
 
-static void allocate_mem(void)
+/*
+ * Shared memory the buffers of the calls are copied through, instead of
+ * temporary memrefs which cost a shared memory allocation each per call.
+ * Without it, or when it is full, temporary memrefs are used. A trim
+ * releases it while no call holds a block and the next call that wants
+ * one allocates it again.
+ */
+#define SHM_ARENA_SIZE (16 * 1024 * 1024)
+static struct shm_arena *g_arena;
+static pthread_mutex_t g_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int g_arena_users;
+static uint64_t g_arena_last_use;
+static bool g_arena_trimmed;
+
+/*
+ * Buffer of the caller registered by TEE_register_buffer(). The TEE
+ * registration is made on first use and released with the context;
+ * users counts the calls in flight referencing it.
+ */
+struct reg_buffer {
+  TEEC_SharedMemory shm;
+  uint8_t *buf;
+  size_t size;
+  bool registered;
+  /* Registration refused, the calls copy through the arena instead */
+  bool failed;
+  unsigned int users;
+};
+
+static struct reg_buffer g_regs[TEE_MAX_REGISTERED_BUFFERS];
+static pthread_mutex_t g_reg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Buffer of a call passed by offset in a registered buffer, as an arena
+ * block or as a temporary memref
+ */
+struct shm_param {
+  struct reg_buffer *reg;
+  struct shm_block blk;
+  bool bounced;
+  void *data;
+  size_t size;
+  uint32_t dir;
+};
+
+static uint64_t now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Optional, try a smaller one before going without */
+static struct shm_arena *create_arena(void)
+{
+  struct shm_arena *arena;
+
+  arena = shm_arena_create(&ctx, SHM_ARENA_SIZE);
+  if (!arena)
+    arena = shm_arena_create(&ctx, SHM_ARENA_SIZE / 4);
+  if (!arena)
+    PR("No shared memory arena, using temporary memrefs\n");
+
+  return arena;
+}
+
+/* Each successful arena_alloc() is paired with an arena_free() */
+static int arena_alloc(size_t size, struct shm_block *blk)
+{
+  struct shm_arena *arena;
+
+  pthread_mutex_lock(&g_arena_lock);
+  if (g_arena_trimmed) {
+    g_arena = create_arena();
+    g_arena_trimmed = false;
+  }
+  arena = g_arena;
+  if (arena)
+    g_arena_users++;
+  pthread_mutex_unlock(&g_arena_lock);
+
+  if (arena && !shm_arena_alloc(arena, size, blk))
+    return 0;
+
+  if (arena) {
+    pthread_mutex_lock(&g_arena_lock);
+    g_arena_users--;
+    pthread_mutex_unlock(&g_arena_lock);
+  }
+  return ENOMEM;
+}
+
+static void arena_free(struct shm_block *blk)
+{
+  /* The arena stays while a block is out */
+  shm_arena_free(g_arena, blk);
+
+  pthread_mutex_lock(&g_arena_lock);
+  g_arena_users--;
+  g_arena_last_use = now_ms();
+  pthread_mutex_unlock(&g_arena_lock);
+}
+
+/* Release the arena once no call has used it for idle_ms */
+static void trim_arena(uint64_t idle_ms)
+{
+  pthread_mutex_lock(&g_arena_lock);
+  if (g_arena && !g_arena_users &&
+      now_ms() - g_arena_last_use >= idle_ms) {
+    shm_arena_destroy(g_arena);
+    g_arena = NULL;
+    g_arena_trimmed = true;
+  }
+  pthread_mutex_unlock(&g_arena_lock);
+}
+
+static TEEC_Result allocate_mem(void)
 {
   TEEC_Result res;
 
   /* Allocate Initialization Vector shared with TEE */
   res = TEEC_AllocateSharedMemory(&ctx, &g_iv);
-  CHECK(res, "TEEC_AllocateSharedMemory for IV");
+  if (res != TEEC_SUCCESS)
+    return res;
 
   /* Allocate shared memory for key */
   res = TEEC_AllocateSharedMemory(&ctx, &g_key);
-  CHECK(res,  "TEEC_AllocateSharedMemory for key");
+  if (res != TEEC_SUCCESS) {
+    TEEC_ReleaseSharedMemory(&g_iv);
+    return res;
+  }
+
+  pthread_mutex_lock(&g_arena_lock);
+  g_arena = create_arena();
+  g_arena_trimmed = false;
+  g_arena_last_use = now_ms();
+  pthread_mutex_unlock(&g_arena_lock);
+
+  return res;
+}
+
+/* Registered buffer holding size bytes at data and a user of it, or NULL */
+static struct reg_buffer *reg_get(const void *data, size_t size)
+{
+  const uint8_t *p = data;
+  struct reg_buffer *r;
+  unsigned int i;
+
+  pthread_mutex_lock(&g_reg_lock);
+  for (i = 0; i < TEE_MAX_REGISTERED_BUFFERS; i++) {
+    r = &g_regs[i];
+    if (r->buf && !r->failed && p >= r->buf && size <= r->size &&
+        (size_t)(p - r->buf) <= r->size - size)
+      break;
+  }
+  if (i == TEE_MAX_REGISTERED_BUFFERS) {
+    pthread_mutex_unlock(&g_reg_lock);
+    return NULL;
+  }
+
+  if (!r->registered) {
+    r->shm.buffer = r->buf;
+    r->shm.size = r->size;
+    r->shm.flags = TEEC_MEM_INPUT | TEEC_MEM_OUTPUT;
+    if (TEEC_RegisterSharedMemory(&ctx, &r->shm) != TEEC_SUCCESS) {
+      PR("Could not register %zu bytes, copying instead\n", r->size);
+      r->failed = true;
+      pthread_mutex_unlock(&g_reg_lock);
+      return NULL;
+    }
+    r->registered = true;
+  }
+  r->users++;
+  pthread_mutex_unlock(&g_reg_lock);
+
+  return r;
+}
+
+static void reg_put(struct reg_buffer *r)
+{
+  pthread_mutex_lock(&g_reg_lock);
+  r->users--;
+  pthread_mutex_unlock(&g_reg_lock);
+}
+
+/* Drop the TEE registrations with the context, the buffers stay known */
+static void reg_release_all(void)
+{
+  unsigned int i;
+
+  pthread_mutex_lock(&g_reg_lock);
+  for (i = 0; i < TEE_MAX_REGISTERED_BUFFERS; i++) {
+    if (g_regs[i].registered)
+      TEEC_ReleaseSharedMemory(&g_regs[i].shm);
+    g_regs[i].registered = false;
+    g_regs[i].failed = false;
+  }
+  pthread_mutex_unlock(&g_reg_lock);
+}
+
+/*
+ * Set parameter idx of op to size bytes at data, which the TA reads and/or
+ * writes as dir says (TEEC_MEM_INPUT, TEEC_MEM_OUTPUT). Returns the
+ * parameter type. shm_param_put() is called once invoked.
+ */
+static uint32_t shm_param_set(TEEC_Operation *op, uint32_t idx,
+                              struct shm_param *p, const void *data,
+                              size_t size, uint32_t dir)
+{
+  bool in = dir & TEEC_MEM_INPUT, out = dir & TEEC_MEM_OUTPUT;
+
+  p->data = (void *)data;
+  p->size = size;
+  p->dir = dir;
+  p->bounced = false;
+
+  p->reg = size ? reg_get(data, size) : NULL;
+  if (p->reg) {
+    op->params[idx].memref.parent = &p->reg->shm;
+    op->params[idx].memref.offset = (const uint8_t *)data - p->reg->buf;
+    op->params[idx].memref.size = size;
+    return in && out ? TEEC_MEMREF_PARTIAL_INOUT :
+      out ? TEEC_MEMREF_PARTIAL_OUTPUT : TEEC_MEMREF_PARTIAL_INPUT;
+  }
+
+  p->bounced = size && !arena_alloc(size, &p->blk);
 
+  if (!p->bounced) {
+    op->params[idx].tmpref.buffer = (void *)data;
+    op->params[idx].tmpref.size = size;
+    return in && out ? TEEC_MEMREF_TEMP_INOUT :
+      out ? TEEC_MEMREF_TEMP_OUTPUT : TEEC_MEMREF_TEMP_INPUT;
+  }
+
+  if (in)
+    memcpy(p->blk.buffer, data, size);
+  op->params[idx].memref.parent = p->blk.shm;
+  op->params[idx].memref.offset = p->blk.offset;
+  op->params[idx].memref.size = size;
+  return in && out ? TEEC_MEMREF_PARTIAL_INOUT :
+    out ? TEEC_MEMREF_PARTIAL_OUTPUT : TEEC_MEMREF_PARTIAL_INPUT;
 }
 
-/* increment counter (128-bit int) */
-static void ctr128_inc(uint8_t *counter, uint32_t increment)
+/* Copy back what the TA wrote through the arena and free the block */
+static void shm_param_put(TEEC_Operation *op, uint32_t idx,
+                          struct shm_param *p)
 {
-  uint16_t *c = (uint16_t *)(counter + 14);
+  if (p->reg) {
+    reg_put(p->reg);
+    p->reg = NULL;
+  }
+  if (!p->bounced)
+    return;
+  if (p->dir & TEEC_MEM_OUTPUT)
+    memcpy(p->data, p->blk.buffer, MIN(p->size, op->params[idx].memref.size));
+  arena_free(&p->blk);
+  p->bounced = false;
+}
 
-  (*c) = htobe16(htobe16(*c) + increment);
+/* add blocks to counter (full 128-bit big endian add) */
+static void ctr128_add(uint8_t *counter, uint64_t blocks)
+{
+  int i;
 
+  for (i = CTR_AES_BLOCK_SIZE - 1; i >= 0 && blocks; i--) {
+    blocks += counter[i];
+    counter[i] = (uint8_t)blocks;
+    blocks >>= 8;
+  }
 }
 
 static void free_mem(void)
 {
+  reg_release_all();
+  pthread_mutex_lock(&g_arena_lock);
+  shm_arena_destroy(g_arena);
+  g_arena = NULL;
+  g_arena_trimmed = false;
+  pthread_mutex_unlock(&g_arena_lock);
   PR("Release IV shared memory...\n");
   TEEC_ReleaseSharedMemory(&g_iv);
   PR("Release key shared memory...\n");
@@ -114,7 +417,10 @@ TEE_AES_ctr128_encrypt(const unsigned char* in_data,
   uint32_t n = 0;
   uint32_t blockOffset = *num;
   uint32_t len = length;
+  bool aligned;
   TEEC_SharedMemory g_outm;
+  struct shm_param in_p, out_p;
+  uint32_t in_type, out_type;
 
   // printf("offset: %d, blockOffset: %d, length: %d\n", offset, blockOffset, length);
 
@@ -135,6 +441,12 @@ TEE_AES_ctr128_encrypt(const unsigned char* in_data,
   if (!key || !out_data || !num || !iv)
     return EINVAL;
 
+  /*
+   * Whole blocks with no keystream left from the previous range, the
+   * common single fully encrypted subsample: nothing is carried in or out.
+   */
+  aligned = !blockOffset && !(length % CTR_AES_BLOCK_SIZE);
+
   /* type cast to avoid warning of losing const qualifier */
   if (blockOffset > 0)
     memcpy((void *)(in_data + offset - blockOffset), ecount_buf, blockOffset);
@@ -158,22 +470,10 @@ TEE_AES_ctr128_encrypt(const unsigned char* in_data,
   memcpy(g_key.buffer, key, CTR_AES_KEY_SIZE);
   memcpy(g_iv.buffer, iv, CTR_AES_IV_SIZE);
 
-  if (!secure) {
-    op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
-				     TEEC_MEMREF_TEMP_OUTPUT, TEEC_MEMREF_WHOLE,
-				     TEEC_MEMREF_WHOLE);
-  } else {
-    op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
-				     TEEC_MEMREF_PARTIAL_OUTPUT, TEEC_MEMREF_WHOLE,
-				     TEEC_MEMREF_WHOLE);
-  }
-
   /* TA input buffer */
-  op.params[PARAM_AES_ENCRYPTED_BUFFER_IDX].tmpref.buffer =
-    (void *) (in_data + offset - blockOffset);
-
-  op.params[PARAM_AES_ENCRYPTED_BUFFER_IDX].tmpref.size =
-    length + blockOffset;
+  in_type = shm_param_set(&op, PARAM_AES_ENCRYPTED_BUFFER_IDX, &in_p,
+                          in_data + offset - blockOffset,
+                          length + blockOffset, TEEC_MEM_INPUT);
 
   // printf("TA input buffer: ");
   // for (int i = 0; i < op.params[PARAM_AES_ENCRYPTED_BUFFER_IDX].tmpref.size; i++)
@@ -184,12 +484,11 @@ TEE_AES_ctr128_encrypt(const unsigned char* in_data,
 
   /* TA output buffer */
   if (!secure) {
-    op.params[PARAM_AES_DECRYPTED_BUFFER_IDX].tmpref.buffer =
-      (void *) (out_data + offset - blockOffset);
-
-    op.params[PARAM_AES_DECRYPTED_BUFFER_IDX].tmpref.size =
-      length + blockOffset;
+    out_type = shm_param_set(&op, PARAM_AES_DECRYPTED_BUFFER_IDX, &out_p,
+                             out_data + offset - blockOffset,
+                             length + blockOffset, TEEC_MEM_OUTPUT);
   } else {
+    out_type = TEEC_MEMREF_PARTIAL_OUTPUT;
     op.params[PARAM_AES_DECRYPTED_BUFFER_IDX].memref.parent = &g_outm;
     op.params[PARAM_AES_DECRYPTED_BUFFER_IDX].memref.size =
       length + blockOffset;
@@ -208,9 +507,15 @@ TEE_AES_ctr128_encrypt(const unsigned char* in_data,
   op.params[PARAM_AES_KEY].memref.parent = &g_key;
   op.params[PARAM_AES_KEY].memref.size =  CTR_AES_KEY_SIZE;
 
+  op.paramTypes = TEEC_PARAM_TYPES(in_type, out_type, TEEC_MEMREF_WHOLE,
+                                   TEEC_MEMREF_WHOLE);
+
   res = TEEC_InvokeCommand(&sess, TA_AES_CTR128_ENCRYPT, &op,
          &err_origin);
   CHECK_INVOKE(res, err_origin);
+  shm_param_put(&op, PARAM_AES_ENCRYPTED_BUFFER_IDX, &in_p);
+  if (!secure)
+    shm_param_put(&op, PARAM_AES_DECRYPTED_BUFFER_IDX, &out_p);
 
 #ifdef SDP_PROTOTYPE
   ion_map_and_memcpy(out_data + offset, length, secure_fd, blockOffset);
@@ -224,21 +529,18 @@ TEE_AES_ctr128_encrypt(const unsigned char* in_data,
   // }
   // printf("\n");
 
-  if(length + blockOffset > 16)
-    len = length + blockOffset;
-
-  while (len >= 16) {
-    ctr128_inc(iv, 1);
+  if (aligned) {
+    ctr128_add(iv, length / CTR_AES_BLOCK_SIZE);
     blockOffset = 0;
-    len -= 16;
-    n++;
-  }
-
-  if (len) {
-    while (len--) {
-      ++blockOffset;
-    }
-    memcpy(ecount_buf, in_data + offset + n*CTR_AES_BLOCK_SIZE, blockOffset);
+  } else {
+    /* The input started blockOffset bytes before offset */
+    len = length + blockOffset;
+    n = len / CTR_AES_BLOCK_SIZE;
+    ctr128_add(iv, n);
+    /* Keep the partial last block, it is fed again with the next range */
+    memcpy(ecount_buf, in_data + offset - blockOffset + n * CTR_AES_BLOCK_SIZE,
+           len % CTR_AES_BLOCK_SIZE);
+    blockOffset = len % CTR_AES_BLOCK_SIZE;
   }
   *num = blockOffset;
 
@@ -248,6 +550,61 @@ TEE_AES_ctr128_encrypt(const unsigned char* in_data,
   return 0;
 }
 
+int TEE_register_buffer(void* buf, size_t size)
+{
+  long page = sysconf(_SC_PAGESIZE);
+  struct reg_buffer *free_reg = NULL;
+  unsigned int i;
+
+  if (!buf || !size || page <= 0 || (uintptr_t)buf % page)
+    return EINVAL;
+
+  pthread_mutex_lock(&g_reg_lock);
+  for (i = 0; i < TEE_MAX_REGISTERED_BUFFERS; i++) {
+    if (g_regs[i].buf == buf) {
+      pthread_mutex_unlock(&g_reg_lock);
+      return EEXIST;
+    }
+    if (!g_regs[i].buf && !free_reg)
+      free_reg = &g_regs[i];
+  }
+  if (!free_reg) {
+    pthread_mutex_unlock(&g_reg_lock);
+    return ENOSPC;
+  }
+  memset(free_reg, 0, sizeof(*free_reg));
+  free_reg->buf = buf;
+  free_reg->size = size;
+  pthread_mutex_unlock(&g_reg_lock);
+
+  return 0;
+}
+
+int TEE_unregister_buffer(void* buf)
+{
+  struct reg_buffer *r = NULL;
+  unsigned int i;
+  int err = 0;
+
+  pthread_mutex_lock(&g_reg_lock);
+  for (i = 0; i < TEE_MAX_REGISTERED_BUFFERS && buf; i++)
+    if (g_regs[i].buf == buf)
+      r = &g_regs[i];
+
+  if (!r) {
+    err = ENOENT;
+  } else if (r->users) {
+    err = EBUSY;
+  } else {
+    if (r->registered)
+      TEEC_ReleaseSharedMemory(&r->shm);
+    memset(r, 0, sizeof(*r));
+  }
+  pthread_mutex_unlock(&g_reg_lock);
+
+  return err;
+}
+
 int TEE_copy_secure_memory(const unsigned char* in_data, unsigned char* out_data,
 			   uint32_t length, uint32_t offset)
 {
@@ -257,13 +614,26 @@ int TEE_copy_secure_memory(const unsigned char* in_data, unsigned char* out_data
   uint32_t err_origin;
   TEEC_SharedMemory g_shm;
   TEEC_SharedMemory g_outm;
-
-  g_shm.size = length;
-  g_shm.buffer = (void *) (in_data + offset);
-  g_shm.flags = TEEC_MEM_INPUT;
-
-  res = TEEC_RegisterSharedMemory(&ctx, &g_shm);
-  CHECK(res, "TEEC_RegisterSharedMemory: g_shm (in buf) failed");
+  struct reg_buffer *reg;
+  struct shm_block blk;
+  bool bounced;
+
+  /*
+   * A source in a registered buffer is passed by offset, otherwise it is
+   * copied through the arena rather than registered for this call
+   */
+  reg = length ? reg_get(in_data + offset, length) : NULL;
+  bounced = !reg && length && !arena_alloc(length, &blk);
+  if (bounced) {
+    memcpy(blk.buffer, in_data + offset, length);
+  } else if (!reg) {
+    g_shm.size = length;
+    g_shm.buffer = (void *) (in_data + offset);
+    g_shm.flags = TEEC_MEM_INPUT;
+
+    res = TEEC_RegisterSharedMemory(&ctx, &g_shm);
+    CHECK(res, "TEEC_RegisterSharedMemory: g_shm (in buf) failed");
+  }
 
   secure_fd = clearkey_plat_get_mem_fd((void *)out_data);
 #ifdef SDP_PROTOTYPE
@@ -279,8 +649,10 @@ int TEE_copy_secure_memory(const unsigned char* in_data, unsigned char* out_data
 				   TEEC_NONE);
 
   /* TA input buffer */
-  op.params[PARAM_COPY_SECURE_MEMORY_SOURCE].memref.parent = &g_shm;
-  op.params[PARAM_COPY_SECURE_MEMORY_SOURCE].memref.offset = 0;
+  op.params[PARAM_COPY_SECURE_MEMORY_SOURCE].memref.parent =
+    reg ? &reg->shm : bounced ? blk.shm : &g_shm;
+  op.params[PARAM_COPY_SECURE_MEMORY_SOURCE].memref.offset =
+    reg ? in_data + offset - reg->buf : bounced ? blk.offset : 0;
   op.params[PARAM_COPY_SECURE_MEMORY_SOURCE].memref.size = length;
   /* TA output buffer */
   op.params[PARAM_COPY_SECURE_MEMORY_DESTINATION].memref.parent = &g_outm;
@@ -302,27 +674,59 @@ int TEE_copy_secure_memory(const unsigned char* in_data, unsigned char* out_data
   close(secure_fd);
 #endif
 
-  TEEC_ReleaseSharedMemory(&g_shm);
+  if (reg)
+    reg_put(reg);
+  else if (bounced)
+    arena_free(&blk);
+  else
+    TEEC_ReleaseSharedMemory(&g_shm);
   TEEC_ReleaseSharedMemory(&g_outm);
 
   return 0;
 }
 
-int
-TEE_AES_ctr128_encrypt_secure(const unsigned char* in_data,
+static int
+encrypt_secure(uint32_t cmd, const unsigned char* in_data,
     unsigned char* out_data,
-    const sub_sample_t* samples,
+    const void* samples,
     uint32_t samples_size,
     const char* key,
+    uint32_t key_size,
     unsigned char iv[CTR_AES_BLOCK_SIZE],
-    uint32_t *length)
+    uint32_t *length,
+    secure_output_t* desc)
 {
     TEEC_SharedMemory shm;
     TEEC_Result res;
     uint32_t err_origin;
     int memfd = -1;
     TEEC_Operation op;
-    char key_and_iv[CTR_AES_KEY_SIZE + CTR_AES_IV_SIZE];
+    char key_and_iv[TA_AES_MAX_KEY_SIZE + CTR_AES_IV_SIZE];
+    struct ta_secure_desc *td = NULL;
+    size_t head = 0;
+    struct shm_param in_p, map_p, key_p;
+    uint32_t in_type, map_type, key_type;
+
+    if (key_size > TA_AES_MAX_KEY_SIZE)
+        return EINVAL;
+
+    /* The descriptor and its NAL table go in front of the subsamples */
+    if (desc) {
+        if (desc->max_nals > TA_SECURE_MAX_NALS ||
+            (desc->max_nals && !desc->nals))
+            return EINVAL;
+        head = sizeof(*td) + desc->max_nals * sizeof(nal_unit_t);
+        td = malloc(head + samples_size);
+        if (!td)
+            return ENOMEM;
+        memset(td, 0, head);
+        td->version = TA_SECURE_DESC_VERSION;
+        td->nal_length_size = desc->nal_length_size;
+        td->max_nals = desc->max_nals;
+        if (samples_size)
+            memcpy((uint8_t *)td + head, samples, samples_size);
+    }
+
     /*
      * Retrieve SDP memory handles -- leave error checking in
      * TEEC_RegisterSharedMemoryFileDescriptor.
@@ -331,76 +735,1336 @@ TEE_AES_ctr128_encrypt_secure(const unsigned char* in_data,
 
     shm.flags = TEEC_MEM_INPUT | TEEC_MEM_OUTPUT;
     res = TEEC_RegisterSharedMemoryFileDescriptor(&ctx, &shm, memfd);
-    if (res != TEEC_SUCCESS)
+    if (res != TEEC_SUCCESS) {
+        free(td);
         return -1;
+    }
 
-    /* First input buffer as tempref */
-    op.params[0].tmpref.buffer = (void *)in_data;
-    op.params[0].tmpref.size = *length;
+    /* First input buffer */
+    in_type = shm_param_set(&op, 0, &in_p, in_data, *length, TEEC_MEM_INPUT);
     /* Output buffer as SDP */
     op.params[1].memref.parent = &shm;
     op.params[1].memref.size = *length;
     op.params[1].memref.offset = 0;
     /* Frames */
-    op.params[2].tmpref.buffer = (void *)samples;
-    op.params[2].tmpref.size = samples_size;
+    if (td)
+        map_type = shm_param_set(&op, 2, &map_p, td, head + samples_size,
+                                 TEEC_MEM_INPUT | TEEC_MEM_OUTPUT);
+    else
+        map_type = shm_param_set(&op, 2, &map_p, samples, samples_size,
+                                 TEEC_MEM_INPUT);
     if (key) {
-        memcpy(key_and_iv, key, CTR_AES_KEY_SIZE);
-        memcpy(&key_and_iv[CTR_AES_KEY_SIZE], iv, CTR_AES_IV_SIZE);
+        memcpy(key_and_iv, key, key_size);
+        memcpy(&key_and_iv[key_size], iv, CTR_AES_IV_SIZE);
     } else
         memset(key_and_iv, 0, sizeof(key_and_iv));
 
-    op.params[3].tmpref.buffer = (void *)key_and_iv;
-    op.params[3].tmpref.size = sizeof(key_and_iv);
+    key_type = shm_param_set(&op, 3, &key_p, key_and_iv,
+                             key_size + CTR_AES_IV_SIZE, TEEC_MEM_INPUT);
 
-    op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
-                                     TEEC_MEMREF_PARTIAL_OUTPUT,
-                                     TEEC_MEMREF_TEMP_INPUT,
-                                     TEEC_MEMREF_TEMP_INPUT);
+    op.paramTypes = TEEC_PARAM_TYPES(in_type, TEEC_MEMREF_PARTIAL_OUTPUT,
+                                     map_type, key_type);
 
-    res = TEEC_InvokeCommand(&sess, TA_AES_CTR128_SECURE_ENCRYPT,
-                             &op, &err_origin);
+    res = TEEC_InvokeCommand(&sess, cmd, &op, &err_origin);
     TEEC_ReleaseSharedMemory(&shm);
+    shm_param_put(&op, 0, &in_p);
+    shm_param_put(&op, 2, &map_p);
+    shm_param_put(&op, 3, &key_p);
+    if (res != TEEC_SUCCESS)
+        free(td);
     CHECK_INVOKE(res, err_origin);
+
+    if (td) {
+        desc->num_nals = td->num_nals;
+        desc->bytes_written = td->bytes_written;
+        desc->frame_end = td->frame_end;
+        memcpy(desc->nals, td + 1,
+               (td->num_nals < desc->max_nals ? td->num_nals :
+                desc->max_nals) * sizeof(nal_unit_t));
+        free(td);
+    }
     return memfd;
 }
 
-int TEE_crypto_init()
+int
+TEE_AES_ctr128_encrypt_secure(const unsigned char* in_data,
+    unsigned char* out_data,
+    const sub_sample_t* samples,
+    uint32_t samples_size,
+    const char* key,
+    unsigned char iv[CTR_AES_BLOCK_SIZE],
+    uint32_t *length)
 {
-  TEEC_Result res;
-  TEEC_UUID uuid = TA_AES_DECRYPTOR_UUID;
-  uint32_t err_origin;
+    return encrypt_secure(TA_AES_CTR128_SECURE_ENCRYPT, in_data, out_data,
+                          samples, samples_size, key, CTR_AES_KEY_SIZE,
+                          iv, length, NULL);
+}
+
+int
+TEE_AES_ctr128_encrypt_secure_packed(const unsigned char* in_data,
+    unsigned char* out_data,
+    const uint8_t* map,
+    uint32_t map_size,
+    const char* key,
+    uint32_t key_size,
+    unsigned char iv[CTR_AES_BLOCK_SIZE],
+    uint32_t *length,
+    secure_output_t* desc)
+{
+    return encrypt_secure(TA_AES_CTR128_SECURE_DECRYPT_PACKED, in_data,
+                          out_data, map, map_size, key, key_size, iv,
+                          length, desc);
+}
+
+int
+TEE_AES_cbc128_decrypt_secure(const unsigned char* in_data,
+    unsigned char* out_data,
+    const sub_sample_t* samples,
+    uint32_t samples_size,
+    const char* key,
+    uint32_t key_size,
+    unsigned char iv[CTR_AES_BLOCK_SIZE],
+    uint32_t *length,
+    secure_output_t* desc)
+{
+    return encrypt_secure(TA_AES_CBC128_SECURE_DECRYPT, in_data, out_data,
+                          samples, samples_size, key, key_size, iv, length,
+                          desc);
+}
+
+static uint8_t *put_leb128(uint8_t *p, uint32_t val)
+{
+    while (val >= 0x80) {
+        *p++ = (uint8_t)val | 0x80;
+        val >>= 7;
+    }
+    *p++ = (uint8_t)val;
+    return p;
+}
+
+uint32_t
+TEE_pack_subsamples(const sub_sample_t* samples,
+    uint32_t num_samples,
+    uint8_t* map,
+    uint32_t map_size)
+{
+    uint8_t *p = map;
+    uint32_t i;
+
+    if (!map || (num_samples && !samples) ||
+        map_size < TA_PACKED_SUBSAMPLES_MAX_SIZE(num_samples))
+        return 0;
+
+    *p++ = TA_PACKED_SUBSAMPLES_VERSION;
+    p = put_leb128(p, num_samples);
+    for (i = 0; i < num_samples; i++) {
+        p = put_leb128(p, samples[i].clear_bytes);
+        p = put_leb128(p, samples[i].encrp_bytes);
+    }
+
+    return p - map;
+}
 
-  if(g_iv.buffer)
+/* One side of a scatter-gather call as passed to the TEE */
+struct sg_side {
+  struct reg_buffer *reg;
+  struct shm_block blk;
+  bool bounced;
+  uint8_t *tmp;
+};
+
+/*
+ * Pass the ranges of one side of a scatter-gather call in op->params[idx]
+ * and fill in their descriptor segments. Ranges all inside one registered
+ * buffer are passed by offset in it. Otherwise only the bytes of the
+ * ranges are copied, back to back, to an arena block or to a temporary
+ * memref if the arena has no room: input ranges are gathered here, output
+ * ranges are scattered back by sg_side_put().
+ */
+static TEEC_Result sg_side_set(TEEC_Operation *op, uint32_t idx,
+                               struct sg_side *side, const sg_range_t *ranges,
+                               uint32_t num, struct ta_sg_segment *segs,
+                               bool out, uint32_t *type)
+{
+  uintptr_t lo = UINTPTR_MAX, hi = 0, p;
+  uint64_t total = 0;
+  uint8_t *buf;
+  uint32_t i, pos;
+
+  memset(side, 0, sizeof(*side));
+  for (i = 0; i < num; i++) {
+    if (!ranges[i].length)
+      continue;
+    if (!ranges[i].buf)
+      return TEEC_ERROR_BAD_PARAMETERS;
+    p = (uintptr_t)ranges[i].buf + ranges[i].offset;
+    lo = MIN(lo, p);
+    if (p + ranges[i].length > hi)
+      hi = p + ranges[i].length;
+    total += ranges[i].length;
+  }
+  if (!total || total > UINT32_MAX)
+    return TEEC_ERROR_BAD_PARAMETERS;
+
+  /* The span of the ranges is only inside a registered buffer if they are */
+  side->reg = reg_get((void *)lo, hi - lo);
+  if (side->reg) {
+    for (i = 0; i < num; i++) {
+      segs[i].offset = ranges[i].length ?
+        (uintptr_t)ranges[i].buf + ranges[i].offset - lo : 0;
+      segs[i].length = ranges[i].length;
+    }
+    op->params[idx].memref.parent = &side->reg->shm;
+    op->params[idx].memref.offset = (uint8_t *)lo - side->reg->buf;
+    op->params[idx].memref.size = hi - lo;
+    *type = out ? TEEC_MEMREF_PARTIAL_OUTPUT : TEEC_MEMREF_PARTIAL_INPUT;
     return TEEC_SUCCESS;
+  }
 
-  res = TEEC_InitializeContext(NULL, &ctx);
+  side->bounced = !arena_alloc(total, &side->blk);
+  if (side->bounced) {
+    buf = side->blk.buffer;
+    op->params[idx].memref.parent = side->blk.shm;
+    op->params[idx].memref.offset = side->blk.offset;
+    op->params[idx].memref.size = total;
+    *type = out ? TEEC_MEMREF_PARTIAL_OUTPUT : TEEC_MEMREF_PARTIAL_INPUT;
+  } else {
+    side->tmp = malloc(total);
+    if (!side->tmp)
+      return TEEC_ERROR_OUT_OF_MEMORY;
+    buf = side->tmp;
+    op->params[idx].tmpref.buffer = buf;
+    op->params[idx].tmpref.size = total;
+    *type = out ? TEEC_MEMREF_TEMP_OUTPUT : TEEC_MEMREF_TEMP_INPUT;
+  }
 
-  if (res != TEEC_SUCCESS)
-    errx(1, "TEEC_InitializeContext failed with code 0x%x", res);
+  for (i = 0, pos = 0; i < num; i++) {
+    segs[i].offset = ranges[i].length ? pos : 0;
+    segs[i].length = ranges[i].length;
+    if (!out && ranges[i].length)
+      memcpy(buf + pos, ranges[i].buf + ranges[i].offset, ranges[i].length);
+    pos += ranges[i].length;
+  }
 
-  res = TEEC_OpenSession(&ctx, &sess, &uuid,
-             TEEC_LOGIN_PUBLIC, NULL, NULL, &err_origin);
+  return TEEC_SUCCESS;
+}
 
-  if (res != TEEC_SUCCESS)
-    errx(1, "TEEC_Opensession failed with code 0x%x origin 0x%x",
-      res, err_origin);
+/* Scatter what the TEE wrote if scatter is set and release the side */
+static void sg_side_put(struct sg_side *side, const sg_range_t *ranges,
+                        uint32_t num, bool scatter)
+{
+  uint8_t *buf = side->bounced ? side->blk.buffer : side->tmp;
+  uint32_t i, pos;
 
-  if (!g_iv.buffer || !g_key.buffer)
-    allocate_mem();
+  if (side->reg) {
+    reg_put(side->reg);
+    return;
+  }
 
- return res;
+  for (i = 0, pos = 0; scatter && i < num; i++) {
+    if (ranges[i].length)
+      memcpy(ranges[i].buf + ranges[i].offset, buf + pos, ranges[i].length);
+    pos += ranges[i].length;
+  }
+
+  if (side->bounced)
+    arena_free(&side->blk);
+  free(side->tmp);
+}
+
+static TEEC_Result
+decrypt_sg(TEEC_Session *s,
+    const sg_range_t* in,
+    uint32_t num_in,
+    const sg_range_t* out,
+    uint32_t num_out,
+    const char* key,
+    uint32_t key_size,
+    const unsigned char iv[CTR_AES_BLOCK_SIZE],
+    uint32_t usage,
+    uint32_t *err_origin)
+{
+  TEEC_Operation op;
+  TEEC_Result res;
+  uint32_t in_type, out_type;
+  char key_and_iv[TA_AES_MAX_KEY_SIZE + CTR_AES_IV_SIZE];
+  struct sg_side in_side, out_side;
+  struct shm_param p[2];
+  struct {
+    struct ta_sg_desc hdr;
+    struct ta_sg_segment segs[TA_SG_MAX_SEGMENTS];
+  } desc;
+
+  *err_origin = TEEC_ORIGIN_API;
+  res = sg_side_set(&op, 0, &in_side, in, num_in, desc.segs, false,
+                    &in_type);
+  if (res != TEEC_SUCCESS)
+    return res;
+  res = sg_side_set(&op, 1, &out_side, out, num_out, desc.segs + num_in,
+                    true, &out_type);
+  if (res != TEEC_SUCCESS) {
+    sg_side_put(&in_side, in, num_in, false);
+    return res;
+  }
+
+  desc.hdr.version = TA_SG_DESC_VERSION;
+  desc.hdr.num_in = num_in;
+  desc.hdr.num_out = num_out;
+  desc.hdr.usage = usage;
+
+  memcpy(key_and_iv, key, key_size);
+  memcpy(&key_and_iv[key_size], iv, CTR_AES_IV_SIZE);
+
+  op.paramTypes = TEEC_PARAM_TYPES(in_type, out_type,
+    shm_param_set(&op, 2, &p[0], &desc,
+                  sizeof(desc.hdr) +
+                  (num_in + num_out) * sizeof(struct ta_sg_segment),
+                  TEEC_MEM_INPUT),
+    shm_param_set(&op, 3, &p[1], key_and_iv, key_size + CTR_AES_IV_SIZE,
+                  TEEC_MEM_INPUT));
+
+  res = TEEC_InvokeCommand(s, TA_AES_CTR128_SG_DECRYPT, &op, err_origin);
+  shm_param_put(&op, 2, &p[0]);
+  shm_param_put(&op, 3, &p[1]);
+  sg_side_put(&in_side, in, num_in, false);
+  sg_side_put(&out_side, out, num_out, res == TEEC_SUCCESS);
+
+  return res;
 }
 
 int
-TEE_crypto_close() {
+TEE_AES_ctr128_decrypt_sg(const sg_range_t* in,
+    uint32_t num_in,
+    const sg_range_t* out,
+    uint32_t num_out,
+    const char* key,
+    uint32_t key_size,
+    unsigned char iv[CTR_AES_BLOCK_SIZE])
+{
+  TEEC_Result res;
+  uint32_t err_origin;
+
+  if (!in || !out || !key || !iv || !num_in || !num_out ||
+      num_in + num_out > TA_SG_MAX_SEGMENTS ||
+      key_size > TA_AES_MAX_KEY_SIZE)
+    return EINVAL;
+
+  res = decrypt_sg(&sess, in, num_in, out, num_out, key, key_size, iv, 0,
+                   &err_origin);
+  if (res == TEEC_ERROR_BAD_PARAMETERS && err_origin == TEEC_ORIGIN_API)
+    return EINVAL;
+  if (res == TEEC_ERROR_OUT_OF_MEMORY && err_origin == TEEC_ORIGIN_API)
+    return ENOMEM;
+  CHECK_INVOKE(res, err_origin);
+
+  return 0;
+}
+
+/*
+ * Parallel CTR decrypt. The sample is cut into regions at block aligned
+ * keystream offsets, so the counter of each region is the IV advanced by
+ * a whole number of blocks. Every region is one pool job that copies its
+ * own clear bytes and decrypts its encrypted ranges with a single SG
+ * invocation on the session of the worker running it.
+ */
+
+/* Smallest region worth handing to another core */
+#define CTR_PARALLEL_MIN_CHUNK (CTR_PARALLEL_MIN_SIZE / 2)
+/* Regions per worker, leaves some slack to even out the load */
+#define CTR_PARALLEL_JOBS_PER_WORKER 2
+/* Encrypted ranges per region, in and out segments share the descriptor */
+#define CTR_JOB_MAX_RANGES (TA_SG_MAX_SEGMENTS / 2)
+
+struct ctr_job {
+  struct pool_job job;
+  const unsigned char *in;
+  unsigned char *out;
+  const sub_sample_t *sub_samples;
+  const char *key;
+  uint32_t key_size;
+  /* region [pos, end) starts first_off bytes into sub_samples[first] */
+  uint32_t first;
+  uint32_t first_off;
+  uint32_t pos;
+  uint32_t end;
+  unsigned char iv[CTR_AES_BLOCK_SIZE];
+  /* See struct ta_sg_desc, the sample is counted by its first region */
+  uint32_t usage;
+};
+
+static int ctr_job_run(struct pool_job *job, TEEC_Session *s)
+{
+  struct ctr_job *cj = (struct ctr_job *)job;
+  sg_range_t in[CTR_JOB_MAX_RANGES], out[CTR_JOB_MAX_RANGES];
+  uint32_t i = cj->first, off = cj->first_off, pos = cj->pos;
+  uint32_t num = 0, err_origin, n;
+  TEEC_Result res;
 
-  if(!g_iv.buffer)
+  while (pos < cj->end) {
+    const sub_sample_t *ss = &cj->sub_samples[i];
+
+    if (off < ss->clear_bytes) {
+      n = MIN(ss->clear_bytes - off, cj->end - pos);
+      memcpy(cj->out + pos, cj->in + pos, n);
+    } else if (off - ss->clear_bytes < ss->encrp_bytes) {
+      n = MIN(ss->encrp_bytes - (off - ss->clear_bytes), cj->end - pos);
+      if (num && in[num - 1].offset + in[num - 1].length == pos) {
+        in[num - 1].length += n;
+      } else {
+        if (num == CTR_JOB_MAX_RANGES)
+          return TEEC_ERROR_BAD_PARAMETERS;
+        in[num].buf = (unsigned char *)cj->in;
+        in[num].offset = pos;
+        in[num].length = n;
+        num++;
+      }
+    } else {
+      i++;
+      off = 0;
+      continue;
+    }
+    pos += n;
+    off += n;
+  }
+
+  if (!num)
     return TEEC_SUCCESS;
 
-  free_mem();
+  for (i = 0; i < num; i++) {
+    out[i] = in[i];
+    out[i].buf = cj->out;
+  }
+  res = decrypt_sg(s, in, num, out, num, cj->key, cj->key_size, cj->iv,
+                   cj->usage, &err_origin);
+  if (res != TEEC_SUCCESS)
+    FP("parallel decrypt: invoke failed with code 0x%x origin 0x%x\n",
+       res, err_origin);
+  return res;
+}
+
+static int ctr_job_close(struct ctr_job **jobs, uint32_t *num_jobs,
+                         uint32_t *cap, const struct ctr_job *job,
+                         uint32_t end)
+{
+  struct ctr_job *tmp;
+
+  if (end == job->pos)
+    return 0;
+
+  if (*num_jobs == *cap) {
+    tmp = realloc(*jobs, (*cap ? *cap * 2 : 8) * sizeof(*tmp));
+    if (!tmp)
+      return ENOMEM;
+    *jobs = tmp;
+    *cap = *cap ? *cap * 2 : 8;
+  }
+
+  (*jobs)[*num_jobs] = *job;
+  (*jobs)[*num_jobs].end = end;
+  (*num_jobs)++;
+  return 0;
+}
+
+/*
+ * Walk the subsamples and cut a new region every chunk bytes of keystream,
+ * or earlier at the last block boundary if a region collects too many
+ * disjoint encrypted ranges for one SG descriptor.
+ */
+static int plan_ctr_jobs(const struct ctr_job *tmpl, uint32_t num_sub_samples,
+                         uint64_t chunk, struct ctr_job **jobs,
+                         uint32_t *num_jobs)
+{
+  const sub_sample_t *ss = tmpl->sub_samples;
+  struct ctr_job job = *tmpl;
+  uint32_t i = 0, off = 0, pos = 0, cap = 0, ranges = 0, n;
+  uint32_t enc_end = UINT32_MAX;
+  uint64_t ks = 0, ks0 = 0, a;
+  struct {
+    uint32_t pos, i, off;
+    uint64_t ks;
+  } cut = { 0, 0, 0, 0 };
+  int ret;
+
+  *jobs = NULL;
+  *num_jobs = 0;
+
+  while (i < num_sub_samples) {
+    if (off < ss[i].clear_bytes) {
+      pos += ss[i].clear_bytes - off;
+      off = ss[i].clear_bytes;
+      continue;
+    }
+    if (off - ss[i].clear_bytes == ss[i].encrp_bytes) {
+      i++;
+      off = 0;
+      continue;
+    }
+
+    if (pos != enc_end && ranges++ == CTR_JOB_MAX_RANGES) {
+      /* Each range is at least a byte, so cut is past the region start */
+      ret = ctr_job_close(jobs, num_jobs, &cap, &job, cut.pos);
+      if (ret)
+        goto err;
+      pos = cut.pos;
+      i = cut.i;
+      off = cut.off;
+      ks = cut.ks;
+      goto next_region;
+    }
+
+    n = ss[i].encrp_bytes - (off - ss[i].clear_bytes);
+    if (ks + n > ks0 + chunk)
+      n = ks0 + chunk - ks;
+
+    a = (ks + n) & ~(uint64_t)(CTR_AES_BLOCK_SIZE - 1);
+    if (a > ks && a > ks0) {
+      cut.pos = pos + (a - ks);
+      cut.i = i;
+      cut.off = off + (a - ks);
+      cut.ks = a;
+    }
+
+    pos += n;
+    off += n;
+    ks += n;
+    enc_end = pos;
+    if (ks < ks0 + chunk)
+      continue;
+
+    ret = ctr_job_close(jobs, num_jobs, &cap, &job, pos);
+    if (ret)
+      goto err;
+
+next_region:
+    job.first = i;
+    job.first_off = off;
+    job.pos = pos;
+    memcpy(job.iv, tmpl->iv, CTR_AES_IV_SIZE);
+    ctr128_add(job.iv, ks / CTR_AES_BLOCK_SIZE);
+    ks0 = ks;
+    ranges = 0;
+    enc_end = UINT32_MAX;
+  }
+
+  ret = ctr_job_close(jobs, num_jobs, &cap, &job, pos);
+  if (!ret)
+    return 0;
+err:
+  free(*jobs);
+  *jobs = NULL;
+  return ret;
+}
+
+static TEEC_Result read_key_usage(TEEC_Session *s, key_usage_t *usage,
+                                  uint32_t max_entries,
+                                  uint32_t *num_entries,
+                                  uint32_t *err_origin)
+{
+  TEEC_Operation op;
+  TEEC_Result res;
+
+  op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_OUTPUT,
+                                   TEEC_VALUE_OUTPUT, TEEC_NONE, TEEC_NONE);
+  op.params[0].tmpref.buffer = usage;
+  op.params[0].tmpref.size = max_entries * sizeof(*usage);
+
+  res = TEEC_InvokeCommand(s, TA_GET_KEY_USAGE, &op, err_origin);
+  /* The size needed comes back in the memref */
+  *num_entries = op.params[0].tmpref.size / sizeof(*usage);
+  if (res == TEEC_SUCCESS)
+    *num_entries = op.params[1].value.a;
+
+  return res;
+}
+
+/*
+ * Add the counters of src to the entries of usage with the same kid. An
+ * entry of a kid not in usage is appended while *num < max.
+ */
+static void add_usage(key_usage_t *usage, uint32_t *num, uint32_t max,
+                      const key_usage_t *src, uint32_t num_src)
+{
+  uint32_t i, j;
+
+  for (i = 0; i < num_src; i++) {
+    for (j = 0; j < *num; j++)
+      if (!memcmp(usage[j].kid, src[i].kid, TA_KID_SIZE))
+        break;
+    if (j == *num) {
+      if (*num == max)
+        continue;
+      usage[(*num)++] = src[i];
+      continue;
+    }
+    usage[j].samples += src[i].samples;
+    usage[j].bytes += src[i].bytes;
+  }
+}
+
+/*
+ * Add the counters of the worker sessions to usage. They hold the same
+ * keys as the main session, see load_pool_keys().
+ */
+static void add_pool_usage(struct decrypt_pool *pool, key_usage_t *usage,
+                           uint32_t *num, uint32_t max)
+{
+  key_usage_t u[TA_MAX_LOADED_KEYS + 1];
+  uint32_t n, err_origin;
+  TEEC_Result res;
+  unsigned i;
+
+  for (i = 0; i < decrypt_pool_size(pool); i++) {
+    res = read_key_usage(decrypt_pool_session(pool, i), u,
+                         TA_MAX_LOADED_KEYS + 1, &n, &err_origin);
+    if (res != TEEC_SUCCESS) {
+      FP("decrypt pool: key usage failed with code 0x%x origin 0x%x\n",
+         res, err_origin);
+      continue;
+    }
+    add_usage(usage, num, max, u, n);
+  }
+}
+
+/* Load num entries of keys into every worker session. g_pool_lock held. */
+static void load_pool_keys(struct decrypt_pool *pool, const key_entry_t *keys,
+                           uint32_t num)
+{
+  TEEC_Operation op;
+  TEEC_Result res;
+  uint32_t err_origin;
+  unsigned i;
+
+  if (!num)
+    return;
+
+  op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT, TEEC_NONE,
+                                   TEEC_NONE, TEEC_NONE);
+  op.params[0].tmpref.buffer = (void *)keys;
+  op.params[0].tmpref.size = num * sizeof(*keys);
+
+  for (i = 0; i < decrypt_pool_size(pool); i++) {
+    res = TEEC_InvokeCommand(decrypt_pool_session(pool, i), TA_LOAD_KEYS,
+                             &op, &err_origin);
+    if (res != TEEC_SUCCESS)
+      FP("decrypt pool: loading keys failed with code 0x%x origin 0x%x\n",
+         res, err_origin);
+  }
+}
+
+/*
+ * Apply k to g_keys the way the TA applies it to its key table, returns
+ * false where the TA stops loading. An unloaded key also loses the
+ * counters kept from closed worker sessions. g_pool_lock held.
+ */
+static bool keep_key(const key_entry_t *k)
+{
+  uint32_t i;
+
+  for (i = 0; i < g_num_keys; i++)
+    if (!memcmp(g_keys[i].kid, k->kid, TA_KID_SIZE))
+      break;
+
+  if (!k->key_size) {
+    if (i < g_num_keys) {
+      g_keys[i] = g_keys[--g_num_keys];
+      memset(&g_keys[g_num_keys], 0, sizeof(g_keys[g_num_keys]));
+    }
+    /* Entry 0 is the zero kid of the keys passed with the calls */
+    for (i = 1; i < g_pool_usage_num; i++) {
+      if (!memcmp(g_pool_usage[i].kid, k->kid, TA_KID_SIZE)) {
+        g_pool_usage[i] = g_pool_usage[--g_pool_usage_num];
+        break;
+      }
+    }
+    return true;
+  }
+
+  if (k->key_size != 16 && k->key_size != 24 && k->key_size != 32)
+    return false;
+  if (i == g_num_keys) {
+    if (g_num_keys == TA_MAX_LOADED_KEYS)
+      return false;
+    g_num_keys++;
+  }
+  g_keys[i] = *k;
+  return true;
+}
+
+/* Close the worker sessions, their counters are kept. g_pool_lock held. */
+static void destroy_pool(void)
+{
+  add_pool_usage(g_pool, g_pool_usage, &g_pool_usage_num,
+                 TA_MAX_LOADED_KEYS + 1);
+  decrypt_pool_destroy(g_pool);
+  g_pool = NULL;
+}
+
+/* Each successful get_pool() is paired with a put_pool() */
+static struct decrypt_pool *get_pool(void)
+{
+  TEEC_UUID uuid = TA_AES_DECRYPTOR_UUID;
+  struct decrypt_pool *pool;
+
+  /* Whoever opens the worker sessions, the reaper closes them when idle */
+  pthread_once(&g_reaper_once, start_reaper);
+
+  pthread_mutex_lock(&g_pool_lock);
+  if (!g_pool && !g_pool_failed) {
+    g_pool = decrypt_pool_create(&ctx, &uuid, 0);
+    g_pool_failed = !g_pool;
+    if (g_pool)
+      load_pool_keys(g_pool, g_keys, g_num_keys);
+  }
+  pool = g_pool;
+  if (pool)
+    g_pool_users++;
+  pthread_mutex_unlock(&g_pool_lock);
+
+  return pool;
+}
+
+static void put_pool(struct decrypt_pool *pool)
+{
+  if (!pool)
+    return;
+
+  pthread_mutex_lock(&g_pool_lock);
+  g_pool_users--;
+  g_pool_last_use = now_ms();
+  pthread_mutex_unlock(&g_pool_lock);
+}
+
+/*
+ * Close the worker sessions once the pool has been unused for idle_ms.
+ * The next parallel decrypt opens them again.
+ */
+static void trim_pool(uint64_t idle_ms)
+{
+  pthread_mutex_lock(&g_pool_lock);
+  if (g_pool && !g_pool_users && now_ms() - g_pool_last_use >= idle_ms)
+    destroy_pool();
+  g_pool_failed = false;
+  pthread_mutex_unlock(&g_pool_lock);
+}
+
+int
+TEE_AES_ctr128_decrypt_parallel(const unsigned char* in_data,
+    unsigned char* out_data,
+    const sub_sample_t* sub_samples,
+    uint32_t num_sub_samples,
+    const char* key,
+    uint32_t key_size,
+    unsigned char iv[CTR_AES_BLOCK_SIZE])
+{
+  struct decrypt_pool *pool = NULL;
+  struct ctr_job tmpl, *jobs;
+  struct pool_group group;
+  uint64_t total = 0, total_enc = 0, chunk;
+  uint32_t num_jobs, i;
+  unsigned workers = 0;
+  int ret;
+
+  if (!in_data || !out_data || !sub_samples || !key || !iv ||
+      key_size > TA_AES_MAX_KEY_SIZE)
+    return EINVAL;
+
+  for (i = 0; i < num_sub_samples; i++) {
+    total += (uint64_t)sub_samples[i].clear_bytes +
+      sub_samples[i].encrp_bytes;
+    total_enc += sub_samples[i].encrp_bytes;
+  }
+  if (total >= UINT32_MAX)
+    return EINVAL;
+
+  /* Small samples are not worth the hop to another thread */
+  if (total_enc >= CTR_PARALLEL_MIN_SIZE) {
+    pool = get_pool();
+    workers = decrypt_pool_size(pool);
+  }
+  if (workers > 1) {
+    chunk = total_enc / (workers * CTR_PARALLEL_JOBS_PER_WORKER);
+    chunk = (chunk + CTR_AES_BLOCK_SIZE - 1) &
+      ~(uint64_t)(CTR_AES_BLOCK_SIZE - 1);
+    if (chunk < CTR_PARALLEL_MIN_CHUNK)
+      chunk = CTR_PARALLEL_MIN_CHUNK;
+  } else {
+    /* One region unless the SG descriptor limit forces a cut */
+    chunk = total_enc + CTR_AES_BLOCK_SIZE;
+  }
+
+  memset(&tmpl, 0, sizeof(tmpl));
+  tmpl.job.run = ctr_job_run;
+  tmpl.in = in_data;
+  tmpl.out = out_data;
+  tmpl.sub_samples = sub_samples;
+  tmpl.key = key;
+  tmpl.key_size = key_size;
+  memcpy(tmpl.iv, iv, CTR_AES_IV_SIZE);
+
+  ret = plan_ctr_jobs(&tmpl, num_sub_samples, chunk, &jobs, &num_jobs);
+  if (ret) {
+    put_pool(pool);
+    return ret;
+  }
+  /*
+   * Unless the sample is all clear, its first region holds encrypted bytes
+   * and so reaches the TEE: it counts the whole sample once
+   */
+  for (i = 0; i < num_jobs; i++)
+    jobs[i].usage = i ? TA_SG_USAGE_NONE : total;
+
+  if (workers > 1 && num_jobs > 1) {
+    pool_group_init(&group);
+    for (i = 0; i < num_jobs; i++) {
+      jobs[i].job.priority = t_sched.priority;
+      jobs[i].job.deadline = t_sched.deadline;
+      decrypt_pool_submit(pool, &group, &jobs[i].job);
+    }
+    ret = pool_group_wait(&group);
+  } else {
+    for (i = 0; i < num_jobs && !ret; i++)
+      ret = ctr_job_run(&jobs[i].job, &sess);
+  }
+  free(jobs);
+  put_pool(pool);
+  CHECK(ret, "TEE_AES_ctr128_decrypt_parallel");
+
+  return 0;
+}
+
+static TEEC_Result
+decrypt_batch(TEEC_Session *s,
+    const unsigned char* in_data,
+    uint32_t in_size,
+    unsigned char* out_data,
+    uint32_t out_size,
+    const batch_sample_t* samples,
+    uint32_t num_samples,
+    const batch_key_t* keys,
+    uint32_t num_keys,
+    uint32_t *err_origin)
+{
+  TEEC_Operation op;
+  TEEC_Result res;
+  uint32_t num_subsamples = 0, i;
+  struct ta_batch_header *hdr;
+  struct ta_batch_sample *tbl;
+  struct ta_subsample *sub;
+  size_t tbl_size;
+  struct shm_param p[4];
+
+  for (i = 0; i < num_samples; i++)
+    num_subsamples += samples[i].num_sub_samples;
+
+  /* Pack the table: header, samples, then all subsamples */
+  tbl_size = sizeof(*hdr) + num_samples * sizeof(*tbl) +
+    num_subsamples * sizeof(*sub);
+  hdr = malloc(tbl_size);
+  if (!hdr) {
+    *err_origin = TEEC_ORIGIN_API;
+    return TEEC_ERROR_OUT_OF_MEMORY;
+  }
+
+  hdr->version = TA_BATCH_VERSION;
+  hdr->num_samples = num_samples;
+  hdr->num_subsamples = num_subsamples;
+  hdr->reserved = 0;
+  tbl = (struct ta_batch_sample *)(hdr + 1);
+  sub = (struct ta_subsample *)(tbl + num_samples);
+
+  for (i = 0; i < num_samples; i++) {
+    tbl[i].in_offset = samples[i].in_offset;
+    tbl[i].out_offset = samples[i].out_offset;
+    tbl[i].size = samples[i].size;
+    tbl[i].key_slot = samples[i].key_slot;
+    tbl[i].first_subsample = sub - (struct ta_subsample *)(tbl + num_samples);
+    tbl[i].num_subsamples = samples[i].num_sub_samples;
+    memcpy(tbl[i].iv, samples[i].iv, CTR_AES_IV_SIZE);
+    memcpy(tbl[i].kid, samples[i].kid, TA_KID_SIZE);
+    tbl[i].scheme = samples[i].scheme;
+    tbl[i].crypt_blocks = samples[i].crypt_blocks;
+    tbl[i].skip_blocks = samples[i].skip_blocks;
+    tbl[i].reserved = 0;
+    if (samples[i].num_sub_samples)
+      memcpy(sub, samples[i].sub_samples,
+             samples[i].num_sub_samples * sizeof(*sub));
+    sub += samples[i].num_sub_samples;
+  }
+
+  op.paramTypes = TEEC_PARAM_TYPES(
+    shm_param_set(&op, 0, &p[0], in_data, in_size, TEEC_MEM_INPUT),
+    shm_param_set(&op, 1, &p[1], out_data, out_size,
+                  TEEC_MEM_INPUT | TEEC_MEM_OUTPUT),
+    shm_param_set(&op, 2, &p[2], hdr, tbl_size, TEEC_MEM_INPUT),
+    shm_param_set(&op, 3, &p[3], keys, num_keys * sizeof(*keys),
+                  TEEC_MEM_INPUT));
+
+  res = TEEC_InvokeCommand(s, TA_AES_CTR128_BATCH_DECRYPT, &op, err_origin);
+  for (i = 0; i < 4; i++)
+    shm_param_put(&op, i, &p[i]);
+  free(hdr);
+
+  return res;
+}
+
+/* A TEE_AES_ctr128_decrypt_batch() call of a scheduled thread */
+struct batch_job {
+  struct pool_job job;
+  const unsigned char *in;
+  uint32_t in_size;
+  unsigned char *out;
+  uint32_t out_size;
+  const batch_sample_t *samples;
+  uint32_t num_samples;
+  const batch_key_t *keys;
+  uint32_t num_keys;
+  TEEC_Result res;
+  uint32_t err_origin;
+};
+
+static int batch_job_run(struct pool_job *job, TEEC_Session *s)
+{
+  struct batch_job *bj = (struct batch_job *)job;
+
+  bj->res = decrypt_batch(s, bj->in, bj->in_size, bj->out, bj->out_size,
+                          bj->samples, bj->num_samples, bj->keys,
+                          bj->num_keys, &bj->err_origin);
+  return bj->res != TEEC_SUCCESS;
+}
+
+int
+TEE_AES_ctr128_decrypt_batch(const unsigned char* in_data,
+    uint32_t in_size,
+    unsigned char* out_data,
+    uint32_t out_size,
+    const batch_sample_t* samples,
+    uint32_t num_samples,
+    const batch_key_t* keys,
+    uint32_t num_keys)
+{
+  struct decrypt_pool *pool = NULL;
+  struct pool_group group;
+  struct batch_job bj;
+  TEEC_Result res;
+  uint32_t err_origin;
+
+  if (!in_data || !out_data || !samples || (!keys && num_keys) ||
+      !num_samples || num_samples > TA_BATCH_MAX_SAMPLES ||
+      num_keys > TA_BATCH_MAX_KEYS)
+    return EINVAL;
+
+  /* The worker sessions hold the keys loaded by key ID as well */
+  if (t_sched_set)
+    pool = get_pool();
+
+  if (pool) {
+    memset(&bj, 0, sizeof(bj));
+    bj.job.run = batch_job_run;
+    bj.job.priority = t_sched.priority;
+    bj.job.deadline = t_sched.deadline;
+    bj.in = in_data;
+    bj.in_size = in_size;
+    bj.out = out_data;
+    bj.out_size = out_size;
+    bj.samples = samples;
+    bj.num_samples = num_samples;
+    bj.keys = keys;
+    bj.num_keys = num_keys;
+
+    pool_group_init(&group);
+    decrypt_pool_submit(pool, &group, &bj.job);
+    pool_group_wait(&group);
+    put_pool(pool);
+    res = bj.res;
+    err_origin = bj.err_origin;
+  } else {
+    res = decrypt_batch(&sess, in_data, in_size, out_data, out_size,
+                        samples, num_samples, keys, num_keys, &err_origin);
+  }
+  if (res == TEEC_ERROR_OUT_OF_MEMORY && err_origin == TEEC_ORIGIN_API)
+    return ENOMEM;
+  CHECK_INVOKE(res, err_origin);
+
+  return 0;
+}
+
+int TEE_crypto_set_sched(const decrypt_sched_t* sched)
+{
+  if (sched && (sched->priority < DECRYPT_PRIO_PLAYBACK ||
+                sched->priority > DECRYPT_PRIO_BACKGROUND))
+    return EINVAL;
+
+  t_sched.priority = sched ? sched->priority : DECRYPT_PRIO_PLAYBACK;
+  t_sched.deadline = sched ? sched->deadline : POOL_NO_DEADLINE;
+  t_sched_set = sched != NULL;
+
+  return 0;
+}
+
+int
+TEE_load_keys(const key_entry_t* keys, uint32_t num_keys)
+{
+  TEEC_Operation op;
+  TEEC_Result res;
+  uint32_t err_origin, num;
+
+  if (!keys || !num_keys)
+    return EINVAL;
+
+  op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT, TEEC_NONE,
+                                   TEEC_NONE, TEEC_NONE);
+  op.params[0].tmpref.buffer = (void *)keys;
+  op.params[0].tmpref.size = num_keys * sizeof(*keys);
+
+  /*
+   * Under g_pool_lock so that worker sessions opened meanwhile get the
+   * same keys: their usage then lands on the right kid too
+   */
+  pthread_mutex_lock(&g_pool_lock);
+  res = TEEC_InvokeCommand(&sess, TA_LOAD_KEYS, &op, &err_origin);
+  for (num = 0; num < num_keys && keep_key(&keys[num]); num++)
+    ;
+  if (g_pool)
+    load_pool_keys(g_pool, keys, num);
+  pthread_mutex_unlock(&g_pool_lock);
+
+  /* Entries before the failing one are loaded */
+  if (res == TEEC_ERROR_OUT_OF_MEMORY && err_origin == TEEC_ORIGIN_TRUSTED_APP)
+    return ENOSPC;
+  if (res == TEEC_ERROR_NOT_SUPPORTED && err_origin == TEEC_ORIGIN_TRUSTED_APP)
+    return EINVAL;
+  CHECK_INVOKE(res, err_origin);
+
+  return 0;
+}
+
+int
+TEE_get_session_stats(session_stats_t* stats)
+{
+  TEEC_Operation op;
+  TEEC_Result res;
+  uint32_t err_origin;
+
+  if (!stats)
+    return EINVAL;
+
+  op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_OUTPUT, TEEC_NONE,
+                                   TEEC_NONE, TEEC_NONE);
+  op.params[0].tmpref.buffer = stats;
+  op.params[0].tmpref.size = sizeof(*stats);
+
+  res = TEEC_InvokeCommand(&sess, TA_GET_SESSION_STATS, &op, &err_origin);
+  CHECK_INVOKE(res, err_origin);
+
+  return 0;
+}
+
+int
+TEE_read_trace(trace_entry_t* entries,
+    uint32_t max_entries,
+    uint32_t *num_entries,
+    uint32_t *dropped)
+{
+  TEEC_Operation op;
+  TEEC_Result res;
+  uint32_t err_origin;
+
+  if ((!entries && max_entries) || !num_entries)
+    return EINVAL;
+
+  op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_OUTPUT,
+                                   TEEC_VALUE_OUTPUT, TEEC_NONE, TEEC_NONE);
+  op.params[0].tmpref.buffer = entries;
+  op.params[0].tmpref.size = max_entries * sizeof(*entries);
+
+  res = TEEC_InvokeCommand(&sess, TA_READ_TRACE, &op, &err_origin);
+  CHECK_INVOKE(res, err_origin);
+
+  *num_entries = op.params[0].tmpref.size / sizeof(*entries);
+  if (dropped)
+    *dropped = op.params[1].value.a;
+
+  return 0;
+}
+
+int
+TEE_get_key_usage(key_usage_t* usage,
+    uint32_t max_entries,
+    uint32_t *num_entries)
+{
+  TEEC_Result res;
+  uint32_t err_origin, num;
+
+  if ((!usage && max_entries) || !num_entries)
+    return EINVAL;
+
+  res = read_key_usage(&sess, usage, max_entries, num_entries, &err_origin);
+  if (res == TEEC_ERROR_SHORT_BUFFER && err_origin == TEEC_ORIGIN_TRUSTED_APP)
+    return ENOSPC;
+  CHECK_INVOKE(res, err_origin);
+
+  num = *num_entries;
+  pthread_mutex_lock(&g_pool_lock);
+  add_usage(usage, &num, num, g_pool_usage, g_pool_usage_num);
+  add_pool_usage(g_pool, usage, &num, num);
+  pthread_mutex_unlock(&g_pool_lock);
+
+  return 0;
+}
+
+static TEEC_Result open_context(uint32_t *err_origin)
+{
+  TEEC_Result res;
+  TEEC_UUID uuid = TA_AES_DECRYPTOR_UUID;
+
+  *err_origin = TEEC_ORIGIN_API;
+  res = TEEC_InitializeContext(NULL, &ctx);
+  if (res != TEEC_SUCCESS)
+    return res;
+
+  res = TEEC_OpenSession(&ctx, &sess, &uuid,
+             TEEC_LOGIN_PUBLIC, NULL, NULL, err_origin);
+  if (res != TEEC_SUCCESS) {
+    TEEC_FinalizeContext(&ctx);
+    return res;
+  }
+
+  *err_origin = TEEC_ORIGIN_API;
+  res = allocate_mem();
+  if (res != TEEC_SUCCESS) {
+    TEEC_CloseSession(&sess);
+    TEEC_FinalizeContext(&ctx);
+  }
+
+  return res;
+}
+
+static void close_context(void)
+{
+  free_mem();
+
+  pthread_mutex_lock(&g_pool_lock);
+  decrypt_pool_destroy(g_pool);
+  g_pool = NULL;
+  g_pool_failed = false;
+  memset(g_pool_usage, 0, sizeof(g_pool_usage));
+  g_pool_usage_num = 0;
+  memset(g_keys, 0, sizeof(g_keys));
+  g_num_keys = 0;
+  pthread_mutex_unlock(&g_pool_lock);
+
+  TEEC_CloseSession(&sess);
+  TEEC_FinalizeContext(&ctx);
+}
+
+static void *prefetch_thread(void *arg)
+{
+  TEEC_Result res;
+  uint32_t err_origin;
+
+  (void)arg;
+  res = open_context(&err_origin);
+  if (res == TEEC_SUCCESS)
+    put_pool(get_pool());
+  else
+    PR("Prefetch failed with code 0x%x origin 0x%x\n", res, err_origin);
+
+  pthread_mutex_lock(&g_ctx_lock);
+  g_ctx_opening = false;
+  if (res != TEEC_SUCCESS) {
+    /* TEE_crypto_init() retries and reports the error */
+    g_ctx_refs--;
+    g_ctx_warm = false;
+  }
+  pthread_cond_broadcast(&g_ctx_cond);
+  pthread_mutex_unlock(&g_ctx_lock);
+
+  return NULL;
+}
+
+/* avg10 of the "some" memory pressure stall in percent, -1 if unknown */
+static int memory_pressure(void)
+{
+  FILE *f;
+  float avg10;
+  int n;
+
+  f = fopen("/proc/pressure/memory", "r");
+  if (!f)
+    return -1;
+  n = fscanf(f, "some avg10=%f", &avg10);
+  fclose(f);
+
+  return n == 1 ? (int)avg10 : -1;
+}
+
+static void *reaper_thread(void *arg)
+{
+  trim_policy_t policy;
+  int pressure;
+
+  (void)arg;
+  for (;;) {
+    usleep(REAPER_PERIOD_MS * 1000);
+
+    pthread_mutex_lock(&g_reaper_lock);
+    policy = g_trim_policy;
+    pthread_mutex_unlock(&g_reaper_lock);
+
+    pressure = memory_pressure();
+    if (pressure >= 0 && policy.pressure_high &&
+        (uint32_t)pressure >= policy.pressure_high)
+      TEE_crypto_trim(TEE_TRIM_ALL);
+    else if (pressure >= 0 && policy.pressure_low &&
+             (uint32_t)pressure >= policy.pressure_low)
+      TEE_crypto_trim(TEE_TRIM_POOL);
+    else if (policy.idle_ms) {
+      trim_pool(policy.idle_ms);
+      trim_arena(policy.idle_ms);
+    }
+  }
+
+  return NULL;
+}
+
+static void start_reaper(void)
+{
+  pthread_t thread;
+
+  if (pthread_create(&thread, NULL, reaper_thread, NULL))
+    FP("Failed to start the session reaper\n");
+  else
+    pthread_detach(thread);
+}
+
+int TEE_crypto_set_trim_policy(const trim_policy_t *policy)
+{
+  if (!policy)
+    return EINVAL;
+
+  pthread_mutex_lock(&g_reaper_lock);
+  g_trim_policy = *policy;
+  pthread_mutex_unlock(&g_reaper_lock);
+
+  return 0;
+}
+
+unsigned int TEE_crypto_pool_sessions(void)
+{
+  unsigned int n;
+
+  pthread_mutex_lock(&g_pool_lock);
+  n = decrypt_pool_size(g_pool);
+  pthread_mutex_unlock(&g_pool_lock);
+
+  return n;
+}
+
+size_t TEE_crypto_arena_size(void)
+{
+  struct shm_arena_stats stats;
+  size_t size = 0;
+
+  pthread_mutex_lock(&g_arena_lock);
+  if (g_arena) {
+    shm_arena_get_stats(g_arena, &stats);
+    size = stats.size;
+  }
+  pthread_mutex_unlock(&g_arena_lock);
+
+  return size;
+}
+
+int TEE_crypto_trim(int level)
+{
+  if (level != TEE_TRIM_POOL && level != TEE_TRIM_ALL)
+    return EINVAL;
+
+  trim_pool(0);
+  trim_arena(0);
+  if (level == TEE_TRIM_ALL)
+    TEE_crypto_release();
+
+  return 0;
+}
+
+int TEE_crypto_prefetch(void)
+{
+  pthread_t thread;
+  int err;
+
+  pthread_mutex_lock(&g_ctx_lock);
+  if (g_ctx_warm) {
+    pthread_mutex_unlock(&g_ctx_lock);
+    return 0;
+  }
+  g_ctx_warm = true;
+  if (g_ctx_refs++) {
+    pthread_mutex_unlock(&g_ctx_lock);
+    return 0;
+  }
+
+  pthread_once(&g_reaper_once, start_reaper);
+
+  g_ctx_opening = true;
+  err = pthread_create(&thread, NULL, prefetch_thread, NULL);
+  if (err) {
+    g_ctx_opening = false;
+    g_ctx_refs--;
+    g_ctx_warm = false;
+  } else
+    pthread_detach(thread);
+  pthread_mutex_unlock(&g_ctx_lock);
+
+  return err;
+}
+
+int TEE_crypto_release(void)
+{
+  pthread_mutex_lock(&g_ctx_lock);
+  while (g_ctx_opening)
+    pthread_cond_wait(&g_ctx_cond, &g_ctx_lock);
+  if (g_ctx_warm) {
+    g_ctx_warm = false;
+    if (!--g_ctx_refs)
+      close_context();
+  }
+  pthread_mutex_unlock(&g_ctx_lock);
+
+  return 0;
+}
+
+int TEE_crypto_init()
+{
+  TEEC_Result res = TEEC_SUCCESS;
+  uint32_t err_origin;
+
+  pthread_mutex_lock(&g_ctx_lock);
+  while (g_ctx_opening)
+    pthread_cond_wait(&g_ctx_cond, &g_ctx_lock);
+  if (!g_ctx_refs) {
+    res = open_context(&err_origin);
+    if (res != TEEC_SUCCESS) {
+      pthread_mutex_unlock(&g_ctx_lock);
+      errx(1, "TEE_crypto_init failed with code 0x%x origin 0x%x",
+        res, err_origin);
+    }
+  }
+  g_ctx_refs++;
+  pthread_mutex_unlock(&g_ctx_lock);
+
+ return res;
+}
+
+int
+TEE_crypto_close() {
+
+  pthread_mutex_lock(&g_ctx_lock);
+  while (g_ctx_opening)
+    pthread_cond_wait(&g_ctx_cond, &g_ctx_lock);
+  if (g_ctx_refs && !--g_ctx_refs)
+    close_context();
+  pthread_mutex_unlock(&g_ctx_lock);
 
-  TEEC_CloseSession(&sess);
-  TEEC_FinalizeContext(&ctx);
   return TEEC_SUCCESS;
 }
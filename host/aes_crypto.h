@@ -45,6 +45,7 @@
 #include <tee_client_api_extensions.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <aes_crypto_ta.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -60,10 +61,101 @@ typedef struct _sub_sample_t {
     uint32_t encrp_bytes;
 } sub_sample_t;
 
-/* Initialize OP TEE and allocate shared memory*/
+/* scatter-gather range: length bytes at offset into buf */
+typedef struct _sg_range_t {
+    unsigned char* buf;
+    uint32_t offset;
+    uint32_t length;
+} sg_range_t;
+
+/*
+ * Initialize OP TEE and allocate shared memory. Calls are reference
+ * counted, each one is paired with a TEE_crypto_close().
+ */
 int
 TEE_crypto_init();
 
+/*
+ * Open the TEE session, shared memory and decrypt worker sessions in the
+ * background, e.g. at process start, and keep them open across playbacks
+ * until TEE_crypto_release(). TEE_crypto_init() waits for a prefetch in
+ * progress instead of loading the TA itself. Keys loaded with
+ * TEE_load_keys() stay loaded while the context is kept open.
+ */
+int
+TEE_crypto_prefetch(void);
+
+/* Drop the reference taken by TEE_crypto_prefetch() */
+int
+TEE_crypto_release(void);
+
+/*
+ * Trimming of idle resources by the reaper thread started with the first
+ * TEE_crypto_prefetch() or the first worker sessions. Every second it
+ * reads the memory pressure stall (avg10 of /proc/pressure/memory, in
+ * percent): at or above pressure_high it trims with TEE_TRIM_ALL, at or
+ * above pressure_low with TEE_TRIM_POOL. Otherwise the worker sessions and
+ * the shared memory arena are released once unused for idle_ms. A zero
+ * field disables its rule. The defaults are 5000 ms, 10 and 40.
+ */
+typedef struct _trim_policy_t {
+    uint32_t idle_ms;
+    uint32_t pressure_low;
+    uint32_t pressure_high;
+} trim_policy_t;
+
+int
+TEE_crypto_set_trim_policy(const trim_policy_t* policy);
+
+/*
+ * Close the parallel decrypt worker sessions not in use and release the
+ * shared memory arena if no call holds a block of it
+ */
+#define TEE_TRIM_POOL 1
+/* Also drop the context kept open by TEE_crypto_prefetch() */
+#define TEE_TRIM_ALL 2
+
+/*
+ * Release idle TEE sessions and shared memory now, e.g. on a memory
+ * pressure signal. Playbacks in progress keep what they use.
+ */
+int
+TEE_crypto_trim(int level);
+
+/* Worker sessions open for parallel decrypts, 0 once they were trimmed */
+unsigned int
+TEE_crypto_pool_sessions(void);
+
+/* Bytes of the shared memory arena, 0 once it was trimmed */
+size_t
+TEE_crypto_arena_size(void);
+
+/* Priorities of TEE_crypto_set_sched(), lower ones run first */
+#define DECRYPT_PRIO_PLAYBACK 0
+#define DECRYPT_PRIO_PREVIEW 1
+#define DECRYPT_PRIO_BACKGROUND 2
+
+/*
+ * Scheduling of the decrypts of a thread on the worker sessions. Among
+ * jobs of the same priority the earliest deadline runs first, so streams
+ * sharing the device must use one clock, e.g. the CLOCK_MONOTONIC time in
+ * microseconds at which the sample is presented.
+ */
+typedef struct _decrypt_sched_t {
+    int priority;
+    uint64_t deadline;
+} decrypt_sched_t;
+
+/*
+ * Set how the next decrypts of the calling thread are scheduled, NULL to
+ * go back to the default: DECRYPT_PRIO_PLAYBACK without a deadline, after
+ * the jobs that have one. With a schedule set, TEE_AES_ctr128_decrypt_batch()
+ * calls also go through the worker sessions instead of the session of
+ * TEE_crypto_init(). Jobs already running are not preempted.
+ */
+int
+TEE_crypto_set_sched(const decrypt_sched_t* sched);
+
 /* AES CTR 128 decryption/encryption */
 int
 TEE_AES_ctr128_encrypt(const unsigned char* in_data,
@@ -75,7 +167,7 @@ TEE_AES_ctr128_encrypt(const unsigned char* in_data,
     uint32_t offset,
     bool secure);
 
-/* AES CTR 128 decryption/encryption for secure buffer */
+/* AES CTR 128 decryption/encryption for secure buffer, 16 byte key */
 int
 TEE_AES_ctr128_encrypt_secure(const unsigned char* in_data,
     unsigned char* out_data,
@@ -85,13 +177,222 @@ TEE_AES_ctr128_encrypt_secure(const unsigned char* in_data,
     unsigned char iv[CTR_AES_BLOCK_SIZE],
     uint32_t *length);
 
+/* NAL unit of a secure output, offset is past its length field */
+typedef struct ta_nal_unit nal_unit_t;
+
+/*
+ * Output descriptor of a secure decrypt, so that the secure buffer can be
+ * queued to the decoder without parsing it. The caller sets
+ * nal_length_size (0, 1, 2 or 4) and the max_nals entries of nals, the
+ * rest is filled in. With a nal_length_size the output is walked as length
+ * prefixed NAL units: the first max_nals are stored, num_nals counts all
+ * of them and frame_end is the end of the last complete one. The walk
+ * stops at the first length field that is not entirely inside a clear
+ * range. With nal_length_size 0, frame_end is bytes_written.
+ */
+typedef struct _secure_output_t {
+    uint32_t nal_length_size;
+    uint32_t max_nals;          /* at most TA_SECURE_MAX_NALS */
+    nal_unit_t* nals;
+    uint32_t num_nals;
+    uint32_t bytes_written;
+    uint32_t frame_end;
+} secure_output_t;
+
+/*
+ * Same as TEE_AES_ctr128_encrypt_secure, with the subsamples given as a
+ * packed map built by TEE_pack_subsamples() instead of a struct array and
+ * a key of key_size bytes (16, 24 or 32). desc may be NULL.
+ */
+int
+TEE_AES_ctr128_encrypt_secure_packed(const unsigned char* in_data,
+    unsigned char* out_data,
+    const uint8_t* map,
+    uint32_t map_size,
+    const char* key,
+    uint32_t key_size,
+    unsigned char iv[CTR_AES_BLOCK_SIZE],
+    uint32_t *length,
+    secure_output_t* desc);
+
+/*
+ * AES CBC 128 ('cbc1') decryption for secure buffer. The chain continues
+ * across subsamples and the trailing partial block of each encrypted range
+ * stays clear. With samples_size 0 the whole input is one encrypted range.
+ * desc may be NULL.
+ */
+int
+TEE_AES_cbc128_decrypt_secure(const unsigned char* in_data,
+    unsigned char* out_data,
+    const sub_sample_t* samples,
+    uint32_t samples_size,
+    const char* key,
+    uint32_t key_size,
+    unsigned char iv[CTR_AES_BLOCK_SIZE],
+    uint32_t *length,
+    secure_output_t* desc);
+
+/*
+ * Pack subsamples into the compact map format. map_size must be at least
+ * TA_PACKED_SUBSAMPLES_MAX_SIZE(num_samples). Returns the packed size, or
+ * 0 on error.
+ */
+uint32_t
+TEE_pack_subsamples(const sub_sample_t* samples,
+    uint32_t num_samples,
+    uint8_t* map,
+    uint32_t map_size);
+
+/*
+ * AES CTR 128 decryption of a whole non-secure sample. Clear bytes are
+ * copied, encrypted bytes decrypted with the counter running across
+ * subsamples. Large samples are split on block boundaries and spread over
+ * a pool of worker threads, each with its own TEE session and so its own
+ * TA instance. Samples with fewer than CTR_PARALLEL_MIN_SIZE encrypted
+ * bytes stay on the session of TEE_crypto_init().
+ */
+#define CTR_PARALLEL_MIN_SIZE (128 * 1024)
+
+int
+TEE_AES_ctr128_decrypt_parallel(const unsigned char* in_data,
+    unsigned char* out_data,
+    const sub_sample_t* sub_samples,
+    uint32_t num_sub_samples,
+    const char* key,
+    uint32_t key_size,
+    unsigned char iv[CTR_AES_BLOCK_SIZE]);
+
+/*
+ * AES CTR 128 decryption of a sample spread over several input ranges into
+ * several output ranges, without coalescing them first. The ranges may be
+ * in different buffers and both lists must add up to the same length.
+ * Ranges all inside one buffer registered with TEE_register_buffer() are
+ * passed by offset, otherwise only their bytes are copied. Bytes between
+ * the output ranges are left untouched.
+ */
+int
+TEE_AES_ctr128_decrypt_sg(const sg_range_t* in,
+    uint32_t num_in,
+    const sg_range_t* out,
+    uint32_t num_out,
+    const char* key,
+    uint32_t key_size,
+    unsigned char iv[CTR_AES_BLOCK_SIZE]);
+
+/* key of a TEE_AES_ctr128_decrypt_batch() call, key_size is 16, 24 or 32 */
+typedef struct ta_batch_key batch_key_t;
+
+/* sample of a TEE_AES_ctr128_decrypt_batch() call, unused fields zeroed */
+typedef struct _batch_sample_t {
+    uint32_t in_offset;
+    uint32_t out_offset;
+    uint32_t size;
+    uint32_t key_slot;          /* index in the keys array, or BATCH_KEY_BY_KID */
+    const sub_sample_t* sub_samples;
+    uint32_t num_sub_samples;   /* 0: the whole sample is encrypted */
+    unsigned char iv[CTR_AES_BLOCK_SIZE];
+    unsigned char kid[TA_KID_SIZE]; /* with BATCH_KEY_BY_KID */
+    uint32_t scheme;            /* BATCH_SCHEME_CENC (0) or BATCH_SCHEME_CBCS */
+    uint8_t crypt_blocks;       /* 'cbcs' pattern, see TA_BATCH_SCHEME_CBCS */
+    uint8_t skip_blocks;
+} batch_sample_t;
+
+#define BATCH_SCHEME_CENC TA_BATCH_SCHEME_CENC
+#define BATCH_SCHEME_CBCS TA_BATCH_SCHEME_CBCS
+
+/* key_slot of a sample using the key loaded under its kid */
+#define BATCH_KEY_BY_KID TA_BATCH_KEY_SLOT_KID
+
+/*
+ * AES CTR 128 decryption of several samples of one buffer, e.g. a whole
+ * fragment, in a single TEE invocation. Samples may instead be AES-CBC
+ * with a 'cbcs' block pattern. Samples pick their key from the
+ * num_keys entries of keys, which may mix key sizes, or by key ID from the
+ * keys loaded with TEE_load_keys(). keys may be NULL if all samples use
+ * key IDs.
+ */
+int
+TEE_AES_ctr128_decrypt_batch(const unsigned char* in_data,
+    uint32_t in_size,
+    unsigned char* out_data,
+    uint32_t out_size,
+    const batch_sample_t* samples,
+    uint32_t num_samples,
+    const batch_key_t* keys,
+    uint32_t num_keys);
+
+/* key loaded by TEE_load_keys(), key_size is 16, 24, 32 or 0 to unload */
+typedef struct ta_key_entry key_entry_t;
+
+/*
+ * Load keys into the TEE session and the worker sessions by key ID,
+ * replacing keys loaded under the same ID. At most TA_MAX_LOADED_KEYS keys
+ * are loaded at a time, ENOSPC is returned beyond that.
+ */
+int
+TEE_load_keys(const key_entry_t* keys, uint32_t num_keys);
+
+/* Counters of the TEE session used by TEE_crypto_init() */
+typedef struct ta_session_stats session_stats_t;
+
+int
+TEE_get_session_stats(session_stats_t* stats);
+
+/* Invocation recorded by the TA, see struct ta_trace_entry */
+typedef struct ta_trace_entry trace_entry_t;
+
+/*
+ * Move up to max_entries of the oldest invocations traced by the TEE
+ * session out of its ring of TA_TRACE_RING_SIZE entries. dropped, if not
+ * NULL, returns how many were overwritten since the last read.
+ */
+int
+TEE_read_trace(trace_entry_t* entries,
+    uint32_t max_entries,
+    uint32_t *num_entries,
+    uint32_t *dropped);
+
+/* Usage counters of a key of the TEE session, see struct ta_key_usage */
+typedef struct ta_key_usage key_usage_t;
+
+/*
+ * Read the usage counters kept by the TEE session: the keys passed with
+ * the calls first, under a zero kid, then every key loaded with
+ * TEE_load_keys(). TA_MAX_LOADED_KEYS + 1 entries always fit, ENOSPC is
+ * returned with the number needed in num_entries otherwise. The counters
+ * include the worker sessions of the context, which hold the same keys,
+ * and those already closed.
+ */
+int
+TEE_get_key_usage(key_usage_t* usage,
+    uint32_t max_entries,
+    uint32_t *num_entries);
+
+/* Buffers that can be registered with TEE_register_buffer() at a time */
+#define TEE_MAX_REGISTERED_BUFFERS 8
+
+/*
+ * Register size bytes at page aligned buf, such as a demuxer's sample
+ * buffers, as shared memory with the TEE. Input and output ranges of
+ * later calls inside it are passed by offset instead of being copied.
+ * The TEE registration is made on first use and redone after the context
+ * was closed. Returns EINVAL, EEXIST if buf is registered already or
+ * ENOSPC when TEE_MAX_REGISTERED_BUFFERS are.
+ */
+int
+TEE_register_buffer(void* buf, size_t size);
+
+/* Returns ENOENT if buf is not registered, EBUSY while a call uses it */
+int
+TEE_unregister_buffer(void* buf);
+
 /* Copy from source buffer to secure dest buffer */
 int TEE_copy_secure_memory(const unsigned char* in_data,
     unsigned char* out_data,
     uint32_t length,
     uint32_t offset);
 
-/* Close TEE session and close memory*/
+/* Close TEE session and close memory once the last reference is gone */
 int
 TEE_crypto_close();
 
@@ -0,0 +1,622 @@
+/*
+ * Copyright (c) 2026, The optee_clearkey contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "cenc_mp4.h"
+
+#define BOX(a, b, c, d) CENC_MP4_FOURCC(a, b, c, d)
+
+/* tfhd flags */
+#define TFHD_BASE_DATA_OFFSET 0x000001
+#define TFHD_SAMPLE_DESC_INDEX 0x000002
+#define TFHD_DEFAULT_DURATION 0x000008
+#define TFHD_DEFAULT_SIZE 0x000010
+#define TFHD_DEFAULT_FLAGS 0x000020
+#define TFHD_DEFAULT_BASE_IS_MOOF 0x020000
+/* trun flags */
+#define TRUN_DATA_OFFSET 0x000001
+#define TRUN_FIRST_FLAGS 0x000004
+#define TRUN_DURATION 0x000100
+#define TRUN_SIZE 0x000200
+#define TRUN_FLAGS 0x000400
+#define TRUN_CTS_OFFSET 0x000800
+/* senc flags */
+#define SENC_OVERRIDE 0x000001
+#define SENC_SUBSAMPLES 0x000002
+/* Bytes of a subsample entry: 16 bit clear, 32 bit encrypted */
+#define SUBSAMPLE_ENTRY_SIZE 6
+
+/* Children of a VisualSampleEntry and an AudioSampleEntry start there */
+#define VISUAL_SAMPLE_ENTRY_SIZE 78
+#define AUDIO_SAMPLE_ENTRY_SIZE 28
+
+struct box {
+  uint64_t start;
+  uint64_t body;
+  uint64_t end;
+  uint32_t type;
+};
+
+static const uint8_t piff_senc_uuid[16] = {
+  0xa2, 0x39, 0x4f, 0x52, 0x5a, 0x9b, 0x4f, 0x14,
+  0xa2, 0x44, 0x6c, 0x42, 0x7c, 0x64, 0x8d, 0xf4,
+};
+
+static uint16_t be16(const uint8_t *p)
+{
+  return (uint16_t)p[0] << 8 | p[1];
+}
+
+static uint32_t be32(const uint8_t *p)
+{
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+    (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint64_t be64(const uint8_t *p)
+{
+  return (uint64_t)be32(p) << 32 | be32(p + 4);
+}
+
+/* len bytes at off lie in box b */
+static bool in_box(const struct box *b, uint64_t off, uint64_t len)
+{
+  return off >= b->body && off <= b->end && len <= b->end - off;
+}
+
+static int box_at(const struct cenc_mp4 *mp4, uint64_t pos, uint64_t end,
+                  struct box *b)
+{
+  const uint8_t *p = mp4->data + pos;
+  uint64_t size;
+
+  if (pos > end || end - pos < 8)
+    return EINVAL;
+  size = be32(p);
+  b->type = be32(p + 4);
+  b->body = pos + 8;
+  if (size == 1) {
+    if (end - pos < 16)
+      return EINVAL;
+    size = be64(p + 8);
+    b->body += 8;
+  } else if (!size) {
+    size = end - pos;
+  }
+  if (size < b->body - pos || size > end - pos)
+    return EINVAL;
+  b->start = pos;
+  b->end = pos + size;
+  return 0;
+}
+
+/* First box of type in [pos, end), ENOENT if there is none */
+static int find_box(const struct cenc_mp4 *mp4, uint64_t pos, uint64_t end,
+                    uint32_t type, struct box *b)
+{
+  int ret;
+
+  while (pos < end) {
+    ret = box_at(mp4, pos, end, b);
+    if (ret)
+      return ret;
+    if (b->type == type)
+      return 0;
+    pos = b->end;
+  }
+  return ENOENT;
+}
+
+/* Walk down a path of nested boxes from the children of parent */
+static int find_path(const struct cenc_mp4 *mp4, const struct box *parent,
+                     const uint32_t *path, unsigned depth, struct box *b)
+{
+  struct box cur = *parent;
+  unsigned i;
+  int ret;
+
+  for (i = 0; i < depth; i++) {
+    ret = find_box(mp4, cur.body, cur.end, path[i], b);
+    if (ret)
+      return ret;
+    cur = *b;
+  }
+  return 0;
+}
+
+static struct cenc_mp4_track *find_track(struct cenc_mp4 *mp4, uint32_t id)
+{
+  uint32_t i;
+
+  for (i = 0; i < mp4->num_tracks; i++)
+    if (mp4->tracks[i].track_id == id)
+      return &mp4->tracks[i];
+  return NULL;
+}
+
+static int parse_tenc(const struct cenc_mp4 *mp4, const struct box *b,
+                      struct cenc_mp4_track *track)
+{
+  const uint8_t *p = mp4->data + b->body;
+
+  /* version, flags, reserved, crypt/skip byte block or reserved */
+  if (!in_box(b, b->body, 4 + 2 + 2 + TA_KID_SIZE))
+    return EINVAL;
+  track->is_protected = p[6];
+  track->iv_size = p[7];
+  memcpy(track->kid, p + 8, TA_KID_SIZE);
+  if (track->iv_size && track->iv_size != 8 && track->iv_size != 16)
+    return EINVAL;
+
+  if (track->is_protected && !track->iv_size) {
+    p += 8 + TA_KID_SIZE;
+    if (!in_box(b, b->body + 8 + TA_KID_SIZE, 1) ||
+        (p[0] != 8 && p[0] != 16) ||
+        !in_box(b, b->body + 8 + TA_KID_SIZE + 1, p[0]))
+      return EINVAL;
+    track->constant_iv_size = p[0];
+    memcpy(track->constant_iv, p + 1, p[0]);
+  }
+  return 0;
+}
+
+/* Protection of the first sample entry, the track stays clear without */
+static int parse_sample_entry(const struct cenc_mp4 *mp4,
+                              const struct box *stsd,
+                              struct cenc_mp4_track *track)
+{
+  static const uint32_t schi_tenc[] = { BOX('s', 'c', 'h', 'i'),
+                                        BOX('t', 'e', 'n', 'c') };
+  struct box entry, children, sinf, schm, tenc;
+  int ret;
+
+  /* version, flags, entry_count */
+  if (!in_box(stsd, stsd->body, 8))
+    return EINVAL;
+  ret = box_at(mp4, stsd->body + 8, stsd->end, &entry);
+  if (ret)
+    return ret;
+
+  children = entry;
+  if (entry.type == BOX('e', 'n', 'c', 'v'))
+    children.body += VISUAL_SAMPLE_ENTRY_SIZE;
+  else if (entry.type == BOX('e', 'n', 'c', 'a'))
+    children.body += AUDIO_SAMPLE_ENTRY_SIZE;
+  else
+    return 0;
+  if (children.body > children.end)
+    return EINVAL;
+
+  ret = find_box(mp4, children.body, children.end, BOX('s', 'i', 'n', 'f'),
+                 &sinf);
+  if (!ret)
+    ret = find_box(mp4, sinf.body, sinf.end, BOX('s', 'c', 'h', 'm'), &schm);
+  if (!ret)
+    ret = find_path(mp4, &sinf, schi_tenc, 2, &tenc);
+  if (ret)
+    return EINVAL;
+  if (!in_box(&schm, schm.body, 8))
+    return EINVAL;
+
+  track->scheme = be32(mp4->data + schm.body + 4);
+  return parse_tenc(mp4, &tenc, track);
+}
+
+static int parse_trak(struct cenc_mp4 *mp4, const struct box *trak)
+{
+  static const uint32_t stsd_path[] = {
+    BOX('m', 'd', 'i', 'a'), BOX('m', 'i', 'n', 'f'),
+    BOX('s', 't', 'b', 'l'), BOX('s', 't', 's', 'd'),
+  };
+  struct cenc_mp4_track *track;
+  struct box tkhd, stsd;
+  const uint8_t *p;
+  uint64_t id;
+  int ret;
+
+  if (mp4->num_tracks == CENC_MP4_MAX_TRACKS)
+    return ENOTSUP;
+  track = &mp4->tracks[mp4->num_tracks];
+  memset(track, 0, sizeof(*track));
+
+  ret = find_box(mp4, trak->body, trak->end, BOX('t', 'k', 'h', 'd'), &tkhd);
+  if (ret)
+    return EINVAL;
+  p = mp4->data + tkhd.body;
+  /* creation and modification times are 64 bit in version 1 */
+  id = tkhd.body + 4 + (in_box(&tkhd, tkhd.body, 1) && p[0] == 1 ? 16 : 8);
+  if (!in_box(&tkhd, id, 4))
+    return EINVAL;
+  track->track_id = be32(mp4->data + id);
+
+  ret = find_path(mp4, trak, stsd_path, 4, &stsd);
+  if (ret)
+    return EINVAL;
+  ret = parse_sample_entry(mp4, &stsd, track);
+  if (ret)
+    return ret;
+
+  mp4->num_tracks++;
+  return 0;
+}
+
+static int parse_moov(struct cenc_mp4 *mp4, const struct box *moov)
+{
+  struct cenc_mp4_track *track;
+  struct box b, trex;
+  uint64_t pos;
+  int ret;
+
+  for (pos = moov->body;
+       !(ret = find_box(mp4, pos, moov->end, BOX('t', 'r', 'a', 'k'), &b));
+       pos = b.end) {
+    ret = parse_trak(mp4, &b);
+    if (ret)
+      return ret;
+  }
+  if (ret != ENOENT)
+    return ret;
+
+  ret = find_box(mp4, moov->body, moov->end, BOX('m', 'v', 'e', 'x'), &b);
+  if (ret)
+    return ret == ENOENT ? 0 : ret;
+  /* version, flags, track_ID, description index, duration, size */
+  for (pos = b.body;
+       !(ret = find_box(mp4, pos, b.end, BOX('t', 'r', 'e', 'x'), &trex));
+       pos = trex.end) {
+    if (!in_box(&trex, trex.body, 20))
+      return EINVAL;
+    track = find_track(mp4, be32(mp4->data + trex.body + 4));
+    if (track)
+      track->default_sample_size = be32(mp4->data + trex.body + 16);
+  }
+  return ret == ENOENT ? 0 : ret;
+}
+
+static int parse_tfhd(struct cenc_mp4 *mp4, const struct box *tfhd)
+{
+  struct cenc_mp4_traf *traf = &mp4->traf;
+  const uint8_t *p = mp4->data + tfhd->body;
+  uint64_t len = 8;
+  uint32_t flags;
+
+  if (!in_box(tfhd, tfhd->body, len))
+    return EINVAL;
+  flags = be32(p) & 0xffffff;
+  len += flags & TFHD_BASE_DATA_OFFSET ? 8 : 0;
+  len += flags & TFHD_SAMPLE_DESC_INDEX ? 4 : 0;
+  len += flags & TFHD_DEFAULT_DURATION ? 4 : 0;
+  if (!in_box(tfhd, tfhd->body, len + (flags & TFHD_DEFAULT_SIZE ? 4 : 0)))
+    return EINVAL;
+
+  traf->track = find_track(mp4, be32(p + 4));
+  if (!traf->track)
+    return EINVAL;
+  traf->tfhd_flags = flags;
+  traf->default_size = flags & TFHD_DEFAULT_SIZE ? be32(p + len) :
+                       traf->track->default_sample_size;
+
+  /* Without an explicit base the data follows the previous traf */
+  if (flags & TFHD_BASE_DATA_OFFSET)
+    traf->base = be64(p + 8);
+  else if (flags & TFHD_DEFAULT_BASE_IS_MOOF)
+    traf->base = mp4->moof;
+  else
+    traf->base = mp4->data_end;
+  traf->data = traf->base;
+  return 0;
+}
+
+static int parse_senc(struct cenc_mp4_traf *traf, const struct cenc_mp4 *mp4,
+                      const struct box *senc, uint64_t body)
+{
+  uint32_t flags;
+
+  if (!in_box(senc, body, 8))
+    return EINVAL;
+  flags = be32(mp4->data + body) & 0xffffff;
+  if (flags & SENC_OVERRIDE)
+    return ENOTSUP;
+  traf->senc_subsamples = flags & SENC_SUBSAMPLES;
+  traf->aux_left = be32(mp4->data + body + 4);
+  traf->aux = body + 8;
+  traf->aux_end = senc->end;
+  return 0;
+}
+
+static int parse_saiz_saio(struct cenc_mp4_traf *traf,
+                           const struct cenc_mp4 *mp4,
+                           const struct box *saiz, const struct box *saio)
+{
+  const uint8_t *p = mp4->data + saiz->body;
+  uint64_t pos = saiz->body + 4, offset;
+  uint8_t version;
+
+  /* aux_info_type and parameter are optional in both boxes */
+  if (!in_box(saiz, saiz->body, 4))
+    return EINVAL;
+  pos += p[3] & 1 ? 8 : 0;
+  if (!in_box(saiz, pos, 5))
+    return EINVAL;
+  traf->aux_size = mp4->data[pos];
+  traf->aux_left = be32(mp4->data + pos + 1);
+  traf->sizes = traf->aux_size ? 0 : pos + 5;
+  if (!traf->aux_size && !in_box(saiz, pos + 5, traf->aux_left))
+    return EINVAL;
+
+  p = mp4->data + saio->body;
+  pos = saio->body + 4;
+  if (!in_box(saio, saio->body, 4))
+    return EINVAL;
+  version = p[0];
+  pos += p[3] & 1 ? 8 : 0;
+  if (!in_box(saio, pos, 4 + (version ? 8 : 4)))
+    return EINVAL;
+  /* One offset: the information of all samples is contiguous */
+  if (be32(mp4->data + pos) != 1)
+    return ENOTSUP;
+  offset = version ? be64(mp4->data + pos + 4) : be32(mp4->data + pos + 4);
+
+  traf->saiz = true;
+  traf->aux = traf->base + offset;
+  traf->aux_end = mp4->size;
+  if (traf->aux < traf->base || traf->aux > mp4->size)
+    return EINVAL;
+  return 0;
+}
+
+static int parse_traf(struct cenc_mp4 *mp4, const struct box *b)
+{
+  struct cenc_mp4_traf *traf = &mp4->traf;
+  struct box tfhd, senc, saiz, saio;
+  uint64_t pos;
+  int ret;
+
+  memset(traf, 0, sizeof(*traf));
+  ret = find_box(mp4, b->body, b->end, BOX('t', 'f', 'h', 'd'), &tfhd);
+  if (!ret)
+    ret = parse_tfhd(mp4, &tfhd);
+  if (ret)
+    return ret == ENOENT ? EINVAL : ret;
+  traf->end = b->end;
+  traf->next_trun = b->body;
+
+  if (!traf->track->scheme)
+    return 0;
+
+  ret = find_box(mp4, b->body, b->end, BOX('s', 'e', 'n', 'c'), &senc);
+  if (!ret)
+    return parse_senc(traf, mp4, &senc, senc.body);
+  for (pos = b->body;
+       !(ret = find_box(mp4, pos, b->end, BOX('u', 'u', 'i', 'd'), &senc));
+       pos = senc.end) {
+    if (in_box(&senc, senc.body, 16) &&
+        !memcmp(mp4->data + senc.body, piff_senc_uuid, 16))
+      return parse_senc(traf, mp4, &senc, senc.body + 16);
+  }
+
+  ret = find_box(mp4, b->body, b->end, BOX('s', 'a', 'i', 'z'), &saiz);
+  if (!ret)
+    ret = find_box(mp4, b->body, b->end, BOX('s', 'a', 'i', 'o'), &saio);
+  if (!ret)
+    return parse_saiz_saio(traf, mp4, &saiz, &saio);
+  /* Constant IVs and whole sample encryption need no information */
+  return ret == ENOENT && traf->track->constant_iv_size ? 0 :
+    ret == ENOENT ? EINVAL : ret;
+}
+
+static int next_trun(struct cenc_mp4 *mp4)
+{
+  struct cenc_mp4_traf *traf = &mp4->traf;
+  struct box trun;
+  uint64_t pos, table;
+  uint32_t flags;
+  int ret;
+
+  ret = find_box(mp4, traf->next_trun, traf->end, BOX('t', 'r', 'u', 'n'),
+                 &trun);
+  if (ret)
+    return ret;
+  traf->next_trun = trun.end;
+
+  pos = trun.body;
+  if (!in_box(&trun, pos, 8))
+    return EINVAL;
+  flags = be32(mp4->data + pos) & 0xffffff;
+  traf->left = be32(mp4->data + pos + 4);
+  pos += 8;
+  if (flags & TRUN_DATA_OFFSET) {
+    if (!in_box(&trun, pos, 4))
+      return EINVAL;
+    traf->data = traf->base + (int32_t)be32(mp4->data + pos);
+    pos += 4;
+  }
+  pos += flags & TRUN_FIRST_FLAGS ? 4 : 0;
+
+  traf->trun_flags = flags;
+  traf->entry_size = 4 * (!!(flags & TRUN_DURATION) + !!(flags & TRUN_SIZE) +
+                          !!(flags & TRUN_FLAGS) + !!(flags & TRUN_CTS_OFFSET));
+  table = (uint64_t)traf->left * traf->entry_size;
+  if (!in_box(&trun, pos, table))
+    return EINVAL;
+  traf->entry = pos;
+  return 0;
+}
+
+/* IV and subsample map of the next sample of the traf */
+static int read_aux(struct cenc_mp4 *mp4, struct cenc_mp4_sample *smp)
+{
+  struct cenc_mp4_traf *traf = &mp4->traf;
+  const struct cenc_mp4_track *track = traf->track;
+  const uint8_t *p = mp4->data + traf->aux;
+  uint64_t left = traf->aux_end - traf->aux, size;
+  bool subsamples = traf->senc_subsamples;
+
+  if (!traf->aux_left) {
+    /* cbcs style whole samples under a constant IV */
+    if (!track->constant_iv_size)
+      return EINVAL;
+    memcpy(smp->iv, track->constant_iv, track->constant_iv_size);
+    return 0;
+  }
+
+  /* saiz gives the size of each entry, senc entries are parsed */
+  if (traf->saiz) {
+    size = traf->sizes ? mp4->data[traf->sizes++] : traf->aux_size;
+    subsamples = size > track->iv_size;
+  } else {
+    size = left;
+  }
+  if (size > left || size < track->iv_size)
+    return EINVAL;
+
+  if (track->iv_size)
+    memcpy(smp->iv, p, track->iv_size);
+  else
+    memcpy(smp->iv, track->constant_iv, track->constant_iv_size);
+  p += track->iv_size;
+
+  if (subsamples) {
+    if (size - track->iv_size < 2)
+      return EINVAL;
+    smp->num_subsamples = be16(p);
+    smp->subsamples = p + 2;
+    if ((uint64_t)smp->num_subsamples * SUBSAMPLE_ENTRY_SIZE >
+        size - track->iv_size - 2)
+      return EINVAL;
+  }
+
+  if (traf->saiz)
+    traf->aux += size;
+  else
+    traf->aux += track->iv_size + (subsamples ? 2 +
+      smp->num_subsamples * SUBSAMPLE_ENTRY_SIZE : 0);
+  traf->aux_left--;
+  return 0;
+}
+
+static int next_sample(struct cenc_mp4 *mp4, struct cenc_mp4_sample *smp)
+{
+  struct cenc_mp4_traf *traf = &mp4->traf;
+  const uint8_t *entry = mp4->data + traf->entry;
+  uint32_t size = traf->default_size;
+
+  if (traf->trun_flags & TRUN_SIZE)
+    size = be32(entry + (traf->trun_flags & TRUN_DURATION ? 4 : 0));
+  traf->entry += traf->entry_size;
+  traf->left--;
+
+  if (traf->data > mp4->size || size > mp4->size - traf->data)
+    return EINVAL;
+
+  memset(smp, 0, sizeof(*smp));
+  smp->track = traf->track;
+  smp->fragment = mp4->fragment - 1;
+  smp->offset = traf->data;
+  smp->data = mp4->data + traf->data;
+  smp->size = size;
+  smp->encrypted = traf->track->scheme && traf->track->is_protected;
+  traf->data += size;
+  mp4->data_end = traf->data;
+
+  return smp->encrypted ? read_aux(mp4, smp) : 0;
+}
+
+void cenc_mp4_init(struct cenc_mp4 *mp4, const uint8_t *data, uint64_t size)
+{
+  memset(mp4, 0, sizeof(*mp4));
+  mp4->data = data;
+  mp4->size = size;
+}
+
+int cenc_mp4_next(struct cenc_mp4 *mp4, struct cenc_mp4_sample *smp)
+{
+  struct box b;
+  int ret;
+
+  for (;;) {
+    if (mp4->traf.track) {
+      if (mp4->traf.left)
+        return next_sample(mp4, smp);
+      ret = next_trun(mp4);
+      if (!ret)
+        continue;
+      if (ret != ENOENT)
+        return ret;
+      mp4->traf.track = NULL;
+    }
+
+    if (mp4->next_traf < mp4->moof_end) {
+      ret = find_box(mp4, mp4->next_traf, mp4->moof_end,
+                     BOX('t', 'r', 'a', 'f'), &b);
+      if (ret == ENOENT) {
+        mp4->next_traf = mp4->moof_end;
+        continue;
+      }
+      if (ret)
+        return ret;
+      mp4->next_traf = b.end;
+      ret = parse_traf(mp4, &b);
+      if (ret)
+        return ret;
+      continue;
+    }
+
+    if (mp4->pos >= mp4->size)
+      return ENODATA;
+    ret = box_at(mp4, mp4->pos, mp4->size, &b);
+    if (ret)
+      return ret;
+    mp4->pos = b.end;
+
+    if (b.type == BOX('m', 'o', 'o', 'v')) {
+      ret = parse_moov(mp4, &b);
+      if (ret)
+        return ret;
+    } else if (b.type == BOX('m', 'o', 'o', 'f')) {
+      mp4->moof = b.start;
+      mp4->moof_end = b.end;
+      mp4->next_traf = b.body;
+      mp4->data_end = b.start;
+      mp4->fragment++;
+    }
+  }
+}
+
+void cenc_mp4_subsamples(const struct cenc_mp4_sample *smp,
+                         sub_sample_t *out)
+{
+  const uint8_t *p = smp->subsamples;
+  uint32_t i;
+
+  for (i = 0; i < smp->num_subsamples; i++, p += SUBSAMPLE_ENTRY_SIZE) {
+    out[i].clear_bytes = be16(p);
+    out[i].encrp_bytes = be32(p + 2);
+  }
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2026, The optee_clearkey contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef OPTEE_CLEARKEY_CENC_MP4_H
+#define OPTEE_CLEARKEY_CENC_MP4_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "aes_crypto.h"
+
+/*
+ * Streaming parser of fragmented MP4 protected with Common Encryption.
+ * The tracks come from moov (tkhd, tenc under the encv/enca sample entry,
+ * trex); each moof/traf then yields its samples with their IV and
+ * subsample map, taken from senc (or the PIFF senc uuid box) and from
+ * saiz/saio when there is no senc. The parser never allocates or copies:
+ * sample data and subsample maps point into the caller's buffer, usually
+ * a file mapping, which must outlive the parser.
+ */
+
+#define CENC_MP4_MAX_TRACKS 8
+
+#define CENC_MP4_FOURCC(a, b, c, d) \
+  ((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 | (d))
+#define CENC_SCHEME_CENC CENC_MP4_FOURCC('c', 'e', 'n', 'c')
+#define CENC_SCHEME_CBCS CENC_MP4_FOURCC('c', 'b', 'c', 's')
+
+struct cenc_mp4_track {
+  uint32_t track_id;
+  uint32_t scheme;            /* 0 for a clear track */
+  bool is_protected;          /* tenc default_isProtected */
+  uint8_t iv_size;            /* 0, 8 or 16 */
+  uint8_t constant_iv_size;
+  uint8_t constant_iv[16];
+  uint8_t kid[TA_KID_SIZE];
+  uint32_t default_sample_size;   /* from trex */
+};
+
+struct cenc_mp4_sample {
+  const struct cenc_mp4_track *track;
+  uint32_t fragment;          /* moof sequence in the file, from 0 */
+  uint64_t offset;            /* of the data in the buffer */
+  const uint8_t *data;
+  uint32_t size;
+  bool encrypted;
+  uint8_t iv[CTR_AES_BLOCK_SIZE]; /* 8 byte IVs are zero padded */
+  /* num_subsamples raw entries, see cenc_mp4_subsamples(); none: all
+   * of the sample is encrypted */
+  const uint8_t *subsamples;
+  uint32_t num_subsamples;
+};
+
+/* Position in the current traf */
+struct cenc_mp4_traf {
+  const struct cenc_mp4_track *track;
+  uint64_t end;
+  uint64_t base;              /* base data offset */
+  uint64_t next_trun;         /* where to look for the next trun */
+  uint64_t data;              /* next sample data */
+  uint32_t tfhd_flags;
+  uint32_t default_size;
+  /* current trun */
+  uint64_t entry;
+  uint32_t entry_size;
+  uint32_t trun_flags;
+  uint32_t left;              /* samples left in the trun */
+  /* sample auxiliary information, from senc or saiz/saio */
+  uint64_t aux;
+  uint64_t aux_end;
+  uint64_t sizes;             /* saiz per sample sizes, 0 with senc */
+  uint8_t aux_size;           /* saiz default size */
+  bool saiz;
+  bool senc_subsamples;
+  uint32_t aux_left;
+};
+
+struct cenc_mp4 {
+  const uint8_t *data;
+  uint64_t size;
+  uint64_t pos;               /* next top level box */
+  struct cenc_mp4_track tracks[CENC_MP4_MAX_TRACKS];
+  uint32_t num_tracks;
+  uint32_t fragment;
+  uint64_t moof;
+  uint64_t moof_end;
+  uint64_t next_traf;
+  uint64_t data_end;          /* end of the previous traf data */
+  struct cenc_mp4_traf traf;
+};
+
+void cenc_mp4_init(struct cenc_mp4 *mp4, const uint8_t *data, uint64_t size);
+
+/*
+ * Next sample in file order. Returns 0, ENODATA past the last sample,
+ * EINVAL for malformed boxes or ENOTSUP for layouts not handled, e.g.
+ * several saio offsets.
+ */
+int cenc_mp4_next(struct cenc_mp4 *mp4, struct cenc_mp4_sample *smp);
+
+/* Convert the subsample map of smp into out, num_subsamples entries */
+void cenc_mp4_subsamples(const struct cenc_mp4_sample *smp,
+                         sub_sample_t *out);
+
+#endif
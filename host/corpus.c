@@ -0,0 +1,382 @@
+/*
+ * Copyright (c) 2026, The optee_clearkey contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "corpus.h"
+#include "ref_aes.h"
+
+/* NAL length field size of the generated samples */
+#define NAL_LENGTH_SIZE 4
+
+struct layout {
+  struct corpus_sample *smp;
+  uint32_t cap;
+  uint32_t pos;
+  uint32_t clear;   /* clear bytes not yet in a subsample */
+  uint32_t codec;
+};
+
+/* splitmix64 */
+static uint64_t rng_next(struct corpus_gen *gen)
+{
+  uint64_t z = (gen->state += 0x9e3779b97f4a7c15ULL);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/* Uniform in [lo, hi] */
+static uint32_t rng_range(struct corpus_gen *gen, uint32_t lo, uint32_t hi)
+{
+  return lo + (uint32_t)(rng_next(gen) % ((uint64_t)hi - lo + 1));
+}
+
+static void rng_fill(struct corpus_gen *gen, uint8_t *buf, uint32_t len)
+{
+  uint64_t r;
+
+  while (len >= sizeof(r)) {
+    r = rng_next(gen);
+    memcpy(buf, &r, sizeof(r));
+    buf += sizeof(r);
+    len -= sizeof(r);
+  }
+  r = rng_next(gen);
+  memcpy(buf, &r, len);
+}
+
+static unsigned ilog2(uint32_t v)
+{
+  unsigned n = 0;
+
+  while (v >>= 1)
+    n++;
+  return n;
+}
+
+/*
+ * Most samples are small inter frames, log-uniform up to an eighth of
+ * max_size, one in sixteen is a key frame of a quarter to all of it.
+ */
+static uint32_t pick_size(struct corpus_gen *gen, bool *key_frame)
+{
+  uint32_t max = gen->params.max_size;
+  uint32_t hi = max / 8 >= CORPUS_MIN_SIZE ? max / 8 : max;
+  unsigned e;
+
+  *key_frame = !(rng_next(gen) % 16);
+  if (*key_frame)
+    return rng_range(gen, max / 4 >= CORPUS_MIN_SIZE ? max / 4 :
+                     CORPUS_MIN_SIZE, max);
+
+  e = rng_range(gen, ilog2(CORPUS_MIN_SIZE), ilog2(hi));
+  return rng_range(gen, 1u << e,
+                   (2u << e) - 1 < hi ? (2u << e) - 1 : hi);
+}
+
+/* Write a NAL unit of len bytes after its length field, header first */
+static void put_nal(struct corpus_gen *gen, struct layout *l, uint8_t type,
+                    uint32_t len)
+{
+  uint8_t *p = l->smp->plain + l->pos;
+
+  p[0] = len >> 24;
+  p[1] = len >> 16;
+  p[2] = len >> 8;
+  p[3] = len;
+  rng_fill(gen, p + NAL_LENGTH_SIZE, len);
+  if (l->codec == CORPUS_CODEC_HEVC) {
+    p[4] = type << 1;
+    p[5] = 1;
+  } else {
+    p[4] = type;
+  }
+  l->pos += NAL_LENGTH_SIZE + len;
+}
+
+static void put_clear_nal(struct corpus_gen *gen, struct layout *l,
+                          uint8_t type, uint32_t len)
+{
+  put_nal(gen, l, type, len);
+  l->clear += NAL_LENGTH_SIZE + len;
+}
+
+static int add_subsample(struct layout *l, uint32_t clear, uint32_t encrp)
+{
+  struct corpus_sample *smp = l->smp;
+  struct ta_subsample *s;
+
+  if (smp->rec.num_subsamples == l->cap) {
+    l->cap = l->cap ? 2 * l->cap : 8;
+    s = realloc(smp->subsamples, l->cap * sizeof(*s));
+    if (!s)
+      return ENOMEM;
+    smp->subsamples = s;
+  }
+  s = &smp->subsamples[smp->rec.num_subsamples++];
+  s->clear_bytes = clear;
+  s->encrp_bytes = encrp;
+  return 0;
+}
+
+/*
+ * A slice keeps its NAL header and slice header in the clear. The
+ * protected part is usually block aligned, as packagers do for video,
+ * with the remainder added to the clear part.
+ */
+static int put_slice(struct corpus_gen *gen, struct layout *l, uint8_t type,
+                     uint32_t len)
+{
+  uint32_t hdr = l->codec == CORPUS_CODEC_HEVC ? 2 : 1;
+  uint32_t clear, encrp;
+  int ret;
+
+  clear = hdr + rng_range(gen, 4, 48);
+  if (clear > len)
+    clear = len;
+  encrp = len - clear;
+  if (rng_next(gen) % 4)
+    encrp &= ~(REF_AES_BLOCK_SIZE - 1);
+  if (encrp < REF_AES_BLOCK_SIZE)
+    encrp = 0;
+  clear = len - encrp;
+
+  put_nal(gen, l, type, len);
+  if (!encrp) {
+    l->clear += NAL_LENGTH_SIZE + len;
+    return 0;
+  }
+
+  ret = add_subsample(l, l->clear + NAL_LENGTH_SIZE + clear, encrp);
+  l->clear = 0;
+  return ret;
+}
+
+static int gen_layout(struct corpus_gen *gen, struct layout *l,
+                      uint32_t target, bool key_frame)
+{
+  bool hevc = l->codec == CORPUS_CODEC_HEVC;
+  uint32_t i, num_slices, left, len;
+  int ret;
+
+  if (key_frame) {
+    if (hevc)
+      put_clear_nal(gen, l, 32, rng_range(gen, 8, 32));     /* VPS */
+    put_clear_nal(gen, l, hevc ? 33 : 0x67, rng_range(gen, 8, 64));
+    put_clear_nal(gen, l, hevc ? 34 : 0x68, rng_range(gen, 4, 16));
+  }
+  if (!(rng_next(gen) % 4))
+    put_clear_nal(gen, l, hevc ? 39 : 0x06, rng_range(gen, 16, 256));
+
+  num_slices = rng_range(gen, 1, key_frame ? 8 : 4);
+  left = target > l->pos + num_slices * 64 ? target - l->pos :
+                                             num_slices * 64;
+  for (i = 0; i < num_slices; i++) {
+    len = i + 1 < num_slices ? left / num_slices :
+          left - (num_slices - 1) * (left / num_slices);
+    len -= NAL_LENGTH_SIZE;
+    ret = put_slice(gen, l, key_frame ? (hevc ? 19 : 0x65) :
+                    (hevc ? 1 : 0x41), len);
+    if (ret)
+      return ret;
+  }
+
+  /* Clear NAL units after the last slice end the sample */
+  if (l->clear)
+    return add_subsample(l, l->clear, 0);
+  return 0;
+}
+
+int corpus_gen_init(struct corpus_gen *gen, const struct corpus_params *params)
+{
+  if (params->max_size < CORPUS_MIN_SIZE ||
+      params->max_size > CORPUS_MAX_SIZE ||
+      (params->key_size && params->key_size != 16 &&
+       params->key_size != 24 && params->key_size != 32) ||
+      params->codec > CORPUS_CODEC_MIXED)
+    return EINVAL;
+
+  gen->params = *params;
+  gen->state = params->seed;
+  return 0;
+}
+
+int corpus_gen_sample(struct corpus_gen *gen, struct corpus_sample *smp)
+{
+  static const uint32_t key_sizes[] = { 16, 24, 32 };
+  struct ref_aes_ctr ctr;
+  struct layout l;
+  uint32_t target, i, pos = 0;
+  bool key_frame;
+  int ret;
+
+  memset(smp, 0, sizeof(*smp));
+  memset(&l, 0, sizeof(l));
+  l.smp = smp;
+  l.codec = gen->params.codec == CORPUS_CODEC_MIXED ?
+            rng_next(gen) % 2 : gen->params.codec;
+  smp->rec.codec = l.codec;
+  smp->rec.key_size = gen->params.key_size ? gen->params.key_size :
+                      key_sizes[rng_next(gen) % 3];
+  rng_fill(gen, smp->rec.key, smp->rec.key_size);
+  rng_fill(gen, smp->rec.iv, sizeof(smp->rec.iv));
+
+  target = pick_size(gen, &key_frame);
+  /* Room for the parameter sets, SEI and minimum slices past target */
+  smp->plain = malloc(target + 1024);
+  if (!smp->plain)
+    return ENOMEM;
+
+  ret = gen_layout(gen, &l, target, key_frame);
+  if (ret)
+    goto err;
+  smp->rec.size = l.pos;
+
+  smp->encrypted = malloc(smp->rec.size);
+  if (!smp->encrypted) {
+    ret = ENOMEM;
+    goto err;
+  }
+
+  /* The counter runs across the encrypted ranges of the sample */
+  ref_aes_ctr_init(&ctr, smp->rec.key, smp->rec.key_size, smp->rec.iv);
+  for (i = 0; i < smp->rec.num_subsamples; i++) {
+    memcpy(smp->encrypted + pos, smp->plain + pos,
+           smp->subsamples[i].clear_bytes);
+    pos += smp->subsamples[i].clear_bytes;
+    ref_aes_ctr_xor(&ctr, smp->plain + pos, smp->encrypted + pos,
+                    smp->subsamples[i].encrp_bytes);
+    pos += smp->subsamples[i].encrp_bytes;
+  }
+
+  return 0;
+err:
+  corpus_sample_free(smp);
+  return ret;
+}
+
+void corpus_sample_free(struct corpus_sample *smp)
+{
+  free(smp->subsamples);
+  free(smp->encrypted);
+  free(smp->plain);
+  memset(smp, 0, sizeof(*smp));
+}
+
+static uint32_t record_padding(const struct corpus_record *rec)
+{
+  uint64_t len = sizeof(*rec) +
+    (uint64_t)rec->num_subsamples * sizeof(struct ta_subsample) +
+    2 * (uint64_t)rec->size;
+
+  return (CORPUS_ALIGN - len % CORPUS_ALIGN) % CORPUS_ALIGN;
+}
+
+int corpus_write_header(FILE *f, uint64_t seed, uint32_t num_samples)
+{
+  struct corpus_header hdr = {
+    .magic = CORPUS_MAGIC,
+    .version = CORPUS_VERSION,
+    .num_samples = num_samples,
+    .seed = seed,
+  };
+
+  return fwrite(&hdr, sizeof(hdr), 1, f) == 1 ? 0 : EIO;
+}
+
+int corpus_write_sample(FILE *f, const struct corpus_sample *smp)
+{
+  static const uint8_t pad[CORPUS_ALIGN];
+  const struct corpus_record *rec = &smp->rec;
+
+  if (fwrite(rec, sizeof(*rec), 1, f) != 1 ||
+      fwrite(smp->subsamples, sizeof(*smp->subsamples),
+             rec->num_subsamples, f) != rec->num_subsamples ||
+      fwrite(smp->encrypted, 1, rec->size, f) != rec->size ||
+      fwrite(smp->plain, 1, rec->size, f) != rec->size ||
+      fwrite(pad, 1, record_padding(rec), f) != record_padding(rec))
+    return EIO;
+  return 0;
+}
+
+int corpus_read_header(FILE *f, struct corpus_header *hdr)
+{
+  if (fread(hdr, sizeof(*hdr), 1, f) != 1)
+    return EIO;
+  if (hdr->magic != CORPUS_MAGIC || hdr->version != CORPUS_VERSION)
+    return EINVAL;
+  return 0;
+}
+
+int corpus_read_sample(FILE *f, struct corpus_sample *smp)
+{
+  struct corpus_record *rec = &smp->rec;
+  uint8_t pad[CORPUS_ALIGN];
+  uint64_t total = 0;
+  uint32_t i;
+
+  memset(smp, 0, sizeof(*smp));
+  if (fread(rec, sizeof(*rec), 1, f) != 1)
+    return feof(f) ? ENODATA : EIO;
+  if (rec->size > CORPUS_MAX_SIZE + 1024 ||
+      rec->num_subsamples > rec->size ||
+      rec->key_size > TA_AES_MAX_KEY_SIZE)
+    return EINVAL;
+
+  smp->subsamples = malloc(rec->num_subsamples * sizeof(*smp->subsamples) +
+                           1);
+  smp->encrypted = malloc(rec->size + 1);
+  smp->plain = malloc(rec->size + 1);
+  if (!smp->subsamples || !smp->encrypted || !smp->plain) {
+    corpus_sample_free(smp);
+    return ENOMEM;
+  }
+
+  if (fread(smp->subsamples, sizeof(*smp->subsamples),
+            rec->num_subsamples, f) != rec->num_subsamples ||
+      fread(smp->encrypted, 1, rec->size, f) != rec->size ||
+      fread(smp->plain, 1, rec->size, f) != rec->size ||
+      fread(pad, 1, record_padding(rec), f) != record_padding(rec)) {
+    corpus_sample_free(smp);
+    return EIO;
+  }
+
+  for (i = 0; i < rec->num_subsamples; i++)
+    total += (uint64_t)smp->subsamples[i].clear_bytes +
+      smp->subsamples[i].encrp_bytes;
+  if (total != rec->size) {
+    corpus_sample_free(smp);
+    return EINVAL;
+  }
+
+  return 0;
+}
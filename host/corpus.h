@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2026, The optee_clearkey contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef OPTEE_CLEARKEY_CORPUS_H
+#define OPTEE_CLEARKEY_CORPUS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <aes_crypto_ta.h>
+
+/*
+ * Seeded generator of encrypted samples with their expected plaintext,
+ * and the binary corpus format storing them. Samples are length prefixed
+ * H.264 or HEVC access units laid out the way CENC packagers protect
+ * them: parameter sets and SEI in the clear, slices encrypted past their
+ * slice header. The same seed and parameters always produce the same
+ * corpus.
+ *
+ * Corpus file, native byte order: a struct corpus_header, then for each
+ * sample a struct corpus_record, num_subsamples struct ta_subsample (laid
+ * out like sub_sample_t), size bytes of ciphertext and size bytes of
+ * plaintext, padded to CORPUS_ALIGN.
+ */
+
+#define CORPUS_MAGIC 0x50524f43 /* "CORP" */
+#define CORPUS_VERSION 1
+#define CORPUS_ALIGN 8
+/* Smallest and largest max_size */
+#define CORPUS_MIN_SIZE 256
+#define CORPUS_MAX_SIZE (64 * 1024 * 1024)
+
+enum {
+  CORPUS_CODEC_H264 = 0,
+  CORPUS_CODEC_HEVC,
+  CORPUS_CODEC_MIXED,
+};
+
+struct corpus_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_samples;
+  uint32_t reserved;
+  uint64_t seed;
+};
+
+struct corpus_record {
+  uint32_t size;
+  uint32_t num_subsamples;
+  uint32_t key_size;
+  uint32_t codec;
+  uint8_t key[TA_AES_MAX_KEY_SIZE];
+  uint8_t iv[16];
+};
+
+struct corpus_sample {
+  struct corpus_record rec;
+  struct ta_subsample *subsamples;
+  uint8_t *encrypted;
+  uint8_t *plain;
+};
+
+struct corpus_params {
+  uint64_t seed;
+  uint32_t max_size;    /* largest sample, key frames reach it */
+  uint32_t key_size;    /* 16, 24, 32 or 0 for a mix */
+  uint32_t codec;       /* CORPUS_CODEC_* */
+};
+
+struct corpus_gen {
+  struct corpus_params params;
+  uint64_t state;
+};
+
+/* Returns EINVAL for out of range parameters */
+int corpus_gen_init(struct corpus_gen *gen, const struct corpus_params *params);
+
+/* Generate the next sample into smp, released with corpus_sample_free() */
+int corpus_gen_sample(struct corpus_gen *gen, struct corpus_sample *smp);
+
+void corpus_sample_free(struct corpus_sample *smp);
+
+/* File I/O, all return 0 or an errno value; EOF reads return ENODATA */
+int corpus_write_header(FILE *f, uint64_t seed, uint32_t num_samples);
+int corpus_write_sample(FILE *f, const struct corpus_sample *smp);
+int corpus_read_header(FILE *f, struct corpus_header *hdr);
+int corpus_read_sample(FILE *f, struct corpus_sample *smp);
+
+#endif
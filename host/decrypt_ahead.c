@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2026, The optee_clearkey contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "decrypt_ahead.h"
+
+struct ahead_slot {
+  const unsigned char *in;
+  batch_sample_t smp;
+  sub_sample_t *subs;
+  uint32_t subs_cap;
+  batch_key_t key;
+  bool has_key;
+  uint64_t deadline;
+  void *cookie;
+  /* Output in the ring, ring_bytes also counts a ring tail skipped */
+  uint32_t out_off;
+  uint32_t ring_bytes;
+  /* Ring write position before the sample, restored by a flush */
+  uint32_t ring_wr;
+  int status;
+};
+
+struct decrypt_ahead {
+  struct decrypt_ahead_config cfg;
+  pthread_mutex_t lock;
+  /* Signalled to the decrypt thread, to poppers and to pushers */
+  pthread_cond_t queued;
+  pthread_cond_t ready;
+  pthread_cond_t space;
+  pthread_t thread;
+  /*
+   * Samples in push order, slot of sample n at n % max_samples:
+   * released <= popped <= decrypted <= pushed
+   */
+  struct ahead_slot *slots;
+  uint32_t released;
+  uint32_t popped;
+  uint32_t decrypted;
+  uint32_t pushed;
+  /* Output buffers, allocated in push order and freed in release order */
+  uint8_t *ring;
+  size_t ring_map_size;
+  uint32_t ring_wr;
+  uint32_t ring_used;
+  bool registered;
+  bool decrypting;
+  bool flushing;
+  bool finished;
+  bool stop;
+};
+
+static struct ahead_slot *slot(struct decrypt_ahead *da, uint32_t n)
+{
+  return &da->slots[n % da->cfg.max_samples];
+}
+
+/*
+ * Take size contiguous bytes after the last sample pushed, or from the
+ * start of the ring if they do not fit before its end.
+ */
+static bool ring_alloc(struct decrypt_ahead *da, uint32_t size,
+                       struct ahead_slot *s)
+{
+  uint32_t cap = da->cfg.max_bytes, off, bytes;
+
+  if (!da->ring_used)
+    da->ring_wr = 0;
+  if (size <= cap - da->ring_wr) {
+    off = da->ring_wr;
+    bytes = size;
+  } else {
+    off = 0;
+    bytes = cap - da->ring_wr + size;
+  }
+  if (bytes > cap - da->ring_used)
+    return false;
+
+  s->ring_wr = da->ring_wr;
+  s->out_off = off;
+  s->ring_bytes = bytes;
+  da->ring_wr = off + size;
+  da->ring_used += bytes;
+  return true;
+}
+
+static int decrypt_slot(struct decrypt_ahead *da, struct ahead_slot *s)
+{
+  decrypt_sched_t sched = { da->cfg.priority, s->deadline };
+  batch_sample_t smp = s->smp;
+
+  /* Only the sample's own ranges, to match the registered ring */
+  smp.in_offset = 0;
+  smp.out_offset = 0;
+  smp.sub_samples = s->subs;
+
+  TEE_crypto_set_sched(&sched);
+  return TEE_AES_ctr128_decrypt_batch(s->in + s->smp.in_offset, smp.size,
+                                      da->ring + s->out_off, smp.size,
+                                      &smp, 1, s->has_key ? &s->key : NULL,
+                                      s->has_key);
+}
+
+static void *ahead_thread(void *arg)
+{
+  struct decrypt_ahead *da = arg;
+  struct ahead_slot *s;
+  int status;
+
+  pthread_mutex_lock(&da->lock);
+  for (;;) {
+    while (!da->stop && (da->flushing || da->decrypted == da->pushed))
+      pthread_cond_wait(&da->queued, &da->lock);
+    if (da->stop)
+      break;
+    s = slot(da, da->decrypted);
+    da->decrypting = true;
+    pthread_mutex_unlock(&da->lock);
+
+    status = decrypt_slot(da, s);
+
+    pthread_mutex_lock(&da->lock);
+    s->status = status;
+    da->decrypting = false;
+    da->decrypted++;
+    pthread_cond_broadcast(&da->ready);
+  }
+  pthread_mutex_unlock(&da->lock);
+
+  return NULL;
+}
+
+int decrypt_ahead_create(const struct decrypt_ahead_config *cfg,
+                         struct decrypt_ahead **out)
+{
+  struct decrypt_ahead *da;
+  long page = sysconf(_SC_PAGESIZE);
+  int err;
+
+  if (!cfg || !out || !cfg->max_samples || !cfg->max_bytes ||
+      cfg->priority < DECRYPT_PRIO_PLAYBACK ||
+      cfg->priority > DECRYPT_PRIO_BACKGROUND || page <= 0)
+    return EINVAL;
+
+  da = calloc(1, sizeof(*da));
+  if (!da)
+    return ENOMEM;
+  da->cfg = *cfg;
+  da->slots = calloc(cfg->max_samples, sizeof(*da->slots));
+  da->ring_map_size = ((size_t)cfg->max_bytes + page - 1) & ~((size_t)page - 1);
+  da->ring = mmap(NULL, da->ring_map_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (!da->slots || da->ring == MAP_FAILED) {
+    if (da->ring != MAP_FAILED)
+      munmap(da->ring, da->ring_map_size);
+    free(da->slots);
+    free(da);
+    return ENOMEM;
+  }
+  /* Without a free registration slot the decrypts copy the output */
+  da->registered = !TEE_register_buffer(da->ring, da->ring_map_size);
+
+  pthread_mutex_init(&da->lock, NULL);
+  pthread_cond_init(&da->queued, NULL);
+  pthread_cond_init(&da->ready, NULL);
+  pthread_cond_init(&da->space, NULL);
+
+  err = pthread_create(&da->thread, NULL, ahead_thread, da);
+  if (err) {
+    da->stop = true;
+    decrypt_ahead_destroy(da);
+    return err;
+  }
+
+  *out = da;
+  return 0;
+}
+
+void decrypt_ahead_destroy(struct decrypt_ahead *da)
+{
+  uint32_t i;
+
+  if (!da)
+    return;
+
+  pthread_mutex_lock(&da->lock);
+  if (!da->stop) {
+    da->stop = true;
+    pthread_cond_broadcast(&da->queued);
+    pthread_cond_broadcast(&da->ready);
+    pthread_cond_broadcast(&da->space);
+    pthread_mutex_unlock(&da->lock);
+    pthread_join(da->thread, NULL);
+  } else {
+    pthread_mutex_unlock(&da->lock);
+  }
+
+  if (da->registered)
+    TEE_unregister_buffer(da->ring);
+  munmap(da->ring, da->ring_map_size);
+  for (i = 0; i < da->cfg.max_samples; i++)
+    free(da->slots[i].subs);
+  free(da->slots);
+
+  pthread_cond_destroy(&da->space);
+  pthread_cond_destroy(&da->ready);
+  pthread_cond_destroy(&da->queued);
+  pthread_mutex_destroy(&da->lock);
+  free(da);
+}
+
+int decrypt_ahead_push(struct decrypt_ahead *da, const unsigned char *in,
+                       const batch_sample_t *smp, const batch_key_t *key,
+                       uint64_t deadline, void *cookie)
+{
+  struct ahead_slot *s;
+  sub_sample_t *subs;
+
+  if (!da || !in || !smp || !smp->size || smp->size > da->cfg.max_bytes ||
+      (!key && smp->key_slot != BATCH_KEY_BY_KID) ||
+      (smp->num_sub_samples && !smp->sub_samples))
+    return EINVAL;
+
+  pthread_mutex_lock(&da->lock);
+  for (;;) {
+    if (da->finished || da->stop) {
+      pthread_mutex_unlock(&da->lock);
+      return EPIPE;
+    }
+    s = slot(da, da->pushed);
+    if (da->pushed - da->released < da->cfg.max_samples &&
+        ring_alloc(da, smp->size, s))
+      break;
+    pthread_cond_wait(&da->space, &da->lock);
+  }
+
+  if (smp->num_sub_samples > s->subs_cap) {
+    subs = realloc(s->subs, smp->num_sub_samples * sizeof(*subs));
+    if (!subs) {
+      da->ring_wr = s->ring_wr;
+      da->ring_used -= s->ring_bytes;
+      pthread_mutex_unlock(&da->lock);
+      return ENOMEM;
+    }
+    s->subs = subs;
+    s->subs_cap = smp->num_sub_samples;
+  }
+  if (smp->num_sub_samples)
+    memcpy(s->subs, smp->sub_samples,
+           smp->num_sub_samples * sizeof(*s->subs));
+
+  s->in = in;
+  s->smp = *smp;
+  s->has_key = key != NULL;
+  if (key) {
+    s->key = *key;
+    s->smp.key_slot = 0;
+  }
+  s->deadline = deadline;
+  s->cookie = cookie;
+  s->status = 0;
+  da->pushed++;
+  pthread_cond_signal(&da->queued);
+  pthread_mutex_unlock(&da->lock);
+
+  return 0;
+}
+
+void decrypt_ahead_finish(struct decrypt_ahead *da)
+{
+  pthread_mutex_lock(&da->lock);
+  da->finished = true;
+  pthread_cond_broadcast(&da->ready);
+  pthread_cond_broadcast(&da->space);
+  pthread_mutex_unlock(&da->lock);
+}
+
+int decrypt_ahead_pop(struct decrypt_ahead *da,
+                      struct decrypt_ahead_sample *out)
+{
+  struct ahead_slot *s;
+
+  pthread_mutex_lock(&da->lock);
+  while (da->popped == da->decrypted && !da->stop &&
+         !(da->finished && da->popped == da->pushed))
+    pthread_cond_wait(&da->ready, &da->lock);
+  if (da->popped == da->decrypted) {
+    pthread_mutex_unlock(&da->lock);
+    return ENODATA;
+  }
+
+  s = slot(da, da->popped++);
+  out->data = da->ring + s->out_off;
+  out->size = s->smp.size;
+  out->deadline = s->deadline;
+  out->cookie = s->cookie;
+  out->status = s->status;
+  pthread_mutex_unlock(&da->lock);
+
+  return 0;
+}
+
+void decrypt_ahead_release(struct decrypt_ahead *da)
+{
+  pthread_mutex_lock(&da->lock);
+  if (da->released != da->popped) {
+    da->ring_used -= slot(da, da->released)->ring_bytes;
+    da->released++;
+    pthread_cond_broadcast(&da->space);
+  }
+  pthread_mutex_unlock(&da->lock);
+}
+
+void decrypt_ahead_flush(struct decrypt_ahead *da)
+{
+  uint32_t n;
+
+  pthread_mutex_lock(&da->lock);
+  /* Let the sample being decrypted complete, start no other */
+  da->flushing = true;
+  while (da->decrypting)
+    pthread_cond_wait(&da->ready, &da->lock);
+
+  if (da->pushed != da->popped)
+    da->ring_wr = slot(da, da->popped)->ring_wr;
+  for (n = da->popped; n != da->pushed; n++)
+    da->ring_used -= slot(da, n)->ring_bytes;
+  da->pushed = da->decrypted = da->popped;
+
+  da->finished = false;
+  da->flushing = false;
+  pthread_cond_broadcast(&da->space);
+  pthread_mutex_unlock(&da->lock);
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2026, The optee_clearkey contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef OPTEE_CLEARKEY_DECRYPT_AHEAD_H
+#define OPTEE_CLEARKEY_DECRYPT_AHEAD_H
+
+#include <stdint.h>
+
+#include "aes_crypto.h"
+
+/*
+ * Decrypt-ahead stage between a demuxer and a decoder. The demuxer pushes
+ * encrypted samples, a thread of the stage decrypts them in order into a
+ * ring of output buffers and the decoder pops them when it needs them, so
+ * a slow TEE invocation is absorbed by the samples already decrypted
+ * instead of delaying a frame. Pushing blocks while max_samples samples or
+ * max_bytes bytes of output are held by the stage and the decoder.
+ *
+ * The ring is registered with TEE_register_buffer(), the decrypts go
+ * through TEE_AES_ctr128_decrypt_batch() scheduled with priority and the
+ * sample deadlines, see TEE_crypto_set_sched(). The stage is used between
+ * TEE_crypto_init() and TEE_crypto_close().
+ */
+
+struct decrypt_ahead;
+
+struct decrypt_ahead_config {
+  /* Lookahead depth in samples, pushed but not released yet */
+  uint32_t max_samples;
+  /* Size of the output ring, no sample can be larger */
+  uint32_t max_bytes;
+  /* DECRYPT_PRIO_* of the decrypts */
+  int priority;
+};
+
+/* Decrypted sample returned by decrypt_ahead_pop() */
+struct decrypt_ahead_sample {
+  const uint8_t *data;
+  uint32_t size;
+  uint64_t deadline;
+  void *cookie;
+  /* 0 or the errno value the decrypt failed with, data is then garbage */
+  int status;
+};
+
+/* Returns 0 or an errno value */
+int decrypt_ahead_create(const struct decrypt_ahead_config *cfg,
+                         struct decrypt_ahead **da);
+
+/* Stop the stage and free it, popped samples may no longer be used */
+void decrypt_ahead_destroy(struct decrypt_ahead *da);
+
+/*
+ * Queue the sample smp of in. in_offset and size of smp locate it in in,
+ * out_offset is ignored; in must stay valid until the sample is popped.
+ * The subsamples are copied. key is the sample's key or NULL if it takes
+ * it by key ID. deadline orders the decrypt among the other streams and is
+ * returned with cookie by decrypt_ahead_pop(). Blocks while the lookahead
+ * window is full. Returns 0, EINVAL, ENOMEM or EPIPE after
+ * decrypt_ahead_finish().
+ */
+int decrypt_ahead_push(struct decrypt_ahead *da, const unsigned char *in,
+                       const batch_sample_t *smp, const batch_key_t *key,
+                       uint64_t deadline, void *cookie);
+
+/* No more pushes until decrypt_ahead_flush(), e.g. at the end of stream */
+void decrypt_ahead_finish(struct decrypt_ahead *da);
+
+/*
+ * Wait for the next sample in push order to be decrypted. Returns 0, or
+ * ENODATA once every sample pushed before decrypt_ahead_finish() was
+ * popped. The sample is held until decrypt_ahead_release().
+ */
+int decrypt_ahead_pop(struct decrypt_ahead *da,
+                      struct decrypt_ahead_sample *out);
+
+/* Give back the oldest popped sample, its buffer is reused */
+void decrypt_ahead_release(struct decrypt_ahead *da);
+
+/*
+ * Drop the samples pushed but not popped yet, e.g. on a seek, and allow
+ * pushes again after decrypt_ahead_finish(). Popped samples stay valid.
+ */
+void decrypt_ahead_flush(struct decrypt_ahead *da);
+
+#endif
@@ -0,0 +1,1042 @@
+/*
+ * Copyright (c) 2026, The optee_clearkey contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cenc_mp4.h"
+#include "decrypt_file.h"
+#include "ts_demux.h"
+
+/* O_DIRECT offset, length and buffer alignment */
+#define DIRECT_ALIGN 4096
+/* Bytes gathered in a staging buffer before it is queued for write */
+#define STAGE_SIZE (4 * 1024 * 1024)
+#define MAX_SAMPLE_SIZE (256 * 1024 * 1024)
+/* Limits of one batch of MP4 samples */
+#define MP4_BATCH_SUBSAMPLES 8192
+#define MP4_BATCH_BYTES (8 * 1024 * 1024)
+/* Transport stream bytes handed to the demux at a time */
+#define TS_PUSH_SIZE (1024 * 1024)
+
+struct index_key {
+  uint32_t size;
+  uint8_t key[TA_AES_MAX_KEY_SIZE];
+};
+
+struct index_sample {
+  uint64_t offset;
+  uint32_t size;
+  uint32_t key;
+  uint32_t first_sub;
+  uint32_t num_subs;
+  uint32_t encrypted;
+  uint8_t iv[CTR_AES_BLOCK_SIZE];
+};
+
+struct sample_index {
+  struct index_sample *samples;
+  uint32_t num_samples;
+  uint32_t cap_samples;
+  sub_sample_t *subs;
+  uint32_t num_subs;
+  uint32_t cap_subs;
+  struct index_key *keys;
+  uint32_t num_keys;
+  uint32_t cap_keys;
+  uint64_t total;
+  uint32_t max_size;
+};
+
+struct stage {
+  uint8_t *buf;
+  uint32_t len;
+};
+
+/*
+ * Staging buffers for O_DIRECT output. The decrypting thread fills one
+ * while the writer drains up to num - 1 queued ones, in order.
+ */
+struct writer {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct stage *stages;
+  unsigned num;
+  uint32_t head;    /* next to write */
+  uint32_t tail;    /* being filled */
+  bool stop;
+  int fd;
+  uint64_t offset;
+  int status;
+};
+
+/*
+ * Samples handed to the decrypt threads, up to num at a time. Each thread
+ * decrypts the samples it takes with a scheduled batch, so they run on the
+ * worker sessions of the context in parallel. Samples large enough to be
+ * split still go through TEE_AES_ctr128_decrypt_parallel().
+ */
+struct inflight {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  const uint8_t *in;
+  const struct sample_index *idx;
+  pthread_t *threads;
+  unsigned num;
+  uint32_t *queue;
+  uint8_t **outs;
+  uint32_t head;    /* next to take */
+  uint32_t tail;    /* next to queue */
+  uint32_t busy;    /* taken, not done */
+  bool stop;
+  int status;
+};
+
+/* MP4 samples gathered for one TEE_AES_ctr128_decrypt_batch() call */
+struct mp4_batch {
+  batch_sample_t *samples;
+  uint32_t num_samples;
+  sub_sample_t *subs;
+  uint32_t num_subs;
+  const uint8_t *in;
+  uint64_t in_end;      /* relative to in */
+  uint8_t *out;
+  uint32_t out_size;
+  uint32_t fragment;
+};
+
+static int grow(void **arr, uint32_t *cap, uint32_t num, size_t elem)
+{
+  void *p;
+
+  if (num < *cap)
+    return 0;
+  p = realloc(*arr, (*cap ? 2 * *cap : 64) * elem);
+  if (!p)
+    return ENOMEM;
+  *arr = p;
+  *cap = *cap ? 2 * *cap : 64;
+  return 0;
+}
+
+/* Returns the decoded length, -1 if s is not hex or longer than max */
+static int parse_hex(const char *s, uint8_t *out, size_t max)
+{
+  size_t len = strlen(s), i;
+  unsigned v;
+
+  if (len % 2 || len / 2 > max)
+    return -1;
+  for (i = 0; i < len / 2; i++) {
+    if (!isxdigit((unsigned char)s[2 * i]) ||
+        !isxdigit((unsigned char)s[2 * i + 1]) ||
+        sscanf(s + 2 * i, "%2x", &v) != 1)
+      return -1;
+    out[i] = v;
+  }
+  return len / 2;
+}
+
+static int parse_u64(const char *s, uint64_t max, uint64_t *val)
+{
+  char *end;
+
+  errno = 0;
+  *val = strtoull(s, &end, 0);
+  if (errno || end == s || *end || *s == '-' || *val > max)
+    return EINVAL;
+  return 0;
+}
+
+static int parse_key(struct sample_index *idx, char *arg)
+{
+  struct index_key *k;
+  int len;
+
+  if (grow((void **)&idx->keys, &idx->cap_keys, idx->num_keys,
+           sizeof(*idx->keys)))
+    return ENOMEM;
+  k = &idx->keys[idx->num_keys];
+  len = arg ? parse_hex(arg, k->key, sizeof(k->key)) : -1;
+  if (len != 16 && len != 24 && len != 32)
+    return EINVAL;
+  k->size = len;
+  idx->num_keys++;
+  return 0;
+}
+
+static int add_subsample(struct sample_index *idx, uint32_t clear,
+                         uint32_t encrp)
+{
+  if (grow((void **)&idx->subs, &idx->cap_subs, idx->num_subs,
+           sizeof(*idx->subs)))
+    return ENOMEM;
+  idx->subs[idx->num_subs].clear_bytes = clear;
+  idx->subs[idx->num_subs].encrp_bytes = encrp;
+  idx->num_subs++;
+  return 0;
+}
+
+static int parse_subsample(struct sample_index *idx, char *tok)
+{
+  uint64_t clear, encrp;
+  char *colon = strchr(tok, ':');
+
+  if (!colon)
+    return EINVAL;
+  *colon = '\0';
+  if (parse_u64(tok, UINT32_MAX, &clear) ||
+      parse_u64(colon + 1, UINT32_MAX, &encrp))
+    return EINVAL;
+  return add_subsample(idx, clear, encrp);
+}
+
+static int parse_sample(struct sample_index *idx, char *tok, char **save)
+{
+  struct index_sample *s;
+  uint64_t val, sum = 0;
+  uint32_t i;
+  int len, ret;
+
+  if (!idx->num_keys)
+    return EINVAL;
+  if (grow((void **)&idx->samples, &idx->cap_samples, idx->num_samples,
+           sizeof(*idx->samples)))
+    return ENOMEM;
+  s = &idx->samples[idx->num_samples];
+  memset(s, 0, sizeof(*s));
+
+  if (parse_u64(tok, UINT64_MAX, &s->offset))
+    return EINVAL;
+  tok = strtok_r(NULL, " \t", save);
+  if (!tok || parse_u64(tok, MAX_SAMPLE_SIZE, &val))
+    return EINVAL;
+  s->size = val;
+  /* 8 byte CENC IVs are the high half of the counter block */
+  tok = strtok_r(NULL, " \t", save);
+  len = tok ? parse_hex(tok, s->iv, sizeof(s->iv)) : -1;
+  if (len != 8 && len != 16)
+    return EINVAL;
+
+  s->key = idx->num_keys - 1;
+  s->first_sub = idx->num_subs;
+  while ((tok = strtok_r(NULL, " \t", save))) {
+    ret = parse_subsample(idx, tok);
+    if (ret)
+      return ret;
+  }
+  if (idx->num_subs == s->first_sub) {
+    ret = add_subsample(idx, 0, s->size);
+    if (ret)
+      return ret;
+  }
+  s->num_subs = idx->num_subs - s->first_sub;
+
+  for (i = s->first_sub; i < idx->num_subs; i++) {
+    sum += (uint64_t)idx->subs[i].clear_bytes + idx->subs[i].encrp_bytes;
+    s->encrypted += idx->subs[i].encrp_bytes;
+  }
+  if (sum != s->size)
+    return EINVAL;
+
+  idx->total += s->size;
+  if (s->size > idx->max_size)
+    idx->max_size = s->size;
+  idx->num_samples++;
+  return 0;
+}
+
+static void index_free(struct sample_index *idx)
+{
+  free(idx->samples);
+  free(idx->subs);
+  if (idx->keys)
+    memset(idx->keys, 0, idx->cap_keys * sizeof(*idx->keys));
+  free(idx->keys);
+  memset(idx, 0, sizeof(*idx));
+}
+
+static int index_load(const char *path, struct sample_index *idx,
+                      unsigned *line)
+{
+  char *buf = NULL, *tok, *save;
+  size_t cap = 0;
+  FILE *f;
+  int ret = 0;
+
+  memset(idx, 0, sizeof(*idx));
+  f = fopen(path, "r");
+  if (!f)
+    return errno;
+
+  *line = 0;
+  while (!ret && getline(&buf, &cap, f) != -1) {
+    (*line)++;
+    buf[strcspn(buf, "#\r\n")] = '\0';
+    tok = strtok_r(buf, " \t", &save);
+    if (!tok)
+      continue;
+    if (!strcmp(tok, "key"))
+      ret = parse_key(idx, strtok_r(NULL, " \t", &save));
+    else
+      ret = parse_sample(idx, tok, &save);
+  }
+  if (!ret && ferror(f))
+    ret = EIO;
+  if (!ret)
+    *line = 0;
+
+  free(buf);
+  fclose(f);
+  if (ret)
+    index_free(idx);
+  return ret;
+}
+
+/* Hint the kernel to read sample i in now */
+static void read_ahead(const uint8_t *in, const struct sample_index *idx,
+                       uint32_t i)
+{
+  const struct index_sample *s;
+  uintptr_t start, end;
+  long page = sysconf(_SC_PAGESIZE);
+
+  if (!in || i >= idx->num_samples || !idx->samples[i].size)
+    return;
+  s = &idx->samples[i];
+  start = ((uintptr_t)in + s->offset) & ~(uintptr_t)(page - 1);
+  end = (uintptr_t)in + s->offset + s->size;
+  madvise((void *)start, end - start, MADV_WILLNEED);
+}
+
+static int decrypt_sample(const uint8_t *in, const struct sample_index *idx,
+                          uint32_t i, uint8_t *out)
+{
+  const struct index_sample *s = &idx->samples[i];
+  const struct index_key *k = &idx->keys[s->key];
+  unsigned char iv[CTR_AES_BLOCK_SIZE];
+
+  if (!s->size)
+    return 0;
+  memcpy(iv, s->iv, sizeof(iv));
+  return TEE_AES_ctr128_decrypt_parallel(in + s->offset, out,
+                                         idx->subs + s->first_sub,
+                                         s->num_subs, (const char *)k->key,
+                                         k->size, iv);
+}
+
+/* Decrypt sample i on a worker session, see TEE_crypto_set_sched() */
+static int decrypt_sample_batch(const uint8_t *in,
+                                const struct sample_index *idx, uint32_t i,
+                                uint8_t *out)
+{
+  const struct index_sample *s = &idx->samples[i];
+  const struct index_key *k = &idx->keys[s->key];
+  batch_sample_t smp;
+  batch_key_t key;
+  int ret;
+
+  if (!s->size)
+    return 0;
+  memset(&smp, 0, sizeof(smp));
+  smp.size = s->size;
+  smp.sub_samples = idx->subs + s->first_sub;
+  smp.num_sub_samples = s->num_subs;
+  memcpy(smp.iv, s->iv, sizeof(smp.iv));
+  key.key_size = k->size;
+  memcpy(key.key, k->key, k->size);
+
+  ret = TEE_AES_ctr128_decrypt_batch(in + s->offset, s->size, out, s->size,
+                                     &smp, 1, &key, 1);
+  memset(&key, 0, sizeof(key));
+  return ret;
+}
+
+static void *inflight_thread(void *arg)
+{
+  struct inflight *f = arg;
+  decrypt_sched_t sched = { DECRYPT_PRIO_PLAYBACK, 0 };
+  uint32_t i;
+  uint8_t *out;
+  bool failed;
+  int ret;
+
+  pthread_mutex_lock(&f->lock);
+  for (;;) {
+    while (f->head == f->tail && !f->stop)
+      pthread_cond_wait(&f->cond, &f->lock);
+    if (f->head == f->tail)
+      break;
+    i = f->queue[f->head % f->num];
+    out = f->outs[f->head % f->num];
+    f->head++;
+    f->busy++;
+    failed = f->status != 0;
+    pthread_mutex_unlock(&f->lock);
+
+    /* Earlier samples first when the workers are all busy */
+    sched.deadline = i;
+    TEE_crypto_set_sched(&sched);
+    if (failed)
+      ret = 0;
+    else if (f->idx->samples[i].encrypted >= CTR_PARALLEL_MIN_SIZE)
+      ret = decrypt_sample(f->in, f->idx, i, out);
+    else
+      ret = decrypt_sample_batch(f->in, f->idx, i, out);
+
+    pthread_mutex_lock(&f->lock);
+    if (ret && !f->status)
+      f->status = ret;
+    f->busy--;
+    pthread_cond_broadcast(&f->cond);
+  }
+  pthread_mutex_unlock(&f->lock);
+  return NULL;
+}
+
+static int inflight_start(struct inflight *f, const uint8_t *in,
+                          const struct sample_index *idx, unsigned num)
+{
+  memset(f, 0, sizeof(*f));
+  pthread_mutex_init(&f->lock, NULL);
+  pthread_cond_init(&f->cond, NULL);
+  f->in = in;
+  f->idx = idx;
+  f->threads = calloc(num, sizeof(*f->threads));
+  f->queue = calloc(num, sizeof(*f->queue));
+  f->outs = calloc(num, sizeof(*f->outs));
+  if (!f->threads || !f->queue || !f->outs)
+    return ENOMEM;
+
+  for (f->num = 0; f->num < num; f->num++)
+    if (pthread_create(&f->threads[f->num], NULL, inflight_thread, f))
+      return f->num ? 0 : EAGAIN;
+  return 0;
+}
+
+/*
+ * Queue sample i, blocks while every thread has a sample. Without
+ * threads, f is NULL and the sample is decrypted right away.
+ */
+static int inflight_submit(struct inflight *f, const uint8_t *in,
+                           const struct sample_index *idx, uint32_t i,
+                           uint8_t *out)
+{
+  int ret;
+
+  if (!f)
+    return decrypt_sample(in, idx, i, out);
+
+  pthread_mutex_lock(&f->lock);
+  while (f->tail - f->head + f->busy >= f->num && !f->status)
+    pthread_cond_wait(&f->cond, &f->lock);
+  ret = f->status;
+  if (!ret) {
+    f->queue[f->tail % f->num] = i;
+    f->outs[f->tail % f->num] = out;
+    f->tail++;
+    pthread_cond_broadcast(&f->cond);
+  }
+  pthread_mutex_unlock(&f->lock);
+  return ret;
+}
+
+/* Wait for the queued samples, returns the first error */
+static int inflight_wait(struct inflight *f)
+{
+  int ret;
+
+  if (!f)
+    return 0;
+  pthread_mutex_lock(&f->lock);
+  while (f->head != f->tail || f->busy)
+    pthread_cond_wait(&f->cond, &f->lock);
+  ret = f->status;
+  pthread_mutex_unlock(&f->lock);
+  return ret;
+}
+
+static void inflight_stop(struct inflight *f)
+{
+  unsigned i;
+
+  pthread_mutex_lock(&f->lock);
+  f->stop = true;
+  pthread_cond_broadcast(&f->cond);
+  pthread_mutex_unlock(&f->lock);
+  for (i = 0; i < f->num; i++)
+    pthread_join(f->threads[i], NULL);
+
+  free(f->threads);
+  free(f->queue);
+  free(f->outs);
+  pthread_cond_destroy(&f->cond);
+  pthread_mutex_destroy(&f->lock);
+}
+
+static void *writer_thread(void *arg)
+{
+  struct writer *w = arg;
+  struct stage *st;
+  uint32_t done;
+  ssize_t n;
+
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (w->head == w->tail && !w->stop)
+      pthread_cond_wait(&w->cond, &w->lock);
+    if (w->head == w->tail)
+      break;
+    st = &w->stages[w->head % w->num];
+    pthread_mutex_unlock(&w->lock);
+
+    for (done = 0; done < st->len && !w->status; done += n) {
+      n = pwrite(w->fd, st->buf + done, st->len - done, w->offset + done);
+      if (n < 0 && errno == EINTR)
+        n = 0;
+      else if (n <= 0)
+        w->status = n < 0 ? errno : EIO;
+    }
+    w->offset += st->len;
+
+    pthread_mutex_lock(&w->lock);
+    w->head++;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+/*
+ * Queue the filled stage of len bytes, carrying the bytes past len over
+ * to the next stage once the writer has released it.
+ */
+static void writer_submit(struct writer *w, uint32_t len, uint32_t fill)
+{
+  struct stage *cur = &w->stages[w->tail % w->num];
+  struct stage *next = &w->stages[(w->tail + 1) % w->num];
+
+  pthread_mutex_lock(&w->lock);
+  while (w->tail + 1 - w->head >= w->num)
+    pthread_cond_wait(&w->cond, &w->lock);
+  pthread_mutex_unlock(&w->lock);
+
+  memcpy(next->buf, cur->buf + len, fill - len);
+  cur->len = len;
+
+  pthread_mutex_lock(&w->lock);
+  w->tail++;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+}
+
+static int decrypt_direct(const uint8_t *in, const struct sample_index *idx,
+                          int fd, unsigned window, struct inflight *f)
+{
+  struct writer w;
+  pthread_t thread;
+  size_t cap;
+  uint32_t fill = 0, len, i;
+  int ret = 0, wait_ret;
+
+  memset(&w, 0, sizeof(w));
+  pthread_mutex_init(&w.lock, NULL);
+  pthread_cond_init(&w.cond, NULL);
+  w.fd = fd;
+  w.num = window + 1;
+  w.stages = calloc(w.num, sizeof(*w.stages));
+  if (!w.stages)
+    return ENOMEM;
+
+  /* A stage holds up to STAGE_SIZE - 1 bytes plus one whole sample */
+  cap = STAGE_SIZE + ((idx->max_size + DIRECT_ALIGN - 1) &
+                      ~(size_t)(DIRECT_ALIGN - 1));
+  for (i = 0; i < w.num && !ret; i++)
+    if (posix_memalign((void **)&w.stages[i].buf, DIRECT_ALIGN, cap))
+      ret = ENOMEM;
+  if (!ret && pthread_create(&thread, NULL, writer_thread, &w))
+    ret = EAGAIN;
+  if (ret)
+    goto out;
+
+  for (i = 0; i < idx->num_samples && !ret; i++) {
+    read_ahead(in, idx, i + window);
+    ret = inflight_submit(f, in, idx, i,
+                          w.stages[w.tail % w.num].buf + fill);
+    fill += idx->samples[i].size;
+    if (!ret && fill >= STAGE_SIZE) {
+      /* The stage is written and its tail moved once all of it is clear */
+      ret = inflight_wait(f);
+      if (ret)
+        break;
+      len = fill & ~(DIRECT_ALIGN - 1);
+      writer_submit(&w, len, fill);
+      fill -= len;
+    }
+  }
+  /* Samples still in flight write to the stages, even after an error */
+  wait_ret = inflight_wait(f);
+  if (!ret)
+    ret = wait_ret;
+  /* The padding of the last block is cut off by the caller */
+  if (!ret && fill) {
+    len = (fill + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+    memset(w.stages[w.tail % w.num].buf + fill, 0, len - fill);
+    writer_submit(&w, len, len);
+  }
+
+  pthread_mutex_lock(&w.lock);
+  w.stop = true;
+  pthread_cond_broadcast(&w.cond);
+  pthread_mutex_unlock(&w.lock);
+  pthread_join(thread, NULL);
+  if (!ret)
+    ret = w.status;
+out:
+  for (i = 0; i < w.num; i++)
+    free(w.stages[i].buf);
+  free(w.stages);
+  pthread_cond_destroy(&w.cond);
+  pthread_mutex_destroy(&w.lock);
+  return ret;
+}
+
+static int decrypt_mapped(const uint8_t *in, const struct sample_index *idx,
+                          int fd, unsigned window, struct inflight *f)
+{
+  uint8_t *out;
+  uint64_t pos = 0;
+  uint32_t i;
+  int ret = 0, wait_ret;
+
+  if (!idx->total)
+    return 0;
+  out = mmap(NULL, idx->total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (out == MAP_FAILED)
+    return errno;
+
+  for (i = 0; i < idx->num_samples && !ret; i++) {
+    read_ahead(in, idx, i + window);
+    ret = inflight_submit(f, in, idx, i, out + pos);
+    pos += idx->samples[i].size;
+  }
+  /* Samples still in flight write to the mapping, even after an error */
+  wait_ret = inflight_wait(f);
+  if (!ret)
+    ret = wait_ret;
+  if (!ret && msync(out, idx->total, MS_SYNC))
+    ret = errno;
+
+  munmap(out, idx->total);
+  return ret;
+}
+
+int decrypt_file(const char *in_path, const char *index_path,
+                 const char *out_path, const struct decrypt_file_opts *opts,
+                 struct decrypt_file_stats *stats, unsigned *line)
+{
+  struct sample_index idx;
+  struct inflight flight, *f = NULL;
+  struct timespec start, end;
+  struct stat st;
+  const uint8_t *in = NULL;
+  unsigned window;
+  uint32_t i;
+  int in_fd = -1, out_fd = -1, ret;
+
+  if (!opts || !stats || !line || opts->window > DECRYPT_FILE_MAX_WINDOW)
+    return EINVAL;
+  window = opts->window ? opts->window : 1;
+  memset(stats, 0, sizeof(*stats));
+
+  ret = index_load(index_path, &idx, line);
+  if (ret)
+    return ret;
+
+  in_fd = open(in_path, O_RDONLY);
+  if (in_fd < 0 || fstat(in_fd, &st)) {
+    ret = errno;
+    goto out;
+  }
+  for (i = 0; i < idx.num_samples; i++) {
+    if (idx.samples[i].offset > (uint64_t)st.st_size ||
+        idx.samples[i].size > st.st_size - idx.samples[i].offset) {
+      ret = ERANGE;
+      goto out;
+    }
+  }
+  if (st.st_size) {
+    in = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in_fd, 0);
+    if (in == MAP_FAILED) {
+      in = NULL;
+      ret = errno;
+      goto out;
+    }
+    madvise((void *)in, st.st_size, MADV_SEQUENTIAL);
+  }
+
+  out_fd = open(out_path, O_RDWR | O_CREAT | O_TRUNC |
+                (opts->direct ? O_DIRECT : 0), 0644);
+  if (out_fd < 0 || (!opts->direct && ftruncate(out_fd, idx.total))) {
+    ret = errno;
+    goto out;
+  }
+
+  for (i = 0; i < window; i++)
+    read_ahead(in, &idx, i);
+  if (window > 1) {
+    f = &flight;
+    ret = inflight_start(f, in, &idx, window);
+    if (ret)
+      goto out;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (opts->direct)
+    ret = decrypt_direct(in, &idx, out_fd, window, f);
+  else
+    ret = decrypt_mapped(in, &idx, out_fd, window, f);
+  if (!ret && ((opts->direct && ftruncate(out_fd, idx.total)) ||
+               fdatasync(out_fd)))
+    ret = errno;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (!ret) {
+    stats->samples = idx.num_samples;
+    stats->bytes = idx.total;
+    stats->ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL +
+      end.tv_nsec - start.tv_nsec;
+  }
+out:
+  if (f)
+    inflight_stop(f);
+  if (out_fd >= 0)
+    close(out_fd);
+  if (in)
+    munmap((void *)in, st.st_size);
+  if (in_fd >= 0)
+    close(in_fd);
+  index_free(&idx);
+  return ret;
+}
+
+static int mp4_flush(struct mp4_batch *b)
+{
+  int ret = 0;
+
+  if (b->num_samples)
+    ret = TEE_AES_ctr128_decrypt_batch(b->in, b->in_end, b->out, b->out_size,
+                                       b->samples, b->num_samples, NULL, 0);
+  b->out += b->out_size;
+  b->out_size = 0;
+  b->num_samples = 0;
+  b->num_subs = 0;
+  b->in = NULL;
+  return ret;
+}
+
+/*
+ * Batches hold samples of one fragment in increasing file order, which
+ * is the usual mdat layout; anything else starts a new batch.
+ */
+static int mp4_add(struct mp4_batch *b, const struct cenc_mp4_sample *smp)
+{
+  batch_sample_t *bs;
+  int ret;
+
+  if (b->in && (smp->fragment != b->fragment ||
+                b->num_samples == TA_BATCH_MAX_SAMPLES ||
+                b->num_subs + smp->num_subsamples > MP4_BATCH_SUBSAMPLES ||
+                smp->data < b->in + b->in_end ||
+                smp->data + smp->size - b->in > MP4_BATCH_BYTES)) {
+    ret = mp4_flush(b);
+    if (ret)
+      return ret;
+  }
+
+  if (!smp->encrypted) {
+    /* Flush first so the output stays in sample order */
+    ret = mp4_flush(b);
+    memcpy(b->out, smp->data, smp->size);
+    b->out += smp->size;
+    return ret;
+  }
+  if (smp->num_subsamples > MP4_BATCH_SUBSAMPLES)
+    return ENOTSUP;
+
+  if (!b->in) {
+    b->in = smp->data;
+    b->fragment = smp->fragment;
+  }
+  bs = &b->samples[b->num_samples++];
+  memset(bs, 0, sizeof(*bs));
+  bs->in_offset = smp->data - b->in;
+  bs->out_offset = b->out_size;
+  bs->size = smp->size;
+  bs->key_slot = BATCH_KEY_BY_KID;
+  bs->sub_samples = b->subs + b->num_subs;
+  bs->num_sub_samples = smp->num_subsamples;
+  memcpy(bs->iv, smp->iv, sizeof(bs->iv));
+  memcpy(bs->kid, smp->track->kid, sizeof(bs->kid));
+  cenc_mp4_subsamples(smp, b->subs + b->num_subs);
+
+  b->num_subs += smp->num_subsamples;
+  b->in_end = bs->in_offset + smp->size;
+  b->out_size += smp->size;
+  return 0;
+}
+
+int decrypt_mp4_file(const char *in_path, const char *out_path,
+                     const key_entry_t *keys, uint32_t num_keys,
+                     struct decrypt_file_stats *stats)
+{
+  struct cenc_mp4_sample smp;
+  struct mp4_batch batch;
+  struct cenc_mp4 mp4;
+  struct timespec start, end;
+  struct stat st;
+  const uint8_t *in = NULL;
+  uint8_t *out = NULL;
+  uint64_t total = 0;
+  uint32_t samples = 0;
+  int in_fd, out_fd = -1, ret;
+
+  if (!stats || (!keys && num_keys))
+    return EINVAL;
+  memset(stats, 0, sizeof(*stats));
+  memset(&batch, 0, sizeof(batch));
+
+  in_fd = open(in_path, O_RDONLY);
+  if (in_fd < 0)
+    return errno;
+  if (fstat(in_fd, &st) || !st.st_size) {
+    ret = st.st_size ? errno : EINVAL;
+    goto out;
+  }
+  in = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in_fd, 0);
+  if (in == MAP_FAILED) {
+    in = NULL;
+    ret = errno;
+    goto out;
+  }
+  madvise((void *)in, st.st_size, MADV_SEQUENTIAL);
+
+  /* Size the output and reject what the CTR path cannot decrypt */
+  cenc_mp4_init(&mp4, in, st.st_size);
+  while (!(ret = cenc_mp4_next(&mp4, &smp))) {
+    if (smp.encrypted && smp.track->scheme != CENC_SCHEME_CENC) {
+      ret = ENOTSUP;
+      goto out;
+    }
+    total += smp.size;
+    samples++;
+  }
+  if (ret != ENODATA)
+    goto out;
+
+  ret = num_keys ? TEE_load_keys(keys, num_keys) : 0;
+  if (ret)
+    goto out;
+
+  batch.samples = malloc(TA_BATCH_MAX_SAMPLES * sizeof(*batch.samples));
+  batch.subs = malloc(MP4_BATCH_SUBSAMPLES * sizeof(*batch.subs));
+  out_fd = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (!batch.samples || !batch.subs) {
+    ret = ENOMEM;
+    goto out;
+  }
+  if (out_fd < 0 || ftruncate(out_fd, total)) {
+    ret = errno;
+    goto out;
+  }
+  if (total) {
+    out = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0);
+    if (out == MAP_FAILED) {
+      out = NULL;
+      ret = errno;
+      goto out;
+    }
+  }
+  batch.out = out;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  cenc_mp4_init(&mp4, in, st.st_size);
+  while (!(ret = cenc_mp4_next(&mp4, &smp)) && !(ret = mp4_add(&batch, &smp)))
+    ;
+  if (ret == ENODATA)
+    ret = mp4_flush(&batch);
+  if (!ret && out && msync(out, total, MS_SYNC))
+    ret = errno;
+  if (!ret && fdatasync(out_fd))
+    ret = errno;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (!ret) {
+    stats->samples = samples;
+    stats->bytes = total;
+    stats->ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL +
+      end.tv_nsec - start.tv_nsec;
+  }
+out:
+  if (out)
+    munmap(out, total);
+  if (out_fd >= 0)
+    close(out_fd);
+  free(batch.samples);
+  free(batch.subs);
+  if (in)
+    munmap((void *)in, st.st_size);
+  close(in_fd);
+  return ret;
+}
+
+struct ts_output {
+  const char *prefix;
+  uint16_t pids[TS_MAX_STREAMS];
+  FILE *files[TS_MAX_STREAMS];
+  uint32_t num_files;
+  uint32_t frames;
+  uint64_t bytes;
+  int err;
+};
+
+static void ts_write(void *arg, const struct ts_es_frame *frame)
+{
+  struct ts_output *o = arg;
+  char path[PATH_MAX];
+  uint32_t i;
+
+  if (o->err)
+    return;
+  for (i = 0; i < o->num_files && o->pids[i] != frame->pid; i++)
+    ;
+  if (i == o->num_files) {
+    if (i == TS_MAX_STREAMS) {
+      o->err = ENOSPC;
+      return;
+    }
+    snprintf(path, sizeof(path), "%s.%u", o->prefix, frame->pid);
+    o->files[i] = fopen(path, "wb");
+    if (!o->files[i]) {
+      o->err = errno;
+      return;
+    }
+    o->pids[i] = frame->pid;
+    o->num_files++;
+  }
+  if (fwrite(frame->data, 1, frame->size, o->files[i]) != frame->size) {
+    o->err = errno ? errno : EIO;
+    return;
+  }
+  o->frames++;
+  o->bytes += frame->size;
+}
+
+int decrypt_ts_file(const char *in_path, const char *out_prefix,
+                    const uint8_t key[16], const uint8_t iv[16],
+                    struct decrypt_file_stats *stats)
+{
+  struct ts_output o;
+  struct ts_demux *demux;
+  struct timespec start, end;
+  struct stat st;
+  const uint8_t *in = NULL;
+  uint64_t pos, len;
+  uint32_t i;
+  int in_fd, ret;
+
+  if (!stats || !out_prefix)
+    return EINVAL;
+  memset(stats, 0, sizeof(*stats));
+  memset(&o, 0, sizeof(o));
+  o.prefix = out_prefix;
+
+  demux = ts_demux_create(ts_write, &o);
+  if (!demux)
+    return ENOMEM;
+  in_fd = open(in_path, O_RDONLY);
+  if (in_fd < 0) {
+    ret = errno;
+    goto out;
+  }
+  if (fstat(in_fd, &st) || !st.st_size) {
+    ret = st.st_size ? errno : EINVAL;
+    goto out;
+  }
+  in = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in_fd, 0);
+  if (in == MAP_FAILED) {
+    in = NULL;
+    ret = errno;
+    goto out;
+  }
+  madvise((void *)in, st.st_size, MADV_SEQUENTIAL);
+
+  ret = (key && iv) ? ts_demux_set_key(demux, key, iv) : 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (pos = 0; !ret && !o.err && pos < (uint64_t)st.st_size; pos += len) {
+    len = (uint64_t)st.st_size - pos;
+    if (len > TS_PUSH_SIZE)
+      len = TS_PUSH_SIZE;
+    ret = ts_demux_push(demux, in + pos, len);
+  }
+  if (!ret)
+    ret = ts_demux_flush(demux);
+  if (!ret)
+    ret = o.err;
+  for (i = 0; i < o.num_files && !ret; i++)
+    if (fflush(o.files[i]) || fdatasync(fileno(o.files[i])))
+      ret = errno;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (!ret) {
+    stats->samples = o.frames;
+    stats->bytes = o.bytes;
+    stats->ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL +
+      end.tv_nsec - start.tv_nsec;
+  }
+out:
+  for (i = 0; i < o.num_files; i++)
+    fclose(o.files[i]);
+  if (in)
+    munmap((void *)in, st.st_size);
+  if (in_fd >= 0)
+    close(in_fd);
+  ts_demux_destroy(demux);
+  return ret;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2026, The optee_clearkey contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef OPTEE_CLEARKEY_DECRYPT_FILE_H
+#define OPTEE_CLEARKEY_DECRYPT_FILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "aes_crypto.h"
+
+/*
+ * Offline decryption of a media file described by a sidecar index, for
+ * throughput measurements on real assets. The input is mapped, the
+ * indexed samples are decrypted and the clear samples are written back to
+ * back to the output file. With a window of one, each sample in turn goes
+ * through TEE_AES_ctr128_decrypt_parallel(), which splits large samples
+ * over the worker sessions; a larger window keeps that many samples in
+ * flight. Those below CTR_PARALLEL_MIN_SIZE encrypted bytes are then
+ * decrypted whole on a worker session by a scheduled
+ * TEE_AES_ctr128_decrypt_batch(), the others are still split.
+ *
+ * The index is a text file, '#' starts a comment:
+ *
+ *   key <hex key>
+ *   <offset> <size> <hex iv> [<clear>:<encrypted> ...]
+ *
+ * A key line applies to the samples after it. Offsets and sizes are in
+ * bytes, a sample without subsamples is encrypted as a whole.
+ */
+
+#define DECRYPT_FILE_MAX_WINDOW 64
+
+struct decrypt_file_opts {
+  /* Samples in flight and read ahead, staging buffers queued with direct */
+  unsigned window;
+  /* Write with O_DIRECT instead of through an output mapping */
+  bool direct;
+};
+
+struct decrypt_file_stats {
+  uint32_t samples;
+  uint64_t bytes;
+  /* Wall time from the first decrypt until the output is on disk */
+  uint64_t ns;
+};
+
+/* Returns 0 or an errno value, line is set for index syntax errors */
+int decrypt_file(const char *in_path, const char *index_path,
+                 const char *out_path, const struct decrypt_file_opts *opts,
+                 struct decrypt_file_stats *stats, unsigned *line);
+
+/*
+ * Same for a fragmented MP4 protected with the 'cenc' scheme, see
+ * cenc_mp4.h. The samples of each fragment go to the TEE in batches
+ * taking their key by key ID from keys, which are loaded first.
+ */
+int decrypt_mp4_file(const char *in_path, const char *out_path,
+                     const key_entry_t *keys, uint32_t num_keys,
+                     struct decrypt_file_stats *stats);
+
+/*
+ * Demux an HLS SAMPLE-AES transport stream, see ts_demux.h, writing the
+ * elementary stream of each PID to <out_prefix>.<pid>. key and iv may be
+ * NULL for a clear stream. stats counts PES packets and ES bytes.
+ */
+int decrypt_ts_file(const char *in_path, const char *out_prefix,
+                    const uint8_t key[16], const uint8_t iv[16],
+                    struct decrypt_file_stats *stats);
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2026, The optee_clearkey contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "decrypt_pool.h"
+#include "logging.h"
+
+/* Jobs queued on the pool */
+#define POOL_QUEUE_SIZE (64 * DECRYPT_POOL_MAX_WORKERS)
+
+struct pool_worker {
+  struct decrypt_pool *pool;
+  pthread_t thread;
+  TEEC_Session sess;
+};
+
+struct decrypt_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t space;
+  /* Binary heap, queue[0] is the next job by job_before() */
+  struct pool_job *queue[POOL_QUEUE_SIZE];
+  uint32_t queued;
+  uint64_t seq;
+  bool stop;
+  unsigned num_workers;
+  struct pool_worker workers[DECRYPT_POOL_MAX_WORKERS];
+};
+
+static bool job_before(const struct pool_job *a, const struct pool_job *b)
+{
+  if (a->priority != b->priority)
+    return a->priority < b->priority;
+  if (a->deadline != b->deadline)
+    return a->deadline < b->deadline;
+  return a->seq < b->seq;
+}
+
+/* Called with pool->lock held and room in the queue */
+static void queue_push(struct decrypt_pool *pool, struct pool_job *job)
+{
+  uint32_t i = pool->queued++, parent;
+
+  while (i && job_before(job, pool->queue[parent = (i - 1) / 2])) {
+    pool->queue[i] = pool->queue[parent];
+    i = parent;
+  }
+  pool->queue[i] = job;
+}
+
+/* Called with pool->lock held and a job queued */
+static struct pool_job *queue_pop(struct decrypt_pool *pool)
+{
+  struct pool_job *job = pool->queue[0];
+  struct pool_job *last = pool->queue[--pool->queued];
+  uint32_t i = 0, child;
+
+  while ((child = 2 * i + 1) < pool->queued) {
+    if (child + 1 < pool->queued &&
+        job_before(pool->queue[child + 1], pool->queue[child]))
+      child++;
+    if (!job_before(pool->queue[child], last))
+      break;
+    pool->queue[i] = pool->queue[child];
+    i = child;
+  }
+  pool->queue[i] = last;
+
+  return job;
+}
+
+static void group_complete(struct pool_group *group, int status)
+{
+  pthread_mutex_lock(&group->lock);
+  if (status && !group->status)
+    group->status = status;
+  if (!--group->pending)
+    pthread_cond_broadcast(&group->done);
+  pthread_mutex_unlock(&group->lock);
+}
+
+static void *worker_main(void *arg)
+{
+  struct pool_worker *w = arg;
+  struct decrypt_pool *pool = w->pool;
+  struct pool_group *group;
+  struct pool_job *job;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->queued && !pool->stop)
+      pthread_cond_wait(&pool->work, &pool->lock);
+    if (!pool->queued)
+      break;
+    job = queue_pop(pool);
+    pthread_cond_signal(&pool->space);
+    pthread_mutex_unlock(&pool->lock);
+
+    /* job may be freed by the waiter as soon as the group completes */
+    group = job->group;
+    group_complete(group, job->run(job, &w->sess));
+
+    pthread_mutex_lock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+struct decrypt_pool *decrypt_pool_create(TEEC_Context *ctx,
+                                         const TEEC_UUID *uuid,
+                                         unsigned num_workers)
+{
+  struct decrypt_pool *pool;
+  struct pool_worker *w;
+  TEEC_Result res;
+  uint32_t err_origin;
+  unsigned i;
+
+  if (!num_workers) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    num_workers = n > 0 ? n : 1;
+  }
+  if (num_workers > DECRYPT_POOL_MAX_WORKERS)
+    num_workers = DECRYPT_POOL_MAX_WORKERS;
+
+  pool = calloc(1, sizeof(*pool));
+  if (!pool)
+    return NULL;
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->space, NULL);
+
+  /* Keep whatever sessions the TEE grants, fail only if there is none */
+  for (i = 0; i < num_workers; i++) {
+    w = &pool->workers[i];
+    res = TEEC_OpenSession(ctx, &w->sess, uuid, TEEC_LOGIN_PUBLIC,
+                           NULL, NULL, &err_origin);
+    if (res != TEEC_SUCCESS) {
+      FP("decrypt pool: TEEC_OpenSession failed with code 0x%x "
+         "origin 0x%x\n", res, err_origin);
+      break;
+    }
+    w->pool = pool;
+    pool->num_workers++;
+  }
+
+  for (i = 0; i < pool->num_workers; i++) {
+    w = &pool->workers[i];
+    if (pthread_create(&w->thread, NULL, worker_main, w))
+      break;
+  }
+
+  if (i < pool->num_workers) {
+    unsigned started = i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < started; i++)
+      pthread_join(pool->workers[i].thread, NULL);
+    for (i = 0; i < pool->num_workers; i++)
+      TEEC_CloseSession(&pool->workers[i].sess);
+    free(pool);
+    return NULL;
+  }
+
+  if (!pool->num_workers) {
+    free(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+void decrypt_pool_destroy(struct decrypt_pool *pool)
+{
+  unsigned i;
+
+  if (!pool)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0; i < pool->num_workers; i++)
+    pthread_join(pool->workers[i].thread, NULL);
+  for (i = 0; i < pool->num_workers; i++)
+    TEEC_CloseSession(&pool->workers[i].sess);
+
+  pthread_cond_destroy(&pool->space);
+  pthread_cond_destroy(&pool->work);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+unsigned decrypt_pool_size(struct decrypt_pool *pool)
+{
+  return pool ? pool->num_workers : 0;
+}
+
+TEEC_Session *decrypt_pool_session(struct decrypt_pool *pool, unsigned i)
+{
+  return &pool->workers[i].sess;
+}
+
+void pool_group_init(struct pool_group *group)
+{
+  pthread_mutex_init(&group->lock, NULL);
+  pthread_cond_init(&group->done, NULL);
+  group->pending = 0;
+  group->status = 0;
+}
+
+void decrypt_pool_submit(struct decrypt_pool *pool, struct pool_group *group,
+                         struct pool_job *job)
+{
+  job->group = group;
+  pthread_mutex_lock(&group->lock);
+  group->pending++;
+  pthread_mutex_unlock(&group->lock);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->queued == POOL_QUEUE_SIZE)
+    pthread_cond_wait(&pool->space, &pool->lock);
+  job->seq = pool->seq++;
+  queue_push(pool, job);
+  pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+int pool_group_wait(struct pool_group *group)
+{
+  int status;
+
+  pthread_mutex_lock(&group->lock);
+  while (group->pending)
+    pthread_cond_wait(&group->done, &group->lock);
+  status = group->status;
+  pthread_mutex_unlock(&group->lock);
+
+  pthread_cond_destroy(&group->done);
+  pthread_mutex_destroy(&group->lock);
+  return status;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2026, The optee_clearkey contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef OPTEE_CLEARKEY_DECRYPT_POOL_H
+#define OPTEE_CLEARKEY_DECRYPT_POOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <tee_client_api.h>
+
+/*
+ * Small thread pool. Every worker owns its own TEE session. The TA is not
+ * TA_FLAG_SINGLE_INSTANCE, so each of these sessions gets a TA instance of
+ * its own and jobs on different workers run in parallel. Queued jobs are
+ * taken by priority, then earliest deadline first, then in submission
+ * order; a running job is not preempted.
+ */
+
+#define DECRYPT_POOL_MAX_WORKERS 8
+
+struct decrypt_pool;
+struct pool_job;
+
+/* Jobs submitted together, waited for together */
+struct pool_group {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  uint32_t pending;
+  int status;
+};
+
+/* Default deadline of a job, after every job that has one */
+#define POOL_NO_DEADLINE UINT64_MAX
+
+struct pool_job {
+  /* Runs on a worker with its session, non-zero marks the group failed */
+  int (*run)(struct pool_job *job, TEEC_Session *sess);
+  struct pool_group *group;
+  /* Lower runs first, whatever the deadlines */
+  int priority;
+  /* Same clock for all jobs, e.g. presentation time */
+  uint64_t deadline;
+  /* Set by decrypt_pool_submit() */
+  uint64_t seq;
+};
+
+/* Spawn num_workers workers (0: one per online CPU), NULL on failure */
+struct decrypt_pool *decrypt_pool_create(TEEC_Context *ctx,
+                                         const TEEC_UUID *uuid,
+                                         unsigned num_workers);
+
+/* Stop and join the workers; no group may still be pending */
+void decrypt_pool_destroy(struct decrypt_pool *pool);
+
+unsigned decrypt_pool_size(struct decrypt_pool *pool);
+
+/*
+ * Session of worker i < decrypt_pool_size(), for commands issued outside
+ * of the jobs. The TEE serializes them with the worker's own.
+ */
+TEEC_Session *decrypt_pool_session(struct decrypt_pool *pool, unsigned i);
+
+void pool_group_init(struct pool_group *group);
+
+/*
+ * Queue job as part of group with the priority and deadline set in it,
+ * blocks while the queue is full
+ */
+void decrypt_pool_submit(struct decrypt_pool *pool, struct pool_group *group,
+                         struct pool_job *job);
+
+/*
+ * Wait for all jobs of group and release it, returns the first non-zero
+ * job status.
+ */
+int pool_group_wait(struct pool_group *group);
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2026, The optee_clearkey contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "corpus.h"
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-s seed] [-n samples] [-m max_size] "
+          "[-k 16|24|32] [-c h264|hevc] output\n", prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  struct corpus_params params = {
+    .seed = 1,
+    .max_size = 1024 * 1024,
+    .key_size = 0,
+    .codec = CORPUS_CODEC_MIXED,
+  };
+  struct corpus_sample smp;
+  struct corpus_gen gen;
+  uint32_t num_samples = 64, i;
+  uint64_t total = 0;
+  FILE *f;
+  int opt, ret;
+
+  while ((opt = getopt(argc, argv, "s:n:m:k:c:")) != -1) {
+    switch (opt) {
+    case 's':
+      params.seed = strtoull(optarg, NULL, 0);
+      break;
+    case 'n':
+      num_samples = strtoul(optarg, NULL, 0);
+      break;
+    case 'm':
+      params.max_size = strtoul(optarg, NULL, 0);
+      break;
+    case 'k':
+      params.key_size = strtoul(optarg, NULL, 0);
+      break;
+    case 'c':
+      if (!strcmp(optarg, "h264"))
+        params.codec = CORPUS_CODEC_H264;
+      else if (!strcmp(optarg, "hevc"))
+        params.codec = CORPUS_CODEC_HEVC;
+      else
+        usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind + 1 != argc)
+    usage(argv[0]);
+
+  ret = corpus_gen_init(&gen, &params);
+  if (ret)
+    errx(EXIT_FAILURE, "bad parameters: %s", strerror(ret));
+
+  f = fopen(argv[optind], "wb");
+  if (!f)
+    err(EXIT_FAILURE, "%s", argv[optind]);
+
+  ret = corpus_write_header(f, params.seed, num_samples);
+  for (i = 0; !ret && i < num_samples; i++) {
+    ret = corpus_gen_sample(&gen, &smp);
+    if (ret)
+      break;
+    ret = corpus_write_sample(f, &smp);
+    total += smp.rec.size;
+    corpus_sample_free(&smp);
+  }
+  if (fclose(f) && !ret)
+    ret = errno;
+  if (ret)
+    errx(EXIT_FAILURE, "%s: %s", argv[optind], strerror(ret));
+
+  printf("%" PRIu32 " samples, %" PRIu64 " bytes, seed %" PRIu64 "\n",
+         num_samples, total, params.seed);
+  return 0;
+}
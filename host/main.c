@@ -1,6 +1,12 @@
+#include <ctype.h>
 #include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 /* OP-TEE TEE client API (built by optee_client) */
 #include <tee_client_api.h>
@@ -10,6 +16,13 @@
 
 #include "aes_crypto.h"
 #include "clearkey_platform.h" /* currently useless */
+#include "corpus.h"
+#include "decrypt_ahead.h"
+#include "decrypt_pool.h"
+#include "decrypt_file.h"
+#include "ref_aes.h"
+#include "shm_arena.h"
+#include "ts_demux.h"
 
 /* Map between OP TEE TA and OpenSSL */
 #define AES_BLOCK_SIZE CTR_AES_BLOCK_SIZE
@@ -628,12 +641,2888 @@ void DecryptsComplexMixedSubSamples(void)
     TEE_crypto_close();
 }
 
-int main()
+void DecryptsShortRangeAfterCarriedResidual(void)
+{
+
+#define TOTAL_SIZE 64
+#define NUM_SUBSAMPLES 4
+
+    // Test vectors from NIST-800-38A
+    Key key = {
+        .array = {
+            0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+            0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c},
+        .size = AES_BLOCK_SIZE,
+        .capacity = AES_BLOCK_SIZE};
+
+    Iv iv = {
+        0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+        0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff};
+
+    uint8_t encrypted[TOTAL_SIZE] = {
+        0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26,
+        0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce,
+        0x98, 0x06, 0xf6, 0x6b, 0x79, 0x70, 0xfd, 0xff,
+        0x86, 0x17, 0x18, 0x7b, 0xb9, 0xff, 0xfd, 0xff,
+        0x5a, 0xe4, 0xdf, 0x3e, 0xdb, 0xd5, 0xd3, 0x5e,
+        0x5b, 0x4f, 0x09, 0x02, 0x0d, 0xb0, 0x3e, 0xab,
+        0x1e, 0x03, 0x1d, 0xda, 0x2f, 0xbe, 0x03, 0xd1,
+        0x79, 0x21, 0x70, 0xa0, 0xf3, 0x00, 0x9c, 0xee};
+
+    uint8_t decrypted[TOTAL_SIZE] = {
+        0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+        0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+        0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+        0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+        0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+        0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+        0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+        0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10};
+
+    // 4 bytes are carried into a range too short to finish the block,
+    // so 9 bytes are carried into the next one
+    sub_sample_t subSamples[NUM_SUBSAMPLES] = {
+        {0, 20},
+        {0, 5},
+        {0, 7},
+        {0, 32}};
+
+    uint8_t source[TOTAL_SIZE], output[TOTAL_SIZE];
+    uint8_t ecount[AES_BLOCK_SIZE];
+    unsigned int num = 0;
+    size_t offset = 0;
+
+    printf("TEST #%d DecryptsShortRangeAfterCarriedResidual\n", test_num);
+
+    // Unlike attemptDecrypt(), keep whatever each call writes over the
+    // carried bytes, so the saved partial block must be the right one
+    memcpy(source, encrypted, TOTAL_SIZE);
+    memset(output, 0, TOTAL_SIZE);
+    memset(ecount, 0, AES_BLOCK_SIZE);
+
+    TEE_crypto_init();
+    for (size_t i = 0; i < NUM_SUBSAMPLES; ++i)
+    {
+        TEE_AES_ctr128_encrypt(source, output, subSamples[i].encrp_bytes,
+                               (const char *)key.array, iv, ecount,
+                               &num, offset, false);
+        offset += subSamples[i].encrp_bytes;
+    }
+    TEE_crypto_close();
+
+    if (memcmp(source, encrypted, TOTAL_SIZE) != 0)
+    {
+        printf("Decryption failed: carried bytes overwrote the input\n");
+        return;
+    }
+    if (num != 0 || memcmp(output, decrypted, TOTAL_SIZE) != 0)
+    {
+        printf("Decryption failed: decrypted data does not match expected data\n");
+        return;
+    }
+
+    printf("Decryption succeeded\n");
+    test_num++;
+}
+
+void DecryptsAcrossCounterCarry(void)
+{
+
+#define TOTAL_SIZE 64
+#define NUM_SUBSAMPLES 2
+
+    // NIST-800-38A key and plaintext, with a counter whose low 16 bits
+    // wrap after the first block
+    Key key = {
+        .array = {
+            0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+            0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c},
+        .size = AES_BLOCK_SIZE,
+        .capacity = AES_BLOCK_SIZE};
+
+    Iv iv = {
+        0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+        0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0x00, 0xff, 0xff};
+
+    uint8_t decrypted[TOTAL_SIZE] = {
+        0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+        0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+        0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+        0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+        0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+        0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+        0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+        0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10};
+
+    // The second range starts after the counter carried into byte 13
+    sub_sample_t subSamples[NUM_SUBSAMPLES] = {
+        {0, 20},
+        {0, 44}};
+
+    uint8_t encrypted[TOTAL_SIZE];
+    struct ref_aes_ctr ctr;
+
+    printf("TEST #%d DecryptsAcrossCounterCarry\n", test_num);
+
+    ref_aes_ctr_init(&ctr, key.array, AES_BLOCK_SIZE, iv);
+    ref_aes_ctr_xor(&ctr, decrypted, encrypted, TOTAL_SIZE);
+
+    TEE_crypto_init();
+    attemptDecryptExpectingSuccess(&key, &iv, encrypted, decrypted,
+                                   subSamples, NUM_SUBSAMPLES, TOTAL_SIZE);
+    TEE_crypto_close();
+}
+
+void DecryptsScatterGatherSegments(void)
+{
+
+#define TOTAL_SIZE 64
+#define NUM_IN_SEGMENTS 3
+#define NUM_OUT_SEGMENTS 2
+
+    // Test vectors from NIST-800-38A
+    Key key = {
+        .array = {
+            0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+            0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c},
+        .size = AES_BLOCK_SIZE,
+        .capacity = AES_BLOCK_SIZE};
+
+    Iv iv = {
+        0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+        0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff};
+
+    // 64 encrypted bytes: two ranges of one demux buffer, one of another
+    uint8_t encrypted[44] = {
+        0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26,
+        0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce,
+        0x98, 0x06, 0xf6, 0x6b, 0x79,
+        // 8 unrelated bytes
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x70, 0xfd, 0xff, 0x86, 0x17, 0x18, 0x7b, 0xb9,
+        0xff, 0xfd, 0xff, 0x5a, 0xe4, 0xdf, 0x3e};
+    uint8_t encryptedTail[28] = {
+        0xdb, 0xd5, 0xd3, 0x5e, 0x5b, 0x4f, 0x09, 0x02,
+        0x0d, 0xb0, 0x3e, 0xab, 0x1e, 0x03, 0x1d, 0xda,
+        0x2f, 0xbe, 0x03, 0xd1, 0x79, 0x21, 0x70, 0xa0,
+        0xf3, 0x00, 0x9c, 0xee};
+
+    uint8_t decrypted[TOTAL_SIZE] = {
+        0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+        0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+        0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+        0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+        0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+        0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+        0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+        0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10};
+
+    // output split over two buffers, the 16 byte holes must stay untouched
+    uint8_t output[TOTAL_SIZE], outputTail[24 + 16];
+
+    sg_range_t inRanges[NUM_IN_SEGMENTS] = {
+        {encrypted, 0, 21},
+        {encrypted, 29, 15},
+        {encryptedTail, 0, 28}};
+
+    sg_range_t outRanges[NUM_OUT_SEGMENTS] = {
+        {output, 0, 40},
+        {outputTail, 16, 24}};
+
+    printf("TEST #%d DecryptsScatterGatherSegments\n", test_num);
+
+    memset(output, 0xa5, sizeof(output));
+    memset(outputTail, 0xa5, sizeof(outputTail));
+
+    TEE_crypto_init();
+    TEE_AES_ctr128_decrypt_sg(inRanges, NUM_IN_SEGMENTS,
+                              outRanges, NUM_OUT_SEGMENTS,
+                              (const char *)key.array, AES_BLOCK_SIZE, iv);
+    TEE_crypto_close();
+
+    if (memcmp(output, decrypted, 40) != 0 ||
+        memcmp(outputTail + 16, decrypted + 40, 24) != 0 ||
+        output[40] != 0xa5 || output[TOTAL_SIZE - 1] != 0xa5 ||
+        outputTail[0] != 0xa5 || outputTail[15] != 0xa5)
+    {
+        printf("Decryption failed: decrypted data does not match expected data\n");
+        return;
+    }
+
+    printf("Decryption succeeded\n");
+    test_num++;
+}
+
+void DecryptsBatchOfSamples(void)
+{
+
+#define TOTAL_SIZE 136
+#define NUM_SAMPLES 2
+#define NUM_SUBSAMPLES 6
+
+    // Based on test vectors from NIST-800-38A
+    batch_key_t keys[1] = {
+        {AES_BLOCK_SIZE,
+         {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+          0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c}}};
+
+    uint8_t encrypted[TOTAL_SIZE] = {
+        // sample #0: 64 encrypted bytes
+        0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26,
+        0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce,
+        0x98, 0x06, 0xf6, 0x6b, 0x79, 0x70, 0xfd, 0xff,
+        0x86, 0x17, 0x18, 0x7b, 0xb9, 0xff, 0xfd, 0xff,
+        0x5a, 0xe4, 0xdf, 0x3e, 0xdb, 0xd5, 0xd3, 0x5e,
+        0x5b, 0x4f, 0x09, 0x02, 0x0d, 0xb0, 0x3e, 0xab,
+        0x1e, 0x03, 0x1d, 0xda, 0x2f, 0xbe, 0x03, 0xd1,
+        0x79, 0x21, 0x70, 0xa0, 0xf3, 0x00, 0x9c, 0xee,
+        // sample #1: subsamples of DecryptsComplexMixedSubSamples
+        0xf0, 0x13, 0xca, 0xc7, 0x87, 0x4d, 0x61, 0x91,
+        0xb6, 0x20, 0xe3, 0x26, 0x1b, 0xef, 0x81, 0x4f,
+        0x24, 0x87, 0x0e, 0xde, 0xba, 0xad, 0x11, 0x9b,
+        0x46, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce, 0x98,
+        0x06, 0xf6, 0x6b, 0x79, 0x70, 0xfd, 0xff, 0x86,
+        0x17, 0x18, 0x7b, 0xb9, 0xff, 0x94, 0xba, 0x88,
+        0x2e, 0x0e, 0x12, 0x11, 0x55, 0x10, 0xf5, 0x22,
+        0xfd, 0xff, 0x5a, 0xe4, 0xdf, 0x3e, 0xdb, 0xd5,
+        0xd3, 0x5e, 0x5b, 0x4f, 0x09, 0x02, 0x02, 0x01};
+
+    uint8_t decrypted[TOTAL_SIZE] = {
+        0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+        0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+        0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+        0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+        0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+        0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+        0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+        0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10,
+        0xf0, 0x13, 0xca, 0xc7, 0x6b, 0xc1, 0xbe, 0xe2,
+        0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x81, 0x4f,
+        0x24, 0x87, 0x0e, 0xde, 0xba, 0xad, 0x11, 0x9b,
+        0x46, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a, 0xae,
+        0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e,
+        0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x94, 0xba, 0x88,
+        0x2e, 0x0e, 0x12, 0x11, 0x55, 0x10, 0xf5, 0x22,
+        0x8e, 0x51, 0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c,
+        0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x02, 0x01};
+
+    sub_sample_t subSamples[NUM_SUBSAMPLES] = {
+        {4, 1},
+        {0, 9},
+        {11, 20},
+        {8, 0},
+        {3, 14},
+        {2, 0}};
+
+    batch_sample_t samples[NUM_SAMPLES] = {
+        {0, 0, 64, 0, NULL, 0,
+         {0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+          0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff}},
+        {64, 64, 72, 0, subSamples, NUM_SUBSAMPLES,
+         {0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+          0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff}}};
+
+    uint8_t output[TOTAL_SIZE];
+
+    printf("TEST #%d DecryptsBatchOfSamples\n", test_num);
+
+    memset(output, 0, sizeof(output));
+
+    TEE_crypto_init();
+    TEE_AES_ctr128_decrypt_batch(encrypted, TOTAL_SIZE, output, TOTAL_SIZE,
+                                 samples, NUM_SAMPLES, keys, 1);
+    TEE_crypto_close();
+
+    if (memcmp(output, decrypted, TOTAL_SIZE) != 0)
+    {
+        printf("Decryption failed: decrypted data does not match expected data\n");
+        return;
+    }
+
+    printf("Decryption succeeded\n");
+    test_num++;
+}
+
+#define MIXED_SAMPLE_SIZE 64
+#define MIXED_NUM_SAMPLES 3
+
+// Based on test vectors from NIST-800-38A F.5.1, F.5.3 and F.5.5
+static batch_key_t mixedKeys[MIXED_NUM_SAMPLES] = {
+    {16,
+     {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+      0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c}},
+    {24,
+     {0x8e, 0x73, 0xb0, 0xf7, 0xda, 0x0e, 0x64, 0x52,
+      0xc8, 0x10, 0xf3, 0x2b, 0x80, 0x90, 0x79, 0xe5,
+      0x62, 0xf8, 0xea, 0xd2, 0x52, 0x2c, 0x6b, 0x7b}},
+    {32,
+     {0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe,
+      0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+      0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7,
+      0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4}}};
+
+static uint8_t mixedEncrypted[MIXED_NUM_SAMPLES * MIXED_SAMPLE_SIZE] = {
+    // AES-128
+    0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26,
+    0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce,
+    0x98, 0x06, 0xf6, 0x6b, 0x79, 0x70, 0xfd, 0xff,
+    0x86, 0x17, 0x18, 0x7b, 0xb9, 0xff, 0xfd, 0xff,
+    0x5a, 0xe4, 0xdf, 0x3e, 0xdb, 0xd5, 0xd3, 0x5e,
+    0x5b, 0x4f, 0x09, 0x02, 0x0d, 0xb0, 0x3e, 0xab,
+    0x1e, 0x03, 0x1d, 0xda, 0x2f, 0xbe, 0x03, 0xd1,
+    0x79, 0x21, 0x70, 0xa0, 0xf3, 0x00, 0x9c, 0xee,
+    // AES-192
+    0x1a, 0xbc, 0x93, 0x24, 0x17, 0x52, 0x1c, 0xa2,
+    0x4f, 0x2b, 0x04, 0x59, 0xfe, 0x7e, 0x6e, 0x0b,
+    0x09, 0x03, 0x39, 0xec, 0x0a, 0xa6, 0xfa, 0xef,
+    0xd5, 0xcc, 0xc2, 0xc6, 0xf4, 0xce, 0x8e, 0x94,
+    0x1e, 0x36, 0xb2, 0x6b, 0xd1, 0xeb, 0xc6, 0x70,
+    0xd1, 0xbd, 0x1d, 0x66, 0x56, 0x20, 0xab, 0xf7,
+    0x4f, 0x78, 0xa7, 0xf6, 0xd2, 0x98, 0x09, 0x58,
+    0x5a, 0x97, 0xda, 0xec, 0x58, 0xc6, 0xb0, 0x50,
+    // AES-256
+    0x60, 0x1e, 0xc3, 0x13, 0x77, 0x57, 0x89, 0xa5,
+    0xb7, 0xa7, 0xf5, 0x04, 0xbb, 0xf3, 0xd2, 0x28,
+    0xf4, 0x43, 0xe3, 0xca, 0x4d, 0x62, 0xb5, 0x9a,
+    0xca, 0x84, 0xe9, 0x90, 0xca, 0xca, 0xf5, 0xc5,
+    0x2b, 0x09, 0x30, 0xda, 0xa2, 0x3d, 0xe9, 0x4c,
+    0xe8, 0x70, 0x17, 0xba, 0x2d, 0x84, 0x98, 0x8d,
+    0xdf, 0xc9, 0xc5, 0x8d, 0xb6, 0x7a, 0xad, 0xa6,
+    0x13, 0xc2, 0xdd, 0x08, 0x45, 0x79, 0x41, 0xa6};
+
+static uint8_t mixedDecrypted[MIXED_SAMPLE_SIZE] = {
+    0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+    0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+    0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+    0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+    0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+    0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+    0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+    0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10};
+
+void DecryptsBatchWithMixedKeySizes(void)
+{
+    batch_sample_t samples[MIXED_NUM_SAMPLES];
+    uint8_t output[MIXED_NUM_SAMPLES * MIXED_SAMPLE_SIZE];
+    uint32_t i;
+
+    printf("TEST #%d DecryptsBatchWithMixedKeySizes\n", test_num);
+
+    memset(samples, 0, sizeof(samples));
+    for (i = 0; i < MIXED_NUM_SAMPLES; i++)
+    {
+        samples[i].in_offset = i * MIXED_SAMPLE_SIZE;
+        samples[i].out_offset = i * MIXED_SAMPLE_SIZE;
+        samples[i].size = MIXED_SAMPLE_SIZE;
+        samples[i].key_slot = i;
+        samples[i].sub_samples = NULL;
+        samples[i].num_sub_samples = 0;
+        for (int j = 0; j < AES_BLOCK_SIZE; j++)
+            samples[i].iv[j] = 0xf0 + j;
+    }
+
+    memset(output, 0, sizeof(output));
+
+    TEE_crypto_init();
+    TEE_AES_ctr128_decrypt_batch(mixedEncrypted, sizeof(mixedEncrypted),
+                                 output, sizeof(output), samples,
+                                 MIXED_NUM_SAMPLES, mixedKeys,
+                                 MIXED_NUM_SAMPLES);
+    TEE_crypto_close();
+
+    for (i = 0; i < MIXED_NUM_SAMPLES; i++)
+    {
+        if (memcmp(output + i * MIXED_SAMPLE_SIZE, mixedDecrypted,
+                   MIXED_SAMPLE_SIZE) != 0)
+        {
+            printf("Decryption failed: decrypted data does not match expected data\n");
+            return;
+        }
+    }
+
+    printf("Decryption succeeded\n");
+    test_num++;
+}
+
+void DecryptsTailsWithMixedKeySizes(void)
+{
+#define TAIL_NUM_SAMPLES 4
+#define TAIL_TOTAL_SIZE (37 + 70 + 101 + 15)
+
+    /* No encrypted range is a whole number of blocks */
+    static const sub_sample_t subSamples[] = {
+        {5, 27}, {2, 36}, {0, 17}, {9, 75}};
+    static const uint32_t sizes[TAIL_NUM_SAMPLES] = {37, 70, 101, 15};
+    static const uint32_t firstSub[TAIL_NUM_SAMPLES] = {0, 0, 2, 0};
+    static const uint32_t numSubs[TAIL_NUM_SAMPLES] = {0, 2, 2, 0};
+    batch_sample_t samples[TAIL_NUM_SAMPLES];
+    uint8_t plain[TAIL_TOTAL_SIZE], encrypted[TAIL_TOTAL_SIZE];
+    uint8_t output[TAIL_TOTAL_SIZE];
+    struct ref_aes_ctr ctr;
+    const batch_key_t *key;
+    uint32_t i, j, offset, pos;
+
+    printf("TEST #%d DecryptsTailsWithMixedKeySizes\n", test_num);
+
+    for (i = 0; i < TAIL_TOTAL_SIZE; i++)
+        plain[i] = encrypted[i] = (uint8_t)(i * 11 + 5);
+
+    memset(samples, 0, sizeof(samples));
+    for (i = 0, offset = 0; i < TAIL_NUM_SAMPLES; i++)
+    {
+        samples[i].in_offset = offset;
+        samples[i].out_offset = offset;
+        samples[i].size = sizes[i];
+        samples[i].key_slot = i % MIXED_NUM_SAMPLES;
+        samples[i].sub_samples = numSubs[i] ? subSamples + firstSub[i] : NULL;
+        samples[i].num_sub_samples = numSubs[i];
+        for (j = 0; j < AES_BLOCK_SIZE; j++)
+            samples[i].iv[j] = (uint8_t)(0xe0 + i * 4 + j);
+        /* The last counters carry out of the low 64 bits */
+        if (i == 2)
+            memset(samples[i].iv + 8, 0xff, 8);
+
+        key = &mixedKeys[samples[i].key_slot];
+        ref_aes_ctr_init(&ctr, key->key, key->key_size, samples[i].iv);
+        if (!numSubs[i])
+            ref_aes_ctr_xor(&ctr, plain + offset, encrypted + offset,
+                            sizes[i]);
+        for (j = 0, pos = offset; j < numSubs[i]; j++)
+        {
+            pos += subSamples[firstSub[i] + j].clear_bytes;
+            ref_aes_ctr_xor(&ctr, plain + pos, encrypted + pos,
+                            subSamples[firstSub[i] + j].encrp_bytes);
+            pos += subSamples[firstSub[i] + j].encrp_bytes;
+        }
+        offset += sizes[i];
+    }
+
+    memset(output, 0, sizeof(output));
+
+    TEE_crypto_init();
+    TEE_AES_ctr128_decrypt_batch(encrypted, sizeof(encrypted),
+                                 output, sizeof(output), samples,
+                                 TAIL_NUM_SAMPLES, mixedKeys,
+                                 MIXED_NUM_SAMPLES);
+    TEE_crypto_close();
+
+    if (memcmp(output, plain, TAIL_TOTAL_SIZE) != 0)
+    {
+        printf("Decryption failed: decrypted data does not match expected data\n");
+        return;
+    }
+
+    printf("Decryption succeeded\n");
+    test_num++;
+}
+
+void DecryptsBatchWithKeyIds(void)
+{
+    key_entry_t entries[MIXED_NUM_SAMPLES];
+    batch_sample_t samples[MIXED_NUM_SAMPLES];
+    uint8_t output[MIXED_NUM_SAMPLES * MIXED_SAMPLE_SIZE];
+    uint32_t i;
+    int j;
+
+    printf("TEST #%d DecryptsBatchWithKeyIds\n", test_num);
+
+    /* Sample i uses key ID i, loaded in reverse order */
+    memset(entries, 0, sizeof(entries));
+    memset(samples, 0, sizeof(samples));
+    for (i = 0; i < MIXED_NUM_SAMPLES; i++)
+    {
+        uint32_t k = MIXED_NUM_SAMPLES - 1 - i;
+
+        memset(entries[i].kid, 0x10 + k, TA_KID_SIZE);
+        entries[i].key_size = mixedKeys[k].key_size;
+        memcpy(entries[i].key, mixedKeys[k].key, mixedKeys[k].key_size);
+
+        samples[i].in_offset = i * MIXED_SAMPLE_SIZE;
+        samples[i].out_offset = i * MIXED_SAMPLE_SIZE;
+        samples[i].size = MIXED_SAMPLE_SIZE;
+        samples[i].key_slot = BATCH_KEY_BY_KID;
+        memset(samples[i].kid, 0x10 + i, TA_KID_SIZE);
+        for (j = 0; j < AES_BLOCK_SIZE; j++)
+            samples[i].iv[j] = 0xf0 + j;
+    }
+
+    memset(output, 0, sizeof(output));
+
+    TEE_crypto_init();
+    TEE_load_keys(entries, MIXED_NUM_SAMPLES);
+    TEE_AES_ctr128_decrypt_batch(mixedEncrypted, sizeof(mixedEncrypted),
+                                 output, sizeof(output), samples,
+                                 MIXED_NUM_SAMPLES, NULL, 0);
+
+    for (i = 0; i < MIXED_NUM_SAMPLES; i++)
+    {
+        if (memcmp(output + i * MIXED_SAMPLE_SIZE, mixedDecrypted,
+                   MIXED_SAMPLE_SIZE) != 0)
+        {
+            TEE_crypto_close();
+            printf("Decryption failed: decrypted data does not match expected data\n");
+            return;
+        }
+    }
+
+    /* Rotate: key ID 0 now holds the AES-256 key */
+    entries[0].key_size = 0;
+    memset(entries[1].kid, 0x10, TA_KID_SIZE);
+    entries[1].key_size = mixedKeys[2].key_size;
+    memcpy(entries[1].key, mixedKeys[2].key, mixedKeys[2].key_size);
+    TEE_load_keys(entries, 2);
+
+    samples[0].in_offset = 2 * MIXED_SAMPLE_SIZE;
+    memset(output, 0, sizeof(output));
+    TEE_AES_ctr128_decrypt_batch(mixedEncrypted, sizeof(mixedEncrypted),
+                                 output, sizeof(output), samples, 1, NULL, 0);
+    TEE_crypto_close();
+
+    if (memcmp(output, mixedDecrypted, MIXED_SAMPLE_SIZE) != 0)
+    {
+        printf("Decryption failed: rotated key was not used\n");
+        return;
+    }
+
+    printf("Decryption succeeded\n");
+    test_num++;
+}
+
+/* Counters of kid in usage, or NULL */
+static const key_usage_t *findKeyUsage(const key_usage_t *usage,
+                                       uint32_t num, const uint8_t *kid)
+{
+    uint32_t i;
+
+    for (i = 0; i < num; i++)
+        if (!memcmp(usage[i].kid, kid, TA_KID_SIZE))
+            return &usage[i];
+    return NULL;
+}
+
+/* Large enough for TEE_AES_ctr128_decrypt_parallel() to use the pool */
+#define POOL_SAMPLE_SIZE (256 * 1024)
+
+void CountsKeyUsage(void)
+{
+    key_usage_t before[TA_MAX_LOADED_KEYS + 1], after[TA_MAX_LOADED_KEYS + 1];
+    const key_usage_t *kidBefore, *kidAfter, *inlineBefore, *inlineAfter;
+    uint8_t zeroKid[TA_KID_SIZE] = {0};
+    uint8_t output[2 * MIXED_SAMPLE_SIZE];
+    uint8_t iv[AES_BLOCK_SIZE], ecount[AES_BLOCK_SIZE];
+    batch_sample_t samples[2];
+    key_entry_t entry;
+    decrypt_sched_t sched = {DECRYPT_PRIO_PLAYBACK, 0};
+    sub_sample_t largeSub = {16, POOL_SAMPLE_SIZE - 16};
+    uint8_t *large;
+    uint32_t numBefore, numAfter, needed, i;
+    unsigned int num = 0, sessions;
+    int j, ret;
+
+    printf("TEST #%d CountsKeyUsage\n", test_num);
+
+    large = calloc(2, POOL_SAMPLE_SIZE);
+    if (!large)
+    {
+        printf("Decryption failed: could not allocate buffers\n");
+        return;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    memset(entry.kid, 0x40, TA_KID_SIZE);
+    entry.key_size = mixedKeys[0].key_size;
+    memcpy(entry.key, mixedKeys[0].key, mixedKeys[0].key_size);
+
+    memset(samples, 0, sizeof(samples));
+    for (i = 0; i < 2; i++)
+    {
+        samples[i].out_offset = i * MIXED_SAMPLE_SIZE;
+        samples[i].size = MIXED_SAMPLE_SIZE;
+        samples[i].key_slot = BATCH_KEY_BY_KID;
+        memcpy(samples[i].kid, entry.kid, TA_KID_SIZE);
+        for (j = 0; j < AES_BLOCK_SIZE; j++)
+            samples[i].iv[j] = 0xf0 + j;
+    }
+
+    TEE_crypto_init();
+    TEE_load_keys(&entry, 1);
+    TEE_get_key_usage(before, TA_MAX_LOADED_KEYS + 1, &numBefore);
+
+    /* Two samples by key ID, then the same key and another one inline */
+    TEE_AES_ctr128_decrypt_batch(mixedEncrypted, sizeof(mixedEncrypted),
+                                 output, sizeof(output), samples, 2, NULL, 0);
+    for (i = 0; i < 2; i++)
+    {
+        for (j = 0; j < AES_BLOCK_SIZE; j++)
+            iv[j] = 0xf0 + j;
+        memset(ecount, 0, sizeof(ecount));
+        TEE_AES_ctr128_encrypt(mixedEncrypted, output, MIXED_SAMPLE_SIZE,
+                               (const char *)mixedKeys[i].key, iv, ecount,
+                               &num, 0, false);
+    }
+
+    /*
+     * The same key through the worker sessions: two scheduled samples by
+     * key ID, one passed inline, and a sample large enough to be split
+     */
+    TEE_crypto_set_sched(&sched);
+    TEE_AES_ctr128_decrypt_batch(mixedEncrypted, sizeof(mixedEncrypted),
+                                 output, sizeof(output), samples, 2, NULL, 0);
+    samples[0].key_slot = 0;
+    TEE_AES_ctr128_decrypt_batch(mixedEncrypted, sizeof(mixedEncrypted),
+                                 output, sizeof(output), samples, 1,
+                                 &mixedKeys[0], 1);
+    TEE_crypto_set_sched(NULL);
+    sessions = TEE_crypto_pool_sessions();
+    memcpy(iv, samples[0].iv, AES_BLOCK_SIZE);
+    TEE_AES_ctr128_decrypt_parallel(large, large + POOL_SAMPLE_SIZE,
+                                    &largeSub, 1,
+                                    (const char *)mixedKeys[0].key,
+                                    mixedKeys[0].key_size, iv);
+
+    TEE_get_key_usage(after, TA_MAX_LOADED_KEYS + 1, &numAfter);
+    ret = TEE_get_key_usage(NULL, 0, &needed);
+
+    entry.key_size = 0;
+    TEE_load_keys(&entry, 1);
+    TEE_crypto_close();
+
+    kidBefore = findKeyUsage(before, numBefore, entry.kid);
+    kidAfter = findKeyUsage(after, numAfter, entry.kid);
+    inlineBefore = findKeyUsage(before, numBefore, zeroKid);
+    inlineAfter = findKeyUsage(after, numAfter, zeroKid);
+    free(large);
+    if (!sessions)
+    {
+        printf("Decryption failed: scheduled batches did not use the pool\n");
+        return;
+    }
+    if (ret != ENOSPC || needed != numAfter || !kidBefore || !kidAfter ||
+        !inlineBefore || !inlineAfter ||
+        kidAfter->samples - kidBefore->samples != 7 ||
+        kidAfter->bytes - kidBefore->bytes !=
+        6 * MIXED_SAMPLE_SIZE + POOL_SAMPLE_SIZE ||
+        inlineAfter->samples - inlineBefore->samples != 1 ||
+        inlineAfter->bytes - inlineBefore->bytes != MIXED_SAMPLE_SIZE)
+    {
+        printf("Decryption failed: key usage was not counted\n");
+        return;
+    }
+
+    printf("Decryption succeeded\n");
+    test_num++;
+}
+
+void ReapsIdleWorkerSessions(void)
+{
+#define REAP_IDLE_MS 100
+#define REAP_WAIT_MS 5000
+
+    trim_policy_t policy = {REAP_IDLE_MS, 0, 0};
+    trim_policy_t defaults = {5000, 10, 40};
+    decrypt_sched_t sched = {DECRYPT_PRIO_PLAYBACK, POOL_NO_DEADLINE};
+    batch_key_t key = {
+        AES_BLOCK_SIZE,
+        {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+         0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c}};
+    batch_sample_t sample = {
+        0, 0, 16, 0, NULL, 0,
+        {0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+         0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff}};
+    uint8_t encrypted[16] = {
+        0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26,
+        0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce};
+    uint8_t decrypted[16] = {
+        0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+        0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a};
+    uint8_t output[16];
+    bool opened, reaped, reopened;
+    int waited;
+
+    printf("TEST #%d ReapsIdleWorkerSessions\n", test_num);
+
+    /*
+     * A scheduled batch runs on the worker sessions, opening them without
+     * TEE_crypto_prefetch(), which must not have been called yet for the
+     * test to be meaningful. The reaper closes them once idle and the next
+     * decrypt opens them again.
+     */
+    TEE_crypto_set_trim_policy(&policy);
+    TEE_crypto_set_sched(&sched);
+    TEE_crypto_init();
+    TEE_AES_ctr128_decrypt_batch(encrypted, sizeof(encrypted), output,
+                                 sizeof(output), &sample, 1, &key, 1);
+    opened = TEE_crypto_pool_sessions() > 0;
+
+    for (waited = 0; TEE_crypto_pool_sessions() && waited < REAP_WAIT_MS;
+         waited += 10)
+        usleep(10 * 1000);
+    reaped = !TEE_crypto_pool_sessions();
+
+    memset(output, 0, sizeof(output));
+    TEE_AES_ctr128_decrypt_batch(encrypted, sizeof(encrypted), output,
+                                 sizeof(output), &sample, 1, &key, 1);
+    reopened = TEE_crypto_pool_sessions() > 0;
+    TEE_crypto_close();
+    TEE_crypto_set_sched(NULL);
+    TEE_crypto_set_trim_policy(&defaults);
+
+    if (!opened || !reaped || !reopened ||
+        memcmp(output, decrypted, sizeof(decrypted)) != 0)
+    {
+        printf("Decryption failed: idle worker sessions were not reaped\n");
+        return;
+    }
+
+    printf("Decryption succeeded\n");
+    test_num++;
+}
+
+void DecryptsWithPrefetchedContext(void)
+{
+    batch_sample_t sample;
+    uint8_t output[MIXED_SAMPLE_SIZE];
+    int round, j;
+
+    printf("TEST #%d DecryptsWithPrefetchedContext\n", test_num);
+
+    memset(&sample, 0, sizeof(sample));
+    sample.size = MIXED_SAMPLE_SIZE;
+    for (j = 0; j < AES_BLOCK_SIZE; j++)
+        sample.iv[j] = 0xf0 + j;
+
+    /* Two playbacks on the context opened in the background */
+    TEE_crypto_prefetch();
+    for (round = 0; round < 2; round++)
+    {
+        memset(output, 0, sizeof(output));
+        TEE_crypto_init();
+        TEE_AES_ctr128_decrypt_batch(mixedEncrypted, MIXED_SAMPLE_SIZE,
+                                     output, sizeof(output), &sample, 1,
+                                     mixedKeys, 1);
+        TEE_crypto_close();
+
+        if (memcmp(output, mixedDecrypted, MIXED_SAMPLE_SIZE) != 0)
+        {
+            TEE_crypto_release();
+            printf("Decryption failed: decrypted data does not match expected data\n");
+            return;
+        }
+    }
+    TEE_crypto_release();
+
+    printf("Decryption succeeded\n");
+    test_num++;
+}
+
+void ReusesSessionCipherOperations(void)
+{
+    batch_sample_t sample;
+    session_stats_t stats;
+    trace_entry_t trace[TA_TRACE_RING_SIZE];
+    uint32_t num_traced, dropped;
+    uint8_t output[MIXED_SAMPLE_SIZE];
+    int round, j;
+
+    printf("TEST #%d ReusesSessionCipherOperations\n", test_num);
+
+    memset(&sample, 0, sizeof(sample));
+    sample.size = MIXED_SAMPLE_SIZE;
+    for (j = 0; j < AES_BLOCK_SIZE; j++)
+        sample.iv[j] = 0xf0 + j;
+
+    TEE_crypto_init();
+    for (round = 0; round < 2; round++)
+        TEE_AES_ctr128_decrypt_batch(mixedEncrypted, MIXED_SAMPLE_SIZE,
+                                     output, sizeof(output), &sample, 1,
+                                     mixedKeys, 1);
+    TEE_get_session_stats(&stats);
+    TEE_read_trace(trace, TA_TRACE_RING_SIZE, &num_traced, &dropped);
+    TEE_crypto_close();
+
+    if (num_traced != 3 || dropped ||
+        trace[0].cmd != TA_AES_CTR128_BATCH_DECRYPT ||
+        trace[0].in_size != MIXED_SAMPLE_SIZE || trace[0].result ||
+        trace[2].cmd != TA_GET_SESSION_STATS)
+    {
+        printf("Trace mismatch: %u entries\n", num_traced);
+        return;
+    }
+
+    /* The same key is only set once on the session's operation */
+    if (stats.invokes != 3 || stats.op_allocs != 1 || stats.rekeys != 1)
+    {
+        printf("Session stats mismatch: invokes %u allocs %u rekeys %u\n",
+               stats.invokes, stats.op_allocs, stats.rekeys);
+        return;
+    }
+
+    printf("Decryption succeeded\n");
+    test_num++;
+}
+
+void TracesInvocationsInRing(void)
+{
+#define TRACE_TEST_INVOKES (TA_TRACE_RING_SIZE + 5)
+#define TRACE_TEST_FIRST_READ 8
+
+    batch_sample_t sample;
+    trace_entry_t trace[TA_TRACE_RING_SIZE];
+    uint32_t numFirst = 0, numSecond = 0, numLast = 1;
+    uint32_t droppedFirst = 0, droppedSecond = 1;
+    uint8_t output[MIXED_SAMPLE_SIZE];
+    bool ok;
+    int i;
+
+    printf("TEST #%d TracesInvocationsInRing\n", test_num);
+
+    memset(&sample, 0, sizeof(sample));
+    for (i = 0; i < AES_BLOCK_SIZE; i++)
+        sample.iv[i] = 0xf0 + i;
+
+    /* Each invocation is told apart by its input size, i + 1 */
+    TEE_crypto_init();
+    for (i = 0; i < TRACE_TEST_INVOKES; i++)
+    {
+        sample.size = i + 1;
+        TEE_AES_ctr128_decrypt_batch(mixedEncrypted, sample.size,
+                                     output, sizeof(output), &sample, 1,
+                                     mixedKeys, 1);
+    }
+    /* Oldest first, a short read leaves the rest in the ring */
+    TEE_read_trace(trace, TRACE_TEST_FIRST_READ, &numFirst, &droppedFirst);
+    ok = numFirst == TRACE_TEST_FIRST_READ &&
+         droppedFirst == TRACE_TEST_INVOKES - TA_TRACE_RING_SIZE;
+    for (i = 0; ok && i < (int)numFirst; i++)
+        ok = trace[i].cmd == TA_AES_CTR128_BATCH_DECRYPT && !trace[i].result &&
+             trace[i].in_size == droppedFirst + i + 1 &&
+             trace[i].seq == trace[0].seq + i &&
+             trace[i].end_ms >= trace[i].start_ms;
+    if (ok)
+    {
+        TEE_read_trace(trace, TA_TRACE_RING_SIZE, &numSecond, &droppedSecond);
+        ok = numSecond == TA_TRACE_RING_SIZE - TRACE_TEST_FIRST_READ &&
+             !droppedSecond;
+        for (i = 0; ok && i < (int)numSecond; i++)
+            ok = trace[i].in_size == droppedFirst + numFirst + i + 1;
+    }
+    if (ok)
+        TEE_read_trace(trace, TA_TRACE_RING_SIZE, &numLast, NULL);
+    TEE_crypto_close();
+
+    if (!ok || numLast)
+    {
+        printf("Trace mismatch: read %u and %u entries, %u and %u dropped\n",
+               numFirst, numSecond, droppedFirst, droppedSecond);
+        return;
+    }
+
+    printf("Decryption succeeded\n");
+    test_num++;
+}
+
+void PacksSubSampleMap(void)
+{
+    sub_sample_t subSamples[3] = {
+        {4, 1},
+        {0, 200},
+        {70000, 16}};
+
+    uint8_t expected[] = {
+        TA_PACKED_SUBSAMPLES_VERSION, 0x03,
+        0x04, 0x01,
+        0x00, 0xc8, 0x01,
+        0xf0, 0xa2, 0x04, 0x10};
+
+    uint8_t map[TA_PACKED_SUBSAMPLES_MAX_SIZE(3)];
+    uint32_t size;
+
+    printf("TEST #%d PacksSubSampleMap\n", test_num);
+
+    size = TEE_pack_subsamples(subSamples, 3, map, sizeof(map));
+    if (size != sizeof(expected) || memcmp(map, expected, size) != 0)
+    {
+        printf("Packing failed: packed map does not match expected data\n");
+        return;
+    }
+
+    if (TEE_pack_subsamples(subSamples, 3, map, sizeof(expected)) != 0)
+    {
+        printf("Packing failed: short output buffer was accepted\n");
+        return;
+    }
+
+    printf("Packing succeeded\n");
+    test_num++;
+}
+
+static void *allocFromOtherThread(void *arg)
+{
+    struct shm_arena *arena = arg;
+    static struct shm_block blk;
+
+    /* Lands in this thread's cache, given back when the thread exits */
+    if (shm_arena_alloc(arena, 1000, &blk) != 0)
+        return NULL;
+    shm_arena_free(arena, &blk);
+    return &blk;
+}
+
+void AllocatesFromShmArena(void)
+{
+    TEEC_Context context;
+    struct shm_arena *arena = NULL;
+    struct shm_arena_stats stats;
+    struct shm_block small, medium, reused, big, split, other;
+    struct shm_block *threadBlock = NULL;
+    pthread_t thread;
+    bool ok;
+
+    printf("TEST #%d AllocatesFromShmArena\n", test_num);
+
+    if (TEEC_InitializeContext(NULL, &context) != TEEC_SUCCESS)
+    {
+        printf("Allocation failed: no TEE context\n");
+        return;
+    }
+    arena = shm_arena_create(&context, 1024 * 1024);
+    if (!arena)
+    {
+        printf("Allocation failed: could not create the arena\n");
+        goto out;
+    }
+
+    /* Carve all of it, then nothing is left for a small block */
+    ok = !shm_arena_alloc(arena, 512 * 1024, &big) &&
+         !shm_arena_alloc(arena, 512 * 1024, &other) &&
+         big.offset == 0 && other.offset == 512 * 1024 &&
+         other.buffer == (uint8_t *)big.buffer + 512 * 1024 &&
+         shm_arena_alloc(arena, 100, &small) == ENOMEM;
+
+    /* A freed large block is split in halves for smaller classes */
+    if (ok)
+    {
+        shm_arena_free(arena, &big);
+        ok = !shm_arena_alloc(arena, 100, &small) &&
+             !shm_arena_alloc(arena, 300, &medium) &&
+             !shm_arena_alloc(arena, 200 * 1024, &split) &&
+             small.offset == 0 && medium.offset == 512 &&
+             split.offset == 256 * 1024;
+    }
+
+    /* A freed small block is reused from the thread's cache */
+    if (ok)
+    {
+        shm_arena_free(arena, &small);
+        ok = !shm_arena_alloc(arena, 200, &reused) &&
+             reused.offset == small.offset;
+    }
+
+    /* The cache of a thread that exits goes back to the shared lists */
+    if (ok && pthread_create(&thread, NULL, allocFromOtherThread, arena) == 0)
+        pthread_join(thread, (void **)&threadBlock);
+    ok = ok && threadBlock && !shm_arena_alloc(arena, 1000, &other) &&
+         other.offset == threadBlock->offset;
+
+    shm_arena_get_stats(arena, &stats);
+    if (!ok || stats.locked_allocs != 7 || stats.splits != 1 ||
+        stats.failures != 1 || stats.carved != 1024 * 1024)
+    {
+        printf("Allocation failed: arena blocks are not the expected ones\n");
+        goto out;
+    }
+
+    printf("Allocation succeeded\n");
+    test_num++;
+out:
+    shm_arena_destroy(arena);
+    TEEC_FinalizeContext(&context);
+}
+
+void ReleasesIdleShmArena(void)
+{
+    batch_key_t key = {
+        AES_BLOCK_SIZE,
+        {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+         0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c}};
+    batch_sample_t sample = {
+        0, 0, 16, 0, NULL, 0,
+        {0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+         0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff}};
+    uint8_t encrypted[16] = {
+        0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26,
+        0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce};
+    uint8_t decrypted[16] = {
+        0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+        0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a};
+    uint8_t output[16];
+    bool held, released, again;
+
+    printf("TEST #%d ReleasesIdleShmArena\n", test_num);
+
+    /* The next call after a trim allocates the arena again */
+    TEE_crypto_init();
+    TEE_AES_ctr128_decrypt_batch(encrypted, sizeof(encrypted), output,
+                                 sizeof(output), &sample, 1, &key, 1);
+    held = TEE_crypto_arena_size() > 0;
+    TEE_crypto_trim(TEE_TRIM_POOL);
+    released = TEE_crypto_arena_size() == 0;
+    memset(output, 0, sizeof(output));
+    TEE_AES_ctr128_decrypt_batch(encrypted, sizeof(encrypted), output,
+                                 sizeof(output), &sample, 1, &key, 1);
+    again = TEE_crypto_arena_size() > 0;
+    TEE_crypto_close();
+
+    if (!held || !released || !again ||
+        memcmp(output, decrypted, sizeof(decrypted)) != 0)
+    {
+        printf("Decryption failed: idle arena was not released\n");
+        return;
+    }
+
+    printf("Decryption succeeded\n");
+    test_num++;
+}
+
+#define SCHED_NUM_JOBS 6
+
+typedef struct
+{
+    struct pool_job job;
+    pthread_mutex_t *lock;
+    pthread_cond_t *cond;
+    bool *started;
+    bool *released;
+    int *order;
+    int *numRun;
+    int id;
+} SchedJob;
+
+static int runSchedJob(struct pool_job *job, TEEC_Session *sess)
+{
+    SchedJob *sj = (SchedJob *)job;
+
+    (void)sess;
+    pthread_mutex_lock(sj->lock);
+    /* The first job holds the only worker until everything is queued */
+    *sj->started = true;
+    pthread_cond_broadcast(sj->cond);
+    while (!*sj->released)
+        pthread_cond_wait(sj->cond, sj->lock);
+    sj->order[(*sj->numRun)++] = sj->id;
+    pthread_mutex_unlock(sj->lock);
+    return 0;
+}
+
+void SchedulesJobsByDeadline(void)
+{
+    TEEC_UUID uuid = TA_AES_DECRYPTOR_UUID;
+    TEEC_Context context;
+    struct decrypt_pool *pool;
+    struct pool_group group;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    bool started = false, released = false;
+    /* Submission order: priority, deadline, expected position */
+    const int jobs[SCHED_NUM_JOBS][3] = {
+        {DECRYPT_PRIO_PLAYBACK, 0, 0},
+        {DECRYPT_PRIO_BACKGROUND, 10, 5},
+        {DECRYPT_PRIO_PREVIEW, 20, 3},
+        {DECRYPT_PRIO_PLAYBACK, 300, 2},
+        {DECRYPT_PRIO_PLAYBACK, 100, 1},
+        {DECRYPT_PRIO_PREVIEW, 20, 4}};
+    SchedJob sj[SCHED_NUM_JOBS];
+    int order[SCHED_NUM_JOBS], numRun = 0, i;
+    decrypt_sched_t sched = {DECRYPT_PRIO_PREVIEW, 1000};
+    batch_key_t key = {
+        AES_BLOCK_SIZE,
+        {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+         0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c}};
+    batch_sample_t sample = {
+        0, 0, 16, 0, NULL, 0,
+        {0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+         0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff}};
+    uint8_t encrypted[16] = {
+        0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26,
+        0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce};
+    uint8_t decrypted[16] = {
+        0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+        0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a};
+    uint8_t output[16];
+    key_usage_t before[TA_MAX_LOADED_KEYS + 1], after[TA_MAX_LOADED_KEYS + 1];
+    key_usage_t trimmed[TA_MAX_LOADED_KEYS + 1];
+    uint32_t numBefore = 0, numAfter = 0, numTrimmed = 0;
+    bool ok = true, counted;
+
+    printf("TEST #%d SchedulesJobsByDeadline\n", test_num);
+
+    if (TEEC_InitializeContext(NULL, &context) != TEEC_SUCCESS)
+    {
+        printf("Decryption failed: no TEE context\n");
+        return;
+    }
+    pool = decrypt_pool_create(&context, &uuid, 1);
+    if (!pool)
+    {
+        printf("Decryption failed: could not create the pool\n");
+        TEEC_FinalizeContext(&context);
+        return;
+    }
+
+    pool_group_init(&group);
+    for (i = 0; i < SCHED_NUM_JOBS; i++)
+    {
+        /* Let the worker take the first job before queueing the others */
+        pthread_mutex_lock(&lock);
+        while (i == 1 && !started)
+            pthread_cond_wait(&cond, &lock);
+        pthread_mutex_unlock(&lock);
+
+        sj[i].job.run = runSchedJob;
+        sj[i].job.priority = jobs[i][0];
+        sj[i].job.deadline = jobs[i][1];
+        sj[i].lock = &lock;
+        sj[i].cond = &cond;
+        sj[i].started = &started;
+        sj[i].released = &released;
+        sj[i].order = order;
+        sj[i].numRun = &numRun;
+        sj[i].id = i;
+        decrypt_pool_submit(pool, &group, &sj[i].job);
+    }
+    pthread_mutex_lock(&lock);
+    released = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    pool_group_wait(&group);
+    decrypt_pool_destroy(pool);
+    TEEC_FinalizeContext(&context);
+
+    for (i = 0; i < SCHED_NUM_JOBS; i++)
+        ok = ok && order[jobs[i][2]] == i;
+
+    /* A scheduled thread's batch runs on a worker session, still counted */
+    memset(output, 0, sizeof(output));
+    ok = ok && TEE_crypto_set_sched(&sched) == 0;
+    TEE_crypto_init();
+    TEE_get_key_usage(before, TA_MAX_LOADED_KEYS + 1, &numBefore);
+    TEE_AES_ctr128_decrypt_batch(encrypted, sizeof(encrypted), output,
+                                 sizeof(output), &sample, 1, &key, 1);
+    TEE_get_key_usage(after, TA_MAX_LOADED_KEYS + 1, &numAfter);
+    TEE_crypto_trim(TEE_TRIM_POOL);
+    TEE_get_key_usage(trimmed, TA_MAX_LOADED_KEYS + 1, &numTrimmed);
+    TEE_crypto_close();
+    sched.priority = -1;
+    ok = ok && TEE_crypto_set_sched(&sched) == EINVAL &&
+         TEE_crypto_set_sched(NULL) == 0 &&
+         memcmp(output, decrypted, sizeof(decrypted)) == 0;
+    counted = numBefore && numAfter && numTrimmed &&
+        after[0].samples - before[0].samples == 1 &&
+        after[0].bytes - before[0].bytes == sizeof(encrypted) &&
+        trimmed[0].samples == after[0].samples &&
+        trimmed[0].bytes == after[0].bytes;
+
+    if (!ok)
+    {
+        printf("Decryption failed: jobs did not run in deadline order\n");
+        return;
+    }
+    if (!counted)
+    {
+        printf("Decryption failed: key usage was not counted\n");
+        return;
+    }
+
+    printf("Decryption succeeded\n");
+    test_num++;
+}
+
+void DecryptsFromRegisteredBuffer(void)
+{
+#define REG_BUFFER_SIZE (64 * 1024)
+#define REG_IN_OFFSET 100
+#define REG_OUT_OFFSET 4000
+
+    // Test vectors from NIST-800-38A
+    batch_key_t key = {
+        AES_BLOCK_SIZE,
+        {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+         0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c}};
+    uint8_t encrypted[64] = {
+        0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26,
+        0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce,
+        0x98, 0x06, 0xf6, 0x6b, 0x79, 0x70, 0xfd, 0xff,
+        0x86, 0x17, 0x18, 0x7b, 0xb9, 0xff, 0xfd, 0xff,
+        0x5a, 0xe4, 0xdf, 0x3e, 0xdb, 0xd5, 0xd3, 0x5e,
+        0x5b, 0x4f, 0x09, 0x02, 0x0d, 0xb0, 0x3e, 0xab,
+        0x1e, 0x03, 0x1d, 0xda, 0x2f, 0xbe, 0x03, 0xd1,
+        0x79, 0x21, 0x70, 0xa0, 0xf3, 0x00, 0x9c, 0xee};
+    uint8_t decrypted[64] = {
+        0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+        0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+        0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+        0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+        0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+        0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+        0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+        0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10};
+    batch_sample_t sample = {
+        0, 0, sizeof(encrypted), 0, NULL, 0,
+        {0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+         0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff}};
+    uint8_t *buf;
+    bool ok;
+    int pass;
+
+    printf("TEST #%d DecryptsFromRegisteredBuffer\n", test_num);
+
+    buf = mmap(NULL, REG_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+    {
+        printf("Decryption failed: could not map the buffer\n");
+        return;
+    }
+
+    ok = TEE_register_buffer(buf + 1, REG_BUFFER_SIZE - 1) == EINVAL &&
+         TEE_register_buffer(buf, REG_BUFFER_SIZE) == 0 &&
+         TEE_register_buffer(buf, REG_BUFFER_SIZE) == EEXIST;
+
+    /*
+     * Input and output are both inside the buffer. The second pass runs
+     * on a new context, which registers the buffer again.
+     */
+    memcpy(buf + REG_IN_OFFSET, encrypted, sizeof(encrypted));
+    for (pass = 0; ok && pass < 2; pass++)
+    {
+        memset(buf + REG_OUT_OFFSET, 0, sizeof(decrypted));
+        TEE_crypto_init();
+        TEE_AES_ctr128_decrypt_batch(buf + REG_IN_OFFSET, sizeof(encrypted),
+                                     buf + REG_OUT_OFFSET, sizeof(decrypted),
+                                     &sample, 1, &key, 1);
+        TEE_crypto_close();
+        ok = !memcmp(buf + REG_OUT_OFFSET, decrypted, sizeof(decrypted));
+    }
+
+    /* Scatter-gather ranges inside it are passed by offset as well */
+    if (ok)
+    {
+        sg_range_t in[2] = {
+            {buf, REG_IN_OFFSET, 20},
+            {buf, REG_IN_OFFSET + 28, sizeof(encrypted) - 20}};
+        sg_range_t out[2] = {
+            {buf, REG_OUT_OFFSET, 30},
+            {buf, REG_OUT_OFFSET + 46, sizeof(decrypted) - 30}};
+
+        memcpy(buf + REG_IN_OFFSET + 28, encrypted + 20,
+               sizeof(encrypted) - 20);
+        memset(buf + REG_OUT_OFFSET, 0xa5, 46 + sizeof(decrypted) - 30);
+        TEE_crypto_init();
+        TEE_AES_ctr128_decrypt_sg(in, 2, out, 2, (const char *)key.key,
+                                  key.key_size, sample.iv);
+        TEE_crypto_close();
+        ok = !memcmp(buf + REG_OUT_OFFSET, decrypted, 30) &&
+             !memcmp(buf + REG_OUT_OFFSET + 46, decrypted + 30,
+                     sizeof(decrypted) - 30) &&
+             buf[REG_OUT_OFFSET + 30] == 0xa5 &&
+             buf[REG_OUT_OFFSET + 45] == 0xa5;
+    }
+
+    ok = ok && TEE_unregister_buffer(buf) == 0 &&
+         TEE_unregister_buffer(buf) == ENOENT;
+    if (!ok)
+        TEE_unregister_buffer(buf);
+    munmap(buf, REG_BUFFER_SIZE);
+
+    if (!ok)
+    {
+        printf("Decryption failed: registered buffer not decrypted as expected\n");
+        return;
+    }
+
+    printf("Decryption succeeded\n");
+    test_num++;
+}
+
+#define AHEAD_NUM_SAMPLES 24
+#define AHEAD_CLEAR_BYTES 3
+
+typedef struct
+{
+    struct decrypt_ahead *da;
+    const uint8_t *input;
+    const batch_key_t *key;
+    const uint8_t *iv;
+    int err;
+} AheadProducer;
+
+static uint32_t aheadEncrpBytes(int i)
+{
+    return 16 + (i * 13) % 49;
+}
+
+static void *pushAheadSamples(void *arg)
+{
+    AheadProducer *p = arg;
+    sub_sample_t sub = {AHEAD_CLEAR_BYTES, 0};
+    batch_sample_t smp;
+    int i;
+
+    for (i = 0; i < AHEAD_NUM_SAMPLES && !p->err; i++)
+    {
+        /* Every other sample starts with clear bytes */
+        memset(&smp, 0, sizeof(smp));
+        smp.in_offset = i * 128;
+        smp.size = aheadEncrpBytes(i);
+        memcpy(smp.iv, p->iv, AES_BLOCK_SIZE);
+        if (i % 2)
+        {
+            sub.encrp_bytes = smp.size;
+            smp.size += AHEAD_CLEAR_BYTES;
+            smp.sub_samples = &sub;
+            smp.num_sub_samples = 1;
+        }
+        p->err = decrypt_ahead_push(p->da, p->input, &smp, p->key,
+                                    i * 1000, (void *)(intptr_t)i);
+    }
+    decrypt_ahead_finish(p->da);
+    return NULL;
+}
+
+void DecryptsAheadOfDecoder(void)
+{
+    // Test vectors from NIST-800-38A, samples decrypt to a prefix
+    batch_key_t key = {
+        AES_BLOCK_SIZE,
+        {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+         0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c}};
+    uint8_t iv[AES_BLOCK_SIZE] = {
+        0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+        0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff};
+    uint8_t encrypted[64] = {
+        0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26,
+        0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce,
+        0x98, 0x06, 0xf6, 0x6b, 0x79, 0x70, 0xfd, 0xff,
+        0x86, 0x17, 0x18, 0x7b, 0xb9, 0xff, 0xfd, 0xff,
+        0x5a, 0xe4, 0xdf, 0x3e, 0xdb, 0xd5, 0xd3, 0x5e,
+        0x5b, 0x4f, 0x09, 0x02, 0x0d, 0xb0, 0x3e, 0xab,
+        0x1e, 0x03, 0x1d, 0xda, 0x2f, 0xbe, 0x03, 0xd1,
+        0x79, 0x21, 0x70, 0xa0, 0xf3, 0x00, 0x9c, 0xee};
+    uint8_t decrypted[64] = {
+        0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+        0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+        0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+        0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+        0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+        0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+        0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+        0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10};
+    /* A few samples deep, and the ring wraps every couple of samples */
+    struct decrypt_ahead_config cfg = {4, 200, DECRYPT_PRIO_PLAYBACK};
+    uint8_t input[AHEAD_NUM_SAMPLES * 128], expected[128];
+    AheadProducer producer;
+    struct decrypt_ahead *da = NULL;
+    struct decrypt_ahead_sample out;
+    batch_sample_t smp;
+    pthread_t thread;
+    uint32_t n;
+    bool ok, joined = false;
+    int i;
+
+    printf("TEST #%d DecryptsAheadOfDecoder\n", test_num);
+
+    for (i = 0; i < AHEAD_NUM_SAMPLES; i++)
+    {
+        uint8_t *in = input + i * 128;
+
+        memset(in, 0x55, 128);
+        if (i % 2)
+            in += AHEAD_CLEAR_BYTES;
+        memcpy(in, encrypted, aheadEncrpBytes(i));
+    }
+
+    TEE_crypto_init();
+    if (decrypt_ahead_create(&cfg, &da) != 0)
+    {
+        TEE_crypto_close();
+        printf("Decryption failed: could not create the stage\n");
+        return;
+    }
+
+    producer.da = da;
+    producer.input = input;
+    producer.key = &key;
+    producer.iv = iv;
+    producer.err = 0;
+    ok = pthread_create(&thread, NULL, pushAheadSamples, &producer) == 0;
+    joined = !ok;
+
+    for (i = 0; ok && i < AHEAD_NUM_SAMPLES; i++)
+    {
+        n = aheadEncrpBytes(i);
+        memset(expected, 0x55, AHEAD_CLEAR_BYTES);
+        memcpy(expected + (i % 2 ? AHEAD_CLEAR_BYTES : 0), decrypted, n);
+        if (i % 2)
+            n += AHEAD_CLEAR_BYTES;
+
+        ok = decrypt_ahead_pop(da, &out) == 0 && out.status == 0 &&
+             out.size == n && out.cookie == (void *)(intptr_t)i &&
+             out.deadline == (uint64_t)i * 1000 &&
+             memcmp(out.data, expected, n) == 0;
+        decrypt_ahead_release(da);
+    }
+    if (ok)
+    {
+        pthread_join(thread, NULL);
+        joined = true;
+        ok = !producer.err && decrypt_ahead_pop(da, &out) == ENODATA;
+    }
+
+    /* Samples not popped yet are dropped by a flush */
+    memset(&smp, 0, sizeof(smp));
+    smp.size = 16;
+    memcpy(smp.iv, iv, AES_BLOCK_SIZE);
+    ok = ok && decrypt_ahead_push(da, input, &smp, &key, 0, NULL) == EPIPE;
+    decrypt_ahead_flush(da);
+    for (i = 0; ok && i < 3; i++)
+        ok = decrypt_ahead_push(da, input, &smp, &key, 0, NULL) == 0;
+    decrypt_ahead_flush(da);
+    ok = ok &&
+         decrypt_ahead_push(da, input, &smp, &key, 0, (void *)99) == 0 &&
+         decrypt_ahead_pop(da, &out) == 0 && out.cookie == (void *)99 &&
+         memcmp(out.data, decrypted, 16) == 0;
+    decrypt_ahead_release(da);
+
+    smp.size = cfg.max_bytes + 1;
+    ok = ok && decrypt_ahead_push(da, input, &smp, &key, 0, NULL) == EINVAL;
+
+    if (!joined)
+    {
+        /* Unblock the producer before tearing the stage down */
+        decrypt_ahead_finish(da);
+        while (decrypt_ahead_pop(da, &out) == 0)
+            decrypt_ahead_release(da);
+        pthread_join(thread, NULL);
+    }
+    decrypt_ahead_destroy(da);
+    TEE_crypto_close();
+
+    if (!ok)
+    {
+        printf("Decryption failed: samples not decrypted ahead as expected\n");
+        return;
+    }
+
+    printf("Decryption succeeded\n");
+    test_num++;
+}
+
+void DecryptsLargeSampleInParallel(void)
+{
+#define LARGE_NUM_SUBSAMPLES 40000
+#define LARGE_CLEAR_BYTES 3
+#define LARGE_ENCRP_BYTES 29
+#define LARGE_TOTAL_SIZE \
+    (LARGE_NUM_SUBSAMPLES * (LARGE_CLEAR_BYTES + LARGE_ENCRP_BYTES))
+
+    batch_key_t key = {
+        AES_BLOCK_SIZE,
+        {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+         0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c}};
+
+    /* Counter carries past the low 32 bits within the sample */
+    batch_sample_t sample = {
+        0, 0, LARGE_TOTAL_SIZE, 0, NULL, 0,
+        {0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+         0xf8, 0xf9, 0xfa, 0xfb, 0xff, 0xff, 0xfe, 0x00}};
+
+    sub_sample_t *subSamples;
+    uint8_t *encrypted, *expected, *output;
+    key_usage_t before[TA_MAX_LOADED_KEYS + 1], after[TA_MAX_LOADED_KEYS + 1];
+    uint32_t numBefore = 0, numAfter = 0, i;
+    uint64_t bytes;
+    int pass;
+
+    printf("TEST #%d DecryptsLargeSampleInParallel\n", test_num);
+
+    subSamples = malloc(LARGE_NUM_SUBSAMPLES * sizeof(*subSamples));
+    encrypted = malloc(LARGE_TOTAL_SIZE);
+    expected = malloc(LARGE_TOTAL_SIZE);
+    output = malloc(LARGE_TOTAL_SIZE);
+    if (!subSamples || !encrypted || !expected || !output)
+    {
+        printf("Decryption failed: could not allocate buffers\n");
+        goto out;
+    }
+
+    for (i = 0; i < LARGE_TOTAL_SIZE; i++)
+        encrypted[i] = (uint8_t)(i * 2654435761u >> 24);
+
+    TEE_crypto_init();
+    TEE_get_key_usage(before, TA_MAX_LOADED_KEYS + 1, &numBefore);
+
+    /*
+     * One big encrypted range split across workers, then many small
+     * ranges forcing extra cuts. The single invocation batch command is
+     * the reference.
+     */
+    for (pass = 0; pass < 2; pass++)
+    {
+        if (pass == 0)
+        {
+            subSamples[0].clear_bytes = 100;
+            subSamples[0].encrp_bytes = LARGE_TOTAL_SIZE - 100;
+            sample.num_sub_samples = 1;
+        }
+        else
+        {
+            for (i = 0; i < LARGE_NUM_SUBSAMPLES; i++)
+            {
+                subSamples[i].clear_bytes = LARGE_CLEAR_BYTES;
+                subSamples[i].encrp_bytes = LARGE_ENCRP_BYTES;
+            }
+            sample.num_sub_samples = LARGE_NUM_SUBSAMPLES;
+        }
+        sample.sub_samples = subSamples;
+
+        memset(expected, 0, LARGE_TOTAL_SIZE);
+        memset(output, 0, LARGE_TOTAL_SIZE);
+        TEE_AES_ctr128_decrypt_batch(encrypted, LARGE_TOTAL_SIZE, expected,
+                                     LARGE_TOTAL_SIZE, &sample, 1, &key, 1);
+        TEE_AES_ctr128_decrypt_parallel(encrypted, output, subSamples,
+                                        sample.num_sub_samples,
+                                        (const char *)key.key, key.key_size,
+                                        sample.iv);
+
+        if (memcmp(output, expected, LARGE_TOTAL_SIZE) != 0)
+            break;
+    }
+
+    /* Closing the worker sessions keeps what they counted */
+    TEE_crypto_trim(TEE_TRIM_POOL);
+    TEE_get_key_usage(after, TA_MAX_LOADED_KEYS + 1, &numAfter);
+    TEE_crypto_close();
+
+    if (pass < 2)
+    {
+        printf("Decryption failed: decrypted data does not match expected data\n");
+        goto out;
+    }
+
+    /* A split sample counts once with its full size, like a batch one */
+    bytes = 4 * (uint64_t)LARGE_TOTAL_SIZE;
+    if (!numBefore || !numAfter ||
+        after[0].samples - before[0].samples != 4 ||
+        after[0].bytes - before[0].bytes != bytes)
+    {
+        printf("Decryption failed: key usage was not counted\n");
+        goto out;
+    }
+
+    printf("Decryption succeeded\n");
+    test_num++;
+out:
+    free(subSamples);
+    free(encrypted);
+    free(expected);
+    free(output);
+}
+
+/*
+ * Decrypt one corpus sample with the parallel path. corpus subsamples are
+ * laid out like sub_sample_t.
+ */
+static int decryptCorpusSample(const struct corpus_sample *smp,
+                               uint8_t *output)
+{
+    Iv iv;
+
+    memcpy(iv, smp->rec.iv, sizeof(iv));
+    memset(output, 0, smp->rec.size);
+    TEE_AES_ctr128_decrypt_parallel(smp->encrypted, output,
+                                    (const sub_sample_t *)smp->subsamples,
+                                    smp->rec.num_subsamples,
+                                    (const char *)smp->rec.key,
+                                    smp->rec.key_size, iv);
+
+    return memcmp(output, smp->plain, smp->rec.size) ? -1 : 0;
+}
+
+void DecryptsGeneratedCorpus(void)
+{
+#define CORPUS_TEST_SAMPLES 16
+
+    struct corpus_params params = {
+        0x5eed, 1024 * 1024, 0, CORPUS_CODEC_MIXED};
+    struct corpus_sample smp;
+    struct corpus_gen gen;
+    uint8_t *output = NULL;
+    int i, failed = 0;
+
+    printf("TEST #%d DecryptsGeneratedCorpus\n", test_num);
+
+    TEE_crypto_init();
+
+    corpus_gen_init(&gen, &params);
+    for (i = 0; i < CORPUS_TEST_SAMPLES && !failed; i++)
+    {
+        if (corpus_gen_sample(&gen, &smp))
+        {
+            printf("Decryption failed: could not generate sample %d\n", i);
+            goto out;
+        }
+
+        output = malloc(smp.rec.size);
+        failed = !output || decryptCorpusSample(&smp, output);
+        free(output);
+        corpus_sample_free(&smp);
+    }
+
+    if (failed)
+    {
+        printf("Decryption failed: sample %d does not match\n", i - 1);
+        goto out;
+    }
+
+    printf("Decryption succeeded\n");
+    test_num++;
+out:
+    TEE_crypto_close();
+}
+
+static void writeHex(FILE *f, const uint8_t *data, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        fprintf(f, "%02x", data[i]);
+}
+
+void DecryptsIndexedFile(void)
+{
+#define FILE_TEST_SAMPLES 12
+
+    static const struct decrypt_file_opts modes[] = {
+        {1, false}, {4, false}, {1, true}, {4, true}};
+    struct corpus_params params = {
+        0xf11e, 2 * 1024 * 1024, 0, CORPUS_CODEC_MIXED};
+    struct corpus_sample smp;
+    struct corpus_gen gen;
+    struct decrypt_file_stats stats;
+    char inPath[] = "/tmp/clearkey_in_XXXXXX";
+    char indexPath[] = "/tmp/clearkey_idx_XXXXXX";
+    char outPath[] = "/tmp/clearkey_out_XXXXXX";
+    uint8_t *expected = NULL, *output = NULL;
+    size_t expectedLen = 0, offset = 0;
+    uint32_t encrypted, j;
+    unsigned line, m;
+    bool large = false;
+    FILE *in = NULL, *index = NULL, *f;
+    int i, fd, ret;
+
+    printf("TEST #%d DecryptsIndexedFile\n", test_num);
+
+    fd = mkstemp(inPath);
+    if (fd >= 0)
+        in = fdopen(fd, "wb");
+    fd = mkstemp(indexPath);
+    if (fd >= 0)
+        index = fdopen(fd, "w");
+    fd = mkstemp(outPath);
+    if (fd >= 0)
+        close(fd);
+    if (!in || !index || fd < 0)
+    {
+        printf("Decryption failed: could not create temporary files\n");
+        goto out;
+    }
+
+    /* Samples back to back after a short header, each with its own key */
+    corpus_gen_init(&gen, &params);
+    fprintf(index, "# DecryptsIndexedFile, seed %#x\n", 0xf11e);
+    for (offset = 0; offset < 40; offset++)
+        fputc(0xee, in);
+    for (i = 0; i < FILE_TEST_SAMPLES; i++)
+    {
+        if (corpus_gen_sample(&gen, &smp))
+        {
+            printf("Decryption failed: could not generate sample %d\n", i);
+            goto out;
+        }
+        output = realloc(expected, expectedLen + smp.rec.size);
+        if (!output)
+        {
+            corpus_sample_free(&smp);
+            printf("Decryption failed: could not allocate buffers\n");
+            goto out;
+        }
+        expected = output;
+        output = NULL;
+        memcpy(expected + expectedLen, smp.plain, smp.rec.size);
+        expectedLen += smp.rec.size;
+        fwrite(smp.encrypted, 1, smp.rec.size, in);
+
+        fprintf(index, "key ");
+        writeHex(index, smp.rec.key, smp.rec.key_size);
+        fprintf(index, "\n%zu %u ", offset, smp.rec.size);
+        writeHex(index, smp.rec.iv, sizeof(smp.rec.iv));
+        for (j = 0, encrypted = 0; j < smp.rec.num_subsamples; j++)
+        {
+            fprintf(index, " %u:%u", smp.subsamples[j].clear_bytes,
+                    smp.subsamples[j].encrp_bytes);
+            encrypted += smp.subsamples[j].encrp_bytes;
+        }
+        fprintf(index, "\n");
+        if (encrypted >= CTR_PARALLEL_MIN_SIZE)
+            large = true;
+        offset += smp.rec.size;
+        corpus_sample_free(&smp);
+    }
+    ret = ferror(in) | ferror(index);
+    ret |= fclose(in) | fclose(index);
+    in = index = NULL;
+    if (ret || !large)
+    {
+        printf("Decryption failed: could not write the corpus\n");
+        goto out;
+    }
+
+    output = malloc(expectedLen + 1);
+    if (!output)
+    {
+        printf("Decryption failed: could not allocate buffers\n");
+        goto out;
+    }
+
+    TEE_crypto_init();
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    {
+        memset(output, 0, expectedLen + 1);
+        line = 0;
+        ret = decrypt_file(inPath, indexPath, outPath, &modes[m], &stats,
+                           &line);
+        /* tmpfs before Linux 6.6 refuses O_DIRECT */
+        if (ret == EINVAL && modes[m].direct)
+        {
+            printf("O_DIRECT not supported, skipping window %u\n",
+                   modes[m].window);
+            continue;
+        }
+
+        f = fopen(outPath, "rb");
+        if (ret || !f || stats.samples != FILE_TEST_SAMPLES ||
+            stats.bytes != expectedLen ||
+            fread(output, 1, expectedLen + 1, f) != expectedLen ||
+            memcmp(output, expected, expectedLen) != 0)
+        {
+            printf("Decryption failed: window %u%s does not match (%d)\n",
+                   modes[m].window, modes[m].direct ? " direct" : "", ret);
+            if (f)
+                fclose(f);
+            TEE_crypto_close();
+            goto out;
+        }
+        fclose(f);
+    }
+    TEE_crypto_close();
+
+    printf("Decryption succeeded\n");
+    test_num++;
+out:
+    if (in)
+        fclose(in);
+    if (index)
+        fclose(index);
+    unlink(inPath);
+    unlink(indexPath);
+    unlink(outPath);
+    free(output);
+    free(expected);
+}
+/* Minimal fragmented MP4 writer for DecryptsFragmentedMp4 */
+typedef struct
+{
+    uint8_t buf[4096];
+    size_t len;
+} Mp4Writer;
+
+static void put32(Mp4Writer *w, uint32_t v)
+{
+    w->buf[w->len++] = v >> 24;
+    w->buf[w->len++] = v >> 16;
+    w->buf[w->len++] = v >> 8;
+    w->buf[w->len++] = v;
+}
+
+static void put16(Mp4Writer *w, uint16_t v)
+{
+    w->buf[w->len++] = v >> 8;
+    w->buf[w->len++] = v;
+}
+
+static void putBytes(Mp4Writer *w, const void *data, size_t len)
+{
+    if (data)
+        memcpy(w->buf + w->len, data, len);
+    else
+        memset(w->buf + w->len, 0, len);
+    w->len += len;
+}
+
+static size_t beginBox(Mp4Writer *w, const char *type)
+{
+    size_t start = w->len;
+
+    put32(w, 0);
+    putBytes(w, type, 4);
+    return start;
+}
+
+static void endBox(Mp4Writer *w, size_t start)
+{
+    size_t len = w->len;
+
+    w->len = start;
+    put32(w, len - start);
+    w->len = len;
+}
+
+static void patch32(Mp4Writer *w, size_t pos, uint32_t v)
+{
+    size_t len = w->len;
+
+    w->len = pos;
+    put32(w, v);
+    w->len = len;
+}
+
+static void putTrack(Mp4Writer *w, uint32_t trackId, bool video,
+                     const uint8_t *kid)
+{
+    size_t trak, box, mdia, minf, stbl, stsd, entry, sinf, schi;
+
+    trak = beginBox(w, "trak");
+    box = beginBox(w, "tkhd");
+    put32(w, 3);
+    putBytes(w, NULL, 8);
+    put32(w, trackId);
+    putBytes(w, NULL, 68);
+    endBox(w, box);
+    mdia = beginBox(w, "mdia");
+    minf = beginBox(w, "minf");
+    stbl = beginBox(w, "stbl");
+    stsd = beginBox(w, "stsd");
+    put32(w, 0);
+    put32(w, 1);
+    if (!video)
+    {
+        /* Clear audio */
+        entry = beginBox(w, "mp4a");
+        putBytes(w, NULL, 28);
+        endBox(w, entry);
+    }
+    else
+    {
+        entry = beginBox(w, "encv");
+        putBytes(w, NULL, 78);
+        sinf = beginBox(w, "sinf");
+        box = beginBox(w, "frma");
+        putBytes(w, "avc1", 4);
+        endBox(w, box);
+        box = beginBox(w, "schm");
+        put32(w, 0);
+        putBytes(w, "cenc", 4);
+        put32(w, 0x10000);
+        endBox(w, box);
+        schi = beginBox(w, "schi");
+        box = beginBox(w, "tenc");
+        put32(w, 0);
+        putBytes(w, NULL, 2);
+        putBytes(w, "\x01\x08", 2);
+        putBytes(w, kid, TA_KID_SIZE);
+        endBox(w, box);
+        endBox(w, schi);
+        endBox(w, sinf);
+        endBox(w, entry);
+    }
+    endBox(w, stsd);
+    endBox(w, stbl);
+    endBox(w, minf);
+    endBox(w, mdia);
+    endBox(w, trak);
+}
+
+static void putTrex(Mp4Writer *w, uint32_t trackId, uint32_t sampleSize)
+{
+    size_t box = beginBox(w, "trex");
+
+    put32(w, 0);
+    put32(w, trackId);
+    put32(w, 1);
+    put32(w, 0);
+    put32(w, sampleSize);
+    put32(w, 0);
+    endBox(w, box);
+}
+
+/* tfhd with default-base-is-moof and a trun, returns its data_offset */
+static size_t putTrafHeader(Mp4Writer *w, uint32_t trackId,
+                            const uint32_t *sizes, uint32_t count)
+{
+    size_t box, dataOffset;
+    uint32_t i;
+
+    box = beginBox(w, "tfhd");
+    put32(w, 0x020000);
+    put32(w, trackId);
+    endBox(w, box);
+    box = beginBox(w, "trun");
+    put32(w, sizes ? 0x201 : 0x1);
+    put32(w, count);
+    dataOffset = w->len;
+    put32(w, 0);
+    for (i = 0; sizes && i < count; i++)
+        put32(w, sizes[i]);
+    endBox(w, box);
+    return dataOffset;
+}
+
+/* Encrypt sample in place with the subsample map, 8 byte IV */
+static void encryptCencSample(const uint8_t *key, const uint8_t *iv8,
+                              uint8_t *data, uint32_t size,
+                              const sub_sample_t *subs, uint32_t numSubs)
+{
+    struct ref_aes_ctr ctr;
+    uint8_t iv[AES_BLOCK_SIZE] = {0};
+    uint32_t i, pos = 0;
+
+    memcpy(iv, iv8, 8);
+    ref_aes_ctr_init(&ctr, key, AES_BLOCK_SIZE, iv);
+    if (!numSubs)
+        ref_aes_ctr_xor(&ctr, data, data, size);
+    for (i = 0; i < numSubs; i++)
+    {
+        pos += subs[i].clear_bytes;
+        ref_aes_ctr_xor(&ctr, data + pos, data + pos, subs[i].encrp_bytes);
+        pos += subs[i].encrp_bytes;
+    }
+}
+
+void DecryptsFragmentedMp4(void)
+{
+#define MP4_AUDIO_SIZE 24
+
+    static const uint8_t kid[TA_KID_SIZE] = {
+        0x10, 0x77, 0xef, 0xec, 0xc0, 0xb2, 0x4d, 0x02,
+        0xac, 0xe3, 0x3c, 0x1e, 0x52, 0xe2, 0xfb, 0x4b};
+    static const uint8_t key[AES_BLOCK_SIZE] = {
+        0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+        0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+    /* Fragment 1 has its IVs in senc, fragment 2 in saiz/saio */
+    static const uint32_t sizes1[] = {100, 300, 40};
+    static const sub_sample_t subs1[] = {{10, 80}, {10, 0}, {20, 160},
+                                         {5, 115}};
+    static const uint32_t numSubs1[] = {2, 2, 0};
+    static const uint32_t sizes2[] = {64, 50};
+    static const sub_sample_t subs2[] = {{16, 48}};
+    static const uint32_t numSubs2[] = {1, 0};
+
+    Mp4Writer *w;
+    uint8_t *expected, *output = NULL;
+    uint8_t iv[8];
+    key_entry_t entry;
+    struct decrypt_file_stats stats;
+    char inPath[] = "/tmp/clearkey_mp4_XXXXXX";
+    char outPath[] = "/tmp/clearkey_out_XXXXXX";
+    size_t moov, mvex, moof, traf, box, mdat, dataOffset[3], aux, saio;
+    size_t expectedLen = 0, pos;
+    uint32_t i, j, sub;
+    FILE *f;
+    int fd, ret;
+
+    printf("TEST #%d DecryptsFragmentedMp4\n", test_num);
+
+    w = calloc(1, sizeof(*w));
+    expected = malloc(sizeof(w->buf));
+    if (!w || !expected)
+    {
+        printf("Decryption failed: could not allocate buffers\n");
+        goto out;
+    }
+
+    moov = beginBox(w, "moov");
+    putTrack(w, 1, true, kid);
+    putTrack(w, 2, false, NULL);
+    mvex = beginBox(w, "mvex");
+    putTrex(w, 1, 0);
+    putTrex(w, 2, MP4_AUDIO_SIZE);
+    endBox(w, mvex);
+    endBox(w, moov);
+
+    /* Fragment 1: video samples with senc, then two audio samples */
+    moof = beginBox(w, "moof");
+    box = beginBox(w, "mfhd");
+    put32(w, 0);
+    put32(w, 1);
+    endBox(w, box);
+    traf = beginBox(w, "traf");
+    dataOffset[0] = putTrafHeader(w, 1, sizes1, 3);
+    box = beginBox(w, "senc");
+    put32(w, 2);
+    put32(w, 3);
+    for (i = 0, sub = 0; i < 3; i++)
+    {
+        memset(iv, 0xa0 + i, sizeof(iv));
+        putBytes(w, iv, sizeof(iv));
+        put16(w, numSubs1[i]);
+        for (j = 0; j < numSubs1[i]; j++, sub++)
+        {
+            put16(w, subs1[sub].clear_bytes);
+            put32(w, subs1[sub].encrp_bytes);
+        }
+    }
+    endBox(w, box);
+    endBox(w, traf);
+    traf = beginBox(w, "traf");
+    dataOffset[1] = putTrafHeader(w, 2, NULL, 2);
+    endBox(w, traf);
+    endBox(w, moof);
+
+    mdat = beginBox(w, "mdat");
+    patch32(w, dataOffset[0], w->len - moof);
+    for (i = 0, sub = 0; i < 3; i++)
+    {
+        pos = w->len;
+        for (j = 0; j < sizes1[i]; j++)
+            w->buf[w->len++] = (uint8_t)(j * 7 + i);
+        memcpy(expected + expectedLen, w->buf + pos, sizes1[i]);
+        expectedLen += sizes1[i];
+        memset(iv, 0xa0 + i, sizeof(iv));
+        encryptCencSample(key, iv, w->buf + pos, sizes1[i], subs1 + sub,
+                          numSubs1[i]);
+        sub += numSubs1[i];
+    }
+    patch32(w, dataOffset[1], w->len - moof);
+    for (i = 0; i < 2 * MP4_AUDIO_SIZE; i++)
+        w->buf[w->len++] = (uint8_t)(0x55 + i);
+    memcpy(expected + expectedLen, w->buf + w->len - 2 * MP4_AUDIO_SIZE,
+           2 * MP4_AUDIO_SIZE);
+    expectedLen += 2 * MP4_AUDIO_SIZE;
+    endBox(w, mdat);
+
+    /* Fragment 2: auxiliary information at the start of mdat */
+    moof = beginBox(w, "moof");
+    box = beginBox(w, "mfhd");
+    put32(w, 0);
+    put32(w, 2);
+    endBox(w, box);
+    traf = beginBox(w, "traf");
+    dataOffset[2] = putTrafHeader(w, 1, sizes2, 2);
+    box = beginBox(w, "saiz");
+    put32(w, 0);
+    w->buf[w->len++] = 0;
+    put32(w, 2);
+    w->buf[w->len++] = 8 + 2 + 6;
+    w->buf[w->len++] = 8;
+    endBox(w, box);
+    box = beginBox(w, "saio");
+    put32(w, 0);
+    put32(w, 1);
+    saio = w->len;
+    put32(w, 0);
+    endBox(w, box);
+    endBox(w, traf);
+    endBox(w, moof);
+
+    mdat = beginBox(w, "mdat");
+    aux = w->len;
+    patch32(w, saio, aux - moof);
+    memset(iv, 0xb0, sizeof(iv));
+    putBytes(w, iv, sizeof(iv));
+    put16(w, 1);
+    put16(w, subs2[0].clear_bytes);
+    put32(w, subs2[0].encrp_bytes);
+    memset(iv, 0xb1, sizeof(iv));
+    putBytes(w, iv, sizeof(iv));
+    patch32(w, dataOffset[2], w->len - moof);
+    for (i = 0, sub = 0; i < 2; i++)
+    {
+        pos = w->len;
+        for (j = 0; j < sizes2[i]; j++)
+            w->buf[w->len++] = (uint8_t)(j * 13 + i);
+        memcpy(expected + expectedLen, w->buf + pos, sizes2[i]);
+        expectedLen += sizes2[i];
+        memset(iv, 0xb0 + i, sizeof(iv));
+        encryptCencSample(key, iv, w->buf + pos, sizes2[i], subs2 + sub,
+                          numSubs2[i]);
+        sub += numSubs2[i];
+    }
+    endBox(w, mdat);
+
+    fd = mkstemp(inPath);
+    if (fd < 0 || write(fd, w->buf, w->len) != (ssize_t)w->len)
+    {
+        printf("Decryption failed: could not write %s\n", inPath);
+        goto out;
+    }
+    close(fd);
+    fd = mkstemp(outPath);
+    if (fd >= 0)
+        close(fd);
+
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.kid, kid, TA_KID_SIZE);
+    entry.key_size = AES_BLOCK_SIZE;
+    memcpy(entry.key, key, AES_BLOCK_SIZE);
+
+    TEE_crypto_init();
+    ret = decrypt_mp4_file(inPath, outPath, &entry, 1, &stats);
+    TEE_crypto_close();
+
+    output = malloc(expectedLen + 1);
+    f = fopen(outPath, "rb");
+    if (ret || !output || !f || stats.samples != 7 ||
+        fread(output, 1, expectedLen + 1, f) != expectedLen ||
+        memcmp(output, expected, expectedLen) != 0)
+    {
+        printf("Decryption failed: decrypted data does not match expected data\n");
+        if (f)
+            fclose(f);
+        goto out;
+    }
+    fclose(f);
+
+    printf("Decryption succeeded\n");
+    test_num++;
+out:
+    unlink(inPath);
+    unlink(outPath);
+    free(output);
+    free(expected);
+    free(w);
+}
+
+/* SAMPLE-AES TS stream writer for DecryptsSampleAesTransportStream */
+typedef struct
+{
+    uint8_t buf[64 * TS_PACKET_SIZE];
+    size_t len;
+    uint8_t cc[2];
+} TsWriter;
+
+typedef struct
+{
+    uint8_t video[2048];
+    size_t videoLen;
+    uint8_t audio[512];
+    size_t audioLen;
+} EsCollector;
+
+static void collectEs(void *arg, const struct ts_es_frame *frame)
+{
+    EsCollector *c = arg;
+
+    if (frame->pid == 0x100 && c->videoLen + frame->size <= sizeof(c->video))
+    {
+        memcpy(c->video + c->videoLen, frame->data, frame->size);
+        c->videoLen += frame->size;
+    }
+    else if (frame->pid == 0x101 &&
+             c->audioLen + frame->size <= sizeof(c->audio))
+    {
+        memcpy(c->audio + c->audioLen, frame->data, frame->size);
+        c->audioLen += frame->size;
+    }
+}
+
+/* One packet per call for PSI, a PES split over as many as needed */
+static void putTsPackets(TsWriter *w, uint16_t pid, uint8_t *cc,
+                         const uint8_t *data, size_t len)
+{
+    uint8_t *pkt;
+    size_t n, stuffing;
+    bool first = true;
+
+    while (len)
+    {
+        pkt = w->buf + w->len;
+        w->len += TS_PACKET_SIZE;
+        n = len < TS_PACKET_SIZE - 4 ? len : TS_PACKET_SIZE - 4;
+        stuffing = TS_PACKET_SIZE - 4 - n;
+
+        pkt[0] = 0x47;
+        pkt[1] = (first ? 0x40 : 0) | pid >> 8;
+        pkt[2] = pid;
+        pkt[3] = (stuffing ? 0x30 : 0x10) | ((*cc)++ & 0xf);
+        if (stuffing)
+        {
+            pkt[4] = stuffing - 1;
+            if (stuffing > 1)
+            {
+                pkt[5] = 0;
+                memset(pkt + 6, 0xff, stuffing - 2);
+            }
+        }
+        memcpy(pkt + 4 + stuffing, data, n);
+        data += n;
+        len -= n;
+        first = false;
+    }
+}
+
+/* Insert emulation prevention bytes, as after SAMPLE-AES encryption */
+static size_t escapeNal(const uint8_t *src, size_t len, uint8_t *dst)
+{
+    size_t i, n = 0, zeros = 0;
+
+    for (i = 0; i < len; i++)
+    {
+        if (zeros >= 2 && src[i] <= 3)
+        {
+            dst[n++] = 3;
+            zeros = 0;
+        }
+        zeros = src[i] ? 0 : zeros + 1;
+        dst[n++] = src[i];
+    }
+    return n;
+}
+
+/* CBC encryption from iv of crypt out of every crypt + skip blocks */
+static void cbcsEncrypt(const struct ref_aes *aes, const uint8_t *iv,
+                        uint8_t *data, size_t len, int crypt, int skip)
+{
+    uint8_t chain[AES_BLOCK_SIZE];
+    size_t block, j;
+
+    memcpy(chain, iv, AES_BLOCK_SIZE);
+    for (block = 0; block < len / AES_BLOCK_SIZE; block++)
+    {
+        if (crypt && block % (crypt + skip) >= (size_t)crypt)
+            continue;
+        for (j = 0; j < AES_BLOCK_SIZE; j++)
+            data[block * AES_BLOCK_SIZE + j] ^= chain[j];
+        ref_aes_encrypt_block(aes, data + block * AES_BLOCK_SIZE,
+                              data + block * AES_BLOCK_SIZE);
+        memcpy(chain, data + block * AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+    }
+}
+
+void DecryptsSampleAesTransportStream(void)
+{
+    static const uint8_t key[AES_BLOCK_SIZE] = {
+        0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+        0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+    static const uint8_t iv[AES_BLOCK_SIZE] = {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+        0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+    static const uint8_t pat[] = {
+        0x00, 0x00, 0xb0, 0x0d, 0x00, 0x01, 0xc1, 0x00, 0x00,
+        0x00, 0x01, 0xf0, 0x00, 0x00, 0x00, 0x00, 0x00};
+    static const uint8_t pmt[] = {
+        0x00, 0x02, 0xb0, 0x17, 0x00, 0x01, 0xc1, 0x00, 0x00,
+        0xe1, 0x00, 0xf0, 0x00,
+        0xdb, 0xe1, 0x00, 0xf0, 0x00,
+        0xcf, 0xe1, 0x01, 0xf0, 0x00,
+        0x00, 0x00, 0x00, 0x00};
+    /* NAL types and raw sizes of the access unit: AUD, SPS, IDR, short
+     * clear slice, slice */
+    static const uint8_t nalTypes[] = {0x09, 0x67, 0x65, 0x41, 0x41};
+    static const size_t nalSizes[] = {2, 21, 401, 30, 251};
+    static const size_t frameSizes[] = {200, 30};
+
+    struct ref_aes aes;
+    struct ts_demux *demux = NULL;
+    struct ts_demux_stats stats;
+    TsWriter *w;
+    EsCollector *expected, *output = NULL;
+    uint8_t pes[1024], nal[512], clear[600];
+    uint8_t patCc = 0, pmtCc = 0;
+    size_t pesLen, i, j, k, n;
+    int ret = 0;
+
+    printf("TEST #%d DecryptsSampleAesTransportStream\n", test_num);
+
+    w = calloc(1, sizeof(*w));
+    expected = calloc(1, sizeof(*expected));
+    output = calloc(1, sizeof(*output));
+    if (!w || !expected || !output)
+    {
+        printf("Decryption failed: could not allocate buffers\n");
+        goto out;
+    }
+    ref_aes_init(&aes, key, sizeof(key));
+
+    putTsPackets(w, 0, &patCc, pat, sizeof(pat));
+    putTsPackets(w, 0x1000, &pmtCc, pmt, sizeof(pmt));
+
+    for (k = 0; k < 2; k++)
+    {
+        /* Video PES with an unbounded length, PTS only */
+        memcpy(pes, "\x00\x00\x01\xe0\x00\x00\x80\x80\x05\x21\x00\x01\x00\x01",
+               14);
+        pesLen = 14;
+        for (i = 0; i < sizeof(nalTypes); i++)
+        {
+            /* RBSP with runs of zeros, escaped as in the clear stream */
+            nal[0] = nalTypes[i];
+            for (j = 1; j < nalSizes[i]; j++)
+                nal[j] = j % 37 < 3 ? 0 : (uint8_t)(j * 11 + k);
+            nal[nalSizes[i] - 1] = 0x80;
+            n = escapeNal(nal, nalSizes[i], clear);
+
+            memcpy(expected->video + expected->videoLen, "\x00\x00\x00\x01",
+                   4);
+            memcpy(expected->video + expected->videoLen + 4, clear, n);
+            expected->videoLen += 4 + n;
+
+            /* Slices over 48 bytes are encrypted, then escaped again */
+            memcpy(pes + pesLen, "\x00\x00\x00\x01", 4);
+            pesLen += 4;
+            if (((nalTypes[i] & 0x1f) == 1 || (nalTypes[i] & 0x1f) == 5) &&
+                n > 48)
+                cbcsEncrypt(&aes, iv, clear + 32, n - 32, 1, 9);
+            pesLen += escapeNal(clear, n, pes + pesLen);
+        }
+        putTsPackets(w, 0x100, &w->cc[0], pes, pesLen);
+
+        /* Audio PES of two ADTS frames, the second too short to encrypt */
+        memcpy(pes, "\x00\x00\x01\xc0\x00\x00\x80\x80\x05\x21\x00\x01\x00\x01",
+               14);
+        pesLen = 14;
+        for (i = 0; i < 2; i++)
+        {
+            memcpy(pes + pesLen, "\xff\xf1\x50\x80\x00\x1f\xfc", 7);
+            pes[pesLen + 3] |= (uint8_t)(frameSizes[i] >> 11);
+            pes[pesLen + 4] = (uint8_t)(frameSizes[i] >> 3);
+            pes[pesLen + 5] |= (uint8_t)(frameSizes[i] << 5);
+            for (j = 7; j < frameSizes[i]; j++)
+                pes[pesLen + j] = (uint8_t)(j * 5 + k);
+            memcpy(expected->audio + expected->audioLen, pes + pesLen,
+                   frameSizes[i]);
+            expected->audioLen += frameSizes[i];
+            if (frameSizes[i] >= 7 + 16 + 16)
+                cbcsEncrypt(&aes, iv, pes + pesLen + 23,
+                            frameSizes[i] - 23, 0, 0);
+            pesLen += frameSizes[i];
+        }
+        pes[4] = (uint8_t)((pesLen - 6) >> 8);
+        pes[5] = (uint8_t)(pesLen - 6);
+        putTsPackets(w, 0x101, &w->cc[1], pes, pesLen);
+    }
+
+    demux = ts_demux_create(collectEs, output);
+    if (!demux)
+    {
+        printf("Decryption failed: could not create the demux\n");
+        goto out;
+    }
+
+    TEE_crypto_init();
+    ret = ts_demux_set_key(demux, key, iv);
+    /* Odd chunks so that packets straddle pushes */
+    for (i = 0; i < w->len && !ret; i += 100)
+        ret = ts_demux_push(demux, w->buf + i,
+                            w->len - i < 100 ? w->len - i : 100);
+    if (!ret)
+        ret = ts_demux_flush(demux);
+    TEE_crypto_close();
+    ts_demux_get_stats(demux, &stats);
+
+    if (ret || stats.pes != 4 || stats.cc_errors || stats.pes_errors ||
+        output->videoLen != expected->videoLen ||
+        memcmp(output->video, expected->video, expected->videoLen) != 0 ||
+        output->audioLen != expected->audioLen ||
+        memcmp(output->audio, expected->audio, expected->audioLen) != 0)
+    {
+        printf("Decryption failed: decrypted data does not match expected data\n");
+        goto out;
+    }
+
+    printf("Decryption succeeded\n");
+    test_num++;
+out:
+    ts_demux_destroy(demux);
+    free(output);
+    free(expected);
+    free(w);
+}
+
+/*
+ * Invoke a secure decrypt command on a session of its own, with temporary
+ * memrefs. Without CFG_SECURE_DATA_PATH the TA takes a non-secure output
+ * buffer, as it does for TA_AES_CTR128_ENCRYPT. With inout, map starts
+ * with a struct ta_secure_desc filled in by the TA.
+ */
+static TEEC_Result invokeSecureDecrypt(uint32_t cmd, const uint8_t *in,
+                                       uint8_t *out, uint32_t len,
+                                       void *map, uint32_t mapSize,
+                                       bool inout, const uint8_t *key,
+                                       uint32_t keySize, const uint8_t *iv)
+{
+    TEEC_UUID uuid = TA_AES_DECRYPTOR_UUID;
+    TEEC_Context context;
+    TEEC_Session session;
+    TEEC_Operation op;
+    TEEC_Result res;
+    uint8_t keyAndIv[TA_AES_MAX_KEY_SIZE + AES_BLOCK_SIZE];
+    uint32_t origin;
+
+    res = TEEC_InitializeContext(NULL, &context);
+    if (res != TEEC_SUCCESS)
+        return res;
+    res = TEEC_OpenSession(&context, &session, &uuid, TEEC_LOGIN_PUBLIC,
+                           NULL, NULL, &origin);
+    if (res != TEEC_SUCCESS)
+    {
+        TEEC_FinalizeContext(&context);
+        return res;
+    }
+
+    memcpy(keyAndIv, key, keySize);
+    memcpy(keyAndIv + keySize, iv, AES_BLOCK_SIZE);
+    memset(&op, 0, sizeof(op));
+    op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+                                     TEEC_MEMREF_TEMP_OUTPUT,
+                                     inout ? TEEC_MEMREF_TEMP_INOUT :
+                                             TEEC_MEMREF_TEMP_INPUT,
+                                     TEEC_MEMREF_TEMP_INPUT);
+    op.params[0].tmpref.buffer = (void *)in;
+    op.params[0].tmpref.size = len;
+    op.params[1].tmpref.buffer = out;
+    op.params[1].tmpref.size = len;
+    op.params[2].tmpref.buffer = map;
+    op.params[2].tmpref.size = mapSize;
+    op.params[3].tmpref.buffer = keyAndIv;
+    op.params[3].tmpref.size = keySize + AES_BLOCK_SIZE;
+
+    res = TEEC_InvokeCommand(&session, cmd, &op, &origin);
+    TEEC_CloseSession(&session);
+    TEEC_FinalizeContext(&context);
+    return res;
+}
+
+void DecryptsCbc1SubSamples(void)
+{
+#define CBC1_SAMPLE_SIZE 77
+
+    /* NIST SP 800-38A F.2.1, the chain runs on into the second range */
+    static const uint8_t key[16] = {
+        0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+        0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+    static const uint8_t iv[16] = {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+        0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+    static const uint8_t cipher[64] = {
+        0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46,
+        0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+        0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee,
+        0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
+        0x73, 0xbe, 0xd6, 0xb8, 0xe3, 0xc1, 0x74, 0x3b,
+        0x71, 0x16, 0xe6, 0x9e, 0x22, 0x22, 0x95, 0x16,
+        0x3f, 0xf1, 0xca, 0xa1, 0x68, 0x1f, 0xac, 0x09,
+        0x12, 0x0e, 0xca, 0x30, 0x75, 0x86, 0xe1, 0xa7};
+    static const uint8_t plain[64] = {
+        0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+        0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+        0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+        0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+        0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+        0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+        0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+        0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10};
+    /* The last five bytes of the second range are a clear partial block */
+    sub_sample_t subSamples[] = {{5, 32}, {3, 37}};
+    uint8_t encrypted[CBC1_SAMPLE_SIZE], expected[CBC1_SAMPLE_SIZE];
+    uint8_t output[CBC1_SAMPLE_SIZE];
+    TEEC_Result res;
+    int i;
+
+    printf("TEST #%d DecryptsCbc1SubSamples\n", test_num);
+
+    for (i = 0; i < CBC1_SAMPLE_SIZE; i++)
+        encrypted[i] = expected[i] = (uint8_t)(0xc0 + i);
+    memcpy(encrypted + 5, cipher, 32);
+    memcpy(expected + 5, plain, 32);
+    memcpy(encrypted + 40, cipher + 32, 32);
+    memcpy(expected + 40, plain + 32, 32);
+    memset(output, 0, sizeof(output));
+
+    res = invokeSecureDecrypt(TA_AES_CBC128_SECURE_DECRYPT, encrypted, output,
+                              CBC1_SAMPLE_SIZE, subSamples,
+                              sizeof(subSamples), false, key, sizeof(key), iv);
+    if (res != TEEC_SUCCESS)
+    {
+        printf("Decryption failed: TA_AES_CBC128_SECURE_DECRYPT returned 0x%x\n",
+               res);
+        return;
+    }
+    if (memcmp(output, expected, CBC1_SAMPLE_SIZE) != 0)
+    {
+        printf("Decryption failed: decrypted data does not match expected data\n");
+        return;
+    }
+
+    printf("Decryption succeeded\n");
+    test_num++;
+}
+
+void DecryptsSecureCtrAcrossSubSamples(void)
+{
+#define SECURE_CTR_SAMPLE_SIZE 86
+
+    static const uint8_t key[16] = {
+        0x7e, 0x24, 0x06, 0x78, 0x17, 0xfa, 0xe0, 0xd7,
+        0x43, 0xd6, 0xce, 0x1f, 0x32, 0x53, 0x91, 0x63};
+    static const uint8_t iv[16] = {
+        0x00, 0x6c, 0xb6, 0xdb, 0xc0, 0x54, 0x3b, 0x59,
+        0xda, 0x48, 0xd9, 0x0b, 0xff, 0xff, 0xff, 0xfe};
+    /* No range is a whole number of blocks, the keystream carries over */
+    sub_sample_t subSamples[] = {{4, 10}, {3, 7}, {0, 21}, {6, 33}, {2, 0}};
+    uint8_t encrypted[SECURE_CTR_SAMPLE_SIZE];
+    uint8_t expected[SECURE_CTR_SAMPLE_SIZE];
+    uint8_t output[SECURE_CTR_SAMPLE_SIZE];
+    struct ref_aes_ctr ctr;
+    TEEC_Result res;
+    size_t i, offset = 0;
+
+    printf("TEST #%d DecryptsSecureCtrAcrossSubSamples\n", test_num);
+
+    for (i = 0; i < SECURE_CTR_SAMPLE_SIZE; i++)
+        encrypted[i] = expected[i] = (uint8_t)(i * 29 + 3);
+    ref_aes_ctr_init(&ctr, key, sizeof(key), iv);
+    for (i = 0; i < sizeof(subSamples) / sizeof(subSamples[0]); i++)
+    {
+        offset += subSamples[i].clear_bytes;
+        ref_aes_ctr_xor(&ctr, expected + offset, encrypted + offset,
+                        subSamples[i].encrp_bytes);
+        offset += subSamples[i].encrp_bytes;
+    }
+    memset(output, 0, sizeof(output));
+
+    res = invokeSecureDecrypt(TA_AES_CTR128_SECURE_ENCRYPT, encrypted, output,
+                              SECURE_CTR_SAMPLE_SIZE, subSamples,
+                              sizeof(subSamples), false, key, sizeof(key), iv);
+    if (res != TEEC_SUCCESS)
+    {
+        printf("Decryption failed: TA_AES_CTR128_SECURE_ENCRYPT returned 0x%x\n",
+               res);
+        return;
+    }
+    if (memcmp(output, expected, SECURE_CTR_SAMPLE_SIZE) != 0)
+    {
+        printf("Decryption failed: decrypted data does not match expected data\n");
+        return;
+    }
+
+    printf("Decryption succeeded\n");
+    test_num++;
+}
+
+/* Output descriptor, NAL table and packed map of one secure decrypt */
+typedef struct
+{
+    struct ta_secure_desc desc;
+    struct ta_nal_unit nals[4];
+    uint8_t map[TA_PACKED_SUBSAMPLES_MAX_SIZE(2)];
+} SecureDescBuffer;
+
+static TEEC_Result decryptWithDescriptor(const uint8_t *key, const uint8_t *iv,
+                                         const uint8_t *encrypted,
+                                         uint8_t *output, uint32_t len,
+                                         const sub_sample_t *subSamples,
+                                         SecureDescBuffer *buf)
+{
+    uint32_t mapSize;
+
+    memset(buf, 0, sizeof(*buf));
+    buf->desc.version = TA_SECURE_DESC_VERSION;
+    buf->desc.nal_length_size = 4;
+    buf->desc.max_nals = 4;
+    mapSize = TEE_pack_subsamples(subSamples, 2, buf->map, sizeof(buf->map));
+    return invokeSecureDecrypt(TA_AES_CTR128_SECURE_DECRYPT_PACKED, encrypted,
+                               output, len, buf,
+                               offsetof(SecureDescBuffer, map) + mapSize,
+                               true, key, AES_BLOCK_SIZE, iv);
+}
+
+void StopsNalWalkAtEncryptedLength(void)
+{
+#define NAL_SAMPLE_SIZE 72
+
+    static const uint8_t key[16] = {
+        0xae, 0x68, 0x52, 0xf8, 0x12, 0x10, 0x67, 0xcc,
+        0x4b, 0xf7, 0xa5, 0x76, 0x55, 0x77, 0xf3, 0x9e};
+    static const uint8_t iv[16] = {
+        0x00, 0x00, 0x00, 0x30, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01};
+    /* NAL units of 20, 30 and 10 bytes after 4 byte length fields */
+    static const uint32_t nalSizes[] = {20, 30, 10};
+    /*
+     * Half of the second length field is in the encrypted range of the
+     * first map, all of it is clear in the second one
+     */
+    sub_sample_t splitField[] = {{6, 18}, {2, 46}};
+    sub_sample_t clearField[] = {{6, 18}, {4, 44}};
+    const sub_sample_t *maps[] = {splitField, clearField};
+    const uint32_t numNals[] = {1, 2}, frameEnd[] = {24, 58};
+    uint8_t plain[NAL_SAMPLE_SIZE], encrypted[NAL_SAMPLE_SIZE];
+    uint8_t output[NAL_SAMPLE_SIZE];
+    SecureDescBuffer buf;
+    struct ref_aes_ctr ctr;
+    TEEC_Result res;
+    size_t i, j, offset;
+
+    printf("TEST #%d StopsNalWalkAtEncryptedLength\n", test_num);
+
+    for (i = 0, offset = 0; i < 3; i++)
+    {
+        plain[offset++] = 0;
+        plain[offset++] = 0;
+        plain[offset++] = 0;
+        plain[offset++] = nalSizes[i];
+        for (j = 0; j < nalSizes[i]; j++)
+            plain[offset++] = (uint8_t)(0x41 + i * 16 + j);
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        memcpy(encrypted, plain, NAL_SAMPLE_SIZE);
+        ref_aes_ctr_init(&ctr, key, sizeof(key), iv);
+        for (j = 0, offset = 0; j < 2; j++)
+        {
+            offset += maps[i][j].clear_bytes;
+            ref_aes_ctr_xor(&ctr, plain + offset, encrypted + offset,
+                            maps[i][j].encrp_bytes);
+            offset += maps[i][j].encrp_bytes;
+        }
+        memset(output, 0, sizeof(output));
+
+        res = decryptWithDescriptor(key, iv, encrypted, output,
+                                    NAL_SAMPLE_SIZE, maps[i], &buf);
+        if (res != TEEC_SUCCESS)
+        {
+            printf("Decryption failed: TA_AES_CTR128_SECURE_DECRYPT_PACKED returned 0x%x\n",
+                   res);
+            return;
+        }
+        if (memcmp(output, plain, NAL_SAMPLE_SIZE) != 0)
+        {
+            printf("Decryption failed: decrypted data does not match expected data\n");
+            return;
+        }
+        if (buf.desc.bytes_written != NAL_SAMPLE_SIZE ||
+            buf.desc.num_nals != numNals[i] ||
+            buf.desc.frame_end != frameEnd[i] ||
+            buf.nals[0].offset != 4 || buf.nals[0].size != nalSizes[0] ||
+            (numNals[i] > 1 && (buf.nals[1].offset != 28 ||
+                                buf.nals[1].size != nalSizes[1])))
+        {
+            printf("Decryption failed: map %zu gave %u NAL units ending at %u\n",
+                   i, buf.desc.num_nals, buf.desc.frame_end);
+            return;
+        }
+    }
+
+    printf("Decryption succeeded\n");
+    test_num++;
+}
+
+static uint64_t elapsed_ns(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000ULL +
+           now.tv_nsec - start->tv_nsec;
+}
+
+/*
+ * Decrypt every sample of a corpus written by gen_corpus, checking it
+ * against the stored plaintext and timing the decryption only.
+ */
+static int runCorpus(const char *path)
+{
+    struct corpus_header hdr;
+    struct corpus_sample smp;
+    struct timespec start;
+    uint64_t bytes = 0, ns = 0;
+    uint32_t samples = 0, mismatches = 0;
+    uint8_t *output;
+    FILE *f;
+    int ret;
+
+    f = fopen(path, "rb");
+    if (!f)
+        err(1, "%s", path);
+    ret = corpus_read_header(f, &hdr);
+    if (ret)
+        errx(1, "%s: %s", path, strerror(ret));
+
+    TEE_crypto_init();
+
+    while (!(ret = corpus_read_sample(f, &smp)))
+    {
+        output = malloc(smp.rec.size + 1);
+        if (!output)
+            errx(1, "out of memory");
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (decryptCorpusSample(&smp, output))
+            mismatches++;
+        ns += elapsed_ns(&start);
+
+        bytes += smp.rec.size;
+        samples++;
+        free(output);
+        corpus_sample_free(&smp);
+    }
+
+    TEE_crypto_close();
+    fclose(f);
+
+    if (ret != ENODATA)
+        errx(1, "%s: sample %u: %s", path, samples, strerror(ret));
+
+    printf("%u/%u samples, %llu bytes, %u mismatches, %.1f MB/s\n",
+           samples, hdr.num_samples, (unsigned long long)bytes, mismatches,
+           ns ? bytes * 1000.0 / ns : 0.0);
+
+    return mismatches || samples != hdr.num_samples;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s                 run the tests\n"
+            "       %s <corpus>        benchmark a gen_corpus file\n"
+            "       %s decrypt [-w window] [-d] <input> <index> <output>\n"
+            "       %s decrypt -m [-k <kid>:<key>]... <input.mp4> <output>\n"
+            "       %s decrypt -t [-k <key>:<iv>] <input.ts> <output prefix>\n",
+            prog, prog, prog, prog, prog);
+    exit(1);
+}
+
+/* Hex string of exactly len bytes */
+static bool parseHex(const char *s, size_t n, uint8_t *out, size_t len)
+{
+    unsigned v;
+    size_t i;
+
+    if (n != 2 * len)
+        return false;
+    for (i = 0; i < len; i++)
+    {
+        if (!isxdigit((unsigned char)s[2 * i]) ||
+            !isxdigit((unsigned char)s[2 * i + 1]) ||
+            sscanf(s + 2 * i, "%2x", &v) != 1)
+            return false;
+        out[i] = v;
+    }
+    return true;
+}
+
+/* <kid>:<key> in hex, the key being 16, 24 or 32 bytes */
+static bool parseKeyArg(const char *arg, key_entry_t *entry)
+{
+    const char *colon = strchr(arg, ':');
+    size_t keyLen;
+
+    if (!colon)
+        return false;
+    memset(entry, 0, sizeof(*entry));
+    keyLen = strlen(colon + 1) / 2;
+    entry->key_size = keyLen;
+    return (keyLen == 16 || keyLen == 24 || keyLen == 32) &&
+           parseHex(arg, colon - arg, entry->kid, TA_KID_SIZE) &&
+           parseHex(colon + 1, strlen(colon + 1), entry->key, keyLen);
+}
+
+/*
+ * Decrypt the samples of a media file listed in a sidecar index, see
+ * decrypt_file.h, or of a fragmented MP4 with -m, and report the
+ * sustained throughput.
+ */
+static int runDecryptFile(int argc, char *argv[])
+{
+    struct decrypt_file_opts opts = {4, false};
+    struct decrypt_file_stats stats;
+    key_entry_t keys[TA_MAX_LOADED_KEYS];
+    uint32_t numKeys = 0;
+    unsigned line = 0;
+    bool mp4 = false, ts = false;
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "w:dmtk:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            opts.window = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            opts.direct = true;
+            break;
+        case 'm':
+            mp4 = true;
+            break;
+        case 't':
+            ts = true;
+            break;
+        case 'k':
+            if (numKeys == TA_MAX_LOADED_KEYS ||
+                !parseKeyArg(optarg, &keys[numKeys++]))
+                errx(1, "invalid key %s", optarg);
+            break;
+        default:
+            usage("optee_example_clearkey");
+        }
+    }
+    /* For a TS the "kid" of -k is the 128-bit key and the key its IV */
+    if (optind + (mp4 || ts ? 2 : 3) != argc || (mp4 && ts) ||
+        (!mp4 && !ts && numKeys) || ((mp4 || ts) && opts.direct) ||
+        (ts && (numKeys > 1 || (numKeys && keys[0].key_size != 16))))
+        usage("optee_example_clearkey");
+
+    TEE_crypto_init();
+    if (ts)
+        ret = decrypt_ts_file(argv[optind], argv[optind + 1],
+                              numKeys ? keys[0].kid : NULL,
+                              numKeys ? keys[0].key : NULL, &stats);
+    else if (mp4)
+        ret = decrypt_mp4_file(argv[optind], argv[optind + 1], keys,
+                               numKeys, &stats);
+    else
+        ret = decrypt_file(argv[optind], argv[optind + 1], argv[optind + 2],
+                           &opts, &stats, &line);
+    TEE_crypto_close();
+    memset(keys, 0, sizeof(keys));
+
+    if (ret && line)
+        errx(1, "%s:%u: invalid index line", argv[optind + 1], line);
+    if (ret)
+        errx(1, "decrypt failed: %s", strerror(ret));
+
+    printf("%u samples, %llu bytes, %.1f MB/s\n", stats.samples,
+           (unsigned long long)stats.bytes,
+           stats.ns ? stats.bytes * 1000.0 / stats.ns : 0.0);
+    return 0;
+}
+
+int main(int argc, char *argv[])
 {
     setvbuf(stdin, NULL, _IONBF, 0);
     setvbuf(stdout, NULL, _IONBF, 0);
     setvbuf(stderr, NULL, _IONBF, 0);
 
+    if (argc > 1 && !strcmp(argv[1], "decrypt"))
+        return runDecryptFile(argc - 1, argv + 1);
+    if (argc > 2 || (argc > 1 && argv[1][0] == '-'))
+        usage(argv[0]);
+    /* Benchmark a corpus from gen_corpus instead of running the tests */
+    if (argc > 1)
+        return runCorpus(argv[1]);
+
     /* test routine */
     DecryptsContiguousEncryptedBlock();
     DecryptsAlignedBifurcatedEncryptedBlock();
@@ -642,6 +3531,32 @@ int main()
     DecryptsAlignedMixedSubSamples();
     DecryptsUnalignedMixedSubSamples();
     DecryptsComplexMixedSubSamples();
+    DecryptsShortRangeAfterCarriedResidual();
+    DecryptsAcrossCounterCarry();
+    DecryptsScatterGatherSegments();
+    DecryptsBatchOfSamples();
+    DecryptsBatchWithMixedKeySizes();
+    DecryptsTailsWithMixedKeySizes();
+    DecryptsBatchWithKeyIds();
+    CountsKeyUsage();
+    ReapsIdleWorkerSessions();
+    DecryptsWithPrefetchedContext();
+    ReusesSessionCipherOperations();
+    TracesInvocationsInRing();
+    PacksSubSampleMap();
+    AllocatesFromShmArena();
+    ReleasesIdleShmArena();
+    DecryptsFromRegisteredBuffer();
+    SchedulesJobsByDeadline();
+    DecryptsAheadOfDecoder();
+    DecryptsLargeSampleInParallel();
+    DecryptsGeneratedCorpus();
+    DecryptsIndexedFile();
+    DecryptsFragmentedMp4();
+    DecryptsSampleAesTransportStream();
+    DecryptsCbc1SubSamples();
+    DecryptsSecureCtrAcrossSubSamples();
+    StopsNalWalkAtEncryptedLength();
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2026, The optee_clearkey contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "ref_aes.h"
+
+static const uint8_t sbox[256] = {
+  0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5,
+  0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+  0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0,
+  0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+  0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc,
+  0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+  0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a,
+  0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+  0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0,
+  0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+  0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b,
+  0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+  0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85,
+  0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+  0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+  0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+  0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17,
+  0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+  0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88,
+  0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+  0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c,
+  0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+  0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9,
+  0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+  0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6,
+  0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+  0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e,
+  0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+  0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94,
+  0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+  0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68,
+  0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static uint8_t xtime(uint8_t x)
+{
+  return (uint8_t)(x << 1) ^ ((x & 0x80) ? 0x1b : 0);
+}
+
+int ref_aes_init(struct ref_aes *aes, const uint8_t *key, unsigned key_size)
+{
+  unsigned nk = key_size / 4, words, i, j;
+  uint8_t *w = aes->round_keys;
+  uint8_t t[4], tmp, rcon = 1;
+
+  if (key_size != 16 && key_size != 24 && key_size != 32)
+    return -1;
+
+  aes->rounds = nk + 6;
+  words = 4 * (aes->rounds + 1);
+  memcpy(w, key, key_size);
+
+  for (i = nk; i < words; i++) {
+    memcpy(t, &w[(i - 1) * 4], 4);
+    if (i % nk == 0) {
+      /* RotWord, SubWord and Rcon */
+      tmp = t[0];
+      t[0] = sbox[t[1]] ^ rcon;
+      t[1] = sbox[t[2]];
+      t[2] = sbox[t[3]];
+      t[3] = sbox[tmp];
+      rcon = xtime(rcon);
+    } else if (nk > 6 && i % nk == 4) {
+      for (j = 0; j < 4; j++)
+        t[j] = sbox[t[j]];
+    }
+    for (j = 0; j < 4; j++)
+      w[i * 4 + j] = w[(i - nk) * 4 + j] ^ t[j];
+  }
+
+  return 0;
+}
+
+void ref_aes_encrypt_block(const struct ref_aes *aes,
+                           const uint8_t in[REF_AES_BLOCK_SIZE],
+                           uint8_t out[REF_AES_BLOCK_SIZE])
+{
+  uint8_t s[REF_AES_BLOCK_SIZE], t[REF_AES_BLOCK_SIZE];
+  uint8_t a0, a1, a2, a3, all;
+  unsigned r, c, i;
+
+  for (i = 0; i < REF_AES_BLOCK_SIZE; i++)
+    s[i] = in[i] ^ aes->round_keys[i];
+
+  for (r = 1; r <= aes->rounds; r++) {
+    /* SubBytes and ShiftRows, the state is column major */
+    for (c = 0; c < 4; c++)
+      for (i = 0; i < 4; i++)
+        t[c * 4 + i] = sbox[s[((c + i) % 4) * 4 + i]];
+
+    /* MixColumns, skipped in the last round */
+    if (r < aes->rounds) {
+      for (c = 0; c < 4; c++) {
+        a0 = t[c * 4];
+        a1 = t[c * 4 + 1];
+        a2 = t[c * 4 + 2];
+        a3 = t[c * 4 + 3];
+        all = a0 ^ a1 ^ a2 ^ a3;
+        t[c * 4] ^= all ^ xtime(a0 ^ a1);
+        t[c * 4 + 1] ^= all ^ xtime(a1 ^ a2);
+        t[c * 4 + 2] ^= all ^ xtime(a2 ^ a3);
+        t[c * 4 + 3] ^= all ^ xtime(a3 ^ a0);
+      }
+    }
+
+    for (i = 0; i < REF_AES_BLOCK_SIZE; i++)
+      s[i] = t[i] ^ aes->round_keys[r * REF_AES_BLOCK_SIZE + i];
+  }
+
+  memcpy(out, s, REF_AES_BLOCK_SIZE);
+}
+
+int ref_aes_ctr_init(struct ref_aes_ctr *ctr, const uint8_t *key,
+                     unsigned key_size, const uint8_t iv[REF_AES_BLOCK_SIZE])
+{
+  memcpy(ctr->counter, iv, REF_AES_BLOCK_SIZE);
+  ctr->used = REF_AES_BLOCK_SIZE;
+  return ref_aes_init(&ctr->aes, key, key_size);
+}
+
+void ref_aes_ctr_xor(struct ref_aes_ctr *ctr, const uint8_t *in,
+                     uint8_t *out, uint64_t len)
+{
+  int i;
+
+  while (len--) {
+    if (ctr->used == REF_AES_BLOCK_SIZE) {
+      ref_aes_encrypt_block(&ctr->aes, ctr->counter, ctr->keystream);
+      for (i = REF_AES_BLOCK_SIZE - 1; i >= 0 && !++ctr->counter[i]; i--)
+        ;
+      ctr->used = 0;
+    }
+    *out++ = *in++ ^ ctr->keystream[ctr->used++];
+  }
+}
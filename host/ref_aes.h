@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2026, The optee_clearkey contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef OPTEE_CLEARKEY_REF_AES_H
+#define OPTEE_CLEARKEY_REF_AES_H
+
+#include <stdint.h>
+
+/*
+ * Plain C AES encryption used as the reference when generating test
+ * corpora. It is written for clarity, not speed or side-channel
+ * resistance, and must never handle real keys.
+ */
+
+#define REF_AES_BLOCK_SIZE 16
+#define REF_AES_MAX_ROUNDS 14
+
+struct ref_aes {
+  uint8_t round_keys[(REF_AES_MAX_ROUNDS + 1) * REF_AES_BLOCK_SIZE];
+  unsigned rounds;
+};
+
+/* key_size is 16, 24 or 32, returns -1 for any other size */
+int ref_aes_init(struct ref_aes *aes, const uint8_t *key, unsigned key_size);
+
+void ref_aes_encrypt_block(const struct ref_aes *aes,
+                           const uint8_t in[REF_AES_BLOCK_SIZE],
+                           uint8_t out[REF_AES_BLOCK_SIZE]);
+
+/*
+ * AES-CTR with a 128-bit big endian counter. The keystream position is
+ * kept across calls, so consecutive calls behave as one stream the way
+ * CENC encrypted ranges of a sample do.
+ */
+struct ref_aes_ctr {
+  struct ref_aes aes;
+  uint8_t counter[REF_AES_BLOCK_SIZE];
+  uint8_t keystream[REF_AES_BLOCK_SIZE];
+  unsigned used;
+};
+
+int ref_aes_ctr_init(struct ref_aes_ctr *ctr, const uint8_t *key,
+                     unsigned key_size, const uint8_t iv[REF_AES_BLOCK_SIZE]);
+
+void ref_aes_ctr_xor(struct ref_aes_ctr *ctr, const uint8_t *in,
+                     uint8_t *out, uint64_t len);
+
+#endif
@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2026, The optee_clearkey contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shm_arena.h"
+
+#define NUM_CLASSES (SHM_ARENA_MAX_SHIFT - SHM_ARENA_MIN_SHIFT + 1)
+/* Classes up to 64 KiB are cached per thread, a few blocks each */
+#define CACHED_CLASSES (16 - SHM_ARENA_MIN_SHIFT + 1)
+#define CACHE_DEPTH 4
+/* End of a free list, free blocks hold the offset of the next one */
+#define NO_BLOCK UINT32_MAX
+
+struct shm_cache {
+  struct shm_arena *arena;
+  struct shm_cache *prev, *next;
+  uint32_t count[CACHED_CLASSES];
+  uint32_t blocks[CACHED_CLASSES][CACHE_DEPTH];
+};
+
+struct shm_arena {
+  TEEC_SharedMemory shm;
+  pthread_mutex_t lock;
+  /* The calling thread's struct shm_cache */
+  pthread_key_t cache_key;
+  struct shm_cache *caches;
+  uint32_t carved;
+  uint32_t free_list[NUM_CLASSES];
+  struct shm_arena_stats stats;
+};
+
+static uint32_t class_size(uint32_t cls)
+{
+  return 1u << (cls + SHM_ARENA_MIN_SHIFT);
+}
+
+static uint32_t size_class(size_t size)
+{
+  uint32_t cls = 0;
+
+  while (cls < NUM_CLASSES && class_size(cls) < size)
+    cls++;
+
+  return cls;
+}
+
+static uint32_t *next_of(struct shm_arena *a, uint32_t offset)
+{
+  return (uint32_t *)((uint8_t *)a->shm.buffer + offset);
+}
+
+static void push_block(struct shm_arena *a, uint32_t cls, uint32_t offset)
+{
+  *next_of(a, offset) = a->free_list[cls];
+  a->free_list[cls] = offset;
+}
+
+static uint32_t pop_block(struct shm_arena *a, uint32_t cls)
+{
+  uint32_t offset = a->free_list[cls];
+
+  if (offset != NO_BLOCK)
+    a->free_list[cls] = *next_of(a, offset);
+
+  return offset;
+}
+
+/* Called with the lock held */
+static uint32_t take_block(struct shm_arena *a, uint32_t cls)
+{
+  uint32_t offset, c;
+
+  offset = pop_block(a, cls);
+  if (offset != NO_BLOCK)
+    return offset;
+
+  if (a->shm.size - a->carved >= class_size(cls)) {
+    offset = a->carved;
+    a->carved += class_size(cls);
+    return offset;
+  }
+
+  /* All carved: split the smallest larger free block in halves */
+  for (c = cls + 1; c < NUM_CLASSES; c++) {
+    offset = pop_block(a, c);
+    if (offset == NO_BLOCK)
+      continue;
+    while (c-- > cls)
+      push_block(a, c, offset + class_size(c));
+    a->stats.splits++;
+    return offset;
+  }
+
+  return NO_BLOCK;
+}
+
+static void release_cache(void *arg)
+{
+  struct shm_cache *c = arg;
+  struct shm_arena *a = c->arena;
+  uint32_t cls;
+
+  pthread_mutex_lock(&a->lock);
+  for (cls = 0; cls < CACHED_CLASSES; cls++) {
+    while (c->count[cls]) {
+      push_block(a, cls, c->blocks[cls][--c->count[cls]]);
+      a->stats.in_use -= class_size(cls);
+    }
+  }
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    a->caches = c->next;
+  if (c->next)
+    c->next->prev = c->prev;
+  pthread_mutex_unlock(&a->lock);
+  free(c);
+}
+
+/* NULL if it cannot be allocated, the shared lists are used then */
+static struct shm_cache *thread_cache(struct shm_arena *a)
+{
+  struct shm_cache *c = pthread_getspecific(a->cache_key);
+
+  if (c)
+    return c;
+
+  c = calloc(1, sizeof(*c));
+  if (!c)
+    return NULL;
+  if (pthread_setspecific(a->cache_key, c)) {
+    free(c);
+    return NULL;
+  }
+  c->arena = a;
+  pthread_mutex_lock(&a->lock);
+  c->next = a->caches;
+  if (c->next)
+    c->next->prev = c;
+  a->caches = c;
+  pthread_mutex_unlock(&a->lock);
+
+  return c;
+}
+
+struct shm_arena *shm_arena_create(TEEC_Context *ctx, uint32_t size)
+{
+  struct shm_arena *a;
+  uint32_t cls;
+
+  size &= ~(SHM_ARENA_MIN_SIZE - 1);
+  if (!ctx || !size)
+    return NULL;
+
+  a = calloc(1, sizeof(*a));
+  if (!a)
+    return NULL;
+  if (pthread_key_create(&a->cache_key, release_cache)) {
+    free(a);
+    return NULL;
+  }
+
+  a->shm.size = size;
+  a->shm.flags = TEEC_MEM_INPUT | TEEC_MEM_OUTPUT;
+  if (TEEC_AllocateSharedMemory(ctx, &a->shm) != TEEC_SUCCESS) {
+    pthread_key_delete(a->cache_key);
+    free(a);
+    return NULL;
+  }
+
+  pthread_mutex_init(&a->lock, NULL);
+  for (cls = 0; cls < NUM_CLASSES; cls++)
+    a->free_list[cls] = NO_BLOCK;
+
+  return a;
+}
+
+void shm_arena_destroy(struct shm_arena *a)
+{
+  struct shm_cache *c;
+
+  if (!a)
+    return;
+
+  /* Caches of threads still running, their destructor no longer runs */
+  pthread_key_delete(a->cache_key);
+  while ((c = a->caches)) {
+    a->caches = c->next;
+    free(c);
+  }
+
+  TEEC_ReleaseSharedMemory(&a->shm);
+  pthread_mutex_destroy(&a->lock);
+  free(a);
+}
+
+int shm_arena_alloc(struct shm_arena *a, size_t size, struct shm_block *blk)
+{
+  struct shm_cache *c = NULL;
+  uint32_t cls, offset;
+
+  cls = size_class(size);
+  if (cls == NUM_CLASSES)
+    goto fail;
+
+  if (cls < CACHED_CLASSES)
+    c = thread_cache(a);
+  if (c && c->count[cls]) {
+    offset = c->blocks[cls][--c->count[cls]];
+  } else {
+    pthread_mutex_lock(&a->lock);
+    offset = take_block(a, cls);
+    if (offset != NO_BLOCK) {
+      a->stats.locked_allocs++;
+      a->stats.in_use += class_size(cls);
+    }
+    pthread_mutex_unlock(&a->lock);
+    if (offset == NO_BLOCK)
+      goto fail;
+  }
+
+  blk->shm = &a->shm;
+  blk->offset = offset;
+  blk->buffer = (uint8_t *)a->shm.buffer + offset;
+  blk->size_class = cls;
+  return 0;
+
+fail:
+  pthread_mutex_lock(&a->lock);
+  a->stats.failures++;
+  pthread_mutex_unlock(&a->lock);
+  return ENOMEM;
+}
+
+void shm_arena_free(struct shm_arena *a, struct shm_block *blk)
+{
+  struct shm_cache *c = NULL;
+  uint32_t cls = blk->size_class;
+
+  if (cls < CACHED_CLASSES)
+    c = thread_cache(a);
+  if (c && c->count[cls] < CACHE_DEPTH) {
+    c->blocks[cls][c->count[cls]++] = blk->offset;
+    return;
+  }
+
+  pthread_mutex_lock(&a->lock);
+  push_block(a, cls, blk->offset);
+  a->stats.in_use -= class_size(cls);
+  pthread_mutex_unlock(&a->lock);
+}
+
+void shm_arena_get_stats(struct shm_arena *a, struct shm_arena_stats *stats)
+{
+  pthread_mutex_lock(&a->lock);
+  *stats = a->stats;
+  stats->size = a->shm.size;
+  stats->carved = a->carved;
+  pthread_mutex_unlock(&a->lock);
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2026, The optee_clearkey contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef OPTEE_CLEARKEY_SHM_ARENA_H
+#define OPTEE_CLEARKEY_SHM_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <tee_client_api.h>
+
+/*
+ * Arena of TEEC shared memory for the buffers handed to the TA. One region
+ * is allocated up front and carved into power of two size classes, from
+ * SHM_ARENA_MIN_SIZE up to SHM_ARENA_MAX_SIZE, passed as partial memrefs
+ * by offset. A freed block goes to the free list of its class: a small
+ * per-thread cache for the smaller classes, else the shared list. So
+ * allocation pops a list, or bumps the carving offset while the region has
+ * room, or splits a larger free block once it is all carved.
+ *
+ * Blocks are never merged back, carved memory only serves its class or
+ * smaller ones. Waste is bounded by the rounding to a power of two and by
+ * the peak use of each class, which suits the few sizes a player
+ * alternates between. When nothing fits, allocation fails and the caller
+ * falls back to a temporary memref.
+ */
+
+#define SHM_ARENA_MIN_SHIFT 8
+#define SHM_ARENA_MAX_SHIFT 22
+#define SHM_ARENA_MIN_SIZE (1u << SHM_ARENA_MIN_SHIFT)
+#define SHM_ARENA_MAX_SIZE (1u << SHM_ARENA_MAX_SHIFT)
+
+struct shm_block {
+  TEEC_SharedMemory *shm;   /* parent of the partial memref */
+  uint32_t offset;
+  void *buffer;
+  uint32_t size_class;
+};
+
+struct shm_arena_stats {
+  uint64_t locked_allocs;   /* not served by the thread's cache */
+  uint64_t splits;          /* larger blocks split once all was carved */
+  uint64_t failures;        /* nothing fitted, the caller fell back */
+  uint32_t size;            /* bytes of the region */
+  uint32_t carved;          /* bytes of the region handed out so far */
+  uint32_t in_use;          /* bytes allocated or in thread caches */
+};
+
+struct shm_arena;
+
+/*
+ * Allocate a region of size bytes, rounded down to SHM_ARENA_MIN_SIZE,
+ * from ctx. NULL on failure.
+ */
+struct shm_arena *shm_arena_create(TEEC_Context *ctx, uint32_t size);
+
+/* No block may still be in use, and no other thread in the arena */
+void shm_arena_destroy(struct shm_arena *arena);
+
+/* Returns 0 or ENOMEM, blk is left untouched on failure */
+int shm_arena_alloc(struct shm_arena *arena, size_t size,
+                    struct shm_block *blk);
+
+void shm_arena_free(struct shm_arena *arena, struct shm_block *blk);
+
+void shm_arena_get_stats(struct shm_arena *arena,
+                         struct shm_arena_stats *stats);
+
+#endif
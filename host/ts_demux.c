@@ -0,0 +1,712 @@
+/*
+ * Copyright (c) 2026, The optee_clearkey contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ts_demux.h"
+
+#define TS_SYNC_BYTE 0x47
+#define TS_NULL_PID 0x1fff
+#define TS_PAT_PID 0
+
+/* Stream types, the 0xdb and 0xcf ones are SAMPLE-AES */
+#define STREAM_TYPE_AAC 0x0f
+#define STREAM_TYPE_H264 0x1b
+#define STREAM_TYPE_AAC_SAMPLE_AES 0xcf
+#define STREAM_TYPE_H264_SAMPLE_AES 0xdb
+
+/* SAMPLE-AES layout */
+#define VIDEO_CLEAR_LEADER 32
+#define VIDEO_MIN_ENCRYPTED_NAL 49
+#define VIDEO_CRYPT_BLOCKS 1
+#define VIDEO_SKIP_BLOCKS 9
+#define AUDIO_CLEAR_LEADER 16
+
+/* Batch limits; the arenas grow for larger PES packets */
+#define TS_BATCH_SAMPLES 256
+#define TS_BATCH_SUBSAMPLES 8192
+#define TS_ARENA_SIZE (1024 * 1024)
+#define TS_PES_SIZE (256 * 1024)
+#define TS_MAX_PES_SIZE (64 * 1024 * 1024)
+
+struct ts_stream {
+  uint16_t pid;
+  uint8_t stream_type;
+  bool encrypted;
+  bool video;
+  bool broken;              /* drop data until the next PES start */
+  int cc;                   /* last continuity counter, -1 for none */
+  uint8_t *pes;
+  uint32_t pes_len;
+  uint32_t pes_cap;
+};
+
+/* PES payload queued in the arena, in stream order */
+struct ts_pending {
+  struct ts_stream *stream;
+  uint32_t offset;
+  uint32_t size;
+  int64_t pts;
+  bool encrypted;
+};
+
+struct ts_demux {
+  ts_es_cb cb;
+  void *arg;
+  batch_key_t key;
+  uint8_t iv[CTR_AES_BLOCK_SIZE];
+  bool has_key;
+
+  int pmt_pid;              /* -1 until the PAT is seen */
+  int pmt_version;
+  struct ts_stream streams[TS_MAX_STREAMS];
+  unsigned num_streams;
+
+  uint8_t carry[TS_PACKET_SIZE];
+  unsigned carry_len;
+
+  uint8_t *in;
+  uint8_t *out;
+  uint32_t arena_cap;
+  uint32_t arena_used;
+  batch_sample_t samples[TS_BATCH_SAMPLES];
+  unsigned num_samples;
+  struct ts_pending pending[TS_BATCH_SAMPLES];
+  unsigned num_pending;
+  sub_sample_t subs[TS_BATCH_SUBSAMPLES];
+  unsigned num_subs;
+
+  struct ts_demux_stats stats;
+};
+
+static uint16_t be16(const uint8_t *p)
+{
+  return (uint16_t)p[0] << 8 | p[1];
+}
+
+struct ts_demux *ts_demux_create(ts_es_cb cb, void *arg)
+{
+  struct ts_demux *d;
+
+  if (!cb)
+    return NULL;
+  d = calloc(1, sizeof(*d));
+  if (!d)
+    return NULL;
+  d->in = malloc(TS_ARENA_SIZE);
+  d->out = malloc(TS_ARENA_SIZE);
+  if (!d->in || !d->out) {
+    ts_demux_destroy(d);
+    return NULL;
+  }
+  d->arena_cap = TS_ARENA_SIZE;
+  d->cb = cb;
+  d->arg = arg;
+  d->pmt_pid = -1;
+  d->pmt_version = -1;
+  return d;
+}
+
+static void free_streams(struct ts_demux *d)
+{
+  unsigned i;
+
+  for (i = 0; i < d->num_streams; i++)
+    free(d->streams[i].pes);
+  memset(d->streams, 0, sizeof(d->streams));
+  d->num_streams = 0;
+}
+
+void ts_demux_destroy(struct ts_demux *d)
+{
+  if (!d)
+    return;
+  free_streams(d);
+  free(d->in);
+  free(d->out);
+  memset(&d->key, 0, sizeof(d->key));
+  free(d);
+}
+
+/* Decrypt the queued samples and hand all queued payloads out */
+static int flush_batch(struct ts_demux *d)
+{
+  struct ts_es_frame frame;
+  struct ts_pending *p;
+  unsigned i;
+  int ret = 0;
+
+  if (d->num_samples) {
+    ret = TEE_AES_ctr128_decrypt_batch(d->in, d->arena_used, d->out,
+                                       d->arena_used, d->samples,
+                                       d->num_samples, &d->key, 1);
+    d->stats.batches++;
+  }
+
+  for (i = 0; i < d->num_pending && !ret; i++) {
+    p = &d->pending[i];
+    frame.pid = p->stream->pid;
+    frame.stream_type = p->stream->stream_type;
+    frame.pts = p->pts;
+    frame.data = (p->encrypted ? d->out : d->in) + p->offset;
+    frame.size = p->size;
+    d->cb(d->arg, &frame);
+  }
+
+  d->arena_used = 0;
+  d->num_samples = 0;
+  d->num_pending = 0;
+  d->num_subs = 0;
+  return ret;
+}
+
+/* Make room for a payload of size bytes in an empty batch if needed */
+static int reserve(struct ts_demux *d, uint32_t size)
+{
+  uint8_t *in, *out;
+  uint32_t cap;
+  int ret;
+
+  if (d->num_pending < TS_BATCH_SAMPLES &&
+      size <= d->arena_cap - d->arena_used)
+    return 0;
+  ret = flush_batch(d);
+  if (ret || size <= d->arena_cap)
+    return ret;
+
+  for (cap = d->arena_cap; cap < size; cap *= 2)
+    ;
+  in = malloc(cap);
+  out = malloc(cap);
+  if (!in || !out) {
+    free(in);
+    free(out);
+    return ENOMEM;
+  }
+  free(d->in);
+  free(d->out);
+  d->in = in;
+  d->out = out;
+  d->arena_cap = cap;
+  return 0;
+}
+
+static int add_subsample(struct ts_demux *d, uint32_t *clear,
+                         uint32_t encrp)
+{
+  if (d->num_subs == TS_BATCH_SUBSAMPLES)
+    return E2BIG;
+  d->subs[d->num_subs].clear_bytes = *clear;
+  d->subs[d->num_subs].encrp_bytes = encrp;
+  d->num_subs++;
+  *clear = 0;
+  return 0;
+}
+
+/* Start of the next 00 00 01 start code at or after pos, or len */
+static uint32_t next_start_code(const uint8_t *p, uint32_t pos, uint32_t len)
+{
+  for (; pos + 3 <= len; pos++) {
+    if (p[pos + 2] > 1)
+      pos += 2;
+    else if (!p[pos] && !p[pos + 1] && p[pos + 2] == 1)
+      return pos;
+  }
+  return len;
+}
+
+/* Copy a NAL unit dropping its emulation prevention bytes */
+static uint32_t unescape(const uint8_t *src, uint32_t len, uint8_t *dst)
+{
+  uint32_t i, n = 0, zeros = 0;
+
+  for (i = 0; i < len; i++) {
+    if (zeros >= 2 && src[i] == 3) {
+      zeros = 0;
+      continue;
+    }
+    zeros = src[i] ? 0 : zeros + 1;
+    dst[n++] = src[i];
+  }
+  return n;
+}
+
+static uint32_t unescaped_size(const uint8_t *src, uint32_t len)
+{
+  uint32_t i, n = len, zeros = 0;
+
+  for (i = 0; i < len; i++) {
+    if (zeros >= 2 && src[i] == 3) {
+      zeros = 0;
+      n--;
+      continue;
+    }
+    zeros = src[i] ? 0 : zeros + 1;
+  }
+  return n;
+}
+
+/*
+ * Copy an H.264 access unit into dst, unescaping the encrypted slices and
+ * adding a subsample for each. Returns the size written.
+ */
+static int build_video(struct ts_demux *d, const uint8_t *es, uint32_t len,
+                       uint8_t *dst, uint32_t *size)
+{
+  uint32_t pos, start, end, next, n, out = 0, clear = 0;
+  uint8_t type;
+  int ret;
+
+  pos = next_start_code(es, 0, len);
+  /* Bytes before the first start code are kept as they are */
+  memcpy(dst, es, pos);
+  out = clear = pos;
+
+  while (pos < len) {
+    start = pos + 3;
+    next = next_start_code(es, start, len);
+    /* Zero bytes before a start code belong to it, not to the NAL */
+    for (end = next; end > start && !es[end - 1] && next < len; end--)
+      ;
+
+    memcpy(dst + out, es + pos, start - pos);
+    out += start - pos;
+    clear += start - pos;
+
+    type = start < end ? es[start] & 0x1f : 0;
+    n = (type == 1 || type == 5) ? unescaped_size(es + start, end - start) :
+                                   0;
+    if (n >= VIDEO_MIN_ENCRYPTED_NAL) {
+      unescape(es + start, end - start, dst + out);
+      clear += VIDEO_CLEAR_LEADER;
+      ret = add_subsample(d, &clear, n - VIDEO_CLEAR_LEADER);
+      if (ret)
+        return ret;
+      out += n;
+    } else {
+      memcpy(dst + out, es + start, end - start);
+      out += end - start;
+      clear += end - start;
+    }
+
+    memcpy(dst + out, es + end, next - end);
+    out += next - end;
+    clear += next - end;
+    pos = next;
+  }
+
+  *size = out;
+  return 0;
+}
+
+/* ADTS frames are copied as is, one subsample per encrypted frame */
+static int build_audio(struct ts_demux *d, const uint8_t *es, uint32_t len,
+                       uint32_t *size)
+{
+  uint32_t pos = 0, hdr, frame, clear = 0, encrp;
+  int ret;
+
+  while (len - pos >= 7 && es[pos] == 0xff && (es[pos + 1] & 0xf0) == 0xf0) {
+    hdr = es[pos + 1] & 1 ? 7 : 9;
+    frame = (uint32_t)(es[pos + 3] & 3) << 11 | es[pos + 4] << 3 |
+      es[pos + 5] >> 5;
+    /* A frame cut short by the end of the PES is left clear */
+    if (frame < hdr || frame > len - pos)
+      break;
+
+    encrp = frame > hdr + AUDIO_CLEAR_LEADER ?
+            frame - hdr - AUDIO_CLEAR_LEADER : 0;
+    clear += frame - encrp;
+    if (encrp >= CTR_AES_BLOCK_SIZE) {
+      ret = add_subsample(d, &clear, encrp);
+      if (ret)
+        return ret;
+    } else {
+      clear += encrp;
+    }
+    pos += frame;
+  }
+
+  *size = len;
+  return 0;
+}
+
+/* Queue the ES payload of a PES packet for decryption */
+static int queue_payload(struct ts_demux *d, struct ts_stream *s,
+                         const uint8_t *es, uint32_t len, int64_t pts)
+{
+  struct ts_pending *p;
+  batch_sample_t *smp;
+  uint8_t *dst;
+  uint32_t first, size = len;
+  int ret, retry;
+
+  if (s->encrypted && !d->has_key)
+    return ENOKEY;
+
+  for (retry = 0; retry < 2; retry++) {
+    ret = reserve(d, len);
+    if (ret)
+      return ret;
+    dst = d->in + d->arena_used;
+    first = d->num_subs;
+
+    if (!s->encrypted) {
+      memcpy(dst, es, len);
+    } else if (s->video) {
+      ret = build_video(d, es, len, dst, &size);
+    } else {
+      memcpy(dst, es, len);
+      ret = build_audio(d, es, len, &size);
+    }
+    if (ret)
+      d->num_subs = first;
+    if (ret != E2BIG || !d->num_pending)
+      break;
+    /* Out of subsamples: send what is queued and start over */
+    ret = flush_batch(d);
+    if (ret)
+      return ret;
+  }
+  if (ret)
+    return ret;
+
+  p = &d->pending[d->num_pending++];
+  p->stream = s;
+  p->offset = d->arena_used;
+  p->size = size;
+  p->pts = pts;
+  p->encrypted = d->num_subs > first;
+
+  if (p->encrypted) {
+    smp = &d->samples[d->num_samples++];
+    memset(smp, 0, sizeof(*smp));
+    smp->in_offset = d->arena_used;
+    smp->out_offset = d->arena_used;
+    smp->size = size;
+    smp->key_slot = 0;
+    smp->sub_samples = d->subs + first;
+    smp->num_sub_samples = d->num_subs - first;
+    memcpy(smp->iv, d->iv, sizeof(smp->iv));
+    smp->scheme = BATCH_SCHEME_CBCS;
+    smp->crypt_blocks = s->video ? VIDEO_CRYPT_BLOCKS : 0;
+    smp->skip_blocks = s->video ? VIDEO_SKIP_BLOCKS : 0;
+  }
+  d->arena_used += size;
+  return 0;
+}
+
+static int pes_done(struct ts_demux *d, struct ts_stream *s)
+{
+  const uint8_t *p = s->pes;
+  uint32_t len = s->pes_len, hdr;
+  int64_t pts = -1;
+
+  s->pes_len = 0;
+  if (len < 9 || p[0] || p[1] || p[2] != 1 || len < 9u + p[8]) {
+    d->stats.pes_errors++;
+    return 0;
+  }
+  hdr = 9 + p[8];
+  if ((p[7] & 0x80) && p[8] >= 5)
+    pts = (int64_t)(p[9] & 0x0e) << 29 | (int64_t)p[10] << 22 |
+      (int64_t)(p[11] & 0xfe) << 14 | (int64_t)p[12] << 7 | p[13] >> 1;
+  /* A known PES length bounds the payload */
+  if (be16(p + 4) && 6u + be16(p + 4) < len)
+    len = 6 + be16(p + 4);
+  if (len < hdr) {
+    d->stats.pes_errors++;
+    return 0;
+  }
+
+  d->stats.pes++;
+  return queue_payload(d, s, p + hdr, len - hdr, pts);
+}
+
+static int finish_streams(struct ts_demux *d)
+{
+  unsigned i;
+  int ret;
+
+  for (i = 0; i < d->num_streams; i++) {
+    if (d->streams[i].pes_len && !d->streams[i].broken) {
+      ret = pes_done(d, &d->streams[i]);
+      if (ret)
+        return ret;
+    }
+    d->streams[i].pes_len = 0;
+  }
+  return flush_batch(d);
+}
+
+/* Section of a PSI packet payload, NULL if it does not start here */
+static const uint8_t *psi_section(const uint8_t *p, uint32_t len,
+                                  bool pusi, uint8_t table_id,
+                                  uint32_t *section_len)
+{
+  if (!pusi || !len || p[0] >= len - 1)
+    return NULL;
+  len -= 1 + p[0];
+  p += 1 + p[0];
+  if (len < 12 || p[0] != table_id)
+    return NULL;
+  *section_len = 3 + (be16(p + 1) & 0xfff);
+  return *section_len <= len && *section_len >= 12 ? p : NULL;
+}
+
+static void parse_pat(struct ts_demux *d, const uint8_t *p, uint32_t len,
+                      bool pusi)
+{
+  uint32_t n, i;
+
+  p = psi_section(p, len, pusi, 0, &n);
+  if (!p)
+    return;
+  /* First program, entries end before the CRC */
+  for (i = 8; i + 4 <= n - 4; i += 4) {
+    if (be16(p + i)) {
+      d->pmt_pid = be16(p + i + 2) & 0x1fff;
+      return;
+    }
+  }
+}
+
+static int parse_pmt(struct ts_demux *d, const uint8_t *p, uint32_t len,
+                     bool pusi)
+{
+  struct ts_stream *s;
+  uint32_t n, i, es_info;
+  uint8_t type;
+  int version, ret;
+
+  p = psi_section(p, len, pusi, 2, &n);
+  if (!p)
+    return 0;
+  version = (p[5] >> 1) & 0x1f;
+  if (version == d->pmt_version)
+    return 0;
+
+  /* New stream layout: hand out what belongs to the previous one */
+  ret = finish_streams(d);
+  if (ret)
+    return ret;
+  free_streams(d);
+  d->pmt_version = version;
+
+  for (i = 12 + (be16(p + 10) & 0xfff); i + 5 <= n - 4; i += 5 + es_info) {
+    type = p[i];
+    es_info = be16(p + i + 3) & 0xfff;
+    if (type != STREAM_TYPE_H264 && type != STREAM_TYPE_AAC &&
+        type != STREAM_TYPE_H264_SAMPLE_AES &&
+        type != STREAM_TYPE_AAC_SAMPLE_AES)
+      continue;
+    if (d->num_streams == TS_MAX_STREAMS)
+      break;
+
+    s = &d->streams[d->num_streams];
+    s->pes = malloc(TS_PES_SIZE);
+    if (!s->pes)
+      return ENOMEM;
+    s->pes_cap = TS_PES_SIZE;
+    s->pid = be16(p + i + 1) & 0x1fff;
+    s->stream_type = type;
+    s->encrypted = type == STREAM_TYPE_H264_SAMPLE_AES ||
+                   type == STREAM_TYPE_AAC_SAMPLE_AES;
+    s->video = type == STREAM_TYPE_H264 ||
+               type == STREAM_TYPE_H264_SAMPLE_AES;
+    s->cc = -1;
+    d->num_streams++;
+  }
+  return 0;
+}
+
+static int append_pes(struct ts_stream *s, const uint8_t *p, uint32_t len)
+{
+  uint8_t *pes;
+  uint32_t cap;
+
+  if (len > s->pes_cap - s->pes_len) {
+    cap = s->pes_cap;
+    while (cap - s->pes_len < len)
+      cap *= 2;
+    if (cap > TS_MAX_PES_SIZE)
+      return E2BIG;
+    pes = realloc(s->pes, cap);
+    if (!pes)
+      return ENOMEM;
+    s->pes = pes;
+    s->pes_cap = cap;
+  }
+  memcpy(s->pes + s->pes_len, p, len);
+  s->pes_len += len;
+  return 0;
+}
+
+static int process_packet(struct ts_demux *d, const uint8_t *pkt)
+{
+  bool pusi = pkt[1] & 0x40;
+  uint16_t pid = be16(pkt + 1) & 0x1fff;
+  uint8_t afc = (pkt[3] >> 4) & 3, cc = pkt[3] & 0xf;
+  const uint8_t *p = pkt + 4;
+  struct ts_stream *s = NULL;
+  uint32_t len, i;
+  int ret;
+
+  d->stats.packets++;
+  if (pid == TS_NULL_PID || !(afc & 1))
+    return 0;
+  if (afc & 2)
+    p += 1 + pkt[4];
+  if (p >= pkt + TS_PACKET_SIZE)
+    return 0;
+  len = pkt + TS_PACKET_SIZE - p;
+
+  if (pid == TS_PAT_PID) {
+    parse_pat(d, p, len, pusi);
+    return 0;
+  }
+  if (pid == d->pmt_pid)
+    return parse_pmt(d, p, len, pusi);
+
+  for (i = 0; i < d->num_streams && !s; i++)
+    if (d->streams[i].pid == pid)
+      s = &d->streams[i];
+  if (!s)
+    return 0;
+
+  /* A lost packet spoils the PES in progress, duplicates are dropped */
+  if (s->cc >= 0 && cc == s->cc)
+    return 0;
+  if (s->cc >= 0 && cc != ((s->cc + 1) & 0xf) && s->pes_len) {
+    d->stats.cc_errors++;
+    s->broken = true;
+  }
+  s->cc = cc;
+
+  if (pusi) {
+    ret = s->pes_len && !s->broken ? pes_done(d, s) : 0;
+    s->pes_len = 0;
+    s->broken = false;
+    if (ret)
+      return ret;
+  } else if (!s->pes_len || s->broken) {
+    return 0;
+  }
+
+  ret = append_pes(s, p, len);
+  if (ret == E2BIG) {
+    d->stats.pes_errors++;
+    s->broken = true;
+    return 0;
+  }
+  if (ret)
+    return ret;
+
+  /* Bounded PES packets end without waiting for the next one */
+  if (s->pes_len >= 6 && be16(s->pes + 4) &&
+      s->pes_len >= 6u + be16(s->pes + 4))
+    return pes_done(d, s);
+  return 0;
+}
+
+int ts_demux_set_key(struct ts_demux *d, const uint8_t key[16],
+                     const uint8_t iv[16])
+{
+  int ret;
+
+  if (!d || !key || !iv)
+    return EINVAL;
+  ret = flush_batch(d);
+  if (ret)
+    return ret;
+  d->key.key_size = 16;
+  memcpy(d->key.key, key, 16);
+  memcpy(d->iv, iv, sizeof(d->iv));
+  d->has_key = true;
+  return 0;
+}
+
+int ts_demux_push(struct ts_demux *d, const uint8_t *data, size_t len)
+{
+  size_t n;
+  int ret;
+
+  if (!d || (!data && len))
+    return EINVAL;
+
+  if (d->carry_len) {
+    n = TS_PACKET_SIZE - d->carry_len;
+    if (n > len)
+      n = len;
+    memcpy(d->carry + d->carry_len, data, n);
+    d->carry_len += n;
+    data += n;
+    len -= n;
+    if (d->carry_len < TS_PACKET_SIZE)
+      return 0;
+    d->carry_len = 0;
+    ret = process_packet(d, d->carry);
+    if (ret)
+      return ret;
+  }
+
+  while (len) {
+    if (data[0] != TS_SYNC_BYTE) {
+      d->stats.sync_errors++;
+      data++;
+      len--;
+      continue;
+    }
+    if (len < TS_PACKET_SIZE) {
+      memcpy(d->carry, data, len);
+      d->carry_len = len;
+      break;
+    }
+    ret = process_packet(d, data);
+    if (ret)
+      return ret;
+    data += TS_PACKET_SIZE;
+    len -= TS_PACKET_SIZE;
+  }
+  return 0;
+}
+
+int ts_demux_flush(struct ts_demux *d)
+{
+  if (!d)
+    return EINVAL;
+  d->carry_len = 0;
+  return finish_streams(d);
+}
+
+void ts_demux_get_stats(const struct ts_demux *d,
+                        struct ts_demux_stats *stats)
+{
+  *stats = d->stats;
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2026, The optee_clearkey contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef OPTEE_CLEARKEY_TS_DEMUX_H
+#define OPTEE_CLEARKEY_TS_DEMUX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aes_crypto.h"
+
+/*
+ * Streaming MPEG-2 TS demux for HLS SAMPLE-AES. Packets are pushed in
+ * chunks of any size; PES packets of the H.264 and AAC streams listed in
+ * the PMT are reassembled and their encrypted parts located:
+ *
+ * - H.264 (stream type 0xdb): slice NAL units (types 1 and 5) longer than
+ *   48 bytes, after their emulation prevention bytes are removed. The
+ *   first 32 bytes are clear, then one block in ten is encrypted.
+ * - AAC in ADTS (stream type 0xcf): each frame past its header and a 16
+ *   byte clear leader.
+ *
+ * The CBC chain restarts from the IV for each NAL unit or frame, and a
+ * trailing partial block is clear, which is the 'cbcs' scheme of
+ * TEE_AES_ctr128_decrypt_batch(). Encrypted PES payloads are gathered
+ * and decrypted in batches, then handed to the callback in stream order
+ * as elementary stream data. Clear streams (0x1b, 0x0f) pass through.
+ *
+ * PSI sections must fit in one packet. Buffers are allocated up front
+ * and only grow for PES packets larger than seen before.
+ */
+
+#define TS_PACKET_SIZE 188
+#define TS_MAX_STREAMS 8
+
+struct ts_es_frame {
+  uint16_t pid;
+  uint8_t stream_type;
+  int64_t pts;              /* 90 kHz, -1 if absent */
+  const uint8_t *data;
+  uint32_t size;
+};
+
+typedef void (*ts_es_cb)(void *arg, const struct ts_es_frame *frame);
+
+struct ts_demux_stats {
+  uint64_t packets;
+  uint64_t pes;
+  uint64_t batches;
+  uint32_t sync_errors;     /* bytes skipped to find a sync byte */
+  uint32_t cc_errors;       /* PES dropped on a continuity counter jump */
+  uint32_t pes_errors;      /* malformed PES dropped */
+};
+
+struct ts_demux;
+
+/* NULL on allocation failure */
+struct ts_demux *ts_demux_create(ts_es_cb cb, void *arg);
+
+void ts_demux_destroy(struct ts_demux *d);
+
+/* AES-128 key and IV of the SAMPLE-AES streams, pending data is flushed */
+int ts_demux_set_key(struct ts_demux *d, const uint8_t key[16],
+                     const uint8_t iv[16]);
+
+/*
+ * Demux len bytes. Returns 0 or an errno value: ENOKEY for encrypted data
+ * without a key, E2BIG for a PES needing more subsamples than a batch.
+ */
+int ts_demux_push(struct ts_demux *d, const uint8_t *data, size_t len);
+
+/* End of stream: complete the PES packets in progress and decrypt them */
+int ts_demux_flush(struct ts_demux *d);
+
+void ts_demux_get_stats(const struct ts_demux *d,
+                        struct ts_demux_stats *stats);
+
+#endif
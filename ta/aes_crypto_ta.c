@@ -10,6 +10,8 @@
 
 #include <aes_crypto_ta.h>
 
+#include "aes_kernels.h"
+
 #define STR_TRACE_USER_TA "SECAES_DEMO"
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -21,7 +23,54 @@
     } \
   } while(0)
 
-static TEE_OperationHandle crypto_op = NULL;
+#define CTR_AES_BLOCK_SIZE  16
+#define CTR_AES_IV_SIZE CTR_AES_BLOCK_SIZE
+#define CTR_AES_KEY_SIZE CTR_AES_BLOCK_SIZE
+
+/* 128, 192 and 256 bit keys */
+#define AES_KEY_SIZES 3
+
+/* Usage counters of a key, see struct ta_key_usage */
+struct key_usage {
+  uint64_t samples;
+  uint64_t bytes;
+};
+
+/* Operation prepared for one key size, with the key currently set on it */
+struct aes_op {
+  TEE_OperationHandle op;
+  uint32_t key_size;
+  uint8_t key[TA_AES_MAX_KEY_SIZE];
+  /* Counters of key, NULL until looked up again after TA_LOAD_KEYS */
+  struct key_usage *usage;
+  /* Round keys of key for kernels.ctr_xor, CTR operations only */
+  struct aes_kernel_key ck;
+};
+
+static void free_aes_ops(struct aes_op *ops)
+{
+  uint32_t i;
+
+  for (i = 0; i < AES_KEY_SIZES; i++) {
+    if (ops[i].op)
+      TEE_FreeOperation(ops[i].op);
+    ops[i].op = TEE_HANDLE_NULL;
+    ops[i].key_size = 0;
+  }
+}
+
+/* Open-addressed key table slots, power of two above TA_MAX_LOADED_KEYS */
+#define KEY_TABLE_SIZE 32
+/* key_size of a slot whose key was unloaded */
+#define KEY_SLOT_DELETED 0xFFFFFFFF
+
+/** Key loaded by TA_LOAD_KEYS; key_size 0 marks a never used slot */
+struct key_slot {
+  uint8_t kid[TA_KID_SIZE];
+  uint32_t key_size;
+  uint8_t key[TA_AES_MAX_KEY_SIZE];
+  struct key_usage usage;
+};
 
 /*==============================================================================
   SESSION DATA STRUCTURE
@@ -32,7 +81,29 @@ static TEE_OperationHandle crypto_op = NULL;
  */
 typedef struct session_data
 {
-  ;
+  /*
+   * Decrypt operations pooled by key size, see select_aes_op(). Streams
+   * mixing key sizes switch between handles instead of reallocating one.
+   */
+  struct aes_op ctr_ops[AES_KEY_SIZES];
+  /* AES CBC operations, for 'cbc1' content */
+  struct aes_op cbc_ops[AES_KEY_SIZES];
+  struct key_slot keys[KEY_TABLE_SIZE];
+  uint32_t num_keys;
+  /* Keys passed with the invocations that are not loaded */
+  struct key_usage inline_usage;
+  /* Counters of the key of the last operation selected */
+  struct key_usage *usage;
+  /* Round keys of the last operation selected, NULL without ctr_xor */
+  const struct aes_kernel_key *ck;
+  struct ta_session_stats stats;
+  /* Trace ring, oldest entry at trace_head */
+  struct ta_trace_entry trace[TA_TRACE_RING_SIZE];
+  uint32_t trace_head;
+  uint32_t trace_count;
+  uint32_t trace_dropped;
+  /* Set by the command handlers for the trace entry */
+  uint32_t trace_subsamples;
 } Session_data;
 
 /*
@@ -41,6 +112,7 @@ typedef struct session_data
  */
 TEE_Result TA_CreateEntryPoint(void)
 {
+  aes_kernels_init();
   return TEE_SUCCESS;
 }
 
@@ -61,6 +133,7 @@ void TA_DestroyEntryPoint(void)
 TEE_Result TA_OpenSessionEntryPoint(uint32_t param_types,
     TEE_Param  params[4], void **sess_ctx)
 {
+  Session_data *sess;
   uint32_t exp_param_types = TEE_PARAM_TYPES(TEE_PARAM_TYPE_NONE,
                TEE_PARAM_TYPE_NONE,
                TEE_PARAM_TYPE_NONE,
@@ -70,7 +143,11 @@ TEE_Result TA_OpenSessionEntryPoint(uint32_t param_types,
 
   /* Unused parameters */
   (void)&params;
-  (void)&sess_ctx;
+
+  sess = TEE_Malloc(sizeof(*sess), TEE_MALLOC_FILL_ZERO);
+  if (!sess)
+    return TEE_ERROR_OUT_OF_MEMORY;
+  *sess_ctx = sess;
 
   /*
    * The DMSG() macro is non-standard, TEE Internal API doesn't
@@ -87,24 +164,25 @@ TEE_Result TA_OpenSessionEntryPoint(uint32_t param_types,
  */
 void TA_CloseSessionEntryPoint(void *sess_ctx)
 {
-  (void)&sess_ctx; /* Unused parameter */
+  Session_data *sess = sess_ctx;
+
+  free_aes_ops(sess->ctr_ops);
+  free_aes_ops(sess->cbc_ops);
+  /* Do not leave key material behind in the heap */
+  TEE_MemFill(sess, 0, sizeof(*sess));
+  TEE_Free(sess);
 
-  if (crypto_op)
-    TEE_FreeOperation(crypto_op);
   DMSG("Session closed");
 }
 
-static TEE_Result allocate_crypto_op(uint8_t *key, uint32_t key_size)
+static TEE_Result set_op_key(TEE_OperationHandle op, uint8_t *key,
+                             uint32_t key_size)
 {
   TEE_Result res;
   TEE_ObjectHandle hkey;
   TEE_Attribute attr;
 
-  res = TEE_AllocateOperation(&crypto_op, TEE_ALG_AES_CTR,
-                              TEE_MODE_DECRYPT, 128);
-  CHECK(res, "TEE_AllocateOperation", return res;);
-
-  res = TEE_AllocateTransientObject(TEE_TYPE_AES, 128, &hkey);
+  res = TEE_AllocateTransientObject(TEE_TYPE_AES, key_size * 8, &hkey);
   CHECK(res, "TEE_AllocateTransientObject", return res;);
 
   attr.attributeID = TEE_ATTR_SECRET_VALUE;
@@ -112,32 +190,369 @@ static TEE_Result allocate_crypto_op(uint8_t *key, uint32_t key_size)
   attr.content.ref.length = key_size;
 
   res = TEE_PopulateTransientObject(hkey, &attr, 1);
-  CHECK(res, "TEE_PopulateTransientObject", return res;);
+  CHECK(res, "TEE_PopulateTransientObject", goto out;);
 
-  res = TEE_SetOperationKey(crypto_op, hkey);
-  CHECK(res, "TEE_SetOperationKey", return res;);
+  res = TEE_SetOperationKey(op, hkey);
+  CHECK(res, "TEE_SetOperationKey", goto out;);
 
+out:
   TEE_FreeTransientObject(hkey);
-
   return res;
 }
 
+/*
+ * Counters of the loaded key holding key, else those of the keys passed
+ * with the invocations. Only called when an operation changes key.
+ */
+static struct key_usage *find_key_usage(Session_data *sess,
+                                        const uint8_t *key,
+                                        uint32_t key_size)
+{
+  struct key_slot *e;
+  uint32_t i;
+
+  for (i = 0; i < KEY_TABLE_SIZE; i++) {
+    e = &sess->keys[i];
+    if (e->key_size == key_size && !TEE_MemCompare(e->key, key, key_size))
+      return &e->usage;
+  }
+
+  return &sess->inline_usage;
+}
+
+static void account_usage(Session_data *sess, uint32_t bytes)
+{
+  sess->usage->samples++;
+  sess->usage->bytes += bytes;
+}
+
+/*
+ * Return the session's alg operation prepared for key_size, holding key.
+ * The operation is allocated on first use of a key size and only rekeyed
+ * when the key changes. sess->usage is pointed at the key's counters and
+ * sess->ck at its round keys when CTR runs on the AES instructions.
+ */
+static TEE_Result select_aes_op(Session_data *sess, uint32_t alg,
+                                uint8_t *key, uint32_t key_size,
+                                TEE_OperationHandle *op)
+{
+  struct aes_op *ops, *a;
+  bool use_ce;
+  TEE_Result res;
+
+  ops = alg == TEE_ALG_AES_CBC_NOPAD ? sess->cbc_ops : sess->ctr_ops;
+  use_ce = alg == TEE_ALG_AES_CTR && kernels.ctr_xor;
+
+  switch (key_size) {
+  case 16:
+    a = &ops[0];
+    break;
+  case 24:
+    a = &ops[1];
+    break;
+  case 32:
+    a = &ops[2];
+    break;
+  default:
+    EMSG("unsupported key size %u", key_size);
+    return TEE_ERROR_NOT_SUPPORTED;
+  }
+
+  if (!a->op) {
+    res = TEE_AllocateOperation(&a->op, alg, TEE_MODE_DECRYPT,
+                                key_size * 8);
+    CHECK(res, "TEE_AllocateOperation", return res;);
+    sess->stats.op_allocs++;
+  } else if (a->key_size == key_size &&
+             !TEE_MemCompare(a->key, key, key_size)) {
+    if (!a->usage)
+      a->usage = find_key_usage(sess, key, key_size);
+    sess->usage = a->usage;
+    sess->ck = use_ce ? &a->ck : NULL;
+    *op = a->op;
+    return TEE_SUCCESS;
+  } else {
+    TEE_ResetOperation(a->op);
+  }
+
+  a->key_size = 0;
+  sess->stats.rekeys++;
+  res = set_op_key(a->op, key, key_size);
+  if (res != TEE_SUCCESS)
+    return res;
+  TEE_MemMove(a->key, key, key_size);
+  a->key_size = key_size;
+  a->usage = find_key_usage(sess, key, key_size);
+  sess->usage = a->usage;
+  if (use_ce)
+    kernels.expand_key(&a->ck, key, key_size);
+  sess->ck = use_ce ? &a->ck : NULL;
+
+  *op = a->op;
+  return TEE_SUCCESS;
+}
+
+/* FNV-1a, key IDs are random so the low bits are good enough */
+static uint32_t kid_hash(const uint8_t *kid)
+{
+  uint32_t h = 2166136261u;
+  uint32_t i;
+
+  for (i = 0; i < TA_KID_SIZE; i++)
+    h = (h ^ kid[i]) * 16777619u;
+
+  return h;
+}
+
+/*
+ * Linear probing from the kid's home slot. Returns the slot holding kid,
+ * or NULL with *free_slot set to the first reusable slot met on the way.
+ */
+static struct key_slot *key_table_lookup(Session_data *sess,
+                                         const uint8_t *kid,
+                                         struct key_slot **free_slot)
+{
+  struct key_slot *e;
+  uint32_t i, h = kid_hash(kid);
+
+  if (free_slot)
+    *free_slot = NULL;
+
+  for (i = 0; i < KEY_TABLE_SIZE; i++) {
+    e = &sess->keys[(h + i) & (KEY_TABLE_SIZE - 1)];
+    if (e->key_size == KEY_SLOT_DELETED || !e->key_size) {
+      if (free_slot && !*free_slot)
+        *free_slot = e;
+      if (!e->key_size)
+        break;
+      continue;
+    }
+    if (!TEE_MemCompare(e->kid, kid, TA_KID_SIZE))
+      return e;
+  }
+
+  return NULL;
+}
+
+static TEE_Result load_key(Session_data *sess, const struct ta_key_entry *k)
+{
+  struct key_slot *e, *free_slot;
+
+  e = key_table_lookup(sess, k->kid, &free_slot);
+
+  if (!k->key_size) {
+    if (!e)
+      return TEE_SUCCESS;
+    TEE_MemFill(e, 0, sizeof(*e));
+    e->key_size = KEY_SLOT_DELETED;
+    /* The table is empty again: drop the tombstones */
+    if (!--sess->num_keys)
+      TEE_MemFill(sess->keys, 0, sizeof(sess->keys));
+    return TEE_SUCCESS;
+  }
+
+  if (k->key_size != 16 && k->key_size != 24 && k->key_size != 32)
+    return TEE_ERROR_NOT_SUPPORTED;
+
+  if (!e) {
+    if (!free_slot || sess->num_keys == TA_MAX_LOADED_KEYS)
+      return TEE_ERROR_OUT_OF_MEMORY;
+    e = free_slot;
+    TEE_MemMove(e->kid, k->kid, TA_KID_SIZE);
+    sess->num_keys++;
+  }
+  TEE_MemFill(e->key, 0, sizeof(e->key));
+  TEE_MemMove(e->key, k->key, k->key_size);
+  e->key_size = k->key_size;
+
+  return TEE_SUCCESS;
+}
+
+static TEE_Result load_keys(Session_data *sess, uint32_t param_types,
+                            TEE_Param params[TEE_NUM_PARAMS])
+{
+  TEE_Result res;
+  struct ta_key_entry k;
+  uint8_t *entries;
+  uint32_t num, i;
+  uint32_t exp_param_types = LOAD_KEYS_TEE_PARAM_TYPES;
+
+  if (param_types != exp_param_types) {
+    EMSG("%s: incorrect parameters", __func__);
+    return TEE_ERROR_BAD_PARAMETERS;
+  }
+
+  entries = params[0].memref.buffer;
+  num = params[0].memref.size / sizeof(k);
+  if (!entries || !num || params[0].memref.size % sizeof(k))
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  /* Keys change: the operations look their counters up again */
+  for (i = 0; i < AES_KEY_SIZES; i++) {
+    sess->ctr_ops[i].usage = NULL;
+    sess->cbc_ops[i].usage = NULL;
+  }
+
+  for (i = 0; i < num; i++) {
+    /* Entries live in shared memory: copy before looking at them */
+    TEE_MemMove(&k, entries + i * sizeof(k), sizeof(k));
+    res = load_key(sess, &k);
+    TEE_MemFill(&k, 0, sizeof(k));
+    if (res != TEE_SUCCESS) {
+      EMSG("%s: entry %u failed: 0x%08x", __func__, i, res);
+      return res;
+    }
+  }
+
+  return TEE_SUCCESS;
+}
+
+/*
+ * CTR keystream position carried across discontiguous ranges. Whole blocks
+ * are deciphered in place of the ranges; the keystream of a block split
+ * between ranges is generated once into ks and XORed into the bytes of
+ * each range in turn. With ck set the blocks go through kernels.ctr_xor
+ * and ctr holds the counter, otherwise through TEE_CipherUpdate().
+ */
+struct ctr_stream {
+  TEE_OperationHandle op;
+  const struct aes_kernel_key *ck;
+  uint8_t ctr[CTR_AES_BLOCK_SIZE];
+  uint8_t ks[CTR_AES_BLOCK_SIZE];
+  /* Keystream bytes not used yet, at the end of ks */
+  uint32_t ks_left;
+};
+
+static void ctr_stream_init(struct ctr_stream *cs, TEE_OperationHandle op,
+                            const struct aes_kernel_key *ck,
+                            const uint8_t *iv)
+{
+  cs->op = op;
+  cs->ck = ck;
+  cs->ks_left = 0;
+  if (ck)
+    TEE_MemMove(cs->ctr, iv, CTR_AES_IV_SIZE);
+  else
+    TEE_CipherInit(op, iv, CTR_AES_IV_SIZE);
+}
+
+/* len is a multiple of the block size */
+static TEE_Result ctr_stream_blocks(struct ctr_stream *cs, const uint8_t *in,
+                                    uint8_t *out, uint32_t len)
+{
+  uint32_t outsz = len;
+  TEE_Result res;
+
+  if (cs->ck) {
+    kernels.ctr_xor(cs->ck, cs->ctr, in, out, len / CTR_AES_BLOCK_SIZE);
+    return TEE_SUCCESS;
+  }
+
+  res = TEE_CipherUpdate(cs->op, in, len, out, &outsz);
+  CHECK(res, "TEE_CipherUpdate", return res;);
+  if (outsz != len)
+    return TEE_ERROR_GENERIC;
+
+  return TEE_SUCCESS;
+}
+
+static TEE_Result ctr_stream_update(struct ctr_stream *cs, const uint8_t *in,
+                                    uint8_t *out, uint32_t len)
+{
+  static const uint8_t zero[CTR_AES_BLOCK_SIZE];
+  TEE_Result res;
+  uint32_t n;
+
+  n = MIN(cs->ks_left, len);
+  if (n) {
+    kernels.xor_bytes(out, in, cs->ks + CTR_AES_BLOCK_SIZE - cs->ks_left, n);
+    cs->ks_left -= n;
+    in += n;
+    out += n;
+    len -= n;
+  }
+
+  n = len & ~(CTR_AES_BLOCK_SIZE - 1);
+  if (n) {
+    res = ctr_stream_blocks(cs, in, out, n);
+    if (res != TEE_SUCCESS)
+      return res;
+    in += n;
+    out += n;
+    len -= n;
+  }
+
+  if (len) {
+    /* Keystream of the block the range ends in: decipher zeros */
+    res = ctr_stream_blocks(cs, zero, cs->ks, CTR_AES_BLOCK_SIZE);
+    if (res != TEE_SUCCESS)
+      return res;
+    kernels.xor_bytes(out, in, cs->ks, len);
+    cs->ks_left = CTR_AES_BLOCK_SIZE - len;
+  }
+
+  return TEE_SUCCESS;
+}
+
+/* Keystream is applied as it is generated, only the operation is left */
+static TEE_Result ctr_stream_final(struct ctr_stream *cs)
+{
+  uint32_t outsz = 0;
+
+  if (cs->ck)
+    return TEE_SUCCESS;
+  return TEE_CipherDoFinal(cs->op, NULL, 0, NULL, &outsz);
+}
+
+/*
+ * Fast path for a sample whose encrypted bytes form one range: there is
+ * no keystream to carry, so the range is deciphered by a single call.
+ */
+static TEE_Result ctr_decrypt_range(TEE_OperationHandle op,
+                                    const struct aes_kernel_key *ck,
+                                    const uint8_t *iv, const uint8_t *in,
+                                    uint8_t *out, uint32_t len)
+{
+  struct ctr_stream cs;
+  uint32_t outlen = len;
+  TEE_Result res;
+
+  if (ck) {
+    ctr_stream_init(&cs, op, ck, iv);
+    return ctr_stream_update(&cs, in, out, len);
+  }
+
+
+  TEE_CipherInit(op, iv, CTR_AES_IV_SIZE);
+  res = TEE_CipherDoFinal(op, in, len, out, &outlen);
+  CHECK(res, "TEE_CipherDoFinal", return res;);
+  if (outlen != len)
+    return TEE_ERROR_GENERIC;
+
+  return TEE_SUCCESS;
+}
+
 /* Decrypt chunk of data */
-static TEE_Result decrypt_128_ctr_aes(void *in, uint32_t sz, /*input buffer and size */
+static TEE_Result decrypt_128_ctr_aes(Session_data *sess,
+        void *in, uint32_t sz, /*input buffer and size */
         void *out, uint32_t *outsz, /*output buffer and size */
         uint8_t* aes_key, uint32_t aes_key_size, /* AES key */
         uint8_t* iv, uint8_t iv_size /*AES IV */
     )
 {
+  TEE_OperationHandle op;
   TEE_Result res;
 
-  if (!crypto_op) {
-    res = allocate_crypto_op(aes_key, aes_key_size);
-    CHECK(res, "allocate_crypto_op", return res;);
+  res = select_aes_op(sess, TEE_ALG_AES_CTR, aes_key, aes_key_size, &op);
+  CHECK(res, "select_aes_op", return res;);
+
+  if (sess->ck && iv_size == CTR_AES_IV_SIZE && *outsz >= sz) {
+    *outsz = sz;
+    return ctr_decrypt_range(op, sess->ck, iv, in, out, sz);
   }
 
-  TEE_CipherInit(crypto_op, iv, iv_size);
-  res = TEE_CipherDoFinal(crypto_op, in, sz, out, outsz);
+  TEE_CipherInit(op, iv, iv_size);
+  res = TEE_CipherDoFinal(op, in, sz, out, outsz);
   CHECK(res, "TEE_CipherDoFinal", return res;);
   if(*outsz != sz) {
     EMSG("FXIME: output buffer size does not match the input buffer size");
@@ -146,7 +561,8 @@ static TEE_Result decrypt_128_ctr_aes(void *in, uint32_t sz, /*input buffer and
   return TEE_SUCCESS;
 }
 
-static TEE_Result aes_Ctr128_Encrypt(uint32_t param_types, TEE_Param params[4])
+static TEE_Result aes_Ctr128_Encrypt(Session_data *sess, uint32_t param_types,
+                                     TEE_Param params[4])
 {
   TEE_Result res;
   void *buf, *outbuf, *iv, *key;
@@ -215,7 +631,7 @@ static TEE_Result aes_Ctr128_Encrypt(uint32_t param_types, TEE_Param params[4])
   CHECK(res, "TEE_CacheFlush", return res;);
 #endif
 
-  res = decrypt_128_ctr_aes(buf, sz, outbuf, &outsz,
+  res = decrypt_128_ctr_aes(sess, buf, sz, outbuf, &outsz,
             (uint8_t*) key, key_size,
             (uint8_t*) iv,  iv_size
            );
@@ -224,6 +640,7 @@ static TEE_Result aes_Ctr128_Encrypt(uint32_t param_types, TEE_Param params[4])
       EMSG("%s: decrypt_128_ctr_aes failed\n", __func__);
       return res;
   }
+  account_usage(sess, outsz);
 
 #ifdef CFG_CACHE_API
   res = TEE_CacheFlush((char *)outbuf, outsz);
@@ -233,7 +650,8 @@ static TEE_Result aes_Ctr128_Encrypt(uint32_t param_types, TEE_Param params[4])
   return TEE_SUCCESS;
 }
 
-static TEE_Result copy_secure_memory(uint32_t param_types, TEE_Param params[4])
+static TEE_Result copy_secure_memory(Session_data *sess, uint32_t param_types,
+                                     TEE_Param params[4])
 {
   TEE_Result res;
   void *inbuf, *outbuf;
@@ -293,7 +711,7 @@ static TEE_Result copy_secure_memory(uint32_t param_types, TEE_Param params[4])
 #endif
 
   /* inject data */
-  TEE_MemMove(outbuf, inbuf, insz);
+  kernels.copy(outbuf, inbuf, insz);
 
 #ifdef CFG_CACHE_API
   res = TEE_CacheFlush((char *)outbuf, outsz);
@@ -303,26 +721,254 @@ static TEE_Result copy_secure_memory(uint32_t param_types, TEE_Param params[4])
   return TEE_SUCCESS;
 }
 
-#define CTR_AES_BLOCK_SIZE  16
-#define CTR_AES_IV_SIZE CTR_AES_BLOCK_SIZE
-#define CTR_AES_KEY_SIZE CTR_AES_BLOCK_SIZE
+/*
+ * Walks the subsamples of a secure decrypt request: either an array of
+ * struct ta_subsample ended by the buffer size or a 0xFFFFFFFF sentinel,
+ * or a packed subsample map (see TA_PACKED_SUBSAMPLES_VERSION). Entries
+ * are decoded in place and read only once from shared memory.
+ */
+struct subsample_iter {
+  const uint8_t *pos;
+  const uint8_t *end;
+  uint32_t left;
+  bool packed;
+};
+
+static TEE_Result read_leb128(struct subsample_iter *it, uint32_t *val)
+{
+  uint32_t v = 0, shift = 0;
+  uint8_t b;
+
+  do {
+    if (it->pos == it->end || shift > 28)
+      return TEE_ERROR_BAD_FORMAT;
+    b = *it->pos++;
+    /* The fifth byte may only carry the top 4 bits */
+    if (shift == 28 && (b & 0x70))
+      return TEE_ERROR_BAD_FORMAT;
+    v |= (uint32_t)(b & 0x7f) << shift;
+    shift += 7;
+  } while (b & 0x80);
+
+  *val = v;
+  return TEE_SUCCESS;
+}
+
+static TEE_Result subsample_iter_init(struct subsample_iter *it, void *buf,
+                                      uint32_t size, bool packed)
+{
+  it->pos = buf;
+  it->end = it->pos + size;
+  it->left = 0;
+  it->packed = packed;
+
+  if (!packed)
+    return size < sizeof(struct ta_subsample) ? TEE_ERROR_BAD_PARAMETERS :
+                                                TEE_SUCCESS;
+
+  if (!size || *it->pos++ != TA_PACKED_SUBSAMPLES_VERSION)
+    return TEE_ERROR_BAD_FORMAT;
+  return read_leb128(it, &it->left);
+}
+
+/* Whether the map holds a single subsample, known before reading it */
+static bool subsample_iter_single(struct subsample_iter *it)
+{
+  uint32_t next;
+
+  if (it->packed)
+    return it->left == 1;
+
+  if ((uint32_t)(it->end - it->pos) < 2 * sizeof(struct ta_subsample))
+    return true;
+  TEE_MemMove(&next, it->pos + sizeof(struct ta_subsample), sizeof(next));
+  return next == 0xFFFFFFFF;
+}
+
+/* Returns TEE_ERROR_ITEM_NOT_FOUND past the last subsample */
+static TEE_Result subsample_iter_next(struct subsample_iter *it,
+                                      struct ta_subsample *sub)
+{
+  TEE_Result res;
 
-struct sub_sample_t {
-    uint32_t clear_bytes;
-    uint32_t encrp_bytes;
+  if (!it->packed) {
+    if ((uint32_t)(it->end - it->pos) < sizeof(*sub))
+      return TEE_ERROR_ITEM_NOT_FOUND;
+    TEE_MemMove(sub, it->pos, sizeof(*sub));
+    it->pos += sizeof(*sub);
+    return sub->clear_bytes == 0xFFFFFFFF ? TEE_ERROR_ITEM_NOT_FOUND :
+                                            TEE_SUCCESS;
+  }
+
+  if (!it->left)
+    return TEE_ERROR_ITEM_NOT_FOUND;
+  it->left--;
+
+  res = read_leb128(it, &sub->clear_bytes);
+  if (res != TEE_SUCCESS)
+    return res;
+  return read_leb128(it, &sub->encrp_bytes);
+}
+
+static bool is_secure_decrypt_params(uint32_t param_types)
+{
+  return param_types == AES_CTR128_ENCRYPT_SECURE_TEE_PARAM_TYPES ||
+         param_types == AES_SECURE_DECRYPT_DESC_TEE_PARAM_TYPES;
+}
+
+/*
+ * Splits an in/out subsample memref into its output descriptor, NAL table
+ * and the subsample map that follows, see TA_SECURE_DESC_VERSION. The
+ * descriptor version stays 0 for an input only memref.
+ */
+static TEE_Result secure_desc_split(uint32_t param_types, TEE_Param *param,
+                                    struct ta_secure_desc *desc,
+                                    struct ta_nal_unit **nals,
+                                    void **map, uint32_t *map_size)
+{
+  uint32_t head;
+
+  *nals = NULL;
+  *map = param->memref.buffer;
+  *map_size = param->memref.size;
+  desc->version = 0;
+  if (param_types != AES_SECURE_DECRYPT_DESC_TEE_PARAM_TYPES)
+    return TEE_SUCCESS;
+
+  if (*map == NULL || *map_size < sizeof(*desc))
+    return TEE_ERROR_BAD_PARAMETERS;
+  TEE_MemMove(desc, *map, sizeof(*desc));
+  if (desc->version != TA_SECURE_DESC_VERSION ||
+      desc->max_nals > TA_SECURE_MAX_NALS)
+    return TEE_ERROR_BAD_FORMAT;
+  if (desc->nal_length_size != 0 && desc->nal_length_size != 1 &&
+      desc->nal_length_size != 2 && desc->nal_length_size != 4)
+    return TEE_ERROR_NOT_SUPPORTED;
+
+  head = sizeof(*desc) + desc->max_nals * sizeof(struct ta_nal_unit);
+  if (*map_size < head)
+    return TEE_ERROR_BAD_PARAMETERS;
+  *nals = (struct ta_nal_unit *)((uint8_t *)*map + sizeof(*desc));
+  *map = (uint8_t *)*map + head;
+  *map_size -= head;
+
+  return TEE_SUCCESS;
+}
+
+/*
+ * Walks the length prefixed NAL units of the secure output while it is
+ * written. A length field is only read when it lies entirely inside a clear
+ * range of the subsample map in use, the walk stops at the first one that
+ * does not: the REE controls both the clear bytes and the map, so reading
+ * a field from a decrypted range would hand it the plaintext.
+ */
+struct nal_walk {
+  struct ta_secure_desc *desc;
+  struct ta_nal_unit *nals;
+  const uint8_t *out;
+  uint32_t next;    /* offset of the next length field */
+  uint32_t field;   /* offset of the last length field read */
+  bool stop;
 };
 
-static TEE_Result aes_Ctr128_Encrypt_secure(uint32_t param_types,
-                                     TEE_Param params[TEE_NUM_PARAMS])
+static void nal_walk_init(struct nal_walk *w, struct ta_secure_desc *desc,
+                          struct ta_nal_unit *nals, const uint8_t *out)
 {
-  TEE_Result res = TEE_SUCCESS;
-  void *key, *iv, *inbuf, *outbuf, *iter_in, *iter_out;
-  uint32_t insz, outsz, offset = 0;
-  struct sub_sample_t *sub_samples;
-  uint8_t *samples_end;
-  uint32_t  exp_param_types = AES_CTR128_ENCRYPT_SECURE_TEE_PARAM_TYPES;
+  w->desc = desc;
+  w->nals = nals;
+  w->out = out;
+  w->next = 0;
+  w->field = 0;
+  w->stop = !desc->version || !desc->nal_length_size;
+  desc->num_nals = 0;
+}
 
-  if (param_types != exp_param_types) {
+static void nal_walk_clear(struct nal_walk *w, uint32_t start, uint32_t len)
+{
+  struct ta_nal_unit nal;
+  uint32_t lsz = w->desc->nal_length_size, end = start + len, size, i;
+
+  if (w->stop || !len)
+    return;
+  if (w->next < start) {
+    w->stop = true;
+    return;
+  }
+
+  while (w->next < end && end - w->next >= lsz) {
+    for (size = 0, i = 0; i < lsz; i++)
+      size = size << 8 | w->out[w->next + i];
+    nal.offset = w->next + lsz;
+    nal.size = size;
+    if (size > UINT32_MAX - nal.offset)
+      break;
+    if (w->desc->num_nals < w->desc->max_nals)
+      TEE_MemMove(&w->nals[w->desc->num_nals], &nal, sizeof(nal));
+    w->desc->num_nals++;
+    w->field = w->next;
+    w->next = nal.offset + size;
+  }
+  /* The next field starts here but runs past the clear range */
+  if (w->next < end)
+    w->stop = true;
+}
+
+static void nal_walk_encrypted(struct nal_walk *w, uint32_t start,
+                               uint32_t len)
+{
+  if (len && w->next < start + len)
+    w->stop = true;
+}
+
+/* Walks one subsample written at start, after it has been processed */
+static void nal_walk_subsample(struct nal_walk *w, uint32_t start,
+                               const struct ta_subsample *sub)
+{
+  nal_walk_clear(w, start, sub->clear_bytes);
+  nal_walk_encrypted(w, start + sub->clear_bytes, sub->encrp_bytes);
+}
+
+/* Reports the bytes written and the NAL units of the output */
+static void secure_desc_fill(TEE_Param *param, struct nal_walk *w,
+                             uint32_t written)
+{
+  struct ta_secure_desc *desc = w->desc;
+
+  if (!desc->version)
+    return;
+
+  desc->bytes_written = written;
+  desc->frame_end = written;
+
+  if (desc->nal_length_size) {
+    /* Only the last NAL read can run past the output */
+    if (desc->num_nals && w->next > written) {
+      desc->num_nals--;
+      w->next = w->field;
+    }
+    desc->frame_end = w->next;
+  }
+
+  TEE_MemMove(param->memref.buffer, desc, sizeof(*desc));
+}
+
+static TEE_Result aes_Ctr128_Encrypt_secure(Session_data *sess,
+                                     uint32_t param_types,
+                                     TEE_Param params[TEE_NUM_PARAMS],
+                                     bool packed)
+{
+  TEE_Result res = TEE_SUCCESS;
+  void *key, *iv, *inbuf, *outbuf, *iter_in, *iter_out, *map;
+  uint32_t insz, outsz, key_size, map_size, offset = 0, start;
+  TEE_OperationHandle op;
+  struct ctr_stream cs;
+  struct subsample_iter it;
+  struct ta_subsample sub;
+  struct ta_secure_desc desc;
+  struct ta_nal_unit *nals;
+  struct nal_walk walk;
+
+  if (!is_secure_decrypt_params(param_types)) {
     EMSG("%s: incorrect parameters", __func__);
     return TEE_ERROR_BAD_PARAMETERS;
   }
@@ -333,8 +979,7 @@ static TEE_Result aes_Ctr128_Encrypt_secure(uint32_t param_types,
   if (params[1].memref.buffer == NULL || params[1].memref.size == 0)
     return TEE_ERROR_BAD_PARAMETERS;
 
-  if (params[2].memref.buffer == NULL ||
-      params[2].memref.size < sizeof(struct sub_sample_t))
+  if (params[2].memref.buffer == NULL)
     return TEE_ERROR_BAD_PARAMETERS;
 
   if (params[3].memref.buffer == NULL ||
@@ -345,10 +990,21 @@ static TEE_Result aes_Ctr128_Encrypt_secure(uint32_t param_types,
   insz = params[0].memref.size;
   outbuf = params[1].memref.buffer;
   outsz = params[1].memref.size;
-  sub_samples = (struct sub_sample_t *)params[2].memref.buffer;
-  samples_end = ((uint8_t *)params[2].memref.buffer + params[2].memref.size);
 
-  /*Encrypt_secure function only be called in 'CFG_SECURE_DATA_PATH=y' case */
+  res = secure_desc_split(param_types, &params[2], &desc, &nals,
+                          &map, &map_size);
+  if (res != TEE_SUCCESS) {
+    EMSG("%s: bad output descriptor", __func__);
+    return res;
+  }
+
+  res = subsample_iter_init(&it, map, map_size, packed);
+  if (res != TEE_SUCCESS) {
+    EMSG("%s: bad subsample map", __func__);
+    return res;
+  }
+
+#ifdef CFG_SECURE_DATA_PATH
   res = TEE_CheckMemoryAccessRights(TEE_MEMORY_ACCESS_ANY_OWNER |
                                     TEE_MEMORY_ACCESS_WRITE |
                                     TEE_MEMORY_ACCESS_SECURE,
@@ -357,51 +1013,101 @@ static TEE_Result aes_Ctr128_Encrypt_secure(uint32_t param_types,
     EMSG("%s: WARNING: output buffer is not in secure memory", __func__);
     return TEE_ERROR_SECURITY;
   }
+#else
+  res = TEE_CheckMemoryAccessRights(TEE_MEMORY_ACCESS_ANY_OWNER |
+                                    TEE_MEMORY_ACCESS_WRITE,
+                                    outbuf, outsz);
+  if (res != TEE_SUCCESS) {
+    EMSG("%s: WARNING: output buffer is not writeable", __func__);
+    return TEE_ERROR_ACCESS_DENIED;
+  }
+#endif
 
   key = params[3].memref.buffer;
-  iv = (uint8_t*)key + CTR_AES_KEY_SIZE;
+  key_size = params[3].memref.size - CTR_AES_IV_SIZE;
+  iv = (uint8_t*)key + key_size;
   iter_in = inbuf;
   iter_out = outbuf;
+  nal_walk_init(&walk, &desc, nals, outbuf);
+
+  res = select_aes_op(sess, TEE_ALG_AES_CTR, key, key_size, &op);
+  CHECK(res, "select_aes_op", return res;);
+
+  if (subsample_iter_single(&it)) {
+    res = subsample_iter_next(&it, &sub);
+    if (res == TEE_ERROR_ITEM_NOT_FOUND)
+      goto done;
+    if (res != TEE_SUCCESS)
+      return res;
+    sess->trace_subsamples = 1;
+
+    /* Offset starts from ZERO, use minus in case of integer overflow */
+    if (insz < sub.clear_bytes || outsz < sub.clear_bytes ||
+        insz - sub.clear_bytes < sub.encrp_bytes ||
+        outsz - sub.clear_bytes < sub.encrp_bytes)
+      return TEE_ERROR_BAD_PARAMETERS;
+
+    kernels.copy(outbuf, inbuf, sub.clear_bytes);
+    offset = sub.clear_bytes;
+    res = ctr_decrypt_range(op, sess->ck, iv, (uint8_t *)inbuf + offset,
+                            (uint8_t *)outbuf + offset, sub.encrp_bytes);
+    if (res != TEE_SUCCESS)
+      return res;
+    offset += sub.encrp_bytes;
+    nal_walk_subsample(&walk, 0, &sub);
+    goto done;
+  }
 
-  while ((uint8_t *)sub_samples < samples_end && 
-         sub_samples->clear_bytes != 0xFFFFFFFF) {
-    if (sub_samples->clear_bytes) {
+  /* The counter runs across all encrypted ranges of the sample */
+  ctr_stream_init(&cs, op, sess->ck, iv);
+
+  while ((res = subsample_iter_next(&it, &sub)) == TEE_SUCCESS) {
+    sess->trace_subsamples++;
+    start = offset;
+    if (sub.clear_bytes) {
       /*
        * Buffer overflow checking. Offset starts from ZERO;
        * use minus here for size checking in case integer overflow.
        */
-      if (insz - offset < sub_samples->clear_bytes ||
-          outsz - offset < sub_samples->clear_bytes)
+      if (insz - offset < sub.clear_bytes ||
+          outsz - offset < sub.clear_bytes)
         return TEE_ERROR_BAD_PARAMETERS;
 
-      TEE_MemMove(iter_out, iter_in, sub_samples->clear_bytes);
-                  offset += sub_samples->clear_bytes;
+      kernels.copy(iter_out, iter_in, sub.clear_bytes);
+      offset += sub.clear_bytes;
       iter_out = (uint8_t *)outbuf + offset;
       iter_in = (uint8_t *)inbuf + offset;
     }
-    if (sub_samples->encrp_bytes) {
-      if (!crypto_op) {
-        res = allocate_crypto_op(key, CTR_AES_KEY_SIZE);
-        CHECK(res, "allocate_crypto_op", return res;);
-      }
+    if (sub.encrp_bytes) {
       /*
        * Buffer overflow checking. Offset starts from ZERO;
        * use minus here for size checking in case integer overflow.
        */
-      if (insz - offset < sub_samples->encrp_bytes ||
-          outsz - offset < sub_samples->encrp_bytes)
+      if (insz - offset < sub.encrp_bytes ||
+          outsz - offset < sub.encrp_bytes)
         return TEE_ERROR_BAD_PARAMETERS;
 
-      TEE_CipherInit(crypto_op, iv, CTR_AES_IV_SIZE);
-      res = TEE_CipherDoFinal(crypto_op,
-                              iter_in, sub_samples->encrp_bytes,
-                              iter_out, &sub_samples->encrp_bytes);
-      offset += sub_samples->encrp_bytes;
+      res = ctr_stream_update(&cs, iter_in, iter_out, sub.encrp_bytes);
+      if (res != TEE_SUCCESS)
+        return res;
+      offset += sub.encrp_bytes;
       iter_out = (uint8_t *)outbuf + offset;
       iter_in = (uint8_t *)inbuf + offset;
     }
-    sub_samples++;
+    nal_walk_subsample(&walk, start, &sub);
   }
+  if (res != TEE_ERROR_ITEM_NOT_FOUND) {
+    EMSG("%s: bad subsample map", __func__);
+    return res;
+  }
+
+  res = ctr_stream_final(&cs);
+  if (res != TEE_SUCCESS)
+    return res;
+
+done:
+  account_usage(sess, offset);
+  secure_desc_fill(&params[2], &walk, offset);
 
 #ifdef CFG_CACHE_API
   res = TEE_CacheFlush((char *)outbuf, offset);
@@ -410,25 +1116,752 @@ static TEE_Result aes_Ctr128_Encrypt_secure(uint32_t param_types,
   return res;
 }
 
-/*
- * Called when a TA is invoked. sess_ctx hold that value that was
- * assigned by TA_OpenSessionEntryPoint(). The rest of the paramters
- * comes from normal world.
- */
-TEE_Result TA_InvokeCommandEntryPoint(void *sess_ctx, uint32_t cmd_id,
-      uint32_t param_types, TEE_Param params[TEE_NUM_PARAMS])
+static TEE_Result cbc_decrypt_subsample(TEE_OperationHandle op,
+                                        const struct ta_subsample *sub,
+                                        uint8_t *inbuf, uint32_t insz,
+                                        uint8_t *outbuf, uint32_t outsz,
+                                        uint32_t *offset)
 {
-  (void)&sess_ctx; /* Unused parameter */
+  TEE_Result res;
+  uint32_t blocks, outlen;
+  uint32_t off = *offset;
 
-  switch (cmd_id)
-  {
-  case TA_AES_CTR128_ENCRYPT:
-    return aes_Ctr128_Encrypt(param_types, params);
-  case TA_COPY_SECURE_MEMORY:
-    return copy_secure_memory(param_types, params);
-  case TA_AES_CTR128_SECURE_ENCRYPT:
-    return aes_Ctr128_Encrypt_secure(param_types, params);
-  default:
+  /* Offset starts from ZERO, use minus in case of integer overflow */
+  if (insz - off < sub->clear_bytes || outsz - off < sub->clear_bytes)
+    return TEE_ERROR_BAD_PARAMETERS;
+  kernels.copy(outbuf + off, inbuf + off, sub->clear_bytes);
+  off += sub->clear_bytes;
+
+  if (insz - off < sub->encrp_bytes || outsz - off < sub->encrp_bytes)
     return TEE_ERROR_BAD_PARAMETERS;
+
+  blocks = sub->encrp_bytes & ~(CTR_AES_BLOCK_SIZE - 1);
+  if (blocks) {
+    outlen = blocks;
+    res = TEE_CipherUpdate(op, inbuf + off, blocks, outbuf + off, &outlen);
+    CHECK(res, "TEE_CipherUpdate", return res;);
+    if (outlen != blocks)
+      return TEE_ERROR_GENERIC;
   }
+  /* The residual partial block is in the clear */
+  kernels.copy(outbuf + off + blocks, inbuf + off + blocks,
+              sub->encrp_bytes - blocks);
+  *offset = off + sub->encrp_bytes;
+
+  return TEE_SUCCESS;
+}
+
+/*
+ * 'cbc1' decryption into secure memory. The chain starts from the IV once
+ * per sample and continues across encrypted ranges, so the whole sample
+ * takes a single TEE_CipherInit(). The bytes past the last whole block of
+ * each encrypted range are not encrypted and are copied as is.
+ */
+static TEE_Result aes_Cbc128_Decrypt_secure(Session_data *sess,
+                                            uint32_t param_types,
+                                            TEE_Param params[TEE_NUM_PARAMS])
+{
+  TEE_Result res;
+  uint8_t *key, *iv, *inbuf, *outbuf;
+  uint32_t insz, outsz, outlen, key_size, map_size, offset = 0;
+  struct subsample_iter it;
+  struct ta_subsample sub;
+  struct ta_secure_desc desc;
+  struct ta_nal_unit *nals;
+  struct nal_walk walk;
+  TEE_OperationHandle op;
+  void *map;
+  uint32_t start;
+  bool whole_sample;
+
+  if (!is_secure_decrypt_params(param_types)) {
+    EMSG("%s: incorrect parameters", __func__);
+    return TEE_ERROR_BAD_PARAMETERS;
+  }
+
+  if (params[0].memref.buffer == NULL || params[0].memref.size == 0)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  if (params[1].memref.buffer == NULL || params[1].memref.size == 0)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  if (params[2].memref.buffer == NULL && params[2].memref.size)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  if (params[3].memref.buffer == NULL ||
+      params[3].memref.size < CTR_AES_KEY_SIZE + CTR_AES_IV_SIZE)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  inbuf = params[0].memref.buffer;
+  insz = params[0].memref.size;
+  outbuf = params[1].memref.buffer;
+  outsz = params[1].memref.size;
+
+  res = secure_desc_split(param_types, &params[2], &desc, &nals,
+                          &map, &map_size);
+  if (res != TEE_SUCCESS) {
+    EMSG("%s: bad output descriptor", __func__);
+    return res;
+  }
+
+  whole_sample = !map_size;
+  if (!whole_sample) {
+    res = subsample_iter_init(&it, map, map_size, false);
+    if (res != TEE_SUCCESS) {
+      EMSG("%s: bad subsample map", __func__);
+      return res;
+    }
+  }
+
+#ifdef CFG_SECURE_DATA_PATH
+  res = TEE_CheckMemoryAccessRights(TEE_MEMORY_ACCESS_ANY_OWNER |
+                                    TEE_MEMORY_ACCESS_WRITE |
+                                    TEE_MEMORY_ACCESS_SECURE,
+                                    outbuf, outsz);
+  if (res != TEE_SUCCESS) {
+    EMSG("%s: WARNING: output buffer is not in secure memory", __func__);
+    return TEE_ERROR_SECURITY;
+  }
+#else
+  res = TEE_CheckMemoryAccessRights(TEE_MEMORY_ACCESS_ANY_OWNER |
+                                    TEE_MEMORY_ACCESS_WRITE,
+                                    outbuf, outsz);
+  if (res != TEE_SUCCESS) {
+    EMSG("%s: WARNING: output buffer is not writeable", __func__);
+    return TEE_ERROR_ACCESS_DENIED;
+  }
+#endif
+
+  key = params[3].memref.buffer;
+  key_size = params[3].memref.size - CTR_AES_IV_SIZE;
+  iv = key + key_size;
+  nal_walk_init(&walk, &desc, nals, outbuf);
+
+  res = select_aes_op(sess, TEE_ALG_AES_CBC_NOPAD, key, key_size, &op);
+  CHECK(res, "select_aes_op", return res;);
+  TEE_CipherInit(op, iv, CTR_AES_IV_SIZE);
+
+  if (whole_sample) {
+    sub.clear_bytes = 0;
+    sub.encrp_bytes = MIN(insz, outsz);
+    res = cbc_decrypt_subsample(op, &sub, inbuf, insz, outbuf, outsz,
+                                &offset);
+    if (res != TEE_SUCCESS)
+      return res;
+    nal_walk_subsample(&walk, 0, &sub);
+  } else {
+    while ((res = subsample_iter_next(&it, &sub)) == TEE_SUCCESS) {
+      sess->trace_subsamples++;
+      start = offset;
+      res = cbc_decrypt_subsample(op, &sub, inbuf, insz, outbuf, outsz,
+                                  &offset);
+      if (res != TEE_SUCCESS)
+        return res;
+      /* The residual partial block counts as encrypted here */
+      nal_walk_subsample(&walk, start, &sub);
+    }
+    if (res != TEE_ERROR_ITEM_NOT_FOUND) {
+      EMSG("%s: bad subsample map", __func__);
+      return res;
+    }
+  }
+
+  outlen = 0;
+  res = TEE_CipherDoFinal(op, NULL, 0, NULL, &outlen);
+  CHECK(res, "TEE_CipherDoFinal", return res;);
+
+  account_usage(sess, offset);
+  secure_desc_fill(&params[2], &walk, offset);
+
+#ifdef CFG_CACHE_API
+  res = TEE_CacheFlush((char *)outbuf, offset);
+#endif
+
+  return res;
+}
+
+static TEE_Result aes_Ctr128_Decrypt_sg(Session_data *sess,
+                                        uint32_t param_types,
+                                        TEE_Param params[TEE_NUM_PARAMS])
+{
+  TEE_Result res;
+  struct ta_sg_desc desc;
+  struct ta_sg_segment *segs, iseg = { 0, 0 }, oseg = { 0, 0 };
+  struct ctr_stream cs;
+  uint8_t *inbuf, *outbuf, *key, *iv;
+  uint32_t insz, outsz, key_size, next_in, next_out, n, written = 0;
+  TEE_OperationHandle op;
+  uint32_t exp_param_types = AES_CTR128_SG_DECRYPT_TEE_PARAM_TYPES;
+
+  if (param_types != exp_param_types) {
+    EMSG("%s: incorrect parameters", __func__);
+    return TEE_ERROR_BAD_PARAMETERS;
+  }
+
+  inbuf = params[0].memref.buffer;
+  insz = params[0].memref.size;
+  outbuf = params[1].memref.buffer;
+  outsz = params[1].memref.size;
+  if (!inbuf || !insz || !outbuf || !outsz)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  if (params[2].memref.buffer == NULL ||
+      params[2].memref.size < sizeof(desc))
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  if (params[3].memref.buffer == NULL ||
+      params[3].memref.size < CTR_AES_KEY_SIZE + CTR_AES_IV_SIZE)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  /* The descriptor lives in shared memory: read each field exactly once */
+  TEE_MemMove(&desc, params[2].memref.buffer, sizeof(desc));
+  if (desc.version != TA_SG_DESC_VERSION || !desc.num_in || !desc.num_out ||
+      desc.num_in > TA_SG_MAX_SEGMENTS ||
+      desc.num_out > TA_SG_MAX_SEGMENTS - desc.num_in ||
+      (params[2].memref.size - sizeof(desc)) / sizeof(*segs) <
+      desc.num_in + desc.num_out) {
+    EMSG("%s: bad descriptor", __func__);
+    return TEE_ERROR_BAD_FORMAT;
+  }
+  segs = (struct ta_sg_segment *)((uint8_t *)params[2].memref.buffer +
+                                  sizeof(desc));
+  sess->trace_subsamples = desc.num_in;
+
+#ifdef CFG_SECURE_DATA_PATH
+  res = TEE_CheckMemoryAccessRights(TEE_MEMORY_ACCESS_ANY_OWNER |
+                                    TEE_MEMORY_ACCESS_WRITE |
+                                    TEE_MEMORY_ACCESS_SECURE,
+                                    outbuf, outsz);
+  if (res != TEE_SUCCESS) {
+    EMSG("%s: WARNING: output buffer is not in secure memory", __func__);
+    return TEE_ERROR_SECURITY;
+  }
+#else
+  res = TEE_CheckMemoryAccessRights(TEE_MEMORY_ACCESS_ANY_OWNER |
+                                    TEE_MEMORY_ACCESS_WRITE,
+                                    outbuf, outsz);
+  if (res != TEE_SUCCESS) {
+    EMSG("%s: WARNING: output buffer is not writeable", __func__);
+    return TEE_ERROR_ACCESS_DENIED;
+  }
+#endif
+
+  key = params[3].memref.buffer;
+  key_size = params[3].memref.size - CTR_AES_IV_SIZE;
+  iv = key + key_size;
+
+  res = select_aes_op(sess, TEE_ALG_AES_CTR, key, key_size, &op);
+  CHECK(res, "select_aes_op", return res;);
+  ctr_stream_init(&cs, op, sess->ck, iv);
+
+  next_in = 0;
+  next_out = desc.num_in;
+  for (;;) {
+    /* Skip to the next non-empty segment on both sides */
+    while (!iseg.length && next_in < desc.num_in) {
+      TEE_MemMove(&iseg, &segs[next_in++], sizeof(iseg));
+      if (iseg.offset > insz || iseg.length > insz - iseg.offset)
+        return TEE_ERROR_BAD_PARAMETERS;
+    }
+    while (!oseg.length && next_out < desc.num_in + desc.num_out) {
+      TEE_MemMove(&oseg, &segs[next_out++], sizeof(oseg));
+      if (oseg.offset > outsz || oseg.length > outsz - oseg.offset)
+        return TEE_ERROR_BAD_PARAMETERS;
+    }
+    if (!iseg.length || !oseg.length)
+      break;
+
+    n = MIN(iseg.length, oseg.length);
+    res = ctr_stream_update(&cs, inbuf + iseg.offset,
+                            outbuf + oseg.offset, n);
+    if (res != TEE_SUCCESS)
+      return res;
+    written += n;
+    iseg.offset += n;
+    iseg.length -= n;
+    oseg.offset += n;
+    oseg.length -= n;
+  }
+
+  res = ctr_stream_final(&cs);
+  if (res != TEE_SUCCESS)
+    return res;
+
+  if (iseg.length || oseg.length) {
+    EMSG("%s: input and output segments differ in length", __func__);
+    return TEE_ERROR_BAD_PARAMETERS;
+  }
+  if (desc.usage != TA_SG_USAGE_NONE)
+    account_usage(sess, desc.usage ? desc.usage : written);
+
+#ifdef CFG_CACHE_API
+  res = TEE_CacheFlush((char *)outbuf, outsz);
+  CHECK(res, "TEE_CacheFlush", return res;);
+#endif
+
+  return TEE_SUCCESS;
+}
+
+/*
+ * 'cbcs' decryption of one encrypted range: the chain starts from the IV
+ * and runs over the encrypted blocks of the pattern only.
+ */
+static TEE_Result cbcs_decrypt_range(TEE_OperationHandle op,
+                                     const struct ta_batch_sample *smp,
+                                     uint8_t *in, uint8_t *out, uint32_t len)
+{
+  uint32_t blocks = len / CTR_AES_BLOCK_SIZE, n, outlen;
+  TEE_Result res;
+
+  TEE_CipherInit(op, smp->iv, CTR_AES_IV_SIZE);
+  while (blocks) {
+    n = smp->crypt_blocks ? MIN(smp->crypt_blocks, blocks) : blocks;
+    outlen = n * CTR_AES_BLOCK_SIZE;
+    res = TEE_CipherUpdate(op, in, outlen, out, &outlen);
+    CHECK(res, "TEE_CipherUpdate", return res;);
+    in += outlen;
+    out += outlen;
+    blocks -= n;
+
+    n = MIN(smp->skip_blocks, blocks);
+    kernels.copy(out, in, n * CTR_AES_BLOCK_SIZE);
+    in += n * CTR_AES_BLOCK_SIZE;
+    out += n * CTR_AES_BLOCK_SIZE;
+    blocks -= n;
+  }
+  kernels.copy(out, in, len % CTR_AES_BLOCK_SIZE);
+
+  outlen = 0;
+  return TEE_CipherDoFinal(op, NULL, 0, NULL, &outlen);
+}
+
+static TEE_Result batch_decrypt_cbcs(TEE_OperationHandle op,
+                                     const struct ta_batch_sample *smp,
+                                     const struct ta_subsample *subsamples,
+                                     uint8_t *in, uint8_t *out)
+{
+  struct ta_subsample sub;
+  uint32_t i, left = smp->size;
+  TEE_Result res;
+
+  if (!smp->num_subsamples)
+    return cbcs_decrypt_range(op, smp, in, out, smp->size);
+
+  for (i = 0; i < smp->num_subsamples; i++) {
+    TEE_MemMove(&sub, &subsamples[i], sizeof(sub));
+    if (sub.clear_bytes > left || sub.encrp_bytes > left - sub.clear_bytes)
+      return TEE_ERROR_BAD_PARAMETERS;
+
+    kernels.copy(out, in, sub.clear_bytes);
+    in += sub.clear_bytes;
+    out += sub.clear_bytes;
+
+    if (sub.encrp_bytes) {
+      res = cbcs_decrypt_range(op, smp, in, out, sub.encrp_bytes);
+      if (res != TEE_SUCCESS)
+        return res;
+    }
+    in += sub.encrp_bytes;
+    out += sub.encrp_bytes;
+
+    left -= sub.clear_bytes + sub.encrp_bytes;
+  }
+
+  kernels.copy(out, in, left);
+  return TEE_SUCCESS;
+}
+
+/* Decrypt one sample of a batch into its output range */
+static TEE_Result batch_decrypt_sample(TEE_OperationHandle op,
+                                       const struct aes_kernel_key *ck,
+                                       const struct ta_batch_sample *smp,
+                                       const struct ta_subsample *subsamples,
+                                       uint8_t *in, uint8_t *out)
+{
+  struct ta_subsample sub;
+  struct ctr_stream cs;
+  uint32_t i, left = smp->size;
+  TEE_Result res;
+
+  if (smp->scheme == TA_BATCH_SCHEME_CBCS)
+    return batch_decrypt_cbcs(op, smp, subsamples, in, out);
+
+  if (!smp->num_subsamples)
+    return ctr_decrypt_range(op, ck, smp->iv, in, out, smp->size);
+
+  if (smp->num_subsamples == 1) {
+    TEE_MemMove(&sub, subsamples, sizeof(sub));
+    if (sub.clear_bytes > left || sub.encrp_bytes > left - sub.clear_bytes)
+      return TEE_ERROR_BAD_PARAMETERS;
+
+    /* Clear lead-in and trailing bytes around the one encrypted range */
+    kernels.copy(out, in, sub.clear_bytes);
+    left -= sub.clear_bytes + sub.encrp_bytes;
+    kernels.copy(out + smp->size - left, in + smp->size - left, left);
+    return ctr_decrypt_range(op, ck, smp->iv, in + sub.clear_bytes,
+                             out + sub.clear_bytes, sub.encrp_bytes);
+  }
+
+  ctr_stream_init(&cs, op, ck, smp->iv);
+
+  for (i = 0; i < smp->num_subsamples; i++) {
+    TEE_MemMove(&sub, &subsamples[i], sizeof(sub));
+    if (sub.clear_bytes > left || sub.encrp_bytes > left - sub.clear_bytes)
+      return TEE_ERROR_BAD_PARAMETERS;
+
+    kernels.copy(out, in, sub.clear_bytes);
+    in += sub.clear_bytes;
+    out += sub.clear_bytes;
+
+    res = ctr_stream_update(&cs, in, out, sub.encrp_bytes);
+    if (res != TEE_SUCCESS)
+      return res;
+    in += sub.encrp_bytes;
+    out += sub.encrp_bytes;
+
+    left -= sub.clear_bytes + sub.encrp_bytes;
+  }
+
+  /* Trailing bytes not covered by the subsamples are clear */
+  kernels.copy(out, in, left);
+
+  return ctr_stream_final(&cs);
+}
+
+static TEE_Result aes_Ctr128_Decrypt_batch(Session_data *sess,
+                                           uint32_t param_types,
+                                           TEE_Param params[TEE_NUM_PARAMS])
+{
+  TEE_Result res;
+  struct ta_batch_header hdr;
+  struct ta_batch_sample smp, *samples;
+  struct ta_subsample *subsamples;
+  struct ta_batch_key *keys, key;
+  struct key_slot *slot;
+  uint8_t *inbuf, *outbuf;
+  uint32_t insz, outsz, num_keys, alg, i;
+  TEE_OperationHandle op;
+  uint32_t exp_param_types = AES_CTR128_BATCH_DECRYPT_TEE_PARAM_TYPES;
+
+  if (param_types != exp_param_types) {
+    EMSG("%s: incorrect parameters", __func__);
+    return TEE_ERROR_BAD_PARAMETERS;
+  }
+
+  inbuf = params[0].memref.buffer;
+  insz = params[0].memref.size;
+  outbuf = params[1].memref.buffer;
+  outsz = params[1].memref.size;
+  if (!inbuf || !insz || !outbuf || !outsz)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  if (params[2].memref.buffer == NULL ||
+      params[2].memref.size < sizeof(hdr))
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  /* The key table may be empty when all samples use loaded keys */
+  keys = params[3].memref.buffer;
+  num_keys = params[3].memref.size / sizeof(*keys);
+  if ((keys == NULL && num_keys) || num_keys > TA_BATCH_MAX_KEYS)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  /* The table lives in shared memory: read each entry exactly once */
+  TEE_MemMove(&hdr, params[2].memref.buffer, sizeof(hdr));
+  if (hdr.version != TA_BATCH_VERSION || !hdr.num_samples ||
+      hdr.num_samples > TA_BATCH_MAX_SAMPLES ||
+      (params[2].memref.size - sizeof(hdr)) / sizeof(smp) <
+      hdr.num_samples ||
+      hdr.num_subsamples > (params[2].memref.size - sizeof(hdr) -
+                            hdr.num_samples * sizeof(smp)) /
+                           sizeof(struct ta_subsample)) {
+    EMSG("%s: bad sample table", __func__);
+    return TEE_ERROR_BAD_FORMAT;
+  }
+  samples = (struct ta_batch_sample *)((uint8_t *)params[2].memref.buffer +
+                                       sizeof(hdr));
+  subsamples = (struct ta_subsample *)(samples + hdr.num_samples);
+  sess->trace_subsamples = hdr.num_subsamples;
+
+#ifdef CFG_SECURE_DATA_PATH
+  res = TEE_CheckMemoryAccessRights(TEE_MEMORY_ACCESS_ANY_OWNER |
+                                    TEE_MEMORY_ACCESS_WRITE |
+                                    TEE_MEMORY_ACCESS_SECURE,
+                                    outbuf, outsz);
+  if (res != TEE_SUCCESS) {
+    EMSG("%s: WARNING: output buffer is not in secure memory", __func__);
+    return TEE_ERROR_SECURITY;
+  }
+#else
+  res = TEE_CheckMemoryAccessRights(TEE_MEMORY_ACCESS_ANY_OWNER |
+                                    TEE_MEMORY_ACCESS_WRITE,
+                                    outbuf, outsz);
+  if (res != TEE_SUCCESS) {
+    EMSG("%s: WARNING: output buffer is not writeable", __func__);
+    return TEE_ERROR_ACCESS_DENIED;
+  }
+#endif
+
+  for (i = 0; i < hdr.num_samples; i++) {
+    TEE_MemMove(&smp, &samples[i], sizeof(smp));
+    if (smp.in_offset > insz || smp.size > insz - smp.in_offset ||
+        smp.out_offset > outsz || smp.size > outsz - smp.out_offset ||
+        (smp.key_slot >= num_keys &&
+         smp.key_slot != TA_BATCH_KEY_SLOT_KID) ||
+        smp.first_subsample > hdr.num_subsamples ||
+        smp.num_subsamples > hdr.num_subsamples - smp.first_subsample ||
+        smp.scheme > TA_BATCH_SCHEME_CBCS) {
+      EMSG("%s: bad sample %u", __func__, i);
+      return TEE_ERROR_BAD_PARAMETERS;
+    }
+    alg = smp.scheme == TA_BATCH_SCHEME_CBCS ? TEE_ALG_AES_CBC_NOPAD :
+                                               TEE_ALG_AES_CTR;
+
+    if (smp.key_slot == TA_BATCH_KEY_SLOT_KID) {
+      slot = key_table_lookup(sess, smp.kid, NULL);
+      if (!slot) {
+        EMSG("%s: sample %u: no key loaded for its kid", __func__, i);
+        return TEE_ERROR_ITEM_NOT_FOUND;
+      }
+      res = select_aes_op(sess, alg, slot->key, slot->key_size, &op);
+      /* Another kid may hold the same key, count under this one */
+      sess->usage = &slot->usage;
+    } else {
+      TEE_MemMove(&key, &keys[smp.key_slot], sizeof(key));
+      if (key.key_size > sizeof(key.key)) {
+        EMSG("%s: bad key slot %u", __func__, smp.key_slot);
+        return TEE_ERROR_BAD_PARAMETERS;
+      }
+      res = select_aes_op(sess, alg, key.key, key.key_size, &op);
+    }
+    CHECK(res, "select_aes_op", return res;);
+
+    res = batch_decrypt_sample(op, sess->ck, &smp,
+                               subsamples + smp.first_subsample,
+                               inbuf + smp.in_offset,
+                               outbuf + smp.out_offset);
+    if (res != TEE_SUCCESS) {
+      EMSG("%s: sample %u failed", __func__, i);
+      return res;
+    }
+    account_usage(sess, smp.size);
+  }
+
+#ifdef CFG_CACHE_API
+  res = TEE_CacheFlush((char *)outbuf, outsz);
+  CHECK(res, "TEE_CacheFlush", return res;);
+#endif
+
+  return TEE_SUCCESS;
+}
+
+static uint32_t time_ms(void)
+{
+  TEE_Time t;
+
+  TEE_GetSystemTime(&t);
+  return t.seconds * 1000 + t.millis;
+}
+
+static uint32_t memref_size(uint32_t param_types, TEE_Param params[4],
+                            uint32_t idx)
+{
+  switch (TEE_PARAM_TYPE_GET(param_types, idx)) {
+  case TEE_PARAM_TYPE_MEMREF_INPUT:
+  case TEE_PARAM_TYPE_MEMREF_OUTPUT:
+  case TEE_PARAM_TYPE_MEMREF_INOUT:
+    return params[idx].memref.size;
+  default:
+    return 0;
+  }
+}
+
+/* Take the next ring entry, overwriting the oldest one when full */
+static struct ta_trace_entry *trace_begin(Session_data *sess, uint32_t cmd,
+                                          uint32_t param_types,
+                                          TEE_Param params[4])
+{
+  struct ta_trace_entry *t;
+
+  if (sess->trace_count == TA_TRACE_RING_SIZE) {
+    sess->trace_head = (sess->trace_head + 1) % TA_TRACE_RING_SIZE;
+    sess->trace_count--;
+    sess->trace_dropped++;
+  }
+  t = &sess->trace[(sess->trace_head + sess->trace_count) %
+                   TA_TRACE_RING_SIZE];
+  sess->trace_count++;
+
+  t->seq = sess->stats.invokes;
+  t->cmd = cmd;
+  t->in_size = memref_size(param_types, params, 0);
+  t->out_size = memref_size(param_types, params, 1);
+  sess->trace_subsamples = 0;
+  t->start_ms = time_ms();
+
+  return t;
+}
+
+static void trace_end(Session_data *sess, struct ta_trace_entry *t,
+                      TEE_Result res)
+{
+  t->end_ms = time_ms();
+  t->result = res;
+  t->num_subsamples = sess->trace_subsamples;
+}
+
+static TEE_Result read_trace(Session_data *sess, uint32_t param_types,
+                             TEE_Param params[TEE_NUM_PARAMS])
+{
+  uint32_t exp_param_types = READ_TRACE_TEE_PARAM_TYPES;
+  uint8_t *out = params[0].memref.buffer;
+  uint32_t n;
+
+  if (param_types != exp_param_types) {
+    EMSG("%s: incorrect parameters", __func__);
+    return TEE_ERROR_BAD_PARAMETERS;
+  }
+
+  if (out == NULL && params[0].memref.size)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  n = MIN(sess->trace_count,
+          params[0].memref.size / sizeof(struct ta_trace_entry));
+  params[0].memref.size = n * sizeof(struct ta_trace_entry);
+  while (n--) {
+    TEE_MemMove(out, &sess->trace[sess->trace_head],
+                sizeof(struct ta_trace_entry));
+    out += sizeof(struct ta_trace_entry);
+    sess->trace_head = (sess->trace_head + 1) % TA_TRACE_RING_SIZE;
+    sess->trace_count--;
+  }
+
+  params[1].value.a = sess->trace_dropped;
+  params[1].value.b = 0;
+  sess->trace_dropped = 0;
+
+  return TEE_SUCCESS;
+}
+
+static TEE_Result get_session_stats(Session_data *sess, uint32_t param_types,
+                                    TEE_Param params[TEE_NUM_PARAMS])
+{
+  uint32_t exp_param_types = GET_SESSION_STATS_TEE_PARAM_TYPES;
+
+  if (param_types != exp_param_types) {
+    EMSG("%s: incorrect parameters", __func__);
+    return TEE_ERROR_BAD_PARAMETERS;
+  }
+
+  if (params[0].memref.size < sizeof(sess->stats)) {
+    params[0].memref.size = sizeof(sess->stats);
+    return TEE_ERROR_SHORT_BUFFER;
+  }
+
+  sess->stats.num_keys = sess->num_keys;
+  TEE_MemMove(params[0].memref.buffer, &sess->stats, sizeof(sess->stats));
+  params[0].memref.size = sizeof(sess->stats);
+
+  return TEE_SUCCESS;
+}
+
+static void put_key_usage(uint8_t *out, const uint8_t *kid,
+                          const struct key_usage *usage)
+{
+  struct ta_key_usage u;
+
+  TEE_MemFill(&u, 0, sizeof(u));
+  if (kid)
+    TEE_MemMove(u.kid, kid, TA_KID_SIZE);
+  u.samples = usage->samples;
+  u.bytes = usage->bytes;
+  TEE_MemMove(out, &u, sizeof(u));
+}
+
+static TEE_Result get_key_usage(Session_data *sess, uint32_t param_types,
+                                TEE_Param params[TEE_NUM_PARAMS])
+{
+  uint32_t exp_param_types = GET_KEY_USAGE_TEE_PARAM_TYPES;
+  uint32_t num = sess->num_keys + 1, i;
+  uint8_t *out;
+
+  if (param_types != exp_param_types) {
+    EMSG("%s: incorrect parameters", __func__);
+    return TEE_ERROR_BAD_PARAMETERS;
+  }
+
+  params[1].value.a = num;
+  params[1].value.b = 0;
+  if (params[0].memref.size < num * sizeof(struct ta_key_usage)) {
+    params[0].memref.size = num * sizeof(struct ta_key_usage);
+    return TEE_ERROR_SHORT_BUFFER;
+  }
+
+  out = params[0].memref.buffer;
+  put_key_usage(out, NULL, &sess->inline_usage);
+  out += sizeof(struct ta_key_usage);
+  for (i = 0; i < KEY_TABLE_SIZE; i++) {
+    if (!sess->keys[i].key_size ||
+        sess->keys[i].key_size == KEY_SLOT_DELETED)
+      continue;
+    put_key_usage(out, sess->keys[i].kid, &sess->keys[i].usage);
+    out += sizeof(struct ta_key_usage);
+  }
+  params[0].memref.size = num * sizeof(struct ta_key_usage);
+
+  return TEE_SUCCESS;
+}
+
+static TEE_Result invoke_command(Session_data *sess, uint32_t cmd_id,
+      uint32_t param_types, TEE_Param params[TEE_NUM_PARAMS])
+{
+  switch (cmd_id)
+  {
+  case TA_AES_CTR128_ENCRYPT:
+    return aes_Ctr128_Encrypt(sess, param_types, params);
+  case TA_COPY_SECURE_MEMORY:
+    return copy_secure_memory(sess, param_types, params);
+  case TA_AES_CTR128_SECURE_ENCRYPT:
+    return aes_Ctr128_Encrypt_secure(sess, param_types, params, false);
+  case TA_AES_CTR128_SECURE_DECRYPT_PACKED:
+    return aes_Ctr128_Encrypt_secure(sess, param_types, params, true);
+  case TA_AES_CTR128_SG_DECRYPT:
+    return aes_Ctr128_Decrypt_sg(sess, param_types, params);
+  case TA_AES_CTR128_BATCH_DECRYPT:
+    return aes_Ctr128_Decrypt_batch(sess, param_types, params);
+  case TA_AES_CBC128_SECURE_DECRYPT:
+    return aes_Cbc128_Decrypt_secure(sess, param_types, params);
+  case TA_LOAD_KEYS:
+    return load_keys(sess, param_types, params);
+  case TA_GET_SESSION_STATS:
+    return get_session_stats(sess, param_types, params);
+  case TA_GET_KEY_USAGE:
+    return get_key_usage(sess, param_types, params);
+  default:
+    return TEE_ERROR_BAD_PARAMETERS;
+  }
+}
+
+/*
+ * Called when a TA is invoked. sess_ctx hold that value that was
+ * assigned by TA_OpenSessionEntryPoint(). The rest of the paramters
+ * comes from normal world.
+ */
+TEE_Result TA_InvokeCommandEntryPoint(void *sess_ctx, uint32_t cmd_id,
+      uint32_t param_types, TEE_Param params[TEE_NUM_PARAMS])
+{
+  Session_data *sess = sess_ctx;
+  struct ta_trace_entry *t;
+  TEE_Result res;
+
+  sess->stats.invokes++;
+
+  /* Reading the trace is not traced, it would only show itself */
+  if (cmd_id == TA_READ_TRACE)
+    return read_trace(sess, param_types, params);
+
+  t = trace_begin(sess, cmd_id, param_types, params);
+  res = invoke_command(sess, cmd_id, param_types, params);
+  trace_end(sess, t, res);
+
+  return res;
 }
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2026, The optee_clearkey contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <tee_internal_api.h>
+#include <tee_internal_api_extensions.h>
+
+#include "aes_kernels.h"
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#if defined(CFG_TA_AES_CE) && \
+    (defined(__ARM_FEATURE_AES) || defined(__ARM_FEATURE_CRYPTO))
+#define HAVE_AES_CE 1
+#endif
+#endif
+
+#define AES_BLOCK_SIZE 16
+
+struct aes_kernels kernels;
+
+static void copy_generic(void *dst, const void *src, uint32_t len)
+{
+  TEE_MemMove(dst, src, len);
+}
+
+/*
+ * Only used for the tail of a block split between two ranges, so at most
+ * 15 bytes: not worth vectorizing, ctr_xor does the whole blocks.
+ */
+static void xor_generic(uint8_t *out, const uint8_t *in, const uint8_t *ks,
+                        uint32_t len)
+{
+  uint32_t i;
+
+  for (i = 0; i < len; i++)
+    out[i] = in[i] ^ ks[i];
+}
+
+#ifdef HAVE_NEON
+/*
+ * 64 bytes per iteration through the vector registers. A forward copy
+ * corrupts dst overlapping the end of src, leave that case to TEE_MemMove.
+ */
+static void copy_neon(void *dst, const void *src, uint32_t len)
+{
+  uint8_t *d = dst;
+  const uint8_t *s = src;
+  uint8x16_t v0, v1, v2, v3;
+
+  if (d > s && d < s + len) {
+    TEE_MemMove(dst, src, len);
+    return;
+  }
+
+  for (; len >= 64; len -= 64, s += 64, d += 64) {
+    v0 = vld1q_u8(s);
+    v1 = vld1q_u8(s + 16);
+    v2 = vld1q_u8(s + 32);
+    v3 = vld1q_u8(s + 48);
+    vst1q_u8(d, v0);
+    vst1q_u8(d + 16, v1);
+    vst1q_u8(d + 32, v2);
+    vst1q_u8(d + 48, v3);
+  }
+  for (; len >= 16; len -= 16, s += 16, d += 16)
+    vst1q_u8(d, vld1q_u8(s));
+  while (len--)
+    *d++ = *s++;
+}
+#endif
+
+#ifdef HAVE_AES_CE
+/*
+ * With the same word in every column ShiftRows has no effect and AESE
+ * with a zero round key is SubBytes alone, i.e. SubWord of the key
+ * expansion.
+ */
+static uint32_t sub_word(uint32_t w)
+{
+  uint8x16_t v = vreinterpretq_u8_u32(vdupq_n_u32(w));
+
+  v = vaeseq_u8(v, vdupq_n_u8(0));
+  return vgetq_lane_u32(vreinterpretq_u32_u8(v), 0);
+}
+
+/* FIPS-197 key expansion, words kept in memory byte order */
+static void expand_key_ce(struct aes_kernel_key *k, const uint8_t *key,
+                          uint32_t key_size)
+{
+  uint32_t nk = key_size / 4;
+  uint32_t rcon = 1;
+  uint32_t i, t;
+
+  k->rounds = nk + 6;
+  for (i = 0; i < nk; i++)
+    k->rk[i] = key[4 * i] | key[4 * i + 1] << 8 |
+               key[4 * i + 2] << 16 | (uint32_t)key[4 * i + 3] << 24;
+
+  for (i = nk; i < 4 * (k->rounds + 1); i++) {
+    t = k->rk[i - 1];
+    if (i % nk == 0) {
+      /* RotWord is a rotate right of the little-endian word */
+      t = sub_word(t);
+      t = (t >> 8 | t << 24) ^ rcon;
+      rcon = (rcon << 1) ^ ((rcon >> 7) * 0x11b);
+    } else if (nk == 8 && i % nk == 4) {
+      t = sub_word(t);
+    }
+    k->rk[i] = k->rk[i - nk] ^ t;
+  }
+}
+
+static void ctr_inc(uint8_t *ctr)
+{
+  int i;
+
+  for (i = AES_BLOCK_SIZE - 1; i >= 0; i--)
+    if (++ctr[i])
+      break;
+}
+
+static uint8x16_t round_key(const struct aes_kernel_key *k, uint32_t i)
+{
+  return vld1q_u8((const uint8_t *)&k->rk[4 * i]);
+}
+
+static uint8x16_t aes_encrypt_block(const struct aes_kernel_key *k,
+                                    uint8x16_t b)
+{
+  uint32_t i;
+
+  for (i = 0; i < k->rounds - 1; i++)
+    b = vaesmcq_u8(vaeseq_u8(b, round_key(k, i)));
+  b = vaeseq_u8(b, round_key(k, i));
+  return veorq_u8(b, round_key(k, i + 1));
+}
+
+/*
+ * Four counter blocks per iteration: AESE/AESMC have a latency of a few
+ * cycles but pipeline, interleaving independent blocks keeps the unit
+ * busy.
+ */
+static void ctr_xor_ce(const struct aes_kernel_key *k, uint8_t *ctr,
+                       const uint8_t *in, uint8_t *out, uint32_t blocks)
+{
+  uint8x16_t b0, b1, b2, b3, rk;
+  uint32_t i;
+
+  for (; blocks >= 4; blocks -= 4, in += 64, out += 64) {
+    b0 = vld1q_u8(ctr);
+    ctr_inc(ctr);
+    b1 = vld1q_u8(ctr);
+    ctr_inc(ctr);
+    b2 = vld1q_u8(ctr);
+    ctr_inc(ctr);
+    b3 = vld1q_u8(ctr);
+    ctr_inc(ctr);
+
+    for (i = 0; i < k->rounds - 1; i++) {
+      rk = round_key(k, i);
+      b0 = vaesmcq_u8(vaeseq_u8(b0, rk));
+      b1 = vaesmcq_u8(vaeseq_u8(b1, rk));
+      b2 = vaesmcq_u8(vaeseq_u8(b2, rk));
+      b3 = vaesmcq_u8(vaeseq_u8(b3, rk));
+    }
+    rk = round_key(k, i);
+    b0 = vaeseq_u8(b0, rk);
+    b1 = vaeseq_u8(b1, rk);
+    b2 = vaeseq_u8(b2, rk);
+    b3 = vaeseq_u8(b3, rk);
+    rk = round_key(k, i + 1);
+    vst1q_u8(out, veorq_u8(vld1q_u8(in), veorq_u8(b0, rk)));
+    vst1q_u8(out + 16, veorq_u8(vld1q_u8(in + 16), veorq_u8(b1, rk)));
+    vst1q_u8(out + 32, veorq_u8(vld1q_u8(in + 32), veorq_u8(b2, rk)));
+    vst1q_u8(out + 48, veorq_u8(vld1q_u8(in + 48), veorq_u8(b3, rk)));
+  }
+
+  for (; blocks; blocks--, in += 16, out += 16) {
+    b0 = aes_encrypt_block(k, vld1q_u8(ctr));
+    ctr_inc(ctr);
+    vst1q_u8(out, veorq_u8(vld1q_u8(in), b0));
+  }
+}
+#endif
+
+/*
+ * The TA cannot read the CPU feature registers or HWCAP, the kernels are
+ * picked by what it was compiled for.
+ */
+void aes_kernels_init(void)
+{
+  kernels.name = "generic";
+  kernels.copy = copy_generic;
+  kernels.xor_bytes = xor_generic;
+  kernels.expand_key = NULL;
+  kernels.ctr_xor = NULL;
+
+#ifdef HAVE_NEON
+  kernels.name = "neon";
+  kernels.copy = copy_neon;
+#endif
+#ifdef HAVE_AES_CE
+  kernels.name = "neon+aes";
+  kernels.expand_key = expand_key_ce;
+  kernels.ctr_xor = ctr_xor_ce;
+#endif
+
+  DMSG("data path kernels: %s", kernels.name);
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2026, The optee_clearkey contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef OPTEE_AES_KERNELS_H
+#define OPTEE_AES_KERNELS_H
+
+#include <stdint.h>
+
+/* Round keys of AES-256, the largest key size */
+#define AES_KERNEL_MAX_ROUNDS 14
+
+/** Key schedule for the AES instructions, see aes_kernels.expand_key */
+struct aes_kernel_key {
+  uint32_t rk[4 * (AES_KERNEL_MAX_ROUNDS + 1)];
+  uint32_t rounds;
+};
+
+/*
+ * Data path kernels of the TA, chosen once by aes_kernels_init(). copy
+ * and xor_bytes are always set; expand_key and ctr_xor only when the TA
+ * was built for the Armv8 Crypto Extensions (CFG_TA_AES_CE), otherwise
+ * the CTR keystream comes from the TEE operations.
+ */
+struct aes_kernels {
+  const char *name;
+  /* Clear bytes, src and dst may overlap */
+  void (*copy)(void *dst, const void *src, uint32_t len);
+  /* out = in ^ ks, for keystream left over from a split block */
+  void (*xor_bytes)(uint8_t *out, const uint8_t *in, const uint8_t *ks,
+                    uint32_t len);
+  void (*expand_key)(struct aes_kernel_key *k, const uint8_t *key,
+                     uint32_t key_size);
+  /*
+   * Decipher blocks of CTR data, ctr is the big-endian counter of the
+   * first block and is advanced past the last one.
+   */
+  void (*ctr_xor)(const struct aes_kernel_key *k, uint8_t *ctr,
+                  const uint8_t *in, uint8_t *out, uint32_t blocks);
+};
+
+extern struct aes_kernels kernels;
+
+void aes_kernels_init(void);
+
+#endif /* OPTEE_AES_KERNELS_H */
@@ -27,9 +27,20 @@
 #ifndef OPTEE_AES_DECRYPTOR_TA_H
 #define OPTEE_AES_DECRYPTOR_TA_H
 
+#include <stdint.h>
+
 #define TA_AES_DECRYPTOR_UUID { 0x442ed209, 0xb8e2, 0x405e, \
     { 0x83, 0x84, 0x5c, 0xc7, 0x8c, 0x75, 0x34, 0x28} }
 
+/*
+ * AES keys may be 128, 192 or 256 bits. Commands taking the key followed
+ * by the IV in one memref derive the key size from the memref size.
+ */
+#define TA_AES_MAX_KEY_SIZE 32
+
+/* CENC key ID size */
+#define TA_KID_SIZE 16
+
 /* The commands implemented in this TA */
 enum {
   /*
@@ -37,6 +48,37 @@ enum {
   TA_AES_CTR128_ENCRYPT = 0,
   TA_COPY_SECURE_MEMORY,
   TA_AES_CTR128_SECURE_ENCRYPT,
+  /*
+   * AES CTR128 decryption of an input gathered from several ranges into
+   * several output ranges, see struct ta_sg_desc */
+  TA_AES_CTR128_SG_DECRYPT,
+  /*
+   * AES CTR128 decryption of a table of samples in one invocation,
+   * samples may also be 'cbcs', see struct ta_batch_header */
+  TA_AES_CTR128_BATCH_DECRYPT,
+  /*
+   * Same as TA_AES_CTR128_SECURE_ENCRYPT with a packed subsample map,
+   * see TA_PACKED_SUBSAMPLES_VERSION */
+  TA_AES_CTR128_SECURE_DECRYPT_PACKED,
+  /*
+   * AES CBC128 ('cbc1') decryption into a secure buffer, same parameters
+   * as TA_AES_CTR128_SECURE_ENCRYPT */
+  TA_AES_CBC128_SECURE_DECRYPT,
+  /*
+   * Load or unload keys of the session by key ID, see struct
+   * ta_key_entry */
+  TA_LOAD_KEYS,
+  /*
+   * Read the counters of the session, see struct ta_session_stats */
+  TA_GET_SESSION_STATS,
+  /*
+   * Drain the command trace ring of the session, see struct
+   * ta_trace_entry */
+  TA_READ_TRACE,
+  /*
+   * Read the usage counters of the session's keys, see struct
+   * ta_key_usage */
+  TA_GET_KEY_USAGE,
 };
 
 /*
@@ -78,6 +120,275 @@ enum {
                TEE_PARAM_TYPE_MEMREF_INPUT, \
                TEE_PARAM_TYPE_MEMREF_INPUT)
 
+/*
+ * TA_AES_CBC128_SECURE_DECRYPT: the cipher block chain runs across all
+ * encrypted ranges of the sample and the trailing partial block of each
+ * range is left clear. An empty subsample table decrypts the whole input
+ * as one range.
+ */
+#define AES_CBC128_DECRYPT_SECURE_TEE_PARAM_TYPES \
+               AES_CTR128_ENCRYPT_SECURE_TEE_PARAM_TYPES
+
+/*
+ * The secure decrypt commands also accept their subsample memref as in/out,
+ * in which case it starts with a struct ta_secure_desc followed by
+ * max_nals struct ta_nal_unit, and the subsample table or map comes after.
+ * The TA fills in the output fields so that the caller can queue the secure
+ * buffer to the decoder without parsing it. With nal_length_size 1, 2 or 4
+ * the output is walked as length prefixed NAL units: the first max_nals
+ * are stored, num_nals counts all of them and frame_end is the end of the
+ * last complete one. A length field must lie entirely inside a clear range
+ * of the subsample map, the walk stops at the first one that does not.
+ * With nal_length_size 0, frame_end is bytes_written.
+ */
+#define AES_SECURE_DECRYPT_DESC_TEE_PARAM_TYPES TEE_PARAM_TYPES( \
+               TEE_PARAM_TYPE_MEMREF_INPUT, \
+               TEE_PARAM_TYPE_MEMREF_OUTPUT, \
+               TEE_PARAM_TYPE_MEMREF_INOUT, \
+               TEE_PARAM_TYPE_MEMREF_INPUT)
+
+#define TA_SECURE_DESC_VERSION 1
+#define TA_SECURE_MAX_NALS 256
+
+/* NAL unit of the output, offset is past its length field */
+struct ta_nal_unit {
+  uint32_t offset;
+  uint32_t size;
+};
+
+struct ta_secure_desc {
+  uint32_t version;
+  uint32_t nal_length_size;   /* in: 0, 1, 2 or 4 */
+  uint32_t max_nals;          /* in: at most TA_SECURE_MAX_NALS */
+  uint32_t num_nals;          /* out */
+  uint32_t bytes_written;     /* out */
+  uint32_t frame_end;         /* out */
+};
+
+/*
+ * TA_AES_CTR128_SG_DECRYPT takes the input buffer, the output buffer, a
+ * descriptor and the key followed by the IV. Any modification here needs
+ * to be synced with AES_CTR128_SG_DECRYPT_TEE_PARAM_TYPES.
+ */
+#define AES_CTR128_SG_DECRYPT_TEE_PARAM_TYPES TEE_PARAM_TYPES( \
+               TEE_PARAM_TYPE_MEMREF_INPUT, \
+               TEE_PARAM_TYPE_MEMREF_OUTPUT, \
+               TEE_PARAM_TYPE_MEMREF_INPUT, \
+               TEE_PARAM_TYPE_MEMREF_INPUT)
+
+#define TA_SG_DESC_VERSION 1
+/* Max number of input plus output segments in one descriptor */
+#define TA_SG_MAX_SEGMENTS 128
+
+/* Range of the input or output memref, offset relative to its start */
+struct ta_sg_segment {
+  uint32_t offset;
+  uint32_t length;
+};
+
+/*
+ * Scatter-gather descriptor: followed by num_in input segments, then
+ * num_out output segments. The input segments are concatenated and
+ * decrypted as one CTR stream which is written to the output segments
+ * in order, so both lists must add up to the same length. Only the output
+ * segments are written.
+ *
+ * usage is what the invocation adds to the key usage counters: 0 counts
+ * one sample of the bytes decrypted. A sample split over several
+ * invocations is counted once with its full size, clear bytes included,
+ * by the first one, the others pass TA_SG_USAGE_NONE.
+ */
+struct ta_sg_desc {
+  uint32_t version;
+  uint32_t num_in;
+  uint32_t num_out;
+  uint32_t usage;
+};
+
+#define TA_SG_USAGE_NONE 0xFFFFFFFF
+
+/* Clear and encrypted byte counts of one subsample */
+struct ta_subsample {
+  uint32_t clear_bytes;
+  uint32_t encrp_bytes;
+};
+
+/*
+ * Packed subsample map: one version byte, the number of subsamples as
+ * unsigned LEB128, then for each subsample its clear and encrypted byte
+ * counts as unsigned LEB128. No sentinel entry is needed.
+ */
+#define TA_PACKED_SUBSAMPLES_VERSION 1
+/* Worst case size of a packed map of n subsamples */
+#define TA_PACKED_SUBSAMPLES_MAX_SIZE(n) (1 + 5 + (n) * 10)
+
+/*
+ * TA_AES_CTR128_BATCH_DECRYPT takes the input buffer, the output buffer,
+ * the sample table and the key table. The output memref is in/out so
+ * that bytes between samples are kept. Any modification here needs to be
+ * synced with AES_CTR128_BATCH_DECRYPT_TEE_PARAM_TYPES.
+ */
+#define AES_CTR128_BATCH_DECRYPT_TEE_PARAM_TYPES TEE_PARAM_TYPES( \
+               TEE_PARAM_TYPE_MEMREF_INPUT, \
+               TEE_PARAM_TYPE_MEMREF_INOUT, \
+               TEE_PARAM_TYPE_MEMREF_INPUT, \
+               TEE_PARAM_TYPE_MEMREF_INPUT)
+
+#define TA_BATCH_VERSION 4
+#define TA_BATCH_MAX_SAMPLES 1024
+/* The key table holds up to this many struct ta_batch_key */
+#define TA_BATCH_MAX_KEYS 16
+
+/* One entry of the batch key table, key_size is 16, 24 or 32 */
+struct ta_batch_key {
+  uint32_t key_size;
+  uint8_t key[TA_AES_MAX_KEY_SIZE];
+};
+
+/* key_slot of a sample whose key is looked up by its kid */
+#define TA_BATCH_KEY_SLOT_KID 0xFFFFFFFF
+
+/* Encryption scheme of a batch sample */
+enum {
+  /* AES-CTR, the counter runs across the encrypted ranges */
+  TA_BATCH_SCHEME_CENC = 0,
+  /*
+   * AES-CBC, each encrypted range restarts the chain from the IV and
+   * only crypt_blocks out of every crypt_blocks + skip_blocks blocks are
+   * encrypted; a trailing partial block is clear. crypt_blocks 0 means
+   * all whole blocks are encrypted.
+   */
+  TA_BATCH_SCHEME_CBCS,
+};
+
+/*
+ * One sample of a batch. in_offset and out_offset are relative to the
+ * input and output memrefs, the subsamples are num_subsamples consecutive
+ * entries of the subsample table starting at first_subsample. A sample
+ * without subsamples is encrypted as a whole. The key is entry key_slot of
+ * the key table, or with TA_BATCH_KEY_SLOT_KID the session key loaded
+ * under kid by TA_LOAD_KEYS.
+ */
+struct ta_batch_sample {
+  uint32_t in_offset;
+  uint32_t out_offset;
+  uint32_t size;
+  uint32_t key_slot;
+  uint32_t first_subsample;
+  uint32_t num_subsamples;
+  uint8_t iv[16];
+  uint8_t kid[TA_KID_SIZE];
+  uint32_t scheme;            /* TA_BATCH_SCHEME_* */
+  uint8_t crypt_blocks;       /* 'cbcs' pattern */
+  uint8_t skip_blocks;
+  uint16_t reserved;
+};
+
+/*
+ * Sample table: followed by num_samples struct ta_batch_sample, then
+ * num_subsamples struct ta_subsample shared by all samples.
+ */
+struct ta_batch_header {
+  uint32_t version;
+  uint32_t num_samples;
+  uint32_t num_subsamples;
+  uint32_t reserved;
+};
+
+/*
+ * TA_LOAD_KEYS takes an array of entries. An entry replaces the key loaded
+ * under the same kid, an entry with key_size 0 unloads it. A session holds
+ * at most TA_MAX_LOADED_KEYS keys. Any modification here needs to be
+ * synced with LOAD_KEYS_TEE_PARAM_TYPES.
+ */
+#define LOAD_KEYS_TEE_PARAM_TYPES TEE_PARAM_TYPES( \
+               TEE_PARAM_TYPE_MEMREF_INPUT, \
+               TEE_PARAM_TYPE_NONE, \
+               TEE_PARAM_TYPE_NONE, \
+               TEE_PARAM_TYPE_NONE)
+
+#define TA_MAX_LOADED_KEYS 24
+
+struct ta_key_entry {
+  uint8_t kid[TA_KID_SIZE];
+  uint32_t key_size;
+  uint8_t key[TA_AES_MAX_KEY_SIZE];
+};
+
+/*
+ * TA_GET_SESSION_STATS fills a struct ta_session_stats. Any modification
+ * here needs to be synced with GET_SESSION_STATS_TEE_PARAM_TYPES.
+ */
+#define GET_SESSION_STATS_TEE_PARAM_TYPES TEE_PARAM_TYPES( \
+               TEE_PARAM_TYPE_MEMREF_OUTPUT, \
+               TEE_PARAM_TYPE_NONE, \
+               TEE_PARAM_TYPE_NONE, \
+               TEE_PARAM_TYPE_NONE)
+
+/* Counters kept by each session since it was opened */
+struct ta_session_stats {
+  uint32_t invokes;
+  uint32_t op_allocs;         /* cipher operations allocated */
+  uint32_t rekeys;            /* keys set on a cipher operation */
+  uint32_t num_keys;          /* keys loaded by TA_LOAD_KEYS */
+};
+
+/*
+ * TA_READ_TRACE moves the oldest entries of the trace ring that fit in the
+ * output memref out of it, and returns in value a of the second parameter
+ * how many entries were overwritten since the last read. Any modification
+ * here needs to be synced with READ_TRACE_TEE_PARAM_TYPES.
+ */
+#define READ_TRACE_TEE_PARAM_TYPES TEE_PARAM_TYPES( \
+               TEE_PARAM_TYPE_MEMREF_OUTPUT, \
+               TEE_PARAM_TYPE_VALUE_OUTPUT, \
+               TEE_PARAM_TYPE_NONE, \
+               TEE_PARAM_TYPE_NONE)
+
+#define TA_TRACE_RING_SIZE 32
+
+/*
+ * One traced invocation. The sizes are those of the first two memref
+ * parameters, num_subsamples the subsamples (segments for the
+ * scatter-gather command) it processed. Times are TEE system time in
+ * milliseconds, wrapping at 32 bits.
+ */
+struct ta_trace_entry {
+  uint32_t seq;
+  uint32_t cmd;
+  uint32_t result;
+  uint32_t in_size;
+  uint32_t out_size;
+  uint32_t num_subsamples;
+  uint32_t start_ms;
+  uint32_t end_ms;
+};
+
+/*
+ * TA_GET_KEY_USAGE fills the output memref with one struct ta_key_usage
+ * per key loaded by TA_LOAD_KEYS, after a first entry with a zero kid
+ * counting the keys passed with the invocations, and returns in value a
+ * of the second parameter the number of entries. Any modification here
+ * needs to be synced with GET_KEY_USAGE_TEE_PARAM_TYPES.
+ */
+#define GET_KEY_USAGE_TEE_PARAM_TYPES TEE_PARAM_TYPES( \
+               TEE_PARAM_TYPE_MEMREF_OUTPUT, \
+               TEE_PARAM_TYPE_VALUE_OUTPUT, \
+               TEE_PARAM_TYPE_NONE, \
+               TEE_PARAM_TYPE_NONE)
+
+/*
+ * Samples decrypted with a key and the bytes written for them, clear
+ * bytes included. A key passed with an invocation is counted under the
+ * loaded key holding the same value, if any. The counters of a loaded key
+ * survive its replacement and are dropped when it is unloaded.
+ */
+struct ta_key_usage {
+  uint8_t kid[TA_KID_SIZE];
+  uint64_t samples;
+  uint64_t bytes;
+};
+
 #define IMAGE_END 2
 #define AES_KEY_IS_CLEARKEY 4
 
@@ -1,2 +1,10 @@
 global-incdirs-y += include
 srcs-y += aes_crypto_ta.c
+srcs-y += aes_kernels.c
+
+# CTR keystream with the AES instructions of Armv8 cores that have them,
+# instead of the TEE operations
+CFG_TA_AES_CE ?= $(CFG_CRYPTO_WITH_CE)
+ifeq ($(CFG_TA_AES_CE)-$(sm),y-ta_arm64)
+cflags-aes_kernels.c-y += -march=armv8-a+crypto -DCFG_TA_AES_CE
+endif
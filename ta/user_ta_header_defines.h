@@ -36,6 +36,10 @@
 
 #define TA_UUID TA_AES_DECRYPTOR_UUID
 
+/*
+ * Not TA_FLAG_SINGLE_INSTANCE: every session, e.g. each worker session of
+ * the host decrypt pool, runs in a TA instance of its own.
+ */
 #define TA_FLAGS                    (TA_FLAG_MULTI_SESSION | TA_FLAG_EXEC_DDR | \
 				     TA_FLAG_SECURE_DATA_PATH |	TA_FLAG_CACHE_MAINTENANCE)
 #define TA_STACK_SIZE               (2 * 1024)